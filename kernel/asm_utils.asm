@@ -11,6 +11,7 @@ extern Main
 global KernelMain
 KernelMain:
     mov rsp, kernel_stack + 1024 * 1024
+    cld ; the kernel's rep movs/stos copy forward
     call Main
 .fin:
     hlt
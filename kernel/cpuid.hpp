@@ -0,0 +1,121 @@
+/**
+ * @file cpuid.hpp
+ * @brief CPUID access and the feature bits the kernel checks at boot
+ *
+ * Features are queried once while the subsystem that needs them initializes;
+ * nothing here caches results.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace kernel::cpu
+{
+
+/**
+ * @brief Register output of one CPUID invocation
+ */
+struct CpuidResult {
+	uint32_t eax;
+	uint32_t ebx;
+	uint32_t ecx;
+	uint32_t edx;
+};
+
+/**
+ * @brief Execute CPUID
+ *
+ * @param leaf Value loaded into EAX
+ * @param subleaf Value loaded into ECX
+ * @return CpuidResult Register contents after the instruction
+ */
+inline CpuidResult cpuid(uint32_t leaf, uint32_t subleaf = 0)
+{
+	CpuidResult r;
+	asm volatile("cpuid"
+				 : "=a"(r.eax), "=b"(r.ebx), "=c"(r.ecx), "=d"(r.edx)
+				 : "a"(leaf), "c"(subleaf));
+	return r;
+}
+
+/**
+ * @brief Highest basic leaf the CPU implements
+ */
+inline uint32_t max_basic_leaf() { return cpuid(0).eax; }
+
+/**
+ * @brief Highest extended leaf (0x8000'0000 and up) the CPU implements
+ */
+inline uint32_t max_extended_leaf() { return cpuid(0x80000000).eax; }
+
+/**
+ * @brief Check for 1 GiB pages (CPUID.80000001H:EDX.Page1GB[bit 26])
+ */
+inline bool has_1gib_pages()
+{
+	if (max_extended_leaf() < 0x80000001) {
+		return false;
+	}
+
+	return (cpuid(0x80000001).edx & (1U << 26)) != 0;
+}
+
+/**
+ * @brief Check for process-context identifiers (CPUID.01H:ECX.PCID[bit 17])
+ */
+inline bool has_pcid() { return (cpuid(1).ecx & (1U << 17)) != 0; }
+
+/**
+ * @brief Check for INVPCID (CPUID.(EAX=07H,ECX=0):EBX.INVPCID[bit 10])
+ */
+inline bool has_invpcid()
+{
+	if (max_basic_leaf() < 7) {
+		return false;
+	}
+
+	return (cpuid(7, 0).ebx & (1U << 10)) != 0;
+}
+
+/**
+ * @brief Check for enhanced REP MOVSB/STOSB (CPUID.(EAX=07H,ECX=0):EBX.ERMS[bit 9])
+ */
+inline bool has_erms()
+{
+	if (max_basic_leaf() < 7) {
+		return false;
+	}
+
+	return (cpuid(7, 0).ebx & (1U << 9)) != 0;
+}
+
+/**
+ * @brief Check for fast short REP MOVSB (CPUID.(EAX=07H,ECX=0):EDX.FSRM[bit 4])
+ */
+inline bool has_fsrm()
+{
+	if (max_basic_leaf() < 7) {
+		return false;
+	}
+
+	return (cpuid(7, 0).edx & (1U << 4)) != 0;
+}
+
+/**
+ * @brief Physical address width in bits (CPUID.80000008H:EAX[7:0])
+ *
+ * @return Reported width, or 36 when the leaf is missing
+ */
+inline unsigned int physical_address_bits()
+{
+	if (max_extended_leaf() < 0x80000008) {
+		return 36;
+	}
+
+	return cpuid(0x80000008).eax & 0xffU;
+}
+
+} // namespace kernel::cpu
@@ -5,6 +5,7 @@
 #include "asm_utils.h"
 #include "error.hpp"
 #include "log/log.hpp"
+#include "memory/exec_image.hpp"
 #include "memory/page.hpp"
 #include "memory/paging.hpp"
 #include "memory/segment.hpp"
@@ -122,7 +123,13 @@ error_t copy_load_segment(elf64_ehdr_t* elf_header)
 	return OK;
 }
 
-error_t load_elf(elf64_ehdr_t* elf_header)
+namespace
+{
+
+using kernel::memory::ExecImage;
+using kernel::memory::ExecSegment;
+
+error_t check_executable(elf64_ehdr_t* elf_header)
 {
 	if (elf_header->e_type != ET_EXEC) {
 		LOG_ERROR("not an executable ELF file");
@@ -135,29 +142,146 @@ error_t load_elf(elf64_ehdr_t* elf_header)
 		return ERR_INVALID_ARG;
 	}
 
+	return OK;
+}
+
+// Read the PT_LOAD segments out of the program headers. Segments that
+// reach past the end of the file are refused.
+error_t collect_load_segments(elf64_ehdr_t* elf_header,
+							  size_t size,
+							  ExecSegment* segments,
+							  int* num_segments)
+{
+	const size_t max_headers =
+			elf_header->e_phoff <= size
+					? (size - elf_header->e_phoff) / sizeof(elf64_phdr_t)
+					: 0;
+	if (elf_header->e_phnum > max_headers) {
+		LOG_ERROR("program headers reach past the end of the file");
+		return ERR_INVALID_ARG;
+	}
+
+	*num_segments = 0;
+	auto* program_header = get_program_header(elf_header);
+	for (int i = 0; i < elf_header->e_phnum; i++) {
+		const elf64_phdr_t& phdr = program_header[i];
+		if (phdr.p_type != PT_LOAD) {
+			continue;
+		}
+
+		if (phdr.p_offset > size || phdr.p_filesz > size - phdr.p_offset ||
+			phdr.p_filesz > phdr.p_memsz) {
+			LOG_ERROR("segment %d reaches past the end of the file", i);
+			return ERR_INVALID_ARG;
+		}
+
+		if (*num_segments == ExecImage::MAX_SEGMENTS) {
+			LOG_ERROR("too many load segments");
+			return ERR_INVALID_ARG;
+		}
+
+		segments[(*num_segments)++] = { phdr.p_vaddr, phdr.p_offset, phdr.p_filesz,
+										phdr.p_memsz, (phdr.p_flags & PF_W) != 0 };
+	}
+
+	return OK;
+}
+
+uint64_t segment_page_end(const ExecSegment& segment)
+{
+	return (segment.vaddr + segment.mem_size + kernel::memory::PAGE_SIZE - 1) &
+		   ~(kernel::memory::PAGE_SIZE - 1);
+}
+
+// Demand-load the segments: each one becomes an area that faults its pages
+// in from the shared image. Segments sharing a page cannot be told apart
+// by the fault handler, so such files are copied eagerly instead (returns
+// ERR_INVALID_ARG without touching the task).
+error_t map_image_segments(kernel::task::Task* task,
+						   kernel::memory::unique_kbuf<>& buffer,
+						   size_t size,
+						   const ExecSegment* segments,
+						   int num_segments)
+{
+	for (int i = 0; i < num_segments; ++i) {
+		for (int j = i + 1; j < num_segments; ++j) {
+			if (segment_page_base(segments[i]) < segment_page_end(segments[j]) &&
+				segment_page_base(segments[j]) < segment_page_end(segments[i])) {
+				return ERR_INVALID_ARG;
+			}
+		}
+	}
+
+	ExecImage* image =
+			kernel::memory::acquire_exec_image(buffer, size, segments, num_segments);
+	if (image == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	task->image = image;
+	for (int i = 0; i < num_segments; ++i) {
+		if (segments[i].mem_size == 0) {
+			continue;
+		}
+
+		RETURN_IF_ERROR(task->vmas.insert(segment_page_base(segments[i]),
+										  segment_page_end(segments[i]),
+										  segments[i].writable, image, i));
+	}
+
+	return OK;
+}
+
+} // namespace
+
+error_t load_elf(elf64_ehdr_t* elf_header)
+{
+	RETURN_IF_ERROR(check_executable(elf_header));
 	return copy_load_segment(elf_header);
 }
 
 void exec_elf(kernel::memory::unique_kbuf<> buffer,
+			  size_t size,
 			  const char* name,
 			  const char* args)
 {
 	auto* elf_header = reinterpret_cast<elf64_ehdr_t*>(buffer.get());
-	if (!is_elf(elf_header)) {
+	if (size < sizeof(elf64_ehdr_t) || !is_elf(elf_header)) {
 		LOG_ERROR("not an ELF file: %s", name);
 		return;
 	}
 
-	error_t err = load_elf(elf_header);
+	ExecSegment segments[ExecImage::MAX_SEGMENTS];
+	int num_segments = 0;
+	error_t err = collect_load_segments(elf_header, size, segments, &num_segments);
+	if (!IS_ERR(err)) {
+		err = check_executable(elf_header);
+	}
 	if (IS_ERR(err)) {
 		LOG_ERROR("failed to load ELF file: %s", name);
 		return;
 	}
 
-	// The segments are copied into the new image now; free the file buffer
-	// before enter_user_mode below, which never returns. Only the entry
-	// point survives past this line.
+	// Only the entry point survives past the buffer, which the image may
+	// take over or drop below
 	const uint64_t elf_entry = elf_header->e_entry;
+
+	auto* task = kernel::task::CURRENT_TASK;
+	task->vmas.clear();
+	kernel::memory::put_exec_image(task->image);
+	task->image = nullptr;
+
+	err = map_image_segments(task, buffer, size, segments, num_segments);
+	if (err == ERR_INVALID_ARG && task->image == nullptr) {
+		err = copy_load_segment(elf_header);
+	}
+	if (IS_ERR(err)) {
+		LOG_ERROR("failed to load ELF file: %s", name);
+		return;
+	}
+
+	// Free the file buffer (unless the image kept it) before
+	// enter_user_mode below, which never returns
 	buffer.reset();
 
 	const kernel::memory::vaddr_t argv_addr{ 0xffff'ffff'ffff'f000 };
@@ -175,25 +299,20 @@ void exec_elf(kernel::memory::unique_kbuf<> buffer,
 	const int argc = make_args(const_cast<char*>(name), const_cast<char*>(args),
 							   argv, arg_v_len, arg_buf, arg_buf_len);
 
+	// The stack is demand-paged: exec only records the area and the page
+	// fault handler maps each page on first touch
 	const int stack_size = kernel::memory::PAGE_SIZE * 8;
 	const kernel::memory::vaddr_t stack_addr{ 0xffff'ffff'ffff'f000 - stack_size };
-	err = kernel::memory::setup_page_tables(
-			stack_addr, stack_size / kernel::memory::PAGE_SIZE, true);
+	err = task->vmas.insert(stack_addr.data, stack_addr.data + stack_size, true);
 	if (IS_ERR(err)) {
-		LOG_ERROR("failed to setup stack page table: %s", name);
+		LOG_ERROR("failed to register stack area: %s", name);
 		return;
 	}
 
-	// User heap (issue #315): mapped eagerly at the layout-contract address
-	// so sbrk/malloc work without a syscall (libs/common/memory_layout.h is
-	// the shared contract, libs/user/newlib_support.c the consumer)
-	const kernel::memory::vaddr_t heap_addr{ USER_HEAP_BASE };
-	err = kernel::memory::setup_page_tables(
-			heap_addr, USER_HEAP_SIZE / kernel::memory::PAGE_SIZE, true);
-	if (IS_ERR(err)) {
-		LOG_ERROR("failed to setup heap page table: %s", name);
-		return;
-	}
+	// User heap (issue #315): starts empty at the layout-contract address
+	// and grows through sys_brk (libs/common/memory_layout.h is the shared
+	// contract, libs/user/newlib_support.c the consumer)
+	task->brk = USER_HEAP_BASE;
 
 	enter_user_mode(argc, argv, kernel::memory::USER_SS, elf_entry,
 					stack_addr.data + stack_size - 8,
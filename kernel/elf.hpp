@@ -12,6 +12,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <libs/common/types.hpp>
 #include "memory/slab.hpp"
@@ -97,6 +98,13 @@ typedef struct {
 #define PT_PHDR 6	 ///< Program header table
 #define PT_TLS 7	 ///< Thread-local storage segment
 
+/**
+ * @brief Segment permission flags (p_flags bits)
+ */
+#define PF_X 0x1 ///< Executable
+#define PF_W 0x2 ///< Writable
+#define PF_R 0x4 ///< Readable
+
 /**
  * @brief ELF64 dynamic section entry
  *
@@ -162,14 +170,21 @@ error_t load_elf(elf64_ehdr_t* elf_header);
  * Creates a new process from the ELF file in the buffer and begins
  * execution at the entry point specified in the ELF header.
  *
- * @param buffer ELF file data; ownership moves in and the buffer is freed
- * once the segments are copied (or on any failure path)
+ * The load segments are not copied: they become areas that fault their
+ * pages in from an ExecImage shared by every process running the same
+ * file. Files whose segments share a page are still copied up front.
+ *
+ * @param buffer ELF file data; ownership moves in and the buffer is kept
+ * by the image or freed before the jump to user mode (or on any failure
+ * path)
+ * @param size Size of the file in bytes
  * @param name Name to assign to the new process
  * @param args Command line arguments to pass to the process
  *
  * @note This function does not return if successful
  */
 void exec_elf(kernel::memory::unique_kbuf<> buffer,
+			  size_t size,
 			  const char* name,
 			  const char* args);
 
@@ -0,0 +1,268 @@
+/**
+ * @file buffer_cache.cpp
+ * @brief Block buffer cache implementation
+ */
+
+#include "buffer_cache.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <libs/common/message.hpp>
+#include <libs/common/process_id.hpp>
+#include <libs/common/types.hpp>
+#include <utility>
+#include "internal_common.hpp"
+#include "log/log.hpp"
+#include "memory/slab.hpp"
+#include "task/ipc.hpp"
+
+namespace kernel::fs::fat
+{
+
+BufferCache* BUFFER_CACHE = nullptr;
+
+BufferCache::BufferCache(BlockDevice device, size_t block_size, size_t max_blocks)
+	: device_(device), block_size_(block_size),
+	  max_blocks_(max_blocks == 0 ? 1 : max_blocks), num_dirty_(0), hits_(0),
+	  misses_(0), writebacks_(0), evictions_(0)
+{
+}
+
+BufferCache::Buffer* BufferCache::find(unsigned int sector)
+{
+	auto it = index_.find(sector);
+	if (it == index_.end()) {
+		return nullptr;
+	}
+
+	lru_.splice(lru_.begin(), lru_, it->second);
+	return &*it->second;
+}
+
+error_t BufferCache::write_back(Buffer& buffer)
+{
+	// The device takes ownership of what it writes, and the cache keeps
+	// its copy
+	auto copy = kernel::memory::make_kbuf(block_size_,
+										  kernel::memory::ALLOC_UNINITIALIZED);
+	if (!copy) {
+		return ERR_NO_MEMORY;
+	}
+	memcpy(copy.get(), buffer.data.get(), block_size_);
+
+	RETURN_IF_ERROR(device_.write(copy.release(), buffer.sector, block_size_));
+
+	buffer.dirty = false;
+	--num_dirty_;
+	++writebacks_;
+
+	return OK;
+}
+
+error_t BufferCache::make_room()
+{
+	while (lru_.size() >= max_blocks_) {
+		Buffer& victim = lru_.back();
+		if (victim.dirty) {
+			const error_t err = write_back(victim);
+			if (IS_ERR(err)) {
+				LOG_ERROR("buffer cache: write-back of sector %u failed: %d",
+						  victim.sector, err);
+				return err;
+			}
+		}
+
+		index_.erase(victim.sector);
+		lru_.pop_back();
+		++evictions_;
+	}
+
+	return OK;
+}
+
+const void* BufferCache::read(unsigned int sector)
+{
+	if (Buffer* cached = find(sector); cached != nullptr) {
+		++hits_;
+		return cached->data.get();
+	}
+
+	++misses_;
+	if (IS_ERR(make_room())) {
+		return nullptr;
+	}
+
+	auto data = device_.read(sector, block_size_);
+	if (!data) {
+		return nullptr;
+	}
+
+	lru_.push_front(Buffer{ sector, false, std::move(data) });
+	index_[sector] = lru_.begin();
+
+	return lru_.front().data.get();
+}
+
+error_t BufferCache::write(unsigned int sector, const void* data)
+{
+	Buffer* buffer = find(sector);
+	if (buffer == nullptr) {
+		RETURN_IF_ERROR(make_room());
+
+		auto block = kernel::memory::make_kbuf(block_size_,
+											   kernel::memory::ALLOC_UNINITIALIZED);
+		if (!block) {
+			return ERR_NO_MEMORY;
+		}
+
+		lru_.push_front(Buffer{ sector, false, std::move(block) });
+		index_[sector] = lru_.begin();
+		buffer = &lru_.front();
+	}
+
+	memcpy(buffer->data.get(), data, block_size_);
+	if (!buffer->dirty) {
+		buffer->dirty = true;
+		++num_dirty_;
+	}
+
+	return OK;
+}
+
+error_t BufferCache::read_run(unsigned int sector, size_t len, void* dst)
+{
+	const size_t sectors_per_block = block_size_ / SECTOR_SIZE;
+	const size_t num_blocks = (len + block_size_ - 1) / block_size_;
+	auto* out = static_cast<uint8_t*>(dst);
+
+	size_t block = 0;
+	while (block < num_blocks) {
+		const unsigned int first = sector + block * sectors_per_block;
+		const size_t offset = block * block_size_;
+		if (Buffer* cached = find(first); cached != nullptr) {
+			++hits_;
+			memcpy(out + offset, cached->data.get(),
+				   std::min(block_size_, len - offset));
+			++block;
+			continue;
+		}
+
+		size_t end = block + 1;
+		while (end < num_blocks &&
+			   index_.count(sector + end * sectors_per_block) == 0) {
+			++end;
+		}
+		misses_ += end - block;
+
+		const size_t run_len = (end - block) * block_size_;
+		auto data = device_.read(first, run_len);
+		if (!data) {
+			return ERR_FAILED_READ_FROM_DEVICE;
+		}
+		memcpy(out + offset, data.get(), std::min(run_len, len - offset));
+		block = end;
+	}
+
+	return OK;
+}
+
+error_t BufferCache::write_run(unsigned int sector,
+							   size_t num_blocks,
+							   const void* src)
+{
+	if (num_blocks == 1) {
+		return write(sector, src);
+	}
+
+	const size_t len = num_blocks * block_size_;
+	auto copy = kernel::memory::make_kbuf(len, kernel::memory::ALLOC_UNINITIALIZED);
+	if (!copy) {
+		return ERR_NO_MEMORY;
+	}
+	memcpy(copy.get(), src, len);
+
+	RETURN_IF_ERROR(device_.write(copy.release(), sector, len));
+
+	// A cached block now matches the disk, dirty or not before
+	const size_t sectors_per_block = block_size_ / SECTOR_SIZE;
+	const auto* in = static_cast<const uint8_t*>(src);
+	for (size_t i = 0; i < num_blocks; ++i) {
+		auto it = index_.find(sector + i * sectors_per_block);
+		if (it == index_.end()) {
+			continue;
+		}
+
+		Buffer& buffer = *it->second;
+		memcpy(buffer.data.get(), in + i * block_size_, block_size_);
+		if (buffer.dirty) {
+			buffer.dirty = false;
+			--num_dirty_;
+		}
+	}
+
+	return OK;
+}
+
+error_t BufferCache::sync()
+{
+	error_t result = OK;
+	for (auto it = lru_.begin(); it != lru_.end() && num_dirty_ != 0; ++it) {
+		if (!it->dirty) {
+			continue;
+		}
+
+		const error_t err = write_back(*it);
+		if (IS_ERR(err)) {
+			LOG_ERROR("buffer cache: write-back of sector %u failed: %d",
+					  it->sector, err);
+			if (IS_OK(result)) {
+				result = err;
+			}
+		}
+	}
+
+	return result;
+}
+
+BufferCacheStats BufferCache::stats() const
+{
+	return BufferCacheStats{ lru_.size(), num_dirty_, hits_,
+							 misses_,	  writebacks_, evictions_ };
+}
+
+void handle_fs_sync(const Message& m)
+{
+	Message reply = { .type = MsgType::FS_SYNC, .sender = process_ids::FS_FAT32 };
+	reply.result = sync_volume();
+
+	kernel::task::reply(m, &reply);
+}
+
+void handle_fs_cache_stats(const Message& m)
+{
+	Message reply = { .type = MsgType::FS_CACHE_STATS,
+					  .sender = process_ids::FS_FAT32 };
+
+	const BufferCacheStats stats = BUFFER_CACHE->stats();
+	auto& out = reply.data.buffer_cache;
+	out.blocks = stats.blocks;
+	out.block_size = BUFFER_CACHE->block_size();
+	out.dirty = stats.dirty;
+	out.hits = stats.hits;
+	out.misses = stats.misses;
+	out.writebacks = stats.writebacks;
+	out.evictions = stats.evictions;
+	reply.result = OK;
+
+	kernel::task::reply(m, &reply);
+}
+
+void handle_flush_timer(const Message&)
+{
+	// Errors are logged where they happen; what failed stays dirty for the
+	// next tick
+	sync_volume();
+}
+
+} // namespace kernel::fs::fat
@@ -0,0 +1,155 @@
+/**
+ * @file buffer_cache.hpp
+ * @brief Write-back cache of volume blocks between FAT32 and virtio-blk
+ *
+ * Directory and file clusters are read through BUFFER_CACHE instead of a
+ * call to the blk task each time: a block is looked up by its first sector
+ * in a hash index, and the least recently used one is evicted once the
+ * cache holds max_blocks. Writes only update the cached copy and mark it
+ * dirty; dirty blocks reach the disk when they are evicted, when a file is
+ * closed, on FS_SYNC, and every BUFFER_CACHE_FLUSH_INTERVAL_MS from the FS
+ * task's timer.
+ *
+ * File data moves in runs of adjacent blocks instead: read_run() and
+ * write_run() go to the device in one request per run and only keep the
+ * blocks already cached coherent, so streaming a large file does not push
+ * the directory blocks out.
+ *
+ * The FAT itself and the boot sector are not cached here: the FAT is kept
+ * whole in FAT_TABLE and written by write_fat_table_to_disk().
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <libs/common/types.hpp>
+#include <list>
+#include <unordered_map>
+#include "memory/slab.hpp"
+
+namespace kernel::fs::fat
+{
+
+/// Memory the live cache may hold, in bytes of block data
+constexpr size_t BUFFER_CACHE_BYTES = 512 * 1024;
+
+/// Period of the FS task's sync_volume(): dirty blocks and FAT sectors
+constexpr unsigned long BUFFER_CACHE_FLUSH_INTERVAL_MS = 1000;
+
+/**
+ * @brief Device a cache reads and writes blocks with
+ *
+ * Same contract as read_from_blk() / write_to_blk(), which back the live
+ * cache: write takes ownership of the buffer. Tests pass an in-memory disk.
+ */
+struct BlockDevice {
+	kernel::memory::unique_kbuf<> (*read)(unsigned int sector, size_t len);
+	error_t (*write)(void* buffer, unsigned int sector, size_t len);
+};
+
+/**
+ * @brief Cache counters
+ *
+ * Hits and misses count the blocks looked up by read() and read_run().
+ */
+struct BufferCacheStats {
+	size_t blocks; ///< Blocks held now
+	size_t dirty;  ///< Of which not written back yet
+	size_t hits;
+	size_t misses;
+	size_t writebacks; ///< Blocks written to the device
+	size_t evictions;
+};
+
+class BufferCache
+{
+public:
+	/**
+	 * @param device Backing device
+	 * @param block_size Bytes per block, a multiple of SECTOR_SIZE
+	 * @param max_blocks Blocks held before the LRU one is evicted (at least 1)
+	 */
+	BufferCache(BlockDevice device, size_t block_size, size_t max_blocks);
+
+	/**
+	 * @brief Contents of the block starting at sector
+	 * @return Cached copy, valid until the next call that may evict
+	 * (read() or write()), or nullptr if the device read failed or the
+	 * block could not be cached
+	 */
+	const void* read(unsigned int sector);
+
+	/**
+	 * @brief Replace the block starting at sector
+	 *
+	 * The device is not read: data holds the whole block. It is written back
+	 * later (see the file comment).
+	 *
+	 * @return OK, ERR_NO_MEMORY, or the device error of writing back the
+	 * dirty block evicted to make room
+	 */
+	error_t write(unsigned int sector, const void* data);
+
+	/**
+	 * @brief Read len bytes of adjacent blocks starting at sector into dst
+	 *
+	 * Cached blocks are copied from the cache; each stretch of uncached
+	 * ones is a single device request, and is not added to the cache.
+	 *
+	 * @return OK, ERR_FAILED_READ_FROM_DEVICE or ERR_NO_MEMORY
+	 */
+	error_t read_run(unsigned int sector, size_t len, void* dst);
+
+	/**
+	 * @brief Write num_blocks adjacent blocks starting at sector
+	 *
+	 * One device request, made now; cached copies of the blocks are updated
+	 * and are clean afterwards. A single block goes through write() instead.
+	 *
+	 * @return OK, ERR_NO_MEMORY or the device error
+	 */
+	error_t write_run(unsigned int sector, size_t num_blocks, const void* src);
+
+	/**
+	 * @brief Write every dirty block back
+	 * @return OK, or the first error (the blocks that failed stay dirty)
+	 */
+	error_t sync();
+
+	BufferCacheStats stats() const;
+
+	size_t block_size() const { return block_size_; }
+
+private:
+	struct Buffer {
+		unsigned int sector;
+		bool dirty;
+		kernel::memory::unique_kbuf<> data;
+	};
+
+	using BufferList = std::list<Buffer>;
+
+	/// Cached block of sector moved to the front, or nullptr
+	Buffer* find(unsigned int sector);
+	error_t make_room();
+	error_t write_back(Buffer& buffer);
+
+	BlockDevice device_;
+	size_t block_size_;
+	size_t max_blocks_;
+
+	BufferList lru_; ///< Most recently used first
+	std::unordered_map<unsigned int, BufferList::iterator> index_;
+
+	size_t num_dirty_;
+	size_t hits_;
+	size_t misses_;
+	size_t writebacks_;
+	size_t evictions_;
+};
+
+/// Cache of the mounted volume, created by initialize_fat32()
+extern BufferCache* BUFFER_CACHE;
+
+} // namespace kernel::fs::fat
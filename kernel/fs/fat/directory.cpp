@@ -12,6 +12,7 @@
 #include <libs/common/types.hpp>
 #include <string>
 #include <utility>
+#include "buffer_cache.hpp"
 #include "fat.hpp"
 #include "graphics/font.hpp"
 #include "internal_common.hpp"
@@ -31,6 +32,24 @@ namespace
 /// the task boundary in ~40 places. Now it is FS state, keyed by owner.
 ClientCwd cwd_table[MAX_CWD_CLIENTS];
 
+/// Own copy of a directory cluster for a cwd record, out of the buffer cache
+/// (its copy may be evicted); empty when the device read fails
+kernel::memory::unique_kbuf<> copy_dir_cluster(cluster_t cluster)
+{
+	const void* block = BUFFER_CACHE->read(calc_start_sector(cluster));
+	if (block == nullptr) {
+		return kernel::memory::unique_kbuf<>{};
+	}
+
+	auto buf = kernel::memory::make_kbuf(BYTES_PER_CLUSTER,
+										 kernel::memory::ALLOC_UNINITIALIZED);
+	if (buf) {
+		memcpy(buf.get(), block, BYTES_PER_CLUSTER);
+	}
+
+	return buf;
+}
+
 /// Drop a record's owned directory buffer (the shared ROOT_DIR is not ours)
 void free_cwd_dir(ClientCwd& c)
 {
@@ -167,8 +186,7 @@ void handle_parent_directory_change(const Message& m, ClientCwd& c)
 	// Synchronous cluster load (issue #314 Stage B): the reply below
 	// reports the real outcome, and the change_dir_requests/names maps
 	// that tracked the in-flight load are gone.
-	auto buf = read_from_blk(calc_start_sector(parent_entry->first_cluster()),
-							 BYTES_PER_CLUSTER);
+	auto buf = copy_dir_cluster(parent_entry->first_cluster());
 	if (!buf) {
 		// Device read failed: keep the current directory instead of
 		// pointing it at a null buffer.
@@ -196,8 +214,7 @@ void handle_normal_directory_change(const Message& m,
 		return;
 	}
 
-	auto buf = read_from_blk(calc_start_sector(entry->first_cluster()),
-							 BYTES_PER_CLUSTER);
+	auto buf = copy_dir_cluster(entry->first_cluster());
 	if (!buf) {
 		send_error_response(m);
 		return;
@@ -377,17 +394,11 @@ void persist_directory_entry(DirectoryEntry* entry, const char* name)
 
 	memcpy(disk_entry, entry, sizeof(DirectoryEntry));
 
-	void* write_buffer;
-	ALLOC_OR_RETURN(write_buffer, BYTES_PER_CLUSTER, kernel::memory::ALLOC_ZEROED);
-
-	memcpy(write_buffer, ROOT_DIR, BYTES_PER_CLUSTER);
-
 	const unsigned int root_dir_sector = calc_start_sector(VOLUME_BPB->root_cluster);
 
-	// Write the entire ROOT_DIR cluster back to disk; write_to_blk hands
-	// buffer ownership to the blk task and reports the real outcome
-	const error_t err =
-			write_to_blk(write_buffer, root_dir_sector, BYTES_PER_CLUSTER);
+	// The entire ROOT_DIR cluster goes to the buffer cache, which writes it
+	// back with the file data
+	const error_t err = BUFFER_CACHE->write(root_dir_sector, ROOT_DIR);
 	if (IS_ERR(err)) {
 		LOG_ERROR("failed to persist directory entry: %d", err);
 	}
@@ -6,10 +6,12 @@
 #include "fat.hpp"
 #include <libs/common/message.hpp>
 #include <libs/common/types.hpp>
+#include "buffer_cache.hpp"
 #include "fs/file_info.hpp"
 #include "internal_common.hpp"
 #include "log/log.hpp"
 #include "task/task.hpp"
+#include "timers/timer.hpp"
 
 namespace kernel::fs::fat
 {
@@ -45,6 +47,11 @@ void fat32_service()
 	t->add_msg_handler(MsgType::FS_PWD, handle_fs_pwd);
 	t->add_msg_handler(MsgType::FS_CHANGE_DIR, handle_fs_change_dir);
 	t->add_msg_handler(MsgType::FS_DUP2, handle_fs_dup2);
+	t->add_msg_handler(MsgType::FS_SYNC, handle_fs_sync);
+	t->add_msg_handler(MsgType::FS_CACHE_STATS, handle_fs_cache_stats);
+	t->add_msg_handler(MsgType::NOTIFY_TIMER_TIMEOUT, handle_flush_timer);
+	kernel::timers::ktimer->add_periodic_timer_event(BUFFER_CACHE_FLUSH_INTERVAL_MS,
+													 t->id);
 
 	kernel::task::process_messages(t);
 }
@@ -49,6 +49,29 @@ struct BiosParameterBlock {
 	char fs_type[8];
 } __attribute__((packed));
 
+/**
+ * @brief FSInfo sector (BiosParameterBlock::fs_info)
+ *
+ * Hints that spare a mount the FAT scan for free space. Either may be
+ * FSINFO_UNKNOWN, and neither is trusted without the signatures.
+ */
+struct FsInfo {
+	uint32_t lead_signature;
+	uint8_t reserved[480];
+	uint32_t struct_signature;
+	uint32_t free_count; ///< Free clusters
+	uint32_t next_free;	 ///< Where to start looking for one
+	uint8_t reserved1[12];
+	uint32_t trail_signature;
+} __attribute__((packed));
+
+static_assert(sizeof(FsInfo) == 512, "FSInfo fills one sector");
+
+constexpr uint32_t FSINFO_LEAD_SIGNATURE = 0x41615252;
+constexpr uint32_t FSINFO_STRUCT_SIGNATURE = 0x61417272;
+constexpr uint32_t FSINFO_TRAIL_SIGNATURE = 0xAA550000;
+constexpr uint32_t FSINFO_UNKNOWN = 0xFFFFFFFF;
+
 enum class entry_attribute : uint8_t {
 	READ_ONLY = 0x01,
 	HIDDEN = 0x02,
@@ -9,6 +9,7 @@
 #include <libs/common/message.hpp>
 #include <libs/common/process_id.hpp>
 #include <libs/common/types.hpp>
+#include "buffer_cache.hpp"
 #include "fat.hpp"
 #include "fs/file_descriptor.hpp"
 #include "fs/file_info.hpp"
@@ -35,9 +36,9 @@ void entry_cache_key(const DirectoryEntry* entry, char (&key)[12])
 /**
  * @brief Load a file's contents into the file cache, cluster by cluster
  *
- * Each cluster is a synchronous call to the blk service (issue #314
- * Stage B); the old per-request async state machine
- * (request_id/sequence tracking, partial-read progress) is gone.
+ * Clusters come from the buffer cache; a miss is a synchronous call to the
+ * blk service (issue #314 Stage B). The old per-request async state
+ * machine (request_id/sequence tracking, partial-read progress) is gone.
  *
  * @return The populated cache entry, or nullptr on failure (a partially
  * filled cache is dropped so it can never serve stale data)
@@ -58,21 +59,13 @@ FileCache* load_file(const DirectoryEntry* entry, ProcessId requester)
 		return nullptr;
 	}
 
-	size_t offset = 0;
-	cluster_t cluster = entry->first_cluster();
-	while (cluster != END_OF_CLUSTER_CHAIN && offset < entry->file_size) {
-		auto buf = read_from_blk(calc_start_sector(cluster), BYTES_PER_CLUSTER);
-		if (!buf) {
-			remove_file_cache_by_path(file_name);
-			return nullptr;
-		}
-
-		const size_t copy_len =
-				std::min(BYTES_PER_CLUSTER, entry->file_size - offset);
-		memcpy(cache->buffer.data() + offset, buf.get(), copy_len);
-		offset += copy_len;
-
-		cluster = next_cluster(cluster);
+	const error_t err =
+			read_cluster_chain(*BUFFER_CACHE, FAT_TABLE, calc_start_sector(2),
+							   entry->first_cluster(), entry->file_size,
+							   cache->buffer.data());
+	if (IS_ERR(err)) {
+		remove_file_cache_by_path(file_name);
+		return nullptr;
 	}
 
 	cache->read_size = entry->file_size;
@@ -153,8 +146,8 @@ OpenFileRecord* resolve_record(const Message& m)
  * @brief Ensure the entry's cluster chain can hold new_size bytes
  *
  * Allocates the first cluster for empty files and extends the chain when
- * the file grows across a cluster boundary; every FAT mutation is written
- * through to disk immediately.
+ * the file grows across a cluster boundary. The FAT sectors that changed
+ * are written by the next sync_volume().
  *
  * @return OK, or ERR_NO_MEMORY when no free clusters remain
  */
@@ -168,7 +161,6 @@ error_t grow_file_if_needed(DirectoryEntry* entry, size_t new_size)
 		}
 
 		entry->set_first_cluster(new_cluster);
-		write_fat_table_to_disk();
 	}
 
 	const size_t current_clusters =
@@ -196,21 +188,24 @@ error_t grow_file_if_needed(DirectoryEntry* entry, size_t new_size)
 		LOG_ERROR("failed to extend cluster chain");
 		return ERR_NO_MEMORY;
 	}
-	write_fat_table_to_disk();
 
 	return OK;
 }
 
 /**
- * @brief Stage and write one cluster's worth of data at offset into the file
+ * @brief Write data at offset into the file, up to one run of clusters
  *
- * Walks the chain to the cluster containing offset, stages the data in a
- * fresh cluster-sized buffer, invalidates the file cache, then writes the
- * cluster through to the block device (buffer ownership moves to the blk
- * task). Writes are bounded to a single cluster per request.
+ * Walks the chain to the cluster containing offset and invalidates the file
+ * cache. A cluster-aligned write of two clusters or more covers as many
+ * whole clusters as are physically adjacent (up to MAX_RUN_TRANSFER_SIZE)
+ * and goes to the device in one request. Anything else is staged in a
+ * fresh cluster-sized buffer and stored in the buffer cache, which writes
+ * it back later.
  *
- * @param write_len Out: bytes staged = min(count, space left in the cluster)
- * @return OK, or the staging/device error
+ * @param write_len Out: bytes written = the run's whole clusters, or
+ * min(count, space left in the cluster)
+ * @return OK, or the staging or device error (or that of writing back the
+ * block the buffer cache evicted)
  */
 error_t write_file_cluster(DirectoryEntry* entry,
 						   size_t offset,
@@ -233,6 +228,27 @@ error_t write_file_cluster(DirectoryEntry* entry,
 		return ERR_INVALID_ARG;
 	}
 
+	char cache_key[12];
+	entry_cache_key(entry, cache_key);
+
+	if (offset_in_cluster == 0 && count >= 2 * BYTES_PER_CLUSTER) {
+		const size_t max_run =
+				std::min(count, MAX_RUN_TRANSFER_SIZE) / BYTES_PER_CLUSTER;
+		const size_t run = cluster_run_length(target_cluster, max_run, nullptr);
+		if (run > 1) {
+			*write_len = run * BYTES_PER_CLUSTER;
+			remove_file_cache_by_path(cache_key);
+
+			const error_t err = BUFFER_CACHE->write_run(
+					calc_start_sector(target_cluster), run, data);
+			if (IS_ERR(err)) {
+				LOG_ERROR("block write failed: result=%d", err);
+			}
+
+			return err;
+		}
+	}
+
 	auto cluster_buffer = kernel::memory::make_kbuf(BYTES_PER_CLUSTER,
 													kernel::memory::ALLOC_ZEROED);
 	if (!cluster_buffer) {
@@ -258,15 +274,11 @@ error_t write_file_cluster(DirectoryEntry* entry,
 
 	// Invalidate the cached file contents so a read after this write does
 	// not return stale data (issue #313).
-	char cache_key[12];
-	entry_cache_key(entry, cache_key);
 	remove_file_cache_by_path(cache_key);
 
-	// Synchronous device write (issue #314 Stage B): the reply carries the
-	// real outcome instead of claiming success before the write happened.
-	const error_t err =
-			write_to_blk(cluster_buffer.release(), calc_start_sector(target_cluster),
-						 BYTES_PER_CLUSTER);
+	// Device errors of the deferred write surface at close or FS_SYNC
+	const unsigned int sector = calc_start_sector(target_cluster);
+	const error_t err = BUFFER_CACHE->write(sector, cluster_buffer.get());
 	if (IS_ERR(err)) {
 		LOG_ERROR("block write failed: result=%d", err);
 	}
@@ -278,8 +290,8 @@ error_t write_file_cluster(DirectoryEntry* entry,
  * @brief Free the clusters no longer needed when the file shrinks to new_size
  *
  * Cuts the chain after the last cluster still in use (frees the whole chain
- * when new_size is 0) and persists the FAT. The caller updates and persists
- * entry->file_size itself.
+ * when new_size is 0); the FAT follows at the next sync_volume(). The caller
+ * updates and persists entry->file_size itself.
  */
 void truncate_file(DirectoryEntry* entry, size_t new_size)
 {
@@ -308,12 +320,10 @@ void truncate_file(DirectoryEntry* entry, size_t new_size)
 			cluster_t next = next_cluster(current);
 			if (next != END_OF_CLUSTER_CHAIN) {
 				free_cluster_chain(next);
-				FAT_TABLE[current] = END_OF_CLUSTER_CHAIN;
+				set_fat_entry(current, END_OF_CLUSTER_CHAIN);
 			}
 		}
 	}
-
-	write_fat_table_to_disk();
 }
 
 } // namespace
@@ -426,12 +436,18 @@ void handle_fs_close(const Message& m)
 		open_file_release(fd_entry->handle);
 	}
 
-	error_t result = kernel::fs::release_process_fd(
+	Message reply = { .type = MsgType::FS_CLOSE, .sender = process_ids::FS_FAT32 };
+	reply.result = kernel::fs::release_process_fd(
 			t->fd_table.data(), kernel::task::MAX_FDS_PER_PROCESS, m.data.fs.fd);
-	if (IS_ERR(result)) {
-		LOG_ERROR("Failed to close fd %d: error %d", m.data.fs.fd, result);
-		return;
+	if (IS_ERR(reply.result)) {
+		LOG_ERROR("Failed to close fd %d: error %d", m.data.fs.fd, reply.result);
+	} else {
+		// What the file wrote reaches the disk by the time it is closed, or
+		// the caller learns it did not
+		reply.result = sync_volume();
 	}
+
+	kernel::task::reply(m, &reply);
 }
 
 void handle_fs_write(const Message& m)
@@ -8,6 +8,8 @@
 #include <cstring>
 #include <libs/common/message.hpp>
 #include <libs/common/process_id.hpp>
+#include <new>
+#include "buffer_cache.hpp"
 #include "fat.hpp"
 #include "internal_common.hpp"
 #include "log/log.hpp"
@@ -24,6 +26,36 @@ unsigned long ENTRIES_PER_CLUSTER = 0;
 uint32_t* FAT_TABLE = nullptr;
 unsigned int FAT_TABLE_SECTOR = 0;
 kernel::fs::DirectoryEntry* ROOT_DIR = nullptr;
+kernel::fs::FsInfo* FS_INFO = nullptr;
+
+namespace
+{
+// FSInfo sector of the volume if its signatures check out, else nullptr
+kernel::fs::FsInfo* read_fs_info()
+{
+	// 0 and 0xFFFF mean there is none; it lives in the reserved area
+	if (VOLUME_BPB->fs_info == 0 ||
+		VOLUME_BPB->fs_info >= VOLUME_BPB->reserved_sector_count) {
+		return nullptr;
+	}
+
+	auto buf = read_from_blk(VOLUME_BPB->fs_info, SECTOR_SIZE);
+	if (!buf) {
+		return nullptr;
+	}
+
+	const auto* info = static_cast<const kernel::fs::FsInfo*>(buf.get());
+	if (info->lead_signature != FSINFO_LEAD_SIGNATURE ||
+		info->struct_signature != FSINFO_STRUCT_SIGNATURE ||
+		info->trail_signature != FSINFO_TRAIL_SIGNATURE) {
+		LOG_ERROR("FSInfo sector %u has bad signatures; ignoring it",
+				  VOLUME_BPB->fs_info);
+		return nullptr;
+	}
+
+	return static_cast<kernel::fs::FsInfo*>(buf.release());
+}
+} // namespace
 
 error_t initialize_fat32()
 {
@@ -44,6 +76,16 @@ error_t initialize_fat32()
 	ENTRIES_PER_CLUSTER = BYTES_PER_CLUSTER / sizeof(kernel::fs::DirectoryEntry);
 	FAT_TABLE_SECTOR = VOLUME_BPB->reserved_sector_count;
 
+	void* cache_buf =
+			kernel::memory::alloc(sizeof(BufferCache), kernel::memory::ALLOC_ZEROED);
+	if (cache_buf == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+	// One block per cluster: directories and file data are read that way
+	const BlockDevice device{ read_from_blk, write_to_blk };
+	BUFFER_CACHE = new (cache_buf) BufferCache(
+			device, BYTES_PER_CLUSTER, BUFFER_CACHE_BYTES / BYTES_PER_CLUSTER);
+
 	const size_t table_size = static_cast<size_t>(VOLUME_BPB->fat_size_32) *
 							  static_cast<size_t>(SECTOR_SIZE);
 	auto fat_buf = read_from_blk(FAT_TABLE_SECTOR, table_size);
@@ -52,6 +94,18 @@ error_t initialize_fat32()
 	}
 	FAT_TABLE = reinterpret_cast<uint32_t*>(fat_buf.release());
 
+	// The bitmap needs the one FAT pass anyway, which also yields the exact
+	// free count; FSInfo only contributes where allocation left off
+	FS_INFO = read_fs_info();
+	const cluster_t hint = FS_INFO != nullptr ? FS_INFO->next_free : 2;
+	RETURN_IF_ERROR(
+			build_cluster_map(CLUSTER_MAP, FAT_TABLE, total_fat_clusters(), hint));
+	if (FS_INFO != nullptr && FS_INFO->free_count != FSINFO_UNKNOWN &&
+		FS_INFO->free_count != CLUSTER_MAP.free_count) {
+		LOG_INFO("FSInfo free count %u is stale: %lu clusters are free",
+				 FS_INFO->free_count, CLUSTER_MAP.free_count);
+	}
+
 	auto root_buf = read_from_blk(calc_start_sector(VOLUME_BPB->root_cluster),
 								  BYTES_PER_CLUSTER);
 	if (!root_buf) {
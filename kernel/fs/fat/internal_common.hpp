@@ -15,6 +15,8 @@
 namespace kernel::fs::fat
 {
 
+class BufferCache;
+
 // Global variables shared across FAT implementation
 extern kernel::fs::BiosParameterBlock* VOLUME_BPB;
 extern unsigned long BYTES_PER_CLUSTER;
@@ -22,10 +24,15 @@ extern unsigned long ENTRIES_PER_CLUSTER;
 extern uint32_t* FAT_TABLE;
 extern unsigned int FAT_TABLE_SECTOR;
 extern kernel::fs::DirectoryEntry* ROOT_DIR;
+/// The volume's FSInfo sector, or nullptr when it has none (or a bad one)
+extern kernel::fs::FsInfo* FS_INFO;
 
 // FAT table write optimization constants
 constexpr size_t FAT_WRITE_CHUNK_SIZE = 65536; // 64KB chunks for batch writes
 
+/// Largest single block request for a run of adjacent file clusters
+constexpr size_t MAX_RUN_TRANSFER_SIZE = 128 * 1024;
+
 /// Space character used to right-pad the 8.3 short file name fields.
 constexpr char SFN_PAD = 0x20;
 
@@ -126,25 +133,113 @@ kernel::fs::DirectoryEntry* scan_valid_entries(kernel::fs::DirectoryEntry* dir,
 
 	return nullptr;
 }
-// The (fat, total_clusters) overloads operate on an explicit FAT so tests
-// can use a private table; the parameterless-FAT overloads wrap the live
-// globals. Tests must never swap the globals themselves: the FS task uses
-// them concurrently (issue #313 regression).
-cluster_t extend_cluster_chain(uint32_t* fat,
-							   size_t total_clusters,
+/// FAT entries per sector, the unit FAT write-back works in
+constexpr size_t FAT_ENTRIES_PER_SECTOR = SECTOR_SIZE / sizeof(uint32_t);
+
+/**
+ * @brief Free-cluster index over a FAT
+ *
+ * One bit per cluster, set while its FAT entry is in use, next to the count
+ * of free clusters and where the next search starts: the two hints of the
+ * FSInfo sector, kept exact. The chain functions below update it with the
+ * FAT, so allocating and counting free clusters need no FAT scan.
+ *
+ * It also has a bit per FAT sector, set when an entry in it changes, so
+ * write_fat_table_to_disk() writes only those sectors.
+ */
+struct ClusterMap {
+	uint32_t* fat;
+	size_t total_clusters;
+	unsigned long* used; ///< Bit per cluster; 0, 1 and those past the end set
+	size_t free_count;
+	cluster_t next_free;
+	unsigned long* dirty; ///< Bit per FAT sector changed since the last flush
+	size_t num_dirty;
+};
+
+/// Index of the mounted volume's FAT_TABLE, built by initialize_fat32()
+extern ClusterMap CLUSTER_MAP;
+
+/**
+ * @brief Index fat in one pass
+ * @param hint Where the first search starts (FSInfo next_free); an
+ * out-of-range value starts at cluster 2
+ * @return OK, or ERR_NO_MEMORY for the bitmap
+ */
+error_t build_cluster_map(ClusterMap& map,
+						  uint32_t* fat,
+						  size_t total_clusters,
+						  cluster_t hint);
+void destroy_cluster_map(ClusterMap& map);
+
+/// Change one FAT entry outside the chain functions, marking its sector dirty
+void set_fat_entry(ClusterMap& map, cluster_t cluster, uint32_t value);
+void set_fat_entry(cluster_t cluster, uint32_t value);
+
+/**
+ * @brief Find the next run of adjacent dirty FAT sectors
+ * @param from First sector to look at
+ * @param first Out: first sector of the run
+ * @param count Out: sectors in the run
+ * @return false when no sector from `from` on is dirty
+ */
+bool next_dirty_run(const ClusterMap& map,
+					size_t from,
+					size_t* first,
+					size_t* count);
+
+// The (map, ...) overloads operate on an explicit map so tests can use a
+// private FAT; the map-less overloads wrap CLUSTER_MAP. Tests must never
+// swap the globals themselves: the FS task uses them concurrently (issue
+// #313 regression).
+cluster_t extend_cluster_chain(ClusterMap& map,
 							   cluster_t last_cluster,
 							   int num_clusters);
 cluster_t extend_cluster_chain(cluster_t last_cluster, int num_clusters);
-cluster_t allocate_cluster_chain(uint32_t* fat,
-								 size_t total_clusters,
-								 size_t num_clusters);
+cluster_t allocate_cluster_chain(ClusterMap& map, size_t num_clusters);
 cluster_t allocate_cluster_chain(size_t num_clusters);
-void free_cluster_chain(uint32_t* fat, cluster_t start_cluster);
+void free_cluster_chain(ClusterMap& map, cluster_t start_cluster);
 void free_cluster_chain(cluster_t start_cluster);
-size_t count_free_clusters(const uint32_t* fat, size_t total_clusters);
+size_t count_free_clusters(const ClusterMap& map);
 size_t count_free_clusters();
+
+/// One past the highest cluster number of the volume: the data region's
+/// clusters plus the two reserved FAT entries
 size_t total_fat_clusters();
 
+/**
+ * @brief Count the physically adjacent clusters a chain continues with
+ *
+ * A run is cluster, cluster + 1, ... as long as each links to the next.
+ *
+ * @param max_clusters Cap on the run (at least 1 is returned)
+ * @param next Out, optional: the cluster the chain goes on with after the
+ * run, END_OF_CLUSTER_CHAIN at its end
+ * @return Clusters in the run
+ */
+size_t cluster_run_length(const uint32_t* fat,
+						  cluster_t cluster,
+						  size_t max_clusters,
+						  cluster_t* next);
+size_t cluster_run_length(cluster_t cluster, size_t max_clusters, cluster_t* next);
+
+/**
+ * @brief Read the first len bytes of a cluster chain into dst
+ *
+ * Each run of adjacent clusters (up to MAX_RUN_TRANSFER_SIZE) is one
+ * cache.read_run(); a cluster is one cache block.
+ *
+ * @param data_sector First sector of cluster 2
+ * @return OK, ERR_INVALID_ARG when the chain ends before len, or the read
+ * error
+ */
+error_t read_cluster_chain(BufferCache& cache,
+						   const uint32_t* fat,
+						   unsigned int data_sector,
+						   cluster_t first_cluster,
+						   size_t len,
+						   void* dst);
+
 /**
  * @brief Synchronously read len bytes starting at sector from the block
  * device (call/reply RPC, issue #314 Stage B)
@@ -163,8 +258,27 @@ error_t write_to_blk(void* buffer, unsigned int sector, size_t len);
 // Synchronous FAT32 initialization: BPB -> FAT -> root directory
 error_t initialize_fat32();
 
-// FAT table persistence
-void write_fat_table_to_disk();
+/**
+ * @brief Write the dirty FAT sectors to every FAT copy
+ *
+ * Adjacent dirty sectors go out as one request (up to FAT_WRITE_CHUNK_SIZE),
+ * and the FSInfo hints are written along with them. Called by
+ * sync_volume(), not on every FAT change.
+ *
+ * @return OK, or the first device error (the failed sectors stay dirty,
+ * and a failed FSInfo write is retried by the next call)
+ */
+error_t write_fat_table_to_disk();
+
+/**
+ * @brief Write everything the volume has cached: buffer cache blocks, then
+ * the FAT
+ *
+ * Runs when a file is closed, on FS_SYNC and from the FS task's timer.
+ *
+ * @return OK, or the first device error
+ */
+error_t sync_volume();
 
 /**
  * @brief Reply to a read-style request with file data
@@ -196,5 +310,9 @@ void handle_fs_register_path(const Message& m);
 void handle_fs_pwd(const Message& m);
 void handle_fs_change_dir(const Message& m);
 void handle_fs_dup2(const Message& m);
+void handle_fs_sync(const Message& m);
+void handle_fs_cache_stats(const Message& m);
+/// NOTIFY_TIMER_TIMEOUT: periodic sync_volume()
+void handle_flush_timer(const Message& m);
 
 } // namespace kernel::fs::fat
@@ -3,6 +3,7 @@
  * @brief FAT32 utility functions implementation
  */
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
@@ -10,6 +11,7 @@
 #include <libs/common/process_id.hpp>
 #include <libs/common/types.hpp>
 #include <utility>
+#include "buffer_cache.hpp"
 #include "fat.hpp"
 #include "internal_common.hpp"
 #include "log/log.hpp"
@@ -114,68 +116,306 @@ size_t total_fat_clusters()
 		return 0;
 	}
 
-	const size_t total_clusters =
-			VOLUME_BPB->total_sectors_32 / VOLUME_BPB->sectors_per_cluster;
+	// Clusters cover the data region only, past the reserved sectors and the
+	// FATs; numbering starts at 2
+	const size_t meta_sectors =
+			VOLUME_BPB->reserved_sector_count +
+			static_cast<size_t>(VOLUME_BPB->num_fats) * VOLUME_BPB->fat_size_32;
+	if (VOLUME_BPB->total_sectors_32 <= meta_sectors) {
+		return 0;
+	}
+	const size_t data_clusters = (VOLUME_BPB->total_sectors_32 - meta_sectors) /
+								 VOLUME_BPB->sectors_per_cluster;
+	size_t total_clusters = data_clusters + 2;
+
+	// The FAT may hold fewer entries than the data region has clusters
+	const size_t fat_entries =
+			static_cast<size_t>(VOLUME_BPB->fat_size_32) * FAT_ENTRIES_PER_SECTOR;
+	if (total_clusters > fat_entries) {
+		total_clusters = fat_entries;
+	}
 
 	// Cluster numbers above 0x0FFFFFF7 are reserved in FAT32
 	return total_clusters < FAT32_EOC_MIN ? total_clusters : FAT32_EOC_MIN;
 }
 
-cluster_t extend_cluster_chain(uint32_t* fat,
-							   size_t total_clusters,
-							   cluster_t last_cluster,
-							   int num_clusters)
+size_t cluster_run_length(const uint32_t* fat,
+						  cluster_t cluster,
+						  size_t max_clusters,
+						  cluster_t* next)
 {
-	cluster_t current_cluster = last_cluster;
-	int num_allocated = 0;
-	for (size_t i = 2; i < total_clusters && num_allocated < num_clusters; ++i) {
+	size_t run = 1;
+	cluster_t last = cluster;
+	uint32_t link = fat[last];
+	while (run < max_clusters && link == last + 1) {
+		last = link;
+		link = fat[last];
+		++run;
+	}
+
+	if (next != nullptr) {
+		*next = link >= FAT32_EOC_MIN ? END_OF_CLUSTER_CHAIN : link;
+	}
+
+	return run;
+}
+
+size_t cluster_run_length(cluster_t cluster, size_t max_clusters, cluster_t* next)
+{
+	return cluster_run_length(FAT_TABLE, cluster, max_clusters, next);
+}
+
+error_t read_cluster_chain(BufferCache& cache,
+						   const uint32_t* fat,
+						   unsigned int data_sector,
+						   cluster_t first_cluster,
+						   size_t len,
+						   void* dst)
+{
+	const size_t cluster_size = cache.block_size();
+	const size_t sectors_per_cluster = cluster_size / SECTOR_SIZE;
+	const size_t max_run = std::max<size_t>(1, MAX_RUN_TRANSFER_SIZE / cluster_size);
+	auto* out = static_cast<uint8_t*>(dst);
+
+	size_t offset = 0;
+	cluster_t cluster = first_cluster;
+	while (offset < len) {
+		if (cluster < 2 || cluster >= FAT32_EOC_MIN) {
+			LOG_ERROR("cluster chain ends %lu bytes short", len - offset);
+			return ERR_INVALID_ARG;
+		}
+
+		const size_t clusters_left =
+				(len - offset + cluster_size - 1) / cluster_size;
+		cluster_t next;
+		const size_t run = cluster_run_length(
+				fat, cluster, std::min(max_run, clusters_left), &next);
+		const size_t run_len = std::min(run * cluster_size, len - offset);
+		const unsigned int sector =
+				data_sector + (cluster - 2) * sectors_per_cluster;
+		RETURN_IF_ERROR(cache.read_run(sector, run_len, out + offset));
+
+		offset += run_len;
+		cluster = next;
+	}
+
+	return OK;
+}
+
+namespace
+{
+constexpr size_t BITS_PER_WORD = sizeof(unsigned long) * 8;
+
+size_t bitmap_words(size_t num_bits)
+{
+	return (num_bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
+
+bool test_bit(const unsigned long* bitmap, size_t bit)
+{
+	return (bitmap[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD) & 1) != 0;
+}
+
+size_t fat_sectors(size_t total_clusters)
+{
+	return (total_clusters + FAT_ENTRIES_PER_SECTOR - 1) / FAT_ENTRIES_PER_SECTOR;
+}
+
+void mark_used(ClusterMap& map, cluster_t cluster)
+{
+	map.used[cluster / BITS_PER_WORD] |= 1UL << (cluster % BITS_PER_WORD);
+	--map.free_count;
+}
+
+void mark_free(ClusterMap& map, cluster_t cluster)
+{
+	map.used[cluster / BITS_PER_WORD] &= ~(1UL << (cluster % BITS_PER_WORD));
+	++map.free_count;
+}
+
+// Take the first free cluster at or after the hint, wrapping around once.
+// Words of used clusters are skipped whole, and the hint moves past what
+// was taken, so filling a volume in order costs O(1) per cluster.
+cluster_t take_free_cluster(ClusterMap& map)
+{
+	if (map.free_count == 0) {
+		return 0;
+	}
+
+	const size_t num_words = bitmap_words(map.total_clusters);
+	size_t word = map.next_free / BITS_PER_WORD;
+	// Clusters below the hint in its word are looked at after the wrap
+	const unsigned long below_hint = (1UL << (map.next_free % BITS_PER_WORD)) - 1;
+	unsigned long used = map.used[word] | below_hint;
+	for (size_t i = 0; i <= num_words; ++i) {
+		if (used != ~0UL) {
+			const cluster_t cluster = word * BITS_PER_WORD + __builtin_ctzl(~used);
+			mark_used(map, cluster);
+			map.next_free = cluster + 1 < map.total_clusters ? cluster + 1 : 2;
+			return cluster;
+		}
+
+		word = (word + 1) % num_words;
+		used = map.used[word];
+	}
+
+	// free_count disagreed with the bitmap
+	LOG_ERROR("cluster map: %lu clusters counted free but none found",
+			  map.free_count);
+	return 0;
+}
+} // namespace
+
+ClusterMap CLUSTER_MAP;
+
+error_t build_cluster_map(ClusterMap& map,
+						  uint32_t* fat,
+						  size_t total_clusters,
+						  cluster_t hint)
+{
+	const size_t num_words = bitmap_words(total_clusters);
+	auto* used = static_cast<unsigned long*>(kernel::memory::alloc(
+			num_words * sizeof(unsigned long), kernel::memory::ALLOC_ZEROED));
+	if (used == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	auto* dirty = static_cast<unsigned long*>(kernel::memory::alloc(
+			bitmap_words(fat_sectors(total_clusters)) * sizeof(unsigned long),
+			kernel::memory::ALLOC_ZEROED));
+	if (dirty == nullptr) {
+		kernel::memory::free(used);
+		return ERR_NO_MEMORY;
+	}
+
+	map.fat = fat;
+	map.total_clusters = total_clusters;
+	map.used = used;
+	map.free_count = 0;
+	map.next_free = hint >= 2 && hint < total_clusters ? hint : 2;
+	map.dirty = dirty;
+	map.num_dirty = 0;
+
+	// Clusters 0 and 1 are reserved, and the bits past the last cluster must
+	// never look free
+	used[0] |= 0b11;
+	for (size_t i = total_clusters; i < num_words * BITS_PER_WORD; ++i) {
+		used[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+	}
+
+	for (size_t i = 2; i < total_clusters; ++i) {
 		if (fat[i] != 0) {
+			used[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+		} else {
+			++map.free_count;
+		}
+	}
+
+	return OK;
+}
+
+void destroy_cluster_map(ClusterMap& map)
+{
+	kernel::memory::free(map.used);
+	kernel::memory::free(map.dirty);
+	map = ClusterMap{};
+}
+
+void set_fat_entry(ClusterMap& map, cluster_t cluster, uint32_t value)
+{
+	map.fat[cluster] = value;
+
+	const size_t sector = cluster / FAT_ENTRIES_PER_SECTOR;
+	if (!test_bit(map.dirty, sector)) {
+		map.dirty[sector / BITS_PER_WORD] |= 1UL << (sector % BITS_PER_WORD);
+		++map.num_dirty;
+	}
+}
+
+void set_fat_entry(cluster_t cluster, uint32_t value)
+{
+	set_fat_entry(CLUSTER_MAP, cluster, value);
+}
+
+bool next_dirty_run(const ClusterMap& map,
+					size_t from,
+					size_t* first,
+					size_t* count)
+{
+	const size_t num_sectors = fat_sectors(map.total_clusters);
+	size_t sector = from;
+	while (sector < num_sectors && !test_bit(map.dirty, sector)) {
+		// Clean words are skipped whole
+		if (sector % BITS_PER_WORD == 0 && map.dirty[sector / BITS_PER_WORD] == 0) {
+			sector += BITS_PER_WORD;
 			continue;
 		}
+		++sector;
+	}
+	if (sector >= num_sectors) {
+		return false;
+	}
 
-		fat[current_cluster] = i;
-		current_cluster = i;
-		++num_allocated;
+	*first = sector;
+	while (sector < num_sectors && test_bit(map.dirty, sector)) {
+		++sector;
 	}
+	*count = sector - *first;
 
-	fat[current_cluster] = END_OF_CLUSTER_CHAIN;
+	return true;
+}
 
-	if (num_allocated < num_clusters) {
-		LOG_ERROR("disk full: allocated %d of %d clusters", num_allocated,
-				  num_clusters);
+cluster_t extend_cluster_chain(ClusterMap& map,
+							   cluster_t last_cluster,
+							   int num_clusters)
+{
+	if (map.free_count < static_cast<size_t>(num_clusters)) {
+		LOG_ERROR("disk full: need %d clusters but only %lu free", num_clusters,
+				  map.free_count);
 		return 0;
 	}
 
+	cluster_t current_cluster = last_cluster;
+	for (int i = 0; i < num_clusters; ++i) {
+		const cluster_t next = take_free_cluster(map);
+		if (next == 0) {
+			set_fat_entry(map, current_cluster, END_OF_CLUSTER_CHAIN);
+			return 0;
+		}
+
+		set_fat_entry(map, current_cluster, next);
+		current_cluster = next;
+	}
+
+	set_fat_entry(map, current_cluster, END_OF_CLUSTER_CHAIN);
+
 	return current_cluster;
 }
 
 cluster_t extend_cluster_chain(cluster_t last_cluster, int num_clusters)
 {
-	return extend_cluster_chain(FAT_TABLE, total_fat_clusters(), last_cluster,
-								num_clusters);
+	return extend_cluster_chain(CLUSTER_MAP, last_cluster, num_clusters);
 }
 
-cluster_t allocate_cluster_chain(uint32_t* fat,
-								 size_t total_clusters,
-								 size_t num_clusters)
+cluster_t allocate_cluster_chain(ClusterMap& map, size_t num_clusters)
 {
-	cluster_t first_cluster = 2;
-	while (first_cluster < total_clusters && fat[first_cluster] != 0) {
-		++first_cluster;
+	if (map.free_count < num_clusters || num_clusters == 0) {
+		LOG_ERROR("disk full: need %lu clusters but only %lu free", num_clusters,
+				  map.free_count);
+		return 0;
 	}
 
-	if (first_cluster >= total_clusters) {
-		LOG_ERROR("disk full: no free cluster found");
+	const cluster_t first_cluster = take_free_cluster(map);
+	if (first_cluster == 0) {
 		return 0;
 	}
 
-	fat[first_cluster] = END_OF_CLUSTER_CHAIN;
+	set_fat_entry(map, first_cluster, END_OF_CLUSTER_CHAIN);
 
 	if (num_clusters > 1) {
-		if (extend_cluster_chain(fat, total_clusters, first_cluster,
-								 num_clusters - 1) == 0) {
+		if (extend_cluster_chain(map, first_cluster, num_clusters - 1) == 0) {
 			// Roll back the partially allocated chain
-			free_cluster_chain(fat, first_cluster);
+			free_cluster_chain(map, first_cluster);
 			return 0;
 		}
 	}
@@ -185,44 +425,31 @@ cluster_t allocate_cluster_chain(uint32_t* fat,
 
 cluster_t allocate_cluster_chain(size_t num_clusters)
 {
-	return allocate_cluster_chain(FAT_TABLE, total_fat_clusters(), num_clusters);
+	return allocate_cluster_chain(CLUSTER_MAP, num_clusters);
 }
 
-size_t count_free_clusters(const uint32_t* fat, size_t total_clusters)
-{
-	size_t free_count = 0;
-	// Start from cluster 2 (0 and 1 are reserved)
-	for (size_t i = 2; i < total_clusters; i++) {
-		if (fat[i] == 0) {
-			free_count++;
-		}
-	}
+size_t count_free_clusters(const ClusterMap& map) { return map.free_count; }
 
-	return free_count;
-}
-
-size_t count_free_clusters()
-{
-	return count_free_clusters(FAT_TABLE, total_fat_clusters());
-}
+size_t count_free_clusters() { return count_free_clusters(CLUSTER_MAP); }
 
-void free_cluster_chain(uint32_t* fat, cluster_t start_cluster)
+void free_cluster_chain(ClusterMap& map, cluster_t start_cluster)
 {
 	if (start_cluster == 0 || start_cluster >= FAT32_EOC_MIN) {
 		return;
 	}
 
 	cluster_t current = start_cluster;
-	while (current < FAT32_EOC_MIN) {
-		cluster_t next = fat[current];
-		fat[current] = 0;
+	while (current >= 2 && current < map.total_clusters) {
+		const cluster_t next = map.fat[current];
+		set_fat_entry(map, current, 0);
+		mark_free(map, current);
 		current = next;
 	}
 }
 
 void free_cluster_chain(cluster_t start_cluster)
 {
-	free_cluster_chain(FAT_TABLE, start_cluster);
+	free_cluster_chain(CLUSTER_MAP, start_cluster);
 }
 
 kernel::memory::unique_kbuf<> read_from_blk(unsigned int sector, size_t len)
@@ -261,80 +488,152 @@ error_t write_to_blk(void* buffer, unsigned int sector, size_t len)
 	return m.result;
 }
 
-void write_fat_sectors_chunked(unsigned int base_sector, size_t sectors_per_fat)
+// Write FAT sectors [first, first + count) of FAT_TABLE to the FAT copy at
+// base_sector, in FAT_WRITE_CHUNK_SIZE requests
+error_t write_fat_sectors_chunked(unsigned int base_sector,
+								  size_t first,
+								  size_t count)
 {
-	const size_t bytes_per_sector = VOLUME_BPB->bytes_per_sector;
-	const size_t sectors_per_chunk = FAT_WRITE_CHUNK_SIZE / bytes_per_sector;
-
-	size_t sector_offset = 0;
-	while (sector_offset < sectors_per_fat) {
-		const size_t sectors_remaining = sectors_per_fat - sector_offset;
-		const size_t current_chunk_sectors = (sectors_remaining < sectors_per_chunk)
-													 ? sectors_remaining
-													 : sectors_per_chunk;
-		const size_t chunk_size = current_chunk_sectors * bytes_per_sector;
-
-		void* chunk_buffer =
-				kernel::memory::alloc(chunk_size, kernel::memory::ALLOC_ZEROED);
+	const size_t sectors_per_chunk = FAT_WRITE_CHUNK_SIZE / SECTOR_SIZE;
+	const auto* fat_bytes = reinterpret_cast<const uint8_t*>(FAT_TABLE);
+
+	error_t result = OK;
+	size_t sector = first;
+	while (sector < first + count) {
+		const size_t chunk_sectors =
+				std::min(first + count - sector, sectors_per_chunk);
+		const size_t chunk_size = chunk_sectors * SECTOR_SIZE;
+		const auto disk_sector = base_sector + static_cast<unsigned int>(sector);
+
+		void* chunk_buffer = kernel::memory::alloc(
+				chunk_size, kernel::memory::ALLOC_UNINITIALIZED);
 		if (chunk_buffer == nullptr) {
 			// Fall back to sector-sized writes: a 512B buffer can still
 			// succeed when the 64KB chunk cannot
-			for (size_t i = 0; i < current_chunk_sectors; ++i) {
+			for (size_t i = 0; i < chunk_sectors; ++i) {
 				void* sector_buffer = kernel::memory::alloc(
-						bytes_per_sector, kernel::memory::ALLOC_ZEROED);
+						SECTOR_SIZE, kernel::memory::ALLOC_UNINITIALIZED);
 				if (sector_buffer == nullptr) {
 					LOG_ERROR("Failed to allocate sector buffer for FAT write");
+					result = ERR_NO_MEMORY;
 					continue;
 				}
-				memcpy(sector_buffer,
-					   reinterpret_cast<uint8_t*>(FAT_TABLE) +
-							   ((sector_offset + i) * bytes_per_sector),
-					   bytes_per_sector);
+				memcpy(sector_buffer, fat_bytes + (sector + i) * SECTOR_SIZE,
+					   SECTOR_SIZE);
 				const error_t err = write_to_blk(
-						sector_buffer,
-						base_sector + static_cast<unsigned int>(sector_offset + i),
-						bytes_per_sector);
+						sector_buffer, disk_sector + static_cast<unsigned int>(i),
+						SECTOR_SIZE);
 				if (IS_ERR(err)) {
 					LOG_ERROR("FAT write failed: sector=%u err=%d",
-							  base_sector +
-									  static_cast<unsigned int>(sector_offset + i),
-							  err);
+							  disk_sector + static_cast<unsigned int>(i), err);
+					result = err;
 				}
 			}
-			sector_offset += current_chunk_sectors;
+			sector += chunk_sectors;
 			continue;
 		}
 
-		void* fat_chunk = reinterpret_cast<uint8_t*>(FAT_TABLE) +
-						  (sector_offset * bytes_per_sector);
-		memcpy(chunk_buffer, fat_chunk, chunk_size);
+		memcpy(chunk_buffer, fat_bytes + sector * SECTOR_SIZE, chunk_size);
 
-		const error_t err =
-				write_to_blk(chunk_buffer, base_sector + sector_offset, chunk_size);
+		const error_t err = write_to_blk(chunk_buffer, disk_sector, chunk_size);
 		if (IS_ERR(err)) {
-			LOG_ERROR("FAT write failed: sector=%u err=%d",
-					  base_sector + static_cast<unsigned int>(sector_offset), err);
+			LOG_ERROR("FAT write failed: sector=%u err=%d", disk_sector, err);
+			result = err;
 		}
 
-		sector_offset += current_chunk_sectors;
+		sector += chunk_sectors;
 	}
+
+	return result;
 }
 
-void write_fat_table_to_disk()
+// Bring the FSInfo hints in line with CLUSTER_MAP, writing the sector only
+// when they changed. FS_INFO keeps the old hints until the write succeeds,
+// so a failed write is retried by the next sync.
+error_t write_fs_info_to_disk()
+{
+	if (FS_INFO == nullptr) {
+		return OK;
+	}
+
+	const auto free_count = static_cast<uint32_t>(CLUSTER_MAP.free_count);
+	const auto next_free = static_cast<uint32_t>(CLUSTER_MAP.next_free);
+	if (FS_INFO->free_count == free_count && FS_INFO->next_free == next_free) {
+		return OK;
+	}
+
+	void* sector_buffer;
+	ALLOC_OR_RETURN_ERROR(sector_buffer, SECTOR_SIZE,
+						  kernel::memory::ALLOC_UNINITIALIZED);
+	memcpy(sector_buffer, FS_INFO, SECTOR_SIZE);
+	auto* fs_info = static_cast<kernel::fs::FsInfo*>(sector_buffer);
+	fs_info->free_count = free_count;
+	fs_info->next_free = next_free;
+
+	const error_t err =
+			write_to_blk(sector_buffer, VOLUME_BPB->fs_info, SECTOR_SIZE);
+	if (IS_ERR(err)) {
+		LOG_ERROR("FSInfo write failed: err=%d", err);
+		return err;
+	}
+
+	FS_INFO->free_count = free_count;
+	FS_INFO->next_free = next_free;
+
+	return OK;
+}
+
+error_t write_fat_table_to_disk()
 {
 	if (FAT_TABLE == nullptr || VOLUME_BPB == nullptr) {
 		LOG_ERROR("FAT table or BPB not initialized");
-		return;
+		return ERR_INVALID_ARG;
 	}
 
 	const size_t sectors_per_fat = VOLUME_BPB->fat_size_32;
 
-	write_fat_sectors_chunked(FAT_TABLE_SECTOR, sectors_per_fat);
+	error_t result = OK;
+	size_t first;
+	size_t count;
+	for (size_t from = 0; next_dirty_run(CLUSTER_MAP, from, &first, &count);
+		 from = first + count) {
+		error_t run_result = OK;
+		for (unsigned int copy = 0; copy < VOLUME_BPB->num_fats; ++copy) {
+			const auto base = FAT_TABLE_SECTOR +
+							  static_cast<unsigned int>(copy * sectors_per_fat);
+			const error_t err = write_fat_sectors_chunked(base, first, count);
+			if (IS_ERR(err)) {
+				run_result = err;
+			}
+		}
+
+		if (IS_ERR(run_result)) {
+			if (IS_OK(result)) {
+				result = run_result;
+			}
+			continue;
+		}
 
-	if (VOLUME_BPB->num_fats > 1) {
-		write_fat_sectors_chunked(FAT_TABLE_SECTOR + sectors_per_fat,
-								  sectors_per_fat);
+		for (size_t sector = first; sector < first + count; ++sector) {
+			CLUSTER_MAP.dirty[sector / BITS_PER_WORD] &=
+					~(1UL << (sector % BITS_PER_WORD));
+		}
+		CLUSTER_MAP.num_dirty -= count;
 	}
+
+	const error_t fs_info_err = write_fs_info_to_disk();
+
+	return IS_ERR(result) ? result : fs_info_err;
+}
+
+error_t sync_volume()
+{
+	// Data and directory blocks first, so the FAT never names clusters
+	// whose contents are not on the disk yet
+	const error_t cache_err = BUFFER_CACHE->sync();
+	const error_t fat_err = write_fat_table_to_disk();
+
+	return IS_ERR(cache_err) ? cache_err : fat_err;
 }
 
 void reply_file_data(const Message& req, const void* buf, size_t size)
@@ -2,8 +2,10 @@
 #include <cstddef>
 #include <cstdint>
 #include "asm_utils.h"
+#include "error.hpp"
 #include "hardware/mm_register.hpp"
 #include "log/log.hpp"
+#include "memory/paging.hpp"
 
 namespace kernel::hw::pci
 {
@@ -62,6 +64,68 @@ bool is_single_function_device(uint8_t header_type)
 	return (header_type & 0x80U) == 0;
 }
 
+namespace
+{
+constexpr uint8_t COMMAND_REG = 0x04;
+constexpr uint32_t COMMAND_MEMORY_SPACE = 1U << 1;
+
+// Bytes decoded by the 64-bit memory BAR at reg: the address bits that
+// stay zero after writing all ones. Memory decoding is off meanwhile, so
+// the device never claims the all-ones address.
+uint64_t probe_bar_size(const Device& dev, uint8_t reg)
+{
+	// Only the command half: writing the status half back would clear its
+	// write-one-to-clear bits
+	const uint32_t command = read_conf_reg(dev, COMMAND_REG) & 0xffffU;
+	write_conf_reg(dev, COMMAND_REG, command & ~COMMAND_MEMORY_SPACE);
+
+	const uint32_t low = read_conf_reg(dev, reg);
+	const uint32_t high = read_conf_reg(dev, reg + 4);
+	write_conf_reg(dev, reg, 0xffffffffU);
+	write_conf_reg(dev, reg + 4, 0xffffffffU);
+	const uint64_t mask = (read_conf_reg(dev, reg) & ~0xfU) |
+						  (static_cast<uint64_t>(read_conf_reg(dev, reg + 4)) << 32);
+	write_conf_reg(dev, reg, low);
+	write_conf_reg(dev, reg + 4, high);
+
+	write_conf_reg(dev, COMMAND_REG, command);
+
+	return mask == 0 ? 0 : ~mask + 1;
+}
+
+// A 64-bit BAR may sit above RAM, outside the boot identity map; map all of
+// each one while enumerating, before a driver starts the device, so later
+// BAR reads need not resize it (issue #374). 32-bit BARs are below 4 GiB,
+// which is always mapped.
+void map_64bit_bars(Device& dev)
+{
+	// Only general devices (header type 0) have six BARs
+	if ((dev.header_type & 0x7fU) != 0) {
+		return;
+	}
+
+	for (unsigned int i = 0; i < dev.bar_size.size(); ++i) {
+		const uint8_t reg = 0x10 + i * 4;
+		const uint32_t low = read_conf_reg(dev, reg);
+		if ((low & 1) != 0 || (low & 4) == 0) {
+			continue;
+		}
+
+		const uint64_t high = read_conf_reg(dev, reg + 4);
+		const uint64_t base = (low & ~0xfU) | (high << 32);
+		dev.bar_size[i] = probe_bar_size(dev, reg);
+		const uint64_t size = dev.bar_size[i] == 0 ? 1 : dev.bar_size[i];
+		if (base != 0 && IS_ERR(kernel::memory::map_identity_range(base, size))) {
+			LOG_ERROR("BAR%u of %02x:%02x.%d at %p is not reachable", i, dev.bus,
+					  dev.device, dev.function, reinterpret_cast<void*>(base));
+		}
+
+		// The upper half of the address
+		++i;
+	}
+}
+} // namespace
+
 void read_function(uint8_t bus, uint8_t dev, uint8_t func)
 {
 	if (num_devices >= static_cast<int>(devices.size())) {
@@ -73,7 +137,7 @@ void read_function(uint8_t bus, uint8_t dev, uint8_t func)
 	auto header_type = read_header_type(bus, dev, func);
 	auto class_code = read_class_code(bus, dev, func);
 
-	Device d;
+	Device d{};
 	d.bus = bus;
 	d.device = dev;
 	d.function = func;
@@ -81,6 +145,7 @@ void read_function(uint8_t bus, uint8_t dev, uint8_t func)
 	d.class_code = class_code;
 	d.vendor_id = read_vendor_id(bus, dev, func);
 	d.device_id = read_device_id(bus, dev, func);
+	map_64bit_bars(d);
 
 	devices[num_devices++] = d;
 }
@@ -38,6 +38,9 @@ struct Device {
 	ClassCode class_code;
 	uint16_t vendor_id;
 	uint16_t device_id;
+	/// Bytes each 64-bit memory BAR decodes, sized once at enumeration (0
+	/// for the other BARs)
+	std::array<uint64_t, 6> bar_size;
 
 	bool is_xhci() const { return class_code.match(0x0cU, 0x03U, 0x30U); }
 
@@ -16,6 +16,11 @@
 
 namespace
 {
+// Requests carry swap write-out and reads back for tasks sleeping in a page
+// fault, which must not depend on reclaim to get memory
+constexpr unsigned REQ_ALLOC_FLAGS =
+		kernel::memory::ALLOC_ATOMIC | kernel::memory::ALLOC_ZEROED;
+
 // Pre-fill a reply that echoes the request geometry; the request/reply
 // pairing itself is Message::correlation now (issue #314 Stage B), so the
 // old dst_type/request_id/sequence bookkeeping is gone.
@@ -90,6 +95,25 @@ namespace kernel::hw::virtio
 
 VirtioPciDevice* blk_dev = nullptr;
 
+namespace
+{
+uint64_t capacity_sectors = 0;
+
+void read_capacity()
+{
+	const VirtioPciCap cap = blk_dev->device_cfg->cap;
+	uint64_t bar_addr = kernel::hw::pci::read_base_address_register(
+			*blk_dev->dev, cap.second_dword.fields.bar);
+	bar_addr = bar_addr & ~0xfff;
+
+	const auto* blk_cfg =
+			reinterpret_cast<const VirtioBlkConfig*>(bar_addr + cap.offset);
+	capacity_sectors = blk_cfg->capacity;
+}
+} // namespace
+
+uint64_t blk_device_capacity() { return capacity_sectors; }
+
 error_t validate_length(uint32_t len)
 {
 	if (len < SECTOR_SIZE) {
@@ -106,8 +130,7 @@ error_t write_to_blk_device(const char* buffer, uint64_t sector, uint32_t len)
 	RETURN_IF_ERROR(validate_length(len));
 
 	void* req_ptr;
-	ALLOC_OR_RETURN_ERROR(req_ptr, sizeof(VirtioBlkReq),
-						  kernel::memory::ALLOC_ZEROED);
+	ALLOC_OR_RETURN_ERROR(req_ptr, sizeof(VirtioBlkReq), REQ_ALLOC_FLAGS);
 	VirtioBlkReq* req = (VirtioBlkReq*)req_ptr;
 
 	req->type = VIRTIO_BLK_T_OUT;
@@ -154,8 +177,7 @@ error_t read_from_blk_device(const char* buffer, uint64_t sector, uint32_t len)
 	RETURN_IF_ERROR(validate_length(len));
 
 	void* req_ptr;
-	ALLOC_OR_RETURN_ERROR(req_ptr, sizeof(VirtioBlkReq),
-						  kernel::memory::ALLOC_ZEROED);
+	ALLOC_OR_RETURN_ERROR(req_ptr, sizeof(VirtioBlkReq), REQ_ALLOC_FLAGS);
 	VirtioBlkReq* req = (VirtioBlkReq*)req_ptr;
 
 	req->type = VIRTIO_BLK_T_IN;
@@ -206,6 +228,7 @@ error_t init_blk_device()
 	blk_dev = new (buffer) VirtioPciDevice();
 
 	RETURN_IF_ERROR(init_virtio_pci_device(blk_dev, VIRTIO_BLK));
+	read_capacity();
 
 	// Wire the completion interrupt to this service's doorbell; the
 	// interrupt layer itself no longer knows any destination PID
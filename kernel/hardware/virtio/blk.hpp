@@ -93,6 +93,21 @@ struct VirtioBlkReq {
 	uint8_t status;
 } __attribute__((packed));
 
+/**
+ * @struct VirtioBlkConfig
+ * @brief Start of the VirtIO block device configuration space
+ *
+ * Only the fields up to the ones the driver reads are declared.
+ *
+ * @see
+ * https://docs.oasis-open.org/virtio/virtio/v1.3/csd01/virtio-v1.3-csd01.html#x1-3110004
+ */
+struct VirtioBlkConfig {
+	uint64_t capacity; ///< Size of the device in 512-byte sectors
+	uint32_t size_max;
+	uint32_t seg_max;
+} __attribute__((packed));
+
 /**
  * @brief Global VirtIO block device instance
  */
@@ -122,6 +137,14 @@ error_t write_to_blk_device(const char* buffer, uint64_t sector, uint32_t len);
  */
 error_t read_from_blk_device(const char* buffer, uint64_t sector, uint32_t len);
 
+/**
+ * @brief Size of the block device
+ *
+ * @return Capacity in SECTOR_SIZE sectors, read at initialization; 0 when
+ * there is no device or it failed to initialize
+ */
+uint64_t blk_device_capacity();
+
 /**
  * @brief Initialize the VirtIO block device
  *
@@ -153,9 +153,11 @@ void handle_rx_interrupt(const Message& m)
 
 		// Copy the DMA buffer into an OOL buffer whose ownership moves to
 		// the NET service (which frees it); the persistent RX buffer goes
-		// straight back to the device below
-		auto packet_buf =
-				kernel::memory::make_kbuf(packet_len, kernel::memory::ALLOC_ZEROED);
+		// straight back to the device below. This runs in the interrupt
+		// handler, which cannot wait for reclaim.
+		auto packet_buf = kernel::memory::make_kbuf(
+				packet_len,
+				kernel::memory::ALLOC_ATOMIC | kernel::memory::ALLOC_ZEROED);
 		if (packet_buf) {
 			memcpy(packet_buf.get(), req->packet_data, packet_len);
 
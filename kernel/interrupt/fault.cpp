@@ -4,6 +4,9 @@
 #include <cstdint>
 #include "handlers.hpp"
 #include "log/log.hpp"
+#include "memory/kernel_stack.hpp"
+#include "memory/segment.hpp"
+#include "memory/user.hpp"
 #include "task/task.hpp"
 
 namespace kernel::interrupt
@@ -66,4 +69,70 @@ const char* report_fault(uint64_t code, InterruptFrame* frame)
 	return buf;
 }
 
+error_t handle_page_fault(uint64_t code, uint64_t fault_addr)
+{
+	const auto* task = kernel::task::CURRENT_TASK;
+	const error_t err = kernel::memory::handle_page_fault(
+			code, fault_addr, task != nullptr ? &task->vmas : nullptr);
+
+	// A swap-in from disk only marks the task waiting (memory/swap.hpp). It
+	// sleeps here, with no lock of the fault path held, and retries the
+	// access once the read has woken it.
+	if (task != nullptr && task->state == kernel::task::TASK_WAITING &&
+		task->wait_reason == kernel::task::WaitReason::SWAP_IN) {
+		kernel::task::switch_next_task(false);
+	}
+
+	return err;
+}
+
+void log_kernel_stack_overflow(uint64_t fault_addr)
+{
+	if (kernel::memory::is_kernel_stack_guard(fault_addr)) {
+		LOG_ERROR("kernel stack overflow: %016lx is a guard page", fault_addr);
+	}
+}
+
+uint64_t user_access_fixup(uint64_t rip) { return find_user_access_fixup(rip); }
+
 } // namespace kernel::interrupt
+
+namespace
+{
+// What on_page_fault (handler.asm) puts below the stack top it is given: the
+// CPU's frame and error code, then its saved rbp, rax and rcx
+constexpr uint64_t PAGE_FAULT_ENTRY_BYTES = 9 * sizeof(uint64_t);
+} // namespace
+
+// Runs on IST_FOR_PAGE_FAULT, where a nested page fault would restart at the
+// top of the stack and overwrite this one: nothing here may fault. frame is
+// the CPU's: error code, rip, cs, rflags, rsp, ss.
+extern "C" uint64_t page_fault_entry(const uint64_t* frame)
+{
+	const uint64_t code = frame[0];
+	const bool user_mode = (frame[2] & 3) != 0;
+	const uint64_t fault_addr = get_cr2();
+
+	// A kernel or fault stack page not backed yet: back it and retry
+	if (!user_mode && (code & 1) == 0 &&
+		kernel::memory::is_kernel_stack_addr(fault_addr)) {
+		if (IS_ERR(kernel::memory::grow_kernel_stack(fault_addr))) {
+			PANIC("unrecoverable kernel stack fault at %016lx", fault_addr);
+		}
+		return 0;
+	}
+
+	// Anything else is handled where the CPU would have put it without an
+	// IST, which must be able to take the frame
+	const uint64_t stack = user_mode ? reinterpret_cast<uint64_t>(
+											   kernel::memory::user_fault_stack())
+									 : frame[4];
+	const uint64_t top = stack & ~uint64_t{ 0xf };
+	const uint64_t bottom = top - PAGE_FAULT_ENTRY_BYTES;
+	if (kernel::memory::is_kernel_stack_addr(bottom) &&
+		IS_ERR(kernel::memory::grow_kernel_stack(bottom))) {
+		PANIC("no stack for the page fault at %016lx", fault_addr);
+	}
+
+	return top;
+}
@@ -57,6 +57,38 @@ __attribute__((no_caller_saved_registers)) const char* report_fault(
 		uint64_t code,
 		InterruptFrame* frame);
 
+/**
+ * @brief Resolve a page fault against the current task's address space
+ *
+ * Passes the task's memory areas to memory::handle_page_fault().
+ *
+ * @param code Error code pushed by the CPU
+ * @param fault_addr Faulting address (CR2)
+ * @return OK when the faulting access can be retried
+ */
+__attribute__((no_caller_saved_registers)) error_t handle_page_fault(
+		uint64_t code,
+		uint64_t fault_addr);
+
+/**
+ * @brief Name a double fault that a kernel stack overflow caused
+ *
+ * Running into a guard page leaves no room for the page fault frame, so the
+ * CPU raises a double fault with CR2 still in the guard page.
+ *
+ * @param fault_addr CR2 at the time of the double fault
+ */
+__attribute__((no_caller_saved_registers)) void log_kernel_stack_overflow(
+		uint64_t fault_addr);
+
+/**
+ * @brief Where a kernel-mode fault inside a user copy resumes
+ *
+ * @param rip Faulting instruction
+ * @return Fixup address from the user copy exception table, or 0
+ */
+__attribute__((no_caller_saved_registers)) uint64_t user_access_fixup(uint64_t rip);
+
 template<uint64_t error_code, bool has_error_code>
 struct FaultHandler;
 
@@ -91,14 +123,28 @@ struct FaultHandler<error_code, true> {
 	{
 		if (error_code == PAGE_FAULT) {
 			const uint64_t fault_addr = get_cr2();
-			if (auto err = kernel::memory::handle_page_fault(code, fault_addr);
+			if (auto err = handle_page_fault(code, fault_addr);
 				!IS_ERR(err)) {
 				return;
 			}
 
+			// A user copy that hit a page it may not touch stops there and
+			// reports the bytes it left
+			if ((frame->cs & 3) == 0) {
+				if (const uint64_t fixup = user_access_fixup(frame->rip);
+					fixup != 0) {
+					frame->rip = fixup;
+					return;
+				}
+			}
+
 			LOG_ERROR("Page fault at %016lx", fault_addr);
 		}
 
+		if (error_code == DOUBLE_FAULT) {
+			log_kernel_stack_overflow(get_cr2());
+		}
+
 		const char* name = report_fault(error_code, frame);
 
 		kill_userland(frame);
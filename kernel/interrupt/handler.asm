@@ -72,6 +72,7 @@ on_timer_interrupt:
     push qword [rbp + 0x08] ; rip
     push rcx
 
+    cld ; DF may be set by ring 3; the kernel's rep movs/stos copy forward
     mov rdi, rsp ; rdi = context
     call switch_task_by_timer_interrupt
 
@@ -116,8 +117,80 @@ interrupt_task_switch:
     push qword [rbp + 0x08] ; rip
     push rcx
 
+    cld ; DF may be set by ring 3; the kernel's rep movs/stos copy forward
     mov rdi, rsp ; rdi = context
     call switch_task_by_interrupt
 
     ; コンテキストがスイッチされなかった場合のみ実行
     jmp common_pop_and_restore
+
+extern page_fault_entry
+extern page_fault_handler
+global on_page_fault ; void on_page_fault(void)
+on_page_fault:
+    ; IST_FOR_PAGE_FAULT: [rsp] = error code, then the CPU's frame
+    push rbp
+    mov rbp, rsp
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    sub rsp, 512
+    fxsave [rsp]
+
+    cld
+    lea rdi, [rbp + 8] ; rdi = error code and frame
+    call page_fault_entry
+
+    fxrstor [rsp]
+    add rsp, 512
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    test rax, rax
+    jnz .move
+
+    ; A stack page was backed: retry the access
+    pop rcx
+    pop rax
+    pop rbp
+    add rsp, 8
+    iretq
+
+.move:
+    ; rax = stack top to handle the fault on. Copy the error code and frame
+    ; below it, then rbp, rax and rcx, and continue there as if the CPU had
+    ; delivered the fault to that stack.
+    sub rax, 8*6
+    mov rcx, [rbp + 8]
+    mov [rax], rcx
+    mov rcx, [rbp + 8*2]
+    mov [rax + 8], rcx
+    mov rcx, [rbp + 8*3]
+    mov [rax + 8*2], rcx
+    mov rcx, [rbp + 8*4]
+    mov [rax + 8*3], rcx
+    mov rcx, [rbp + 8*5]
+    mov [rax + 8*4], rcx
+    mov rcx, [rbp + 8*6]
+    mov [rax + 8*5], rcx
+    mov rcx, [rbp - 8*2] ; rcx
+    mov [rax - 8], rcx
+    mov rcx, [rbp - 8] ; rax
+    mov [rax - 8*2], rcx
+    mov rcx, [rbp] ; rbp
+    mov [rax - 8*3], rcx
+    lea rsp, [rax - 8*3]
+    pop rbp
+    pop rax
+    pop rcx
+    jmp [rel page_fault_handler]
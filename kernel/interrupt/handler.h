@@ -12,6 +12,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 extern "C" {
 /**
  * @brief Timer interrupt handler
@@ -36,4 +38,19 @@ void on_timer_interrupt();
  * @note Interrupts must be disabled when calling this function
  */
 void interrupt_task_switch();
+
+/**
+ * @brief Page fault entry on IST_FOR_PAGE_FAULT
+ *
+ * Calls page_fault_entry() (interrupt/fault.cpp). A fault that backed a
+ * kernel stack page returns right away; any other fault is moved to the
+ * stack page_fault_entry() names and continues in page_fault_handler
+ * there.
+ *
+ * @note Installed by use_fault_stacks() once the TSS is loaded
+ */
+void on_page_fault();
+
+/// Address of the handler on_page_fault continues in
+extern uint64_t page_fault_handler;
 }
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include "memory/segment.hpp"
 #include "vector.hpp"
 
+uint64_t page_fault_handler = 0;
+
 namespace kernel::interrupt
 {
 
@@ -46,11 +48,14 @@ void initialize_interrupt()
 
 	set_entry(InterruptVector::LOCAL_APIC_TIMER, on_timer_interrupt, IST_FOR_TIMER);
 	set_entry(InterruptVector::XHCI, on_xhci_interrupt, IST_FOR_XHCI);
-	set_entry(InterruptVector::VIRTIO_BLK, on_virtio_blk_interrupt);
-	set_entry(InterruptVector::VIRTQUEUE_BLK, on_virtio_blk_queue_interrupt);
-	set_entry(InterruptVector::VIRTIO_NET, on_virtio_net_interrupt);
-	set_entry(InterruptVector::VIRTQUEUE_NET_RX, on_virtio_net_rx_queue_interrupt);
-	set_entry(InterruptVector::VIRTQUEUE_NET_TX, on_virtio_net_tx_queue_interrupt);
+	set_entry(InterruptVector::VIRTIO_BLK, on_virtio_blk_interrupt, IST_FOR_DEVICE);
+	set_entry(InterruptVector::VIRTQUEUE_BLK, on_virtio_blk_queue_interrupt,
+			  IST_FOR_DEVICE);
+	set_entry(InterruptVector::VIRTIO_NET, on_virtio_net_interrupt, IST_FOR_DEVICE);
+	set_entry(InterruptVector::VIRTQUEUE_NET_RX, on_virtio_net_rx_queue_interrupt,
+			  IST_FOR_DEVICE);
+	set_entry(InterruptVector::VIRTQUEUE_NET_TX, on_virtio_net_tx_queue_interrupt,
+			  IST_FOR_DEVICE);
 	set_entry(InterruptVector::SWITCH_TASK, interrupt_task_switch,
 			  IST_FOR_SWITCH_TASK);
 	set_entry(DIVIDE_ERROR, FaultHandler<DIVIDE_ERROR, false>::handler);
@@ -83,4 +88,15 @@ void initialize_interrupt()
 	LOG_INFO("Interrupt initialized successfully.");
 }
 
+void use_fault_stacks()
+{
+	// on_page_fault continues in the regular handler once it has left the IST
+	page_fault_handler =
+			reinterpret_cast<uint64_t>(FaultHandler<PAGE_FAULT, true>::handler);
+	set_idt_entry(idt[PAGE_FAULT], reinterpret_cast<uint64_t>(on_page_fault),
+				  TypeAttr{ IST_FOR_PAGE_FAULT, GateType::INTERRUPT_GATE, 0, 1 },
+				  kernel::memory::KERNEL_CS);
+	idt[DOUBLE_FAULT].attr.interrupt_stack_table = IST_FOR_DOUBLE_FAULT;
+}
+
 } // namespace kernel::interrupt
@@ -40,7 +40,22 @@ struct Idtr {
 constexpr int IST_FOR_TIMER = 1;
 constexpr int IST_FOR_XHCI = 2;
 constexpr int IST_FOR_SWITCH_TASK = 3;
+/// Entry stack of page faults, which back kernel stack pages there (see
+/// memory/kernel_stack.hpp); every other fault leaves it before it is handled
+constexpr int IST_FOR_PAGE_FAULT = 4;
+/// A fault the page fault entry cannot recover from may still double fault
+constexpr int IST_FOR_DOUBLE_FAULT = 5;
+/// Device interrupts must not push onto a kernel stack page that is not
+/// backed yet: an interrupt whose delivery faults is lost
+constexpr int IST_FOR_DEVICE = 6;
 
 void initialize_interrupt();
 
+/**
+ * @brief Take page faults and double faults on their IST entries from now on
+ *
+ * Called once the TSS is loaded; faults before that run on the current stack.
+ */
+void use_fault_stacks();
+
 } // namespace kernel::interrupt
\ No newline at end of file
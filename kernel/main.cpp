@@ -2,7 +2,9 @@
 #include "graphics/screen.hpp"
 #include "hardware/serial.hpp"
 #include "interrupt/idt.hpp"
+#include "mem_ops.hpp"
 #include "memory/bootstrap_allocator.hpp"
+#include "memory/kernel_stack.hpp"
 #include "memory/paging.hpp"
 #include "memory/segment.hpp"
 #include "services.hpp"
@@ -57,17 +59,24 @@ extern "C" void Main(const FrameBufferConf& frame_buffer_conf,
 
 	kernel::hw::serial::initialize();
 
+	kernel::memory::initialize_mem_ops();
+
 	kernel::graphics::initialize(frame_buffer_conf, { 0, 0, 0 });
 
 	kernel::graphics::initialize_font();
 
 	kernel::memory::initialize_segmentation();
 
-	kernel::memory::initialize_paging();
+	// The bootstrap allocator comes first: the identity map's page tables
+	// are carved out of it. Until set_cr3 we still run on the loader's map,
+	// so boot-services memory is only handed out after paging is up.
+	kernel::memory::initialize(memory_map);
 
-	kernel::interrupt::initialize_interrupt();
+	kernel::memory::initialize_paging(memory_map);
 
-	kernel::memory::initialize(memory_map);
+	kernel::memory::reclaim_boot_services_memory(memory_map);
+
+	kernel::interrupt::initialize_interrupt();
 
 	kernel::tests::run_bootstrap_stage_tests();
 
@@ -75,6 +84,8 @@ extern "C" void Main(const FrameBufferConf& frame_buffer_conf,
 
 	kernel::memory::initialize_tss();
 
+	kernel::memory::initialize_kernel_stacks();
+
 	kernel::timers::acpi::initialize(rsdp);
 
 	kernel::timers::initialize();
@@ -0,0 +1,190 @@
+#include "mem_ops.hpp"
+#include <cstddef>
+#include <cstdint>
+#include "cpuid.hpp"
+#include "log/log.hpp"
+#include "memory/page.hpp"
+
+// No <cstring> here: this file defines memcpy and memset for the whole
+// kernel, which then never pulls newlib's versions in from libc.a.
+
+namespace kernel::memory
+{
+
+namespace
+{
+// Below this, ERMS without FSRM still pays REP MOVSB's startup cost
+constexpr size_t ERMS_SHORT_COPY = 128;
+
+constexpr size_t STREAM_CHUNK = 64;
+
+using copy_fn = void* (*)(void*, const void*, size_t);
+using fill_fn = void* (*)(void*, int, size_t);
+
+void* copy_erms(void* dst, const void* src, size_t n)
+{
+	return n < ERMS_SHORT_COPY ? copy_movsq(dst, src, n) : copy_movsb(dst, src, n);
+}
+
+void* fill_erms(void* dst, int c, size_t n)
+{
+	return n < ERMS_SHORT_COPY ? fill_stosq(dst, c, n) : fill_stosb(dst, c, n);
+}
+
+copy_fn copy_impl = copy_movsq;
+fill_fn fill_impl = fill_stosq;
+const char* variant = "movsq";
+
+bool page_aligned(const void* addr)
+{
+	return reinterpret_cast<uintptr_t>(addr) % PAGE_SIZE == 0;
+}
+
+// bytes is a non-zero multiple of STREAM_CHUNK
+void stream_zero(void* dst, size_t bytes)
+{
+	asm volatile("1:\n\t"
+				 "movnti %2, 0(%0)\n\t"
+				 "movnti %2, 8(%0)\n\t"
+				 "movnti %2, 16(%0)\n\t"
+				 "movnti %2, 24(%0)\n\t"
+				 "movnti %2, 32(%0)\n\t"
+				 "movnti %2, 40(%0)\n\t"
+				 "movnti %2, 48(%0)\n\t"
+				 "movnti %2, 56(%0)\n\t"
+				 "addq $64, %0\n\t"
+				 "subq $64, %1\n\t"
+				 "jnz 1b\n\t"
+				 "sfence"
+				 : "+r"(dst), "+r"(bytes)
+				 : "r"(0ULL)
+				 : "cc", "memory");
+}
+
+void stream_copy(void* dst, const void* src, size_t bytes)
+{
+	asm volatile("1:\n\t"
+				 "movq 0(%1), %%r8\n\t"
+				 "movq 8(%1), %%r9\n\t"
+				 "movq 16(%1), %%r10\n\t"
+				 "movq 24(%1), %%r11\n\t"
+				 "movnti %%r8, 0(%0)\n\t"
+				 "movnti %%r9, 8(%0)\n\t"
+				 "movnti %%r10, 16(%0)\n\t"
+				 "movnti %%r11, 24(%0)\n\t"
+				 "movq 32(%1), %%r8\n\t"
+				 "movq 40(%1), %%r9\n\t"
+				 "movq 48(%1), %%r10\n\t"
+				 "movq 56(%1), %%r11\n\t"
+				 "movnti %%r8, 32(%0)\n\t"
+				 "movnti %%r9, 40(%0)\n\t"
+				 "movnti %%r10, 48(%0)\n\t"
+				 "movnti %%r11, 56(%0)\n\t"
+				 "addq $64, %0\n\t"
+				 "addq $64, %1\n\t"
+				 "subq $64, %2\n\t"
+				 "jnz 1b\n\t"
+				 "sfence"
+				 : "+r"(dst), "+r"(src), "+r"(bytes)
+				 :
+				 : "r8", "r9", "r10", "r11", "cc", "memory");
+}
+} // namespace
+
+void* copy_movsq(void* dst, const void* src, size_t n)
+{
+	void* ret = dst;
+	size_t qwords = n / sizeof(uint64_t);
+	size_t tail = n % sizeof(uint64_t);
+	asm volatile("rep movsq\n\t"
+				 "movq %3, %%rcx\n\t"
+				 "rep movsb"
+				 : "+D"(dst), "+S"(src), "+c"(qwords)
+				 : "r"(tail)
+				 : "memory");
+	return ret;
+}
+
+void* copy_movsb(void* dst, const void* src, size_t n)
+{
+	void* ret = dst;
+	asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+	return ret;
+}
+
+void* fill_stosq(void* dst, int c, size_t n)
+{
+	void* ret = dst;
+	const uint64_t pattern = 0x0101'0101'0101'0101ULL * static_cast<uint8_t>(c);
+	size_t qwords = n / sizeof(uint64_t);
+	size_t tail = n % sizeof(uint64_t);
+	asm volatile("rep stosq\n\t"
+				 "movq %3, %%rcx\n\t"
+				 "rep stosb"
+				 : "+D"(dst), "+c"(qwords)
+				 : "a"(pattern), "r"(tail)
+				 : "memory");
+	return ret;
+}
+
+void* fill_stosb(void* dst, int c, size_t n)
+{
+	void* ret = dst;
+	asm volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(c) : "memory");
+	return ret;
+}
+
+void initialize_mem_ops()
+{
+	if (kernel::cpu::has_fsrm()) {
+		copy_impl = copy_movsb;
+		fill_impl = fill_stosb;
+		variant = "fsrm";
+	} else if (kernel::cpu::has_erms()) {
+		copy_impl = copy_erms;
+		fill_impl = fill_erms;
+		variant = "erms";
+	}
+
+	LOG_INFO("memcpy/memset use the %s variant", variant);
+}
+
+const char* mem_ops_variant() { return variant; }
+
+void clear_pages(void* addr, size_t num_pages)
+{
+	if (num_pages == 0) {
+		return;
+	}
+
+	if (!page_aligned(addr)) {
+		fill_impl(addr, 0, num_pages * PAGE_SIZE);
+		return;
+	}
+
+	stream_zero(addr, num_pages * PAGE_SIZE);
+}
+
+void copy_page(void* dst, const void* src)
+{
+	if (!page_aligned(dst) || !page_aligned(src)) {
+		copy_impl(dst, src, PAGE_SIZE);
+		return;
+	}
+
+	stream_copy(dst, src, PAGE_SIZE);
+}
+
+static_assert(PAGE_SIZE % STREAM_CHUNK == 0);
+
+} // namespace kernel::memory
+
+extern "C" void* memcpy(void* dst, const void* src, size_t n)
+{
+	return kernel::memory::copy_impl(dst, src, n);
+}
+
+extern "C" void* memset(void* dst, int c, size_t n)
+{
+	return kernel::memory::fill_impl(dst, c, n);
+}
@@ -0,0 +1,59 @@
+/**
+ * @file mem_ops.hpp
+ * @brief Kernel memcpy/memset and whole-page clear and copy
+ *
+ * The kernel defines memcpy and memset itself rather than taking newlib's
+ * byte-at-a-time C versions. Both run on x86 string instructions: REP
+ * MOVSQ/STOSQ by default, REP MOVSB/STOSB once CPUID reports enhanced
+ * (ERMS) or fast short (FSRM) REP MOVSB. The variant is picked once at boot
+ * by initialize_mem_ops(); until then the quadword variant is used.
+ *
+ * Page clears and copies bypass the cache with non-temporal stores: a
+ * freshly zeroed or CoW-copied page is usually touched later, if at all, by
+ * another address space, so pulling it into the cache only evicts the
+ * caller's working set.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace kernel::memory
+{
+
+/**
+ * @brief Select the memcpy/memset variants for this CPU
+ *
+ * Called once at boot before the allocators come up.
+ */
+void initialize_mem_ops();
+
+/**
+ * @brief Name of the memcpy/memset variant in use ("movsq", "erms", "fsrm")
+ */
+const char* mem_ops_variant();
+
+/**
+ * @brief Zero num_pages pages with non-temporal stores
+ *
+ * @param addr Page-aligned start; anything else falls back to memset
+ */
+void clear_pages(void* addr, size_t num_pages);
+
+/**
+ * @brief Copy one page with non-temporal stores
+ *
+ * @param dst Page-aligned destination; anything else falls back to memcpy
+ * @param src Page-aligned source
+ */
+void copy_page(void* dst, const void* src);
+
+// The variants behind memcpy/memset, exposed for the benchmarks
+void* copy_movsq(void* dst, const void* src, size_t n);
+void* copy_movsb(void* dst, const void* src, size_t n);
+void* fill_stosq(void* dst, int c, size_t n);
+void* fill_stosb(void* dst, int c, size_t n);
+
+} // namespace kernel::memory
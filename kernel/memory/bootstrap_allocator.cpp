@@ -6,46 +6,78 @@
 #include "../../UchLoaderPkg/memory_map.hpp"
 #include "log/log.hpp"
 #include "memory/buddy_system.hpp"
+#include "memory/kasan.hpp"
 #include "memory/page.hpp"
 #include "memory/slab.hpp"
+#include "tsc.hpp"
 
 #include <sys/types.h>
 
 namespace kernel::memory
 {
 
-BootstrapAllocator::BootstrapAllocator() : bitmap_{}, memory_end_{ 0x0 }
+BootstrapAllocator::BootstrapAllocator(unsigned long* bitmap, size_t num_pages)
+	: bitmap_{ bitmap }, num_pages_{ num_pages }, memory_end_{ 0x0 }
 {
-	bitmap_.fill(ULONG_MAX);
+	std::fill(bitmap_, bitmap_ + bitmap_words(num_pages_), ULONG_MAX);
 }
 
-void* BootstrapAllocator::allocate(size_t size)
+void BootstrapAllocator::assign_range(size_t start, size_t end, bool used)
 {
-	const size_t num_pages = pages_for_bytes(size);
+	end = std::min(end, num_pages_);
+	while (start < end) {
+		const size_t bit = start % BITMAP_ENTRY_SIZE;
+		const size_t count = std::min(BITMAP_ENTRY_SIZE - bit, end - start);
+		const unsigned long mask =
+				count == BITMAP_ENTRY_SIZE ? ULONG_MAX : ((1UL << count) - 1) << bit;
+
+		if (used) {
+			bitmap_[start / BITMAP_ENTRY_SIZE] |= mask;
+		} else {
+			bitmap_[start / BITMAP_ENTRY_SIZE] &= ~mask;
+		}
 
-	size_t consecutive_start_index = 0;
-	size_t num_consecutive_pages = 0;
+		start += count;
+	}
+}
 
-	for (size_t i = 0; i < end_index(); i++) {
-		if (is_bit_set(i)) {
-			num_consecutive_pages = 0;
-			continue;
+size_t BootstrapAllocator::find_next(size_t from, size_t end, bool used) const
+{
+	const size_t limit = std::min(end, num_pages_);
+	size_t i = from;
+	while (i < limit) {
+		const size_t bit = i % BITMAP_ENTRY_SIZE;
+		unsigned long word = bitmap_[i / BITMAP_ENTRY_SIZE];
+		if (!used) {
+			word = ~word;
 		}
 
-		if (num_consecutive_pages == 0) {
-			consecutive_start_index = i;
+		word &= ULONG_MAX << bit;
+		if (word != 0) {
+			return std::min(i - bit + __builtin_ctzl(word), limit);
 		}
 
-		num_consecutive_pages++;
+		i += BITMAP_ENTRY_SIZE - bit;
+	}
 
-		if (num_consecutive_pages == num_pages) {
-			for (size_t j = consecutive_start_index;
-				 j < consecutive_start_index + num_pages; j++) {
-				bitmap_[j / BITMAP_ENTRY_SIZE] |= 1UL << (j % BITMAP_ENTRY_SIZE);
-			}
+	// Everything past the bitmap is used
+	return used ? std::min(std::max(from, limit), end) : end;
+}
 
-			return reinterpret_cast<void*>(consecutive_start_index * PAGE_SIZE);
+void* BootstrapAllocator::allocate(size_t size)
+{
+	const size_t num_pages = pages_for_bytes(size);
+	const size_t end = end_index();
+
+	size_t start = find_next(0, end, false);
+	while (num_pages > 0 && end - start >= num_pages) {
+		const size_t run_end = find_next(start, start + num_pages, true);
+		if (run_end == start + num_pages) {
+			assign_range(start, run_end, true);
+			return reinterpret_cast<void*>(start * PAGE_SIZE);
 		}
+
+		start = find_next(run_end, end, false);
 	}
 
 	LOG_ERROR("failed to allocate %u bytes", size);
@@ -58,9 +90,7 @@ void BootstrapAllocator::free(void* addr, size_t size)
 	auto start = reinterpret_cast<uintptr_t>(addr) / PAGE_SIZE;
 	auto end = (reinterpret_cast<uintptr_t>(addr) + size) / PAGE_SIZE;
 
-	for (auto i = start; i < end; i++) {
-		bitmap_[i / BITMAP_ENTRY_SIZE] &= ~(1UL << (i % BITMAP_ENTRY_SIZE));
-	}
+	assign_range(start, end, false);
 }
 
 void BootstrapAllocator::mark_available(void* addr, size_t size)
@@ -68,21 +98,28 @@ void BootstrapAllocator::mark_available(void* addr, size_t size)
 	auto start = reinterpret_cast<uintptr_t>(addr) / PAGE_SIZE;
 	auto end = (reinterpret_cast<uintptr_t>(addr) + size) / PAGE_SIZE;
 
-	for (auto i = start; i < end; i++) {
-		bitmap_[i / BITMAP_ENTRY_SIZE] &= ~(1UL << (i % BITMAP_ENTRY_SIZE));
-	}
+	assign_range(start, end, false);
 
 	memory_end_ = std::max(memory_end_, reinterpret_cast<void*>(end * PAGE_SIZE));
 }
 
+void BootstrapAllocator::mark_used(void* addr, size_t size)
+{
+	auto start = reinterpret_cast<uintptr_t>(addr) / PAGE_SIZE;
+	auto end = pages_for_bytes(reinterpret_cast<uintptr_t>(addr) + size);
+
+	assign_range(start, end, true);
+}
+
 void BootstrapAllocator::show_available_memory() const
 {
 	size_t available_pages = 0;
 
-	for (size_t i = 0; i < end_index(); i++) {
-		if (!is_bit_set(i)) {
-			available_pages++;
-		}
+	const size_t end = end_index();
+	for (size_t i = find_next(0, end, false); i < end;) {
+		const size_t run_end = find_next(i, end, true);
+		available_pages += run_end - i;
+		i = find_next(run_end, end, false);
 	}
 
 	LOG_INFO("available memory: %u MiB / %u MiB",
@@ -94,23 +131,111 @@ alignas(BootstrapAllocator) char bootstrap_allocator_buffer[sizeof(
 		BootstrapAllocator)];
 BootstrapAllocator* boot_allocator;
 
+namespace
+{
+
+// Every descriptor type that is backed by RAM, whether or not the kernel may
+// allocate from it, gets page metadata so get_page() works on it.
+bool is_ram(MemoryType type)
+{
+	switch (type) {
+		case MemoryType::kEfiReservedMemoryType:
+		case MemoryType::kEfiUnusableMemory:
+		case MemoryType::kEfiMemoryMappedIO:
+		case MemoryType::kEfiMemoryMappedIOPortSpace:
+		case MemoryType::kEfiPalCode:
+			return false;
+		default:
+			return true;
+	}
+}
+
+// Memory the bootstrap allocator may hand out. Page 0 is never used.
+bool is_usable(const MemoryDescriptor& desc)
+{
+	return IsAvailableMemory(static_cast<MemoryType>(desc.type)) &&
+		   desc.physical_start != 0;
+}
+
+// Boot-services memory still holds the loader's memory map and the firmware
+// page tables until we switch to our own, so it is only handed out after that.
+bool is_conventional(const MemoryDescriptor& desc)
+{
+	return static_cast<MemoryType>(desc.type) ==
+				   MemoryType::kEfiConventionalMemory &&
+		   desc.physical_start != 0;
+}
+
+// The bitmap is filled before the map has been read to the end, so it must
+// also stay clear of the map itself.
+bool can_hold_bitmap(const MemoryDescriptor& desc,
+					 size_t bitmap_bytes,
+					 uintptr_t mem_map_base,
+					 uintptr_t mem_map_end)
+{
+	const uintptr_t start = desc.physical_start;
+	const uintptr_t end = start + desc.number_of_pages * PAGE_SIZE;
+
+	return is_conventional(desc) &&
+		   desc.number_of_pages >= pages_for_bytes(bitmap_bytes) &&
+		   (end <= mem_map_base || start >= mem_map_end);
+}
+
+} // namespace
+
 void initialize(const MemoryMap& mem_map)
 {
 	LOG_INFO("Initializing bootstrap allocator...");
-	boot_allocator = new (bootstrap_allocator_buffer) BootstrapAllocator();
 
 	const auto mem_map_base = reinterpret_cast<uintptr_t>(mem_map.buffer);
 	const auto mem_map_end = mem_map_base + mem_map.map_size;
 
+	// The bitmap only has to reach the end of the highest usable region
+	size_t num_pages = 0;
+	for (uintptr_t iter = mem_map_base; iter < mem_map_end;
+		 iter += mem_map.descriptor_size) {
+		const auto* desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+		if (is_usable(*desc)) {
+			const size_t end_pfn =
+					desc->physical_start / PAGE_SIZE + desc->number_of_pages;
+			num_pages = std::max(num_pages, end_pfn);
+		}
+	}
+	num_pages = std::min<size_t>(num_pages, TOTAL_PAGES);
+
+	// ...and goes at the start of the first region that can hold it
+	const size_t bitmap_bytes =
+			BootstrapAllocator::bitmap_words(num_pages) * sizeof(unsigned long);
+	unsigned long* bitmap = nullptr;
+	for (uintptr_t iter = mem_map_base; iter < mem_map_end && bitmap == nullptr;
+		 iter += mem_map.descriptor_size) {
+		const auto* desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+		if (desc->physical_start / PAGE_SIZE < num_pages &&
+			can_hold_bitmap(*desc, bitmap_bytes, mem_map_base, mem_map_end)) {
+			bitmap = reinterpret_cast<unsigned long*>(desc->physical_start);
+		}
+	}
+
+	if (bitmap == nullptr) {
+		LOG_ERROR("no conventional region holds the %u byte page bitmap",
+				  bitmap_bytes);
+		return;
+	}
+
+	boot_allocator =
+			new (bootstrap_allocator_buffer) BootstrapAllocator(bitmap, num_pages);
+
 	for (uintptr_t iter = mem_map_base; iter < mem_map_end;
 		 iter += mem_map.descriptor_size) {
 		auto* desc = reinterpret_cast<MemoryDescriptor*>(iter);
 
-		if (!IsAvailableMemory(static_cast<MemoryType>(desc->type))) {
-			continue;
+		const size_t start_pfn = desc->physical_start / PAGE_SIZE;
+		if (is_ram(static_cast<MemoryType>(desc->type)) && start_pfn < TOTAL_PAGES) {
+			add_page_region(start_pfn, std::min<size_t>(desc->number_of_pages,
+														TOTAL_PAGES - start_pfn));
 		}
 
-		if (desc->physical_start == 0) {
+		if (!is_conventional(*desc)) {
 			continue;
 		}
 
@@ -118,11 +243,35 @@ void initialize(const MemoryMap& mem_map)
 									   desc->number_of_pages * PAGE_SIZE);
 	}
 
+	boot_allocator->mark_used(bitmap, bitmap_bytes);
+
 	boot_allocator->show_available_memory();
 
 	LOG_INFO("Bootstrap allocator initialized successfully.");
 }
 
+void reclaim_boot_services_memory(const MemoryMap& mem_map)
+{
+	if (boot_allocator == nullptr) {
+		return;
+	}
+
+	const auto mem_map_base = reinterpret_cast<uintptr_t>(mem_map.buffer);
+	const auto mem_map_end = mem_map_base + mem_map.map_size;
+
+	for (uintptr_t iter = mem_map_base; iter < mem_map_end;
+		 iter += mem_map.descriptor_size) {
+		const auto* desc = reinterpret_cast<const MemoryDescriptor*>(iter);
+		if (is_usable(*desc) && !is_conventional(*desc)) {
+			boot_allocator->mark_available(
+					reinterpret_cast<void*>(desc->physical_start),
+					desc->number_of_pages * PAGE_SIZE);
+		}
+	}
+
+	boot_allocator->show_available_memory();
+}
+
 extern "C" caddr_t program_break, program_break_end;
 
 void initialize_heap()
@@ -143,8 +292,11 @@ void initialize_heap()
 
 void release_bootstrap()
 {
-	// The allocator lives in a static buffer inside the kernel BSS, so its
-	// pages must never be handed to the buddy system; just drop the pointer.
+	// The bitmap sits in usable RAM and goes to the buddy system. The
+	// allocator object itself lives in a static buffer inside the kernel
+	// BSS, so its pages must never be handed over; just drop the pointer.
+	memory_manager->free_range(boot_allocator->bitmap(),
+							   pages_for_bytes(boot_allocator->bitmap_bytes()));
 	boot_allocator = nullptr;
 
 	LOG_INFO("Bootstrap allocator released.");
@@ -156,11 +308,25 @@ void initialize_allocators()
 	// still alive, page metadata must exist before the buddy system indexes
 	// it, and the bootstrap allocator is retired only once the buddy system
 	// can serve allocations. The slab allocator sits on top of buddy pages.
+	const uint64_t start = kernel::cpu::read_tsc();
 	initialize_heap();
+#ifdef KERNEL_KASAN_ENABLED
+	// The shadow is one contiguous range, so it comes from the bitmap too
+	kasan::initialize();
+#endif
+	const uint64_t heap_done = kernel::cpu::read_tsc();
 	initialize_pages();
+	const uint64_t pages_done = kernel::cpu::read_tsc();
 	initialize_memory_manager();
 	release_bootstrap();
+	const uint64_t buddy_done = kernel::cpu::read_tsc();
 	initialize_slab_allocator();
+	const uint64_t end = kernel::cpu::read_tsc();
+
+	LOG_INFO("initialize_allocators took %lu cycles (heap %lu, pages %lu, "
+			 "buddy %lu, slab %lu)",
+			 end - start, heap_done - start, pages_done - heap_done,
+			 buddy_done - pages_done, end - buddy_done);
 }
 
 } // namespace kernel::memory
@@ -3,42 +3,76 @@
 struct MemoryMap;
 
 #include <stddef.h>
-#include <array>
 #include <cstdint>
 #include "page.hpp"
 
 namespace kernel::memory
 {
 
-// 64 GiB
+// Physical memory above 64 GiB is ignored
 static const uint64_t MAX_PHYS_MEM_BYTES = 64UL * 1024 * 1024 * 1024;
 const uint64_t TOTAL_PAGES = MAX_PHYS_MEM_BYTES / PAGE_SIZE;
 const size_t BITMAP_ENTRY_SIZE = sizeof(unsigned long) * 8;
 
+/**
+ * @brief Page allocator used before the buddy system exists
+ *
+ * One bit per page, set when the page is used. The bitmap covers only the
+ * pages up to the end of the highest usable memory-map region and lives in
+ * pages carved from that memory, so its size and its initialization follow
+ * the installed RAM rather than MAX_PHYS_MEM_BYTES. Pages past the bitmap
+ * read as used. Ranges are set, cleared and searched a word at a time.
+ */
 class BootstrapAllocator
 {
 public:
-	BootstrapAllocator();
+	/**
+	 * @brief Track pages [0, num_pages) in bitmap, all of them used
+	 * @param bitmap At least bitmap_words(num_pages) words
+	 */
+	BootstrapAllocator(unsigned long* bitmap, size_t num_pages);
+
+	static constexpr size_t bitmap_words(size_t num_pages)
+	{
+		return (num_pages + BITMAP_ENTRY_SIZE - 1) / BITMAP_ENTRY_SIZE;
+	}
 
 	void* allocate(size_t size);
 	void free(void* addr, size_t size);
 	void mark_available(void* addr, size_t size);
+	void mark_used(void* addr, size_t size);
 
 	void show_available_memory() const;
 
 	bool is_bit_set(size_t i) const
 	{
-		return (bitmap_[i / BITMAP_ENTRY_SIZE] & (1UL << (i % BITMAP_ENTRY_SIZE))) !=
-			   0U;
+		return i >= num_pages_ ||
+			   (bitmap_[i / BITMAP_ENTRY_SIZE] & (1UL << (i % BITMAP_ENTRY_SIZE))) !=
+					   0U;
 	}
 
+	/**
+	 * @brief First page in [from, end) that is used (or free), else end
+	 */
+	size_t find_next(size_t from, size_t end, bool used) const;
+
 	size_t end_index() const
 	{
 		return reinterpret_cast<uintptr_t>(memory_end_) / PAGE_SIZE;
 	}
 
+	/// The bitmap's own pages, handed to the buddy system on release
+	void* bitmap() const { return bitmap_; }
+	size_t bitmap_bytes() const
+	{
+		return bitmap_words(num_pages_) * sizeof(unsigned long);
+	}
+
 private:
-	std::array<unsigned long, TOTAL_PAGES / BITMAP_ENTRY_SIZE> bitmap_;
+	void assign_range(size_t start, size_t end, bool used);
+
+	unsigned long* bitmap_;
+	size_t num_pages_;
 	void* memory_end_;
 };
 
@@ -51,6 +85,15 @@ extern BootstrapAllocator* boot_allocator;
 extern char bootstrap_allocator_buffer[sizeof(BootstrapAllocator)];
 
 void initialize(const MemoryMap& mem_map);
+
+/**
+ * @brief Hand the boot-services regions to the bootstrap allocator
+ * @note initialize() only frees conventional memory, because the loader's
+ * memory map and the firmware page tables live in boot-services memory.
+ * Call once the kernel runs on its own page tables and is done with the map.
+ */
+void reclaim_boot_services_memory(const MemoryMap& mem_map);
+
 void initialize_heap();
 
 /**
@@ -60,14 +103,15 @@ void initialize_heap();
  * retirement and the slab allocator as one step, so the order dependency
  * lives here instead of in the boot flow. Call once, after initialize()
  * (and the bootstrap-stage tests, which exercise the bootstrap allocator
- * before it is retired).
+ * before it is retired). The cycles spent are logged over serial.
  */
 void initialize_allocators();
 
 /**
  * @brief Retire the bootstrap allocator once the buddy system is up
- * @note Only drops the global pointer. The allocator's static BSS buffer
- * must never be freed into the buddy system.
+ * @note Frees the bitmap pages into the buddy system and drops the global
+ * pointer. The allocator object's static BSS buffer must never be freed
+ * into the buddy system.
  */
 void release_bootstrap();
 
@@ -4,7 +4,10 @@
 #include <cstdint>
 #include "bit_utils.hpp"
 #include "log/log.hpp"
+#include "memory/bootstrap_allocator.hpp"
 #include "memory/page.hpp"
+#include "memory/slab.hpp"
+#include "memory/tlb.hpp"
 
 namespace kernel::memory
 {
@@ -76,9 +79,10 @@ void* BuddySystem::allocate(size_t size)
 	}
 
 	free_lists_[order].pop_front();
+	num_free_pages_ -= num_order_pages;
 
 	for (size_t i = 0; i < num_order_pages; ++i) {
-		pages[page->index() + i].set_used();
+		page[i].set_used();
 	}
 
 	return page->ptr();
@@ -86,7 +90,12 @@ void* BuddySystem::allocate(size_t size)
 
 void BuddySystem::free(void* addr, size_t size)
 {
-	auto* start_page = &pages[reinterpret_cast<uintptr_t>(addr) / PAGE_SIZE];
+	auto* start_page = get_page(addr);
+	if (start_page == nullptr) {
+		LOG_ERROR("free of non-RAM address: %p", addr);
+		return;
+	}
+
 	if (start_page->is_free()) {
 		LOG_ERROR("double free detected at address: %p", addr);
 		return;
@@ -98,13 +107,15 @@ void BuddySystem::free(void* addr, size_t size)
 		return;
 	}
 
+	num_free_pages_ += 1UL << order;
+
 	while (order <= MAX_ORDER) {
 		const size_t num_order_pages = 1 << order;
 
 		if (order == MAX_ORDER) {
 			free_lists_[order].push_back(start_page);
 			for (size_t i = 0; i < num_order_pages; i++) {
-				pages[start_page->index() + i].set_free();
+				start_page[i].set_free();
 			}
 			return;
 		}
@@ -119,7 +130,7 @@ void BuddySystem::free(void* addr, size_t size)
 		if (it == free_lists_[order].end()) {
 			free_lists_[order].push_back(start_page);
 			for (size_t i = 0; i < num_order_pages; i++) {
-				pages[start_page->index() + i].set_free();
+				start_page[i].set_free();
 			}
 
 			return;
@@ -127,60 +138,57 @@ void BuddySystem::free(void* addr, size_t size)
 
 		free_lists_[order].erase(it);
 
-		start_page = std::min(start_page, buddy_block);
+		// Descriptors of different regions are not laid out in address
+		// order, so pick the lower block by physical address.
+		if (buddy_addr < reinterpret_cast<uintptr_t>(start_page->ptr())) {
+			start_page = buddy_block;
+		}
 
 		++order;
 	}
 }
 
-void BuddySystem::register_memory_blocks(size_t num_total_pages, Page* start_page)
+void BuddySystem::free_range(void* addr, size_t num_pages)
 {
-	if (num_total_pages <= 0) {
-		return;
-	}
-
-	auto calc_max_order_in_total_pages = [](size_t num_total_pages) -> size_t {
-		if (num_total_pages == 0) {
-			return 0;
-		}
-
-		// floor(log2(num_total_pages)), clamped so that regions larger than
-		// the biggest buddy block are chunked into MAX_ORDER blocks
-		const size_t order = bit_width(num_total_pages) - 1;
-		return order > static_cast<size_t>(MAX_ORDER)
-					   ? static_cast<size_t>(MAX_ORDER)
-					   : order;
-	};
-
-	size_t order = calc_max_order_in_total_pages(num_total_pages);
-
-	const uintptr_t alignment_size = (1 << order) * PAGE_SIZE;
-	const uintptr_t page_addr = reinterpret_cast<uintptr_t>(start_page->ptr());
-	if ((page_addr % alignment_size) != 0) {
-		const auto aligned_addr =
-				static_cast<uintptr_t>(align_up(page_addr, alignment_size));
-
-		const size_t num_rounded_up_pages = (aligned_addr - page_addr) / PAGE_SIZE;
-		if ((num_total_pages - num_rounded_up_pages) < (1 << order)) {
+	auto start = reinterpret_cast<uintptr_t>(addr);
+	while (num_pages > 0) {
+		// Largest block aligned at start that the run still covers
+		const uintptr_t pfn = start / PAGE_SIZE;
+		int order = pfn == 0 ? MAX_ORDER : std::min(__builtin_ctzll(pfn), MAX_ORDER);
+		while ((1UL << order) > num_pages) {
 			--order;
 		}
 
-		register_memory_blocks(num_rounded_up_pages, start_page);
-		num_total_pages -= num_rounded_up_pages;
-		order = calc_max_order_in_total_pages(num_total_pages);
+		const size_t block_pages = 1UL << order;
+		free(reinterpret_cast<void*>(start), block_pages * PAGE_SIZE);
+		start += block_pages * PAGE_SIZE;
+		num_pages -= block_pages;
+	}
+}
 
-		start_page = &pages[start_page->index() + num_rounded_up_pages];
+void BuddySystem::register_memory_blocks(size_t num_total_pages, Page* start_page)
+{
+	if (num_total_pages == 0) {
+		return;
 	}
 
+	// The run goes in as the largest naturally aligned blocks it covers.
+	// No two of them are buddies (they would have formed one block of the
+	// next order), so they are pushed without searching the free lists.
+	auto pfn = reinterpret_cast<uintptr_t>(start_page->ptr()) / PAGE_SIZE;
 	while (num_total_pages > 0) {
-		this->free_lists_[order].push_back(start_page);
-		const size_t num_pages = 1 << order;
+		int order = pfn == 0 ? MAX_ORDER : std::min(__builtin_ctzll(pfn), MAX_ORDER);
+		while ((1UL << order) > num_total_pages) {
+			--order;
+		}
 
-		start_page = &pages[start_page->index() + num_pages];
+		const size_t num_pages = 1UL << order;
+		free_lists_[order].push_back(start_page);
+		num_free_pages_ += num_pages;
 
+		start_page += num_pages;
+		pfn += num_pages;
 		num_total_pages -= num_pages;
-
-		order = calc_max_order_in_total_pages(num_total_pages);
 	}
 }
 
@@ -204,38 +212,133 @@ void BuddySystem::print_free_lists(int order) const
 	}
 }
 
+namespace
+{
+// Whether the run of b directly follows the run of a, in memory and in the
+// page descriptors
+bool runs_adjacent(uintptr_t a, size_t a_pages, uintptr_t b)
+{
+	if (a + a_pages * PAGE_SIZE != b) {
+		return false;
+	}
+
+	Page* first = get_page(reinterpret_cast<void*>(a));
+	Page* next = get_page(reinterpret_cast<void*>(b));
+	return first != nullptr && first + a_pages == next;
+}
+} // namespace
+
+void FrameFreeBatch::add(void* frame, size_t num_pages)
+{
+	const auto start = reinterpret_cast<uintptr_t>(frame);
+	if (num_runs_ > 0) {
+		Run& last = runs_[num_runs_ - 1];
+		if (runs_adjacent(last.start, last.num_pages, start)) {
+			last.num_pages += num_pages;
+			return;
+		}
+	}
+
+	if (num_runs_ == MAX_RUNS) {
+		flush();
+	}
+
+	runs_[num_runs_++] = Run{ start, num_pages };
+}
+
+void FrameFreeBatch::flush()
+{
+	if (num_runs_ == 0) {
+		return;
+	}
+
+	if (tlb_ != nullptr) {
+		tlb_->flush();
+	}
+
+	std::sort(runs_, runs_ + num_runs_,
+			  [](const Run& a, const Run& b) { return a.start < b.start; });
+
+	Run merged = runs_[0];
+	for (size_t i = 1; i < num_runs_; ++i) {
+		if (runs_adjacent(merged.start, merged.num_pages, runs_[i].start)) {
+			merged.num_pages += runs_[i].num_pages;
+			continue;
+		}
+
+		memory_manager->free_range(reinterpret_cast<void*>(merged.start),
+								   merged.num_pages);
+		merged = runs_[i];
+	}
+
+	memory_manager->free_range(reinterpret_cast<void*>(merged.start),
+							   merged.num_pages);
+	num_runs_ = 0;
+}
+
 void initialize_memory_manager()
 {
 	LOG_INFO("Initializing memory manager...");
 
 	memory_manager = new BuddySystem();
 
-	size_t start_index = 0;
-	size_t num_total_pages = 0;
-
-	for (size_t i = 0; i < pages.size(); i++) {
-		if (pages[i].is_used()) {
-			if (num_total_pages > 0) {
-				memory_manager->register_memory_blocks(num_total_pages,
-													   &pages[start_index]);
-			}
-
-			num_total_pages = 0;
+	// Free runs come straight from the bootstrap bitmap, a word at a time.
+	// They never span regions: physically adjacent RAM is always coalesced
+	// into a single region, so each run is contiguous metadata.
+	for (size_t r = 0; r < num_page_regions; ++r) {
+		const PageRegion& region = page_regions[r];
+		if (region.pages == nullptr) {
 			continue;
 		}
 
-		if (num_total_pages == 0) {
-			start_index = i;
+		const size_t end_pfn = region.start_pfn + region.num_pages;
+		size_t pfn = boot_allocator->find_next(region.start_pfn, end_pfn, false);
+		while (pfn < end_pfn) {
+			const size_t run_end = boot_allocator->find_next(pfn, end_pfn, true);
+			memory_manager->register_memory_blocks(
+					run_end - pfn, &region.pages[pfn - region.start_pfn]);
+			pfn = boot_allocator->find_next(run_end, end_pfn, false);
 		}
+	}
+
+	LOG_INFO("Memory manager initialized successfully.");
+}
 
-		++num_total_pages;
+void get_memory_usage(MemoryUsage* usage)
+{
+	*usage = MemoryUsage{};
+	usage->total_pages = total_ram_pages();
+	usage->slab_pages = slab_usage.slab_pages;
+	usage->page_table_pages = slab_usage.page_table_pages;
+	usage->ool_pages = slab_usage.ool_pages;
+
+	if (memory_manager == nullptr) {
+		return;
 	}
 
-	if (num_total_pages > 0) {
-		memory_manager->register_memory_blocks(num_total_pages, &pages[start_index]);
+	usage->free_pages = memory_manager->free_pages();
+
+	for (int order = 0; order <= MAX_ORDER; ++order) {
+		usage->free_blocks[order] = memory_manager->free_blocks(order);
 	}
 
-	LOG_INFO("Memory manager initialized successfully.");
+	usage->fragmentation =
+			fragmentation_index(usage->free_blocks, usage->free_pages);
+}
+
+unsigned int fragmentation_index(const size_t* free_blocks, size_t free_pages)
+{
+	if (free_pages == 0) {
+		return 0;
+	}
+
+	size_t usable_pages = 0;
+	for (int order = FRAGMENTATION_ORDER; order <= MAX_ORDER; ++order) {
+		usable_pages += free_blocks[order] << order;
+	}
+
+	const size_t unusable_pages = free_pages - usable_pages;
+	return static_cast<unsigned int>(unusable_pages * 1000 / free_pages);
 }
 
 } // namespace kernel::memory
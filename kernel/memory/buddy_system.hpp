@@ -14,6 +14,7 @@
 
 #include <array>
 #include <cstddef>
+#include <cstdint>
 #include <list>
 #include "memory/custom_allocators.hpp"
 #include "memory/page.hpp"
@@ -23,6 +24,10 @@ namespace kernel::memory
 
 static const auto MAX_ORDER = 18;
 
+/// Order the fragmentation index is measured against: a 2 MiB block, the
+/// size user memory is mapped with where possible
+constexpr int FRAGMENTATION_ORDER = 9;
+
 class BuddySystem
 {
 public:
@@ -53,11 +58,25 @@ public:
 	 */
 	void free(void* addr, size_t size);
 
+	/**
+	 * @brief Frees a run of pages, however it was allocated.
+	 *
+	 * The run goes back as the fewest naturally aligned blocks covering it,
+	 * so the free lists are searched once per block rather than per page.
+	 * The descriptors of the run must be contiguous (one memory region).
+	 *
+	 * @param addr First page of the run.
+	 * @param num_pages Number of pages in the run.
+	 */
+	void free_range(void* addr, size_t num_pages);
+
 	/**
 	 * @brief Registers a block of memory pages with the buddy system.
 	 *
-	 * This function divides the given memory into appropriate order blocks
-	 * and adds them to the system's free lists for future allocations.
+	 * This function divides the given memory into the largest naturally
+	 * aligned blocks it covers and adds them to the system's free lists
+	 * without looking for buddies, so it is only for free runs found at
+	 * boot, whose neighbours are not on the free lists.
 	 *
 	 * @param num_total_pages The number of memory pages in the block.
 	 * @param start_page The starting address of the memory block.
@@ -66,6 +85,18 @@ public:
 
 	void print_free_lists(int order = -1) const;
 
+	/**
+	 * @brief Number of pages currently on the free lists
+	 */
+	size_t free_pages() const { return num_free_pages_; }
+
+	/**
+	 * @brief Number of free blocks of the given order
+	 *
+	 * @param order Block order in [0, MAX_ORDER]
+	 */
+	size_t free_blocks(int order) const { return free_lists_[order].size(); }
+
 private:
 	/**
 	 * @brief Splits a memory block of the given order into two smaller blocks.
@@ -95,10 +126,92 @@ private:
 
 	std::array<std::list<Page*, PoolAllocator<Page*, PAGE_SIZE>>, MAX_ORDER + 1>
 			free_lists_;
+	size_t num_free_pages_ = 0;
 };
 
 extern BuddySystem* memory_manager;
 
+class TlbFlushBatch;
+
+/**
+ * @brief Buddy frames gathered while tearing down mappings
+ *
+ * Frames are freed by flush() or the destructor: sorted, merged into
+ * contiguous runs and handed to BuddySystem::free_range(), so for example
+ * the 4 KiB pieces of a split 2 MiB page go back as one block. flush()
+ * runs when the batch fills up, too, so pass the TlbFlushBatch of the same
+ * change: it is flushed first, and the frames are freed only once no TLB
+ * entry can reach them.
+ */
+class FrameFreeBatch
+{
+public:
+	static constexpr size_t MAX_RUNS = 32;
+
+	explicit FrameFreeBatch(TlbFlushBatch* tlb = nullptr)
+		: tlb_{ tlb }, num_runs_{ 0 }
+	{
+	}
+	~FrameFreeBatch() { flush(); }
+
+	FrameFreeBatch(const FrameFreeBatch&) = delete;
+	FrameFreeBatch& operator=(const FrameFreeBatch&) = delete;
+
+	/// Queue num_pages buddy pages from frame
+	void add(void* frame, size_t num_pages);
+
+	void flush();
+
+private:
+	struct Run {
+		uintptr_t start;
+		size_t num_pages;
+	};
+
+	TlbFlushBatch* tlb_;
+	Run runs_[MAX_RUNS];
+	size_t num_runs_;
+};
+
 void initialize_memory_manager();
 
+/**
+ * @brief Snapshot of the memory usage counters
+ *
+ * Every field is read from a counter the allocators keep up to date, so
+ * taking a snapshot costs the same regardless of RAM size.
+ */
+struct MemoryUsage {
+	size_t total_pages;		 ///< Frames covered by page descriptors (all RAM)
+	size_t free_pages;		 ///< Frames on the buddy free lists
+	size_t slab_pages;		 ///< Frames backing slab caches
+	size_t page_table_pages; ///< Slab frames holding page tables
+	size_t ool_pages;		 ///< Slab frames holding IPC OOL buffers
+	/// Free blocks per buddy order
+	size_t free_blocks[MAX_ORDER + 1];
+	/// Share of free memory in blocks below FRAGMENTATION_ORDER, in per
+	/// mille (see fragmentation_index())
+	unsigned int fragmentation;
+};
+
+/**
+ * @brief Unusable free space index of a free-block histogram
+ *
+ * The share of free pages that sit in blocks smaller than
+ * FRAGMENTATION_ORDER, so no request of that order can use them.
+ *
+ * @param free_blocks Free blocks per order, MAX_ORDER + 1 entries
+ * @param free_pages Total of the histogram, in pages
+ * @return Per mille: 0 when every free page is in a block of at least
+ * FRAGMENTATION_ORDER, 1000 when none is (and 0 when nothing is free)
+ */
+unsigned int fragmentation_index(const size_t* free_blocks, size_t free_pages);
+
+/**
+ * @brief Get current memory usage statistics
+ *
+ * @param[out] usage Filled with the current counters
+ */
+void get_memory_usage(MemoryUsage* usage);
+
 } // namespace kernel::memory
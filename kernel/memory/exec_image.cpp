@@ -0,0 +1,189 @@
+#include "memory/exec_image.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "memory/page.hpp"
+#include "memory/slab.hpp"
+
+namespace kernel::memory
+{
+
+namespace
+{
+// Images kept after their last process exits, so that running the same
+// program again (shell commands) finds its pages already built
+constexpr size_t MAX_CACHED_IMAGES = 8;
+
+std::array<ExecImage*, MAX_CACHED_IMAGES> image_cache{};
+uint64_t cache_clock = 0;
+} // namespace
+
+ExecImage::ExecImage()
+	: file_{ nullptr },
+	  size_{ 0 },
+	  segments_{},
+	  num_segments_{ 0 },
+	  users_{ 0 },
+	  cached_{ false },
+	  last_use_{ 0 }
+{
+}
+
+ExecImage::~ExecImage()
+{
+	for (int i = 0; i < num_segments_; ++i) {
+		CachedSegment& cached = segments_[i];
+		if (cached.pages == nullptr) {
+			continue;
+		}
+
+		for (size_t p = 0; p < cached.num_pages; ++p) {
+			void* frame = cached.pages[p];
+			if (frame == nullptr) {
+				continue;
+			}
+
+			Page* page = get_page(frame);
+			if (page == nullptr || page->dec_ref() == 0) {
+				free(frame);
+			}
+		}
+
+		free(cached.pages);
+	}
+}
+
+void* ExecImage::page(int segment, size_t index)
+{
+	if (segment < 0 || segment >= num_segments_ ||
+		index >= segments_[segment].num_pages) {
+		return nullptr;
+	}
+
+	CachedSegment& cached = segments_[segment];
+	if (cached.pages[index] != nullptr) {
+		return cached.pages[index];
+	}
+
+	auto* frame = static_cast<uint8_t*>(alloc(PAGE_SIZE, ALLOC_ZEROED));
+	if (frame == nullptr) {
+		return nullptr;
+	}
+
+	// Copy the part of the page the file backs; the rest stays zero (bss,
+	// and the bytes around a segment that does not start or end on a page)
+	const ExecSegment& seg = cached.segment;
+	const uint64_t page_start = segment_page_base(seg) + index * PAGE_SIZE;
+	const uint64_t copy_start = std::max(page_start, seg.vaddr);
+	const uint64_t copy_end =
+			std::min(page_start + PAGE_SIZE, seg.vaddr + seg.file_size);
+	if (copy_start < copy_end) {
+		const auto* file = static_cast<const uint8_t*>(file_.get());
+		memcpy(frame + (copy_start - page_start),
+			   file + seg.offset + (copy_start - seg.vaddr), copy_end - copy_start);
+	}
+
+	Page* page = get_page(frame);
+	if (page != nullptr) {
+		page->inc_ref();
+	}
+
+	cached.pages[index] = frame;
+	return frame;
+}
+
+ExecImage* acquire_exec_image(unique_kbuf<>& file,
+							  size_t size,
+							  const ExecSegment* segments,
+							  int num_segments)
+{
+	if (num_segments > ExecImage::MAX_SEGMENTS) {
+		return nullptr;
+	}
+
+	for (ExecImage* image : image_cache) {
+		if (image != nullptr && image->size_ == size &&
+			memcmp(image->file_.get(), file.get(), size) == 0) {
+			++image->users_;
+			image->last_use_ = ++cache_clock;
+			return image;
+		}
+	}
+
+	auto* image = new ExecImage();
+	if (image == nullptr) {
+		return nullptr;
+	}
+
+	for (int i = 0; i < num_segments; ++i) {
+		ExecImage::CachedSegment& cached = image->segments_[i];
+		cached.segment = segments[i];
+		cached.num_pages = pages_for_bytes(segments[i].vaddr +
+										   segments[i].mem_size -
+										   segment_page_base(segments[i]));
+		image->num_segments_ = i + 1;
+		if (cached.num_pages == 0) {
+			continue;
+		}
+
+		cached.pages = static_cast<void**>(
+				alloc(cached.num_pages * sizeof(void*), ALLOC_ZEROED));
+		if (cached.pages == nullptr) {
+			delete image;
+			return nullptr;
+		}
+	}
+
+	image->file_ = std::move(file);
+	image->size_ = size;
+	image->users_ = 1;
+	image->last_use_ = ++cache_clock;
+
+	// Take a free slot, or the one of the least recently used idle image.
+	// With every slot running, the new image is simply not cached.
+	ExecImage** slot = nullptr;
+	for (ExecImage*& entry : image_cache) {
+		if (entry == nullptr) {
+			slot = &entry;
+			break;
+		}
+
+		if (entry->users_ == 0 &&
+			(slot == nullptr || entry->last_use_ < (*slot)->last_use_)) {
+			slot = &entry;
+		}
+	}
+
+	if (slot != nullptr) {
+		if (*slot != nullptr) {
+			delete *slot;
+		}
+
+		*slot = image;
+		image->cached_ = true;
+	}
+
+	return image;
+}
+
+void get_exec_image(ExecImage* image)
+{
+	if (image != nullptr) {
+		++image->users_;
+	}
+}
+
+void put_exec_image(ExecImage* image)
+{
+	if (image == nullptr || image->users_ == 0) {
+		return;
+	}
+
+	if (--image->users_ == 0 && !image->cached_) {
+		delete image;
+	}
+}
+
+} // namespace kernel::memory
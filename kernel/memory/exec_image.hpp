@@ -0,0 +1,129 @@
+/**
+ * @file memory/exec_image.hpp
+ * @brief Page cache of executable images shared by the processes running them
+ *
+ * exec no longer copies the load segments of a program into every new
+ * address space. The file stays in an ExecImage, each page of a segment is
+ * built on the first fault that touches it, and the page is then mapped
+ * into every process running the same file: read-only segments share it
+ * for good, writable ones until their first write (CoW).
+ *
+ * FS_LOAD hands over file contents, not an inode, so an image is found by
+ * its size and bytes; identical binaries under different names share one.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "error.hpp"
+#include "memory/page.hpp"
+#include "memory/slab.hpp"
+
+namespace kernel::memory
+{
+
+/**
+ * @brief One load segment of an executable, as the program headers give it
+ */
+struct ExecSegment {
+	uint64_t vaddr;	  ///< Virtual address of the first byte
+	uint64_t offset;  ///< File offset of the first byte
+	size_t file_size; ///< Bytes read from the file
+	size_t mem_size;  ///< Bytes in memory; the rest is zero filled
+	bool writable;
+};
+
+class ExecImage
+{
+public:
+	static constexpr int MAX_SEGMENTS = 8;
+
+	/**
+	 * @brief Get the page of a segment, building it on first use
+	 *
+	 * The image holds one reference on each page it built; every mapping
+	 * takes its own.
+	 *
+	 * @param segment Segment index
+	 * @param index Page index from the page containing the segment start
+	 * @return void* The page, or nullptr when out of range or out of memory
+	 */
+	void* page(int segment, size_t index);
+
+	const ExecSegment& segment(int index) const
+	{
+		return segments_[index].segment;
+	}
+	int num_segments() const { return num_segments_; }
+
+	static void* operator new(size_t size) { return alloc(size, ALLOC_ZEROED); }
+	static void operator delete(void* p) { free(p); }
+
+private:
+	struct CachedSegment {
+		ExecSegment segment;
+		void** pages;
+		size_t num_pages;
+	};
+
+	friend ExecImage* acquire_exec_image(unique_kbuf<>& file,
+										 size_t size,
+										 const ExecSegment* segments,
+										 int num_segments);
+	friend void put_exec_image(ExecImage* image);
+	friend void get_exec_image(ExecImage* image);
+
+	ExecImage();
+	~ExecImage();
+
+	unique_kbuf<> file_;
+	size_t size_;
+	CachedSegment segments_[MAX_SEGMENTS];
+	int num_segments_;
+	int users_;
+	bool cached_;		///< Listed in the image cache
+	uint64_t last_use_; ///< Cache clock at the last acquire
+};
+
+/**
+ * @brief Find or create the image of an executable file
+ *
+ * A cached image with the same contents is reused and file is left alone.
+ * Otherwise a new image takes ownership of file; when the cache is full,
+ * the least recently used image that no process runs is evicted.
+ *
+ * @param file File contents
+ * @param size File size in bytes
+ * @param segments Load segments, already checked to lie inside the file
+ * @param num_segments Number of segments (at most ExecImage::MAX_SEGMENTS)
+ * @return ExecImage* The image with one user taken, or nullptr on
+ * allocation failure (file is left alone then too)
+ */
+ExecImage* acquire_exec_image(unique_kbuf<>& file,
+							  size_t size,
+							  const ExecSegment* segments,
+							  int num_segments);
+
+/// Take one more user (fork)
+void get_exec_image(ExecImage* image);
+
+/**
+ * @brief Drop one user
+ *
+ * An image evicted from the cache is freed with its last user. Pages still
+ * mapped somewhere survive on their own reference. nullptr is ignored.
+ */
+void put_exec_image(ExecImage* image);
+
+/**
+ * @brief First page-aligned address of a segment
+ */
+inline uint64_t segment_page_base(const ExecSegment& segment)
+{
+	return segment.vaddr & ~static_cast<uint64_t>(PAGE_SIZE - 1);
+}
+
+} // namespace kernel::memory
@@ -110,23 +110,39 @@ void initialize()
 
 size_t redzone_reserve() { return REDZONE_SIZE; }
 
-void* on_alloc(void* raw, size_t user_size, size_t object_size, void* caller)
+namespace
+{
+// A previously-freed object must still hold its poison. If not, something
+// wrote to it after it was freed. Either way the object leaves the table.
+void claim_poisoned(void* raw, void* caller)
 {
-	// A previously-freed object must still hold its poison. If not, something
-	// wrote to it after it was freed.
 	auto pit = poisoned_objs.find(raw);
-	if (pit != poisoned_objs.end()) {
-		if (!poison_intact(raw, pit->second)) {
-			++g_stats.use_after_free;
-			if (g_expected_violations == 0) {
-				LOG_ERROR(
-						"heap-debug: use-after-free in object %p (size %lu), "
-						"reallocated from %p",
-						raw, static_cast<unsigned long>(pit->second), caller);
-			}
+	if (pit == poisoned_objs.end()) {
+		return;
+	}
+
+	if (!poison_intact(raw, pit->second)) {
+		++g_stats.use_after_free;
+		if (g_expected_violations == 0) {
+			LOG_ERROR("heap-debug: use-after-free in object %p (size %lu), "
+					  "reallocated from %p",
+					  raw, static_cast<unsigned long>(pit->second), caller);
 		}
-		poisoned_objs.erase(pit);
 	}
+	poisoned_objs.erase(pit);
+}
+} // namespace
+
+void on_release(void* base, size_t size, size_t object_size)
+{
+	for (size_t offset = 0; offset < size; offset += object_size) {
+		poisoned_objs.erase(static_cast<char*>(base) + offset);
+	}
+}
+
+void* on_alloc(void* raw, size_t user_size, size_t object_size, void* caller)
+{
+	claim_poisoned(raw, caller);
 
 	// The payload starts at the object boundary so its natural alignment is
 	// preserved (kernel stacks, page tables and DMA buffers rely on that).
@@ -142,6 +158,8 @@ void* on_alloc(void* raw, size_t user_size, size_t object_size, void* caller)
 	return raw;
 }
 
+void on_reserve(void* raw, void* caller) { claim_poisoned(raw, caller); }
+
 void* raw_from_user(void* user)
 {
 	auto it = live_allocs.find(user);
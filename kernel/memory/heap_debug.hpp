@@ -15,6 +15,7 @@
  *
  * When the option is OFF this whole header is empty and slab.cpp compiles to
  * exactly the same code as before: there is zero footprint on release builds.
+ * Only ExpectedViolation remains, as a no-op or as the KERNEL_KASAN one.
  */
 
 #pragma once
@@ -74,6 +75,29 @@ size_t redzone_reserve();
  */
 void* on_alloc(void* raw, size_t user_size, size_t object_size, void* caller);
 
+/**
+ * @brief Take a slab object that is set aside before it is handed out
+ *
+ * Verifies and forgets the object's freed-poison like on_alloc(), so the
+ * pre-zeroed page pool can overwrite it. The object is not tracked (and not
+ * counted by live_bytes()) until on_alloc() hands it to a caller.
+ *
+ * @param raw Slab object base as returned by MCache::alloc()
+ * @param caller __builtin_return_address(0) of whoever set it aside
+ */
+void on_reserve(void* raw, void* caller);
+
+/**
+ * @brief Forget the freed-poison of a slab given back to the buddy system
+ *
+ * Its pages get other owners, so the poison is no longer expected to hold.
+ *
+ * @param base First object of the slab
+ * @param size Bytes the slab spans
+ * @param object_size Object size of the owning cache
+ */
+void on_release(void* base, size_t size, size_t object_size);
+
 /**
  * @brief Map a user pointer back to its raw slab object
  * @param user Pointer previously returned by on_alloc()
@@ -130,6 +154,16 @@ public:
 
 } // namespace kernel::memory::heap_debug
 
+#elif defined(KERNEL_KASAN_ENABLED)
+
+#include "memory/kasan.hpp"
+
+namespace kernel::memory::heap_debug
+{
+/// Deliberate heap faults are reported by the shadow checker instead
+using ExpectedViolation = kasan::ExpectedViolation;
+} // namespace kernel::memory::heap_debug
+
 #else
 
 namespace kernel::memory::heap_debug
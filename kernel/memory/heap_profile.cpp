@@ -0,0 +1,315 @@
+/**
+ * @file memory/heap_profile.cpp
+ * @brief Allocation sampler and live-heap dump
+ *
+ * The whole translation unit is empty unless KERNEL_HEAP_PROFILE_ENABLED is
+ * set. Nothing here allocates: the sample table and the dump's scratch space
+ * are static, so the hooks can run inside alloc() and free().
+ */
+
+#include "memory/heap_profile.hpp"
+
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+
+#include <stdio.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include "interrupt/irq_guard.hpp"
+#include "log/log.hpp"
+
+namespace kernel::memory::heap_profile
+{
+namespace
+{
+
+struct Sample {
+	uintptr_t addr; ///< Payload pointer; 0 marks an empty slot
+	size_t weight;
+	size_t depth;
+	uintptr_t frames[MAX_FRAMES];
+};
+
+// Open addressing with linear probing, at most half full so a miss in
+// free() ends at the first or second slot
+constexpr size_t TABLE_BITS = 9;
+constexpr size_t TABLE_SIZE = 1UL << TABLE_BITS;
+static_assert(TABLE_SIZE >= 2 * MAX_LIVE_SAMPLES);
+
+// A saved frame pointer further up than this is not a kernel stack frame
+// (kernel stacks are KERNEL_STACK_PAGES long); the walk stops there
+constexpr uintptr_t MAX_FRAME_STEP = 64 * 1024;
+
+// Sites printed per dump, largest first
+constexpr size_t MAX_DUMP_SITES = 32;
+
+Sample table[TABLE_SIZE];
+Stats g_stats = { 0, 0, 0, 0 };
+
+size_t sample_interval = DEFAULT_SAMPLE_INTERVAL;
+size_t bytes_since_sample = 0;
+size_t next_sample_at = DEFAULT_SAMPLE_INTERVAL;
+uint64_t rng_state = 0x9e37'79b9'7f4a'7c15ULL;
+
+// Copy of the live samples taken by dump(), grouped outside the IrqGuard
+Sample snapshot[MAX_LIVE_SAMPLES];
+
+struct Site {
+	const Sample* first; ///< A sample with this site's stack
+	size_t bytes;
+	size_t samples;
+};
+
+Site sites[MAX_LIVE_SAMPLES];
+
+uint64_t next_random()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+// Uniform in [interval / 2, interval * 3 / 2): the mean gap stays the
+// interval, but no allocation pattern lines up with it
+size_t draw_gap()
+{
+	if (sample_interval <= 1) {
+		return sample_interval;
+	}
+
+	return sample_interval / 2 + next_random() % sample_interval;
+}
+
+size_t slot_of(uintptr_t addr)
+{
+	return ((addr >> 4) * 0x9e37'79b9'7f4a'7c15ULL) >> (64 - TABLE_BITS);
+}
+
+Sample* find(uintptr_t addr)
+{
+	for (size_t i = slot_of(addr);; i = (i + 1) % TABLE_SIZE) {
+		if (table[i].addr == addr) {
+			return &table[i];
+		}
+		if (table[i].addr == 0) {
+			return nullptr;
+		}
+	}
+}
+
+// Backward-shift deletion: later entries of the probe run move into the
+// hole, so lookups never need tombstones
+void erase(Sample* sample)
+{
+	size_t hole = sample - table;
+	for (size_t i = (hole + 1) % TABLE_SIZE; table[i].addr != 0;
+		 i = (i + 1) % TABLE_SIZE) {
+		const size_t home = slot_of(table[i].addr);
+		// Move entry i unless its home lies cyclically in (hole, i]
+		const bool stays = hole < i ? (hole < home && home <= i)
+									: (hole < home || home <= i);
+		if (!stays) {
+			table[hole] = table[i];
+			hole = i;
+		}
+	}
+	table[hole].addr = 0;
+}
+
+// Return addresses between walk_stack() and the alloc() caller: back into
+// record(), on_alloc() and alloc(). Both local callees are noinline so the
+// count holds at any optimization level.
+constexpr size_t SKIPPED_FRAMES = 3;
+
+// Return addresses of the alloc() caller and up, minus one so that each
+// names the call instruction rather than the line after it
+__attribute__((noinline)) size_t walk_stack(uintptr_t* frames)
+{
+	auto fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+	size_t depth = 0;
+	size_t skip = SKIPPED_FRAMES;
+	while (depth < MAX_FRAMES && fp != 0 && fp % sizeof(uintptr_t) == 0) {
+		const auto* frame = reinterpret_cast<const uintptr_t*>(fp);
+		const uintptr_t ret = frame[1];
+		if (ret == 0) {
+			break;
+		}
+		if (skip == 0) {
+			frames[depth++] = ret - 1;
+		} else {
+			--skip;
+		}
+
+		const uintptr_t next = frame[0];
+		if (next <= fp || next - fp > MAX_FRAME_STEP) {
+			break;
+		}
+		fp = next;
+	}
+
+	return depth;
+}
+
+__attribute__((noinline)) void record(uintptr_t addr, size_t weight)
+{
+	uintptr_t frames[MAX_FRAMES];
+	const size_t depth = walk_stack(frames);
+
+	const kernel::interrupt::IrqGuard guard;
+	++g_stats.total_samples;
+	if (g_stats.live_samples == MAX_LIVE_SAMPLES || find(addr) != nullptr) {
+		++g_stats.dropped;
+		return;
+	}
+
+	size_t i = slot_of(addr);
+	while (table[i].addr != 0) {
+		i = (i + 1) % TABLE_SIZE;
+	}
+
+	Sample& s = table[i];
+	s.addr = addr;
+	s.weight = weight;
+	s.depth = depth;
+	std::copy(frames, frames + depth, s.frames);
+
+	++g_stats.live_samples;
+	g_stats.live_bytes += weight;
+}
+
+bool same_stack(const Sample& a, const Sample& b)
+{
+	return a.depth == b.depth && std::equal(a.frames, a.frames + a.depth, b.frames);
+}
+
+bool stack_less(const Sample& a, const Sample& b)
+{
+	return std::lexicographical_compare(a.frames, a.frames + a.depth, b.frames,
+										b.frames + b.depth);
+}
+
+void log_site(const Site& site)
+{
+	char line[MAX_FRAMES * 20 + 1] = "";
+	size_t len = 0;
+	for (size_t i = 0; i < site.first->depth; ++i) {
+		len += snprintf(line + len, sizeof(line) - len, " %p",
+						reinterpret_cast<void*>(site.first->frames[i]));
+	}
+
+	LOG_INFO("heap profile: %lu KiB in %lu samples at%s",
+			 static_cast<unsigned long>(site.bytes / 1024),
+			 static_cast<unsigned long>(site.samples), line);
+}
+
+} // namespace
+
+void on_alloc(void* addr, size_t size)
+{
+	if (sample_interval == 0) {
+		return;
+	}
+
+	// ALLOC_ATOMIC allocations come from interrupt context too
+	const kernel::interrupt::IrqGuard guard;
+	bytes_since_sample += size;
+	if (bytes_since_sample < next_sample_at) {
+		return;
+	}
+
+	const size_t weight = bytes_since_sample;
+	bytes_since_sample = 0;
+	next_sample_at = draw_gap();
+	record(reinterpret_cast<uintptr_t>(addr), weight);
+}
+
+void on_free(void* addr)
+{
+	if (g_stats.live_samples == 0) {
+		return;
+	}
+
+	const kernel::interrupt::IrqGuard guard;
+	Sample* sample = find(reinterpret_cast<uintptr_t>(addr));
+	if (sample == nullptr) {
+		return;
+	}
+
+	--g_stats.live_samples;
+	g_stats.live_bytes -= sample->weight;
+	erase(sample);
+}
+
+size_t sampled_frames(const void* addr, uintptr_t* frames)
+{
+	const kernel::interrupt::IrqGuard guard;
+	const Sample* sample = find(reinterpret_cast<uintptr_t>(addr));
+	if (sample == nullptr) {
+		return 0;
+	}
+
+	std::copy(sample->frames, sample->frames + sample->depth, frames);
+	return sample->depth;
+}
+
+void set_sample_interval(size_t bytes)
+{
+	const kernel::interrupt::IrqGuard guard;
+	sample_interval = bytes;
+	bytes_since_sample = 0;
+	next_sample_at = draw_gap();
+}
+
+Stats stats() { return g_stats; }
+
+void dump()
+{
+	size_t num_samples = 0;
+	size_t interval;
+	{
+		const kernel::interrupt::IrqGuard guard;
+		for (const Sample& s : table) {
+			if (s.addr != 0) {
+				snapshot[num_samples++] = s;
+			}
+		}
+		interval = sample_interval;
+	}
+
+	std::sort(snapshot, snapshot + num_samples, stack_less);
+
+	size_t num_sites = 0;
+	size_t total_bytes = 0;
+	for (size_t i = 0; i < num_samples; ++i) {
+		if (num_sites == 0 ||
+			!same_stack(*sites[num_sites - 1].first, snapshot[i])) {
+			sites[num_sites++] = { &snapshot[i], 0, 0 };
+		}
+		sites[num_sites - 1].bytes += snapshot[i].weight;
+		sites[num_sites - 1].samples += 1;
+		total_bytes += snapshot[i].weight;
+	}
+
+	std::sort(sites, sites + num_sites,
+			  [](const Site& a, const Site& b) { return a.bytes > b.bytes; });
+
+	LOG_INFO("heap profile: ~%lu KiB live in %lu samples from %lu sites "
+			 "(1 sample per %lu bytes allocated)",
+			 static_cast<unsigned long>(total_bytes / 1024),
+			 static_cast<unsigned long>(num_samples),
+			 static_cast<unsigned long>(num_sites),
+			 static_cast<unsigned long>(interval));
+
+	for (size_t i = 0; i < std::min(num_sites, MAX_DUMP_SITES); ++i) {
+		log_site(sites[i]);
+	}
+	if (num_sites > MAX_DUMP_SITES) {
+		LOG_INFO("heap profile: %lu smaller sites not shown",
+				 static_cast<unsigned long>(num_sites - MAX_DUMP_SITES));
+	}
+}
+
+} // namespace kernel::memory::heap_profile
+
+#endif // KERNEL_HEAP_PROFILE_ENABLED
@@ -0,0 +1,105 @@
+/**
+ * @file memory/heap_profile.hpp
+ * @brief Sampling profile of the live slab heap, by allocation site
+ *
+ * KERNEL_HEAP_DEBUG can name the site of every live byte, but it pays for a
+ * record per allocation. This profiler records only about one allocation per
+ * DEFAULT_SAMPLE_INTERVAL bytes handed out. The gap before the next sample
+ * is drawn at random so that a periodic allocation pattern cannot slip
+ * between samples. Each sample keeps the allocation's return address
+ * stack and a weight: the bytes allocated since the previous
+ * sample, which the sample stands for. Summing the weights of the samples
+ * still live estimates the live heap per call stack.
+ *
+ * On an unsampled allocation alloc() only adds to a byte counter. free()
+ * does one probe of a fixed-size hash table, and skips even that while no
+ * sample is live. The cost is low enough to stay on in production images;
+ * pass -DKERNEL_HEAP_PROFILE=OFF to compile it out.
+ *
+ * The idle task calls dump() every DUMP_INTERVAL_SEC. It prints one line per
+ * call stack over serial, largest first:
+ *
+ *   heap profile: 3072 KiB in 6 samples at 0x10a2f3 0x10c881 0x1042b0
+ *
+ * The addresses are call instructions (return address - 1), so
+ * `llvm-addr2line -fipe build/UchosKernel 0x10a2f3 0x10c881 0x1042b0` names
+ * the allocation site and its callers. Stacks are walked through frame
+ * pointers and stop at MAX_FRAMES.
+ *
+ * When the option is OFF this header is empty.
+ */
+
+#pragma once
+
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+
+#include <cstddef>
+#include <cstdint>
+
+namespace kernel::memory::heap_profile
+{
+
+/// Mean number of bytes allocated between two samples
+constexpr size_t DEFAULT_SAMPLE_INTERVAL = 512 * 1024;
+
+/// Return addresses kept per sample, innermost (the alloc() caller) first
+constexpr size_t MAX_FRAMES = 8;
+
+/// Samples that can be live at once; later samples are dropped until some
+/// are freed
+constexpr size_t MAX_LIVE_SAMPLES = 256;
+
+/// Seconds between two dumps from the idle task
+constexpr uint64_t DUMP_INTERVAL_SEC = 60;
+
+/**
+ * @brief Sampler counters
+ */
+struct Stats {
+	size_t live_samples;  ///< Sampled objects not freed yet
+	size_t live_bytes;	  ///< Estimated live heap: sum of their weights
+	size_t total_samples; ///< Samples taken since boot
+	size_t dropped;		  ///< Samples lost because the table was full
+};
+
+/**
+ * @brief Count an allocation and sample it if its turn has come
+ *
+ * Called by alloc() with the pointer it returns. Takes the caller's stack
+ * through frame pointers, so it must be called from alloc() itself.
+ *
+ * @param addr Payload pointer handed to the caller
+ * @param size Bytes the caller asked for
+ */
+void on_alloc(void* addr, size_t size);
+
+/**
+ * @brief Forget @p addr if it was sampled
+ * @param addr Pointer passed to free()
+ */
+void on_free(void* addr);
+
+/**
+ * @brief Stack recorded for a live sample
+ * @param addr Payload pointer
+ * @param frames Receives up to MAX_FRAMES call sites
+ * @return Number of frames written; 0 if @p addr is not sampled
+ */
+size_t sampled_frames(const void* addr, uintptr_t* frames);
+
+/**
+ * @brief Change the mean sampling interval
+ * @param bytes Mean bytes between samples; 1 samples every allocation and
+ * 0 stops sampling. Samples already taken stay.
+ */
+void set_sample_interval(size_t bytes);
+
+/// @brief Snapshot of the sampler counters
+Stats stats();
+
+/// @brief Log the live samples grouped by call stack
+void dump();
+
+} // namespace kernel::memory::heap_profile
+
+#endif // KERNEL_HEAP_PROFILE_ENABLED
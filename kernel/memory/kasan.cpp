@@ -0,0 +1,291 @@
+/**
+ * @file memory/kasan.cpp
+ * @brief Runtime of the KASAN-style shadow checker
+ *
+ * The whole translation unit is empty unless KERNEL_KASAN_ENABLED is set.
+ * It is itself built without -fsanitize=kernel-address (memory/CMakeLists.txt)
+ * so that the checks never recurse into themselves.
+ */
+
+#include "memory/kasan.hpp"
+
+#ifdef KERNEL_KASAN_ENABLED
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "log/log.hpp"
+#include "mem_ops.hpp"
+#include "memory/bootstrap_allocator.hpp"
+#include "memory/page.hpp"
+
+namespace kernel::memory::kasan
+{
+namespace
+{
+
+// Shadow byte of address a is shadow[a >> GRANULE_SHIFT], for a < shadow_end
+uint8_t* shadow = nullptr;
+uintptr_t shadow_end = 0;
+
+Stats g_stats = { 0, 0, 0 };
+
+// Depth of nested ExpectedViolation scopes currently alive
+int g_expected_violations = 0;
+
+// Set while a report is logged: the logging code is instrumented too
+bool g_reporting = false;
+
+uintptr_t granule_down(uintptr_t addr) { return addr & ~(GRANULE_SIZE - 1); }
+
+uintptr_t granule_up(uintptr_t addr)
+{
+	return (addr + GRANULE_SIZE - 1) & ~(GRANULE_SIZE - 1);
+}
+
+// First byte of [addr, end) the shadow forbids
+bool find_bad(uintptr_t addr, uintptr_t end, uintptr_t* bad)
+{
+	for (uintptr_t a = addr; a < end; a = granule_down(a) + GRANULE_SIZE) {
+		const auto value = static_cast<int8_t>(shadow[a >> GRANULE_SHIFT]);
+		if (value == 0) {
+			continue;
+		}
+
+		if (value < 0) {
+			*bad = a;
+			return true;
+		}
+
+		// Only the first value bytes of this granule are addressable
+		const uintptr_t usable_end = granule_down(a) + value;
+		if (std::min(end, granule_down(a) + GRANULE_SIZE) > usable_end) {
+			*bad = std::max(a, usable_end);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void check_access(uintptr_t addr, size_t size, bool write, void* caller)
+{
+	if (shadow == nullptr || g_reporting || size == 0 || addr >= shadow_end) {
+		return;
+	}
+
+	const uintptr_t end = size > shadow_end - addr ? shadow_end : addr + size;
+	uintptr_t bad;
+	if (!find_bad(addr, end, &bad)) {
+		return;
+	}
+
+	const bool freed = shadow[bad >> GRANULE_SHIFT] == SLAB_FREE;
+	if (freed) {
+		++g_stats.use_after_free;
+	} else {
+		++g_stats.out_of_bounds;
+	}
+
+	if (g_expected_violations == 0) {
+		g_reporting = true;
+		LOG_ERROR("kasan: %s: %s of %lu bytes at %p (first bad byte %p) from %p",
+				  freed ? "use-after-free" : "out-of-bounds",
+				  write ? "write" : "read", static_cast<unsigned long>(size),
+				  reinterpret_cast<void*>(addr), reinterpret_cast<void*>(bad),
+				  caller);
+		g_reporting = false;
+	}
+}
+
+} // namespace
+
+void initialize()
+{
+	g_stats = { 0, 0, 0 };
+	g_expected_violations = 0;
+
+	const uintptr_t covered = boot_allocator->end_index() * PAGE_SIZE;
+	const size_t shadow_bytes = covered >> GRANULE_SHIFT;
+	void* mem = boot_allocator->allocate(shadow_bytes);
+	if (mem == nullptr) {
+		LOG_ERROR("kasan: no memory for a %lu KiB shadow, checks are off",
+				  static_cast<unsigned long>(shadow_bytes / 1024));
+		return;
+	}
+
+	clear_pages(mem, pages_for_bytes(shadow_bytes));
+	shadow = static_cast<uint8_t*>(mem);
+	shadow_end = covered;
+
+	LOG_INFO("kasan: %lu KiB shadow covers %lu MiB",
+			 static_cast<unsigned long>(shadow_bytes / 1024),
+			 static_cast<unsigned long>(covered / 1024 / 1024));
+}
+
+void poison(const void* addr, size_t size, uint8_t value)
+{
+	const auto start = reinterpret_cast<uintptr_t>(addr);
+	if (shadow == nullptr || start >= shadow_end) {
+		return;
+	}
+
+	const uintptr_t end = std::min(start + size, shadow_end);
+	memset(shadow + (start >> GRANULE_SHIFT), value,
+		   (end - start) >> GRANULE_SHIFT);
+}
+
+void unpoison(const void* addr, size_t size)
+{
+	const auto start = reinterpret_cast<uintptr_t>(addr);
+	if (shadow == nullptr || start >= shadow_end) {
+		return;
+	}
+
+	const uintptr_t end = std::min(start + size, shadow_end);
+	memset(shadow + (start >> GRANULE_SHIFT), 0, (end - start) >> GRANULE_SHIFT);
+	if (end % GRANULE_SIZE != 0) {
+		shadow[end >> GRANULE_SHIFT] = end % GRANULE_SIZE;
+	}
+}
+
+void on_alloc(void* raw, size_t object_size, void* user, size_t user_size)
+{
+	//   [raw, user)                      alignment padding: redzone
+	//   [user, user + user_size)         payload
+	//   [granule_up(payload end), end)   tail redzone (>= REDZONE_SIZE)
+	const auto base = reinterpret_cast<uintptr_t>(raw);
+	const auto start = reinterpret_cast<uintptr_t>(user);
+	const uintptr_t tail = granule_up(start + user_size);
+
+	poison(raw, start - base, SLAB_REDZONE);
+	unpoison(user, user_size);
+	poison(reinterpret_cast<void*>(tail), base + object_size - tail, SLAB_REDZONE);
+}
+
+bool check_free(void* user, void* caller)
+{
+	const auto addr = reinterpret_cast<uintptr_t>(user);
+	if (shadow == nullptr || addr >= shadow_end) {
+		return true;
+	}
+
+	if (addr % GRANULE_SIZE == 0 &&
+		static_cast<int8_t>(shadow[addr >> GRANULE_SHIFT]) >= 0) {
+		return true;
+	}
+
+	++g_stats.invalid_free;
+	if (g_expected_violations == 0) {
+		LOG_ERROR("kasan: invalid or double free of %p (freed from %p)", user,
+				  caller);
+	}
+
+	return false;
+}
+
+Stats stats() { return g_stats; }
+
+ExpectedViolation::ExpectedViolation() { ++g_expected_violations; }
+
+ExpectedViolation::~ExpectedViolation() { --g_expected_violations; }
+
+} // namespace kernel::memory::kasan
+
+// Entry points the compiler calls from instrumented code. The access size is
+// part of the name for the common sizes and an argument otherwise.
+// NOLINTBEGIN(readability-identifier-naming): names are fixed by the compiler
+using kernel::memory::kasan::check_access;
+
+extern "C" void __asan_load1_noabort(uintptr_t addr)
+{
+	check_access(addr, 1, false, __builtin_return_address(0));
+}
+
+extern "C" void __asan_load2_noabort(uintptr_t addr)
+{
+	check_access(addr, 2, false, __builtin_return_address(0));
+}
+
+extern "C" void __asan_load4_noabort(uintptr_t addr)
+{
+	check_access(addr, 4, false, __builtin_return_address(0));
+}
+
+extern "C" void __asan_load8_noabort(uintptr_t addr)
+{
+	check_access(addr, 8, false, __builtin_return_address(0));
+}
+
+extern "C" void __asan_load16_noabort(uintptr_t addr)
+{
+	check_access(addr, 16, false, __builtin_return_address(0));
+}
+
+extern "C" void __asan_loadN_noabort(uintptr_t addr, size_t size)
+{
+	check_access(addr, size, false, __builtin_return_address(0));
+}
+
+extern "C" void __asan_store1_noabort(uintptr_t addr)
+{
+	check_access(addr, 1, true, __builtin_return_address(0));
+}
+
+extern "C" void __asan_store2_noabort(uintptr_t addr)
+{
+	check_access(addr, 2, true, __builtin_return_address(0));
+}
+
+extern "C" void __asan_store4_noabort(uintptr_t addr)
+{
+	check_access(addr, 4, true, __builtin_return_address(0));
+}
+
+extern "C" void __asan_store8_noabort(uintptr_t addr)
+{
+	check_access(addr, 8, true, __builtin_return_address(0));
+}
+
+extern "C" void __asan_store16_noabort(uintptr_t addr)
+{
+	check_access(addr, 16, true, __builtin_return_address(0));
+}
+
+extern "C" void __asan_storeN_noabort(uintptr_t addr, size_t size)
+{
+	check_access(addr, size, true, __builtin_return_address(0));
+}
+
+// Struct copies and other memory intrinsics in instrumented code
+extern "C" void* __asan_memcpy(void* dst, const void* src, size_t n)
+{
+	check_access(reinterpret_cast<uintptr_t>(src), n, false,
+				 __builtin_return_address(0));
+	check_access(reinterpret_cast<uintptr_t>(dst), n, true,
+				 __builtin_return_address(0));
+	return memcpy(dst, src, n);
+}
+
+extern "C" void* __asan_memmove(void* dst, const void* src, size_t n)
+{
+	check_access(reinterpret_cast<uintptr_t>(src), n, false,
+				 __builtin_return_address(0));
+	check_access(reinterpret_cast<uintptr_t>(dst), n, true,
+				 __builtin_return_address(0));
+	return memmove(dst, src, n);
+}
+
+extern "C" void* __asan_memset(void* dst, int c, size_t n)
+{
+	check_access(reinterpret_cast<uintptr_t>(dst), n, true,
+				 __builtin_return_address(0));
+	return memset(dst, c, n);
+}
+
+// Only stack instrumentation has state to unwind here, and it is off
+extern "C" void __asan_handle_no_return() {}
+// NOLINTEND(readability-identifier-naming)
+
+#endif // KERNEL_KASAN_ENABLED
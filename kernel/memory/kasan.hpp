@@ -0,0 +1,122 @@
+/**
+ * @file memory/kasan.hpp
+ * @brief Shadow-memory checker for slab allocations (KASAN-style)
+ *
+ * An alternative to KERNEL_HEAP_DEBUG that catches heap bugs at the faulting
+ * access instead of at free() or at the next reuse. With the KERNEL_KASAN
+ * CMake option the kernel is built with -fsanitize=kernel-address, which
+ * makes the compiler call __asan_load<N>_noabort / __asan_store<N>_noabort
+ * before every memory access; this file's runtime answers them from a shadow
+ * map holding one byte per 8-byte granule of physical memory:
+ *
+ *   - 0           : all 8 bytes addressable
+ *   - 1..7        : only the first k bytes addressable
+ *   - SLAB_FREE   : object free, in quarantine or never handed out
+ *   - SLAB_REDZONE: slack after (or alignment padding before) a payload
+ *
+ * The shadow covers all RAM the bootstrap allocator manages, since slab
+ * objects can come from anywhere in it. Memory the slab allocator never
+ * touched keeps a zero shadow and is not checked. Freed objects sit in a
+ * quarantine (memory/slab.cpp) before they can be reused, so a use after
+ * free keeps hitting SLAB_FREE shadow for a while.
+ *
+ * Per allocation the cost is a few shadow writes. There is no side table.
+ * Underflow is caught too: the granules before an object are the previous
+ * slot's redzone or free shadow.
+ *
+ * When the option is OFF this header is empty.
+ */
+
+#pragma once
+
+#ifdef KERNEL_KASAN_ENABLED
+
+#include <cstddef>
+#include <cstdint>
+
+namespace kernel::memory::kasan
+{
+
+/// Bytes of memory described by one shadow byte
+constexpr size_t GRANULE_SIZE = 8;
+constexpr size_t GRANULE_SHIFT = 3;
+
+/// Minimum redzone after every allocation, added before size-class rounding
+constexpr size_t REDZONE_SIZE = 16;
+
+constexpr uint8_t SLAB_FREE = 0xFB;
+constexpr uint8_t SLAB_REDZONE = 0xFC;
+
+/**
+ * @brief Running counts of the violations detected since boot
+ */
+struct Stats {
+	size_t out_of_bounds;  ///< Access to a redzone or past a partial granule
+	size_t use_after_free; ///< Access to a free or quarantined object
+	size_t invalid_free;   ///< free() of a pointer that is not a live payload
+};
+
+/**
+ * @brief Allocate and clear the shadow map
+ *
+ * Called from initialize_allocators() while the bootstrap allocator is still
+ * up. Accesses are not checked before this.
+ */
+void initialize();
+
+/**
+ * @brief Mark [addr, addr + size) unaddressable
+ * @param addr Start, GRANULE_SIZE aligned
+ * @param size Multiple of GRANULE_SIZE
+ * @param value SLAB_FREE or SLAB_REDZONE
+ */
+void poison(const void* addr, size_t size, uint8_t value);
+
+/**
+ * @brief Mark [addr, addr + size) addressable
+ * @param addr Start, GRANULE_SIZE aligned
+ * @param size Any size; a partial last granule is encoded as such
+ */
+void unpoison(const void* addr, size_t size);
+
+/**
+ * @brief Lay out the shadow of an object alloc() is handing out
+ *
+ * The payload [user, user + user_size) becomes addressable; the rest of
+ * the object, before and after it, becomes redzone.
+ *
+ * @param raw Slab object base
+ * @param object_size Object size of the owning cache
+ * @param user Payload pointer returned to the caller
+ * @param user_size Bytes the caller asked for
+ */
+void on_alloc(void* raw, size_t object_size, void* user, size_t user_size);
+
+/**
+ * @brief Check a pointer passed to free()
+ * @param user Pointer passed to free()
+ * @param caller __builtin_return_address(0) captured in free()
+ * @return false if @p user is free already or is not the start of a payload
+ * (the violation has been reported)
+ */
+bool check_free(void* user, void* caller);
+
+/// @brief Snapshot of the violation counters
+Stats stats();
+
+/**
+ * @brief Suppress violation LOG_ERROR output for deliberate test faults
+ *
+ * While at least one instance is alive, violations still update stats()
+ * but are not logged.
+ */
+class ExpectedViolation
+{
+public:
+	ExpectedViolation();
+	~ExpectedViolation();
+};
+
+} // namespace kernel::memory::kasan
+
+#endif // KERNEL_KASAN_ENABLED
@@ -0,0 +1,262 @@
+#include "memory/kernel_stack.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <libs/common/types.hpp>
+#include "interrupt/irq_guard.hpp"
+#include "log/log.hpp"
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/slab.hpp"
+#include "memory/tlb.hpp"
+#include "memory/vaddr_allocator.hpp"
+
+namespace kernel::memory
+{
+
+namespace
+{
+using kernel::interrupt::IrqGuard;
+
+// Page offsets inside a slot (see the file comment of kernel_stack.hpp)
+constexpr size_t STACK_OFFSET = KERNEL_STACK_SLOT_PAGES - KERNEL_STACK_PAGES;
+constexpr size_t GUARD_OFFSET = STACK_OFFSET - 1;
+constexpr size_t FAULT_STACK_OFFSET = GUARD_OFFSET - FAULT_STACK_PAGES;
+
+constexpr uint64_t SLOT_SIZE = KERNEL_STACK_SLOT_PAGES * PAGE_SIZE;
+
+static_assert((KERNEL_STACK_SLOT_PAGES & (KERNEL_STACK_SLOT_PAGES - 1)) == 0);
+static_assert(STACK_OFFSET > FAULT_STACK_PAGES + 1,
+			  "a slot starts with at least one unmapped page");
+static_assert(KERNEL_STACK_INITIAL_PAGES <= KERNEL_STACK_PAGES);
+
+VaddrAllocator stack_space{ KERNEL_STACK_WINDOW_BASE, KERNEL_STACK_WINDOW_END };
+
+page_table_entry* window_pdpt = nullptr;
+
+uint64_t slot_of(uint64_t addr) { return addr & ~(SLOT_SIZE - 1); }
+
+uint64_t page_in_slot(uint64_t slot, size_t offset)
+{
+	return slot + offset * PAGE_SIZE;
+}
+
+// Leaf entry of a window address. The tables down to it are created when
+// create is set; nullptr if one is missing or could not be allocated.
+page_table_entry* window_pte(uint64_t addr, bool create)
+{
+	const vaddr_t v{ addr };
+	page_table_entry* table = window_pdpt;
+	for (int level = 3; level > 1; --level) {
+		page_table_entry& entry = table[v.part(level)];
+		if (!entry.bits.present) {
+			if (!create) {
+				return nullptr;
+			}
+
+			page_table_entry* next = new_page_table();
+			if (next == nullptr) {
+				return nullptr;
+			}
+			entry.data = reinterpret_cast<uint64_t>(next) | PTE_KERNEL_FLAGS;
+		}
+		table = entry.get_next_level_table();
+	}
+
+	return &table[v.part(1)];
+}
+
+bool is_backed(uint64_t addr)
+{
+	const page_table_entry* pte = window_pte(addr, false);
+	return pte != nullptr && pte->bits.present;
+}
+
+// Back the pages of [addr, addr + num_pages) that are not yet, with zeroed
+// frames
+error_t map_pages(uint64_t addr, size_t num_pages, int flags = ALLOC_ZEROED)
+{
+	for (size_t i = 0; i < num_pages; ++i) {
+		page_table_entry* pte = window_pte(addr + i * PAGE_SIZE, true);
+		if (pte == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+		if (pte->bits.present) {
+			continue;
+		}
+
+		void* frame;
+		ALLOC_OR_RETURN_ERROR(frame, PAGE_SIZE, flags);
+		pte->data = reinterpret_cast<uint64_t>(frame) | PTE_KERNEL_FLAGS;
+	}
+
+	return OK;
+}
+
+void unmap_slot(uint64_t slot)
+{
+	void* frames[KERNEL_STACK_SLOT_PAGES];
+	size_t num_frames = 0;
+	for (size_t i = 0; i < KERNEL_STACK_SLOT_PAGES; ++i) {
+		page_table_entry* pte = window_pte(page_in_slot(slot, i), false);
+		if (pte == nullptr || !pte->bits.present) {
+			continue;
+		}
+
+		frames[num_frames++] = pte->get_next_level_table();
+		pte->data = 0;
+	}
+
+	// The frames are reused only once no address space can reach them
+	flush_kernel_range(slot, KERNEL_STACK_SLOT_PAGES);
+	for (size_t i = 0; i < num_frames; ++i) {
+		free(frames[i]);
+	}
+}
+} // namespace
+
+void initialize_kernel_stacks()
+{
+	window_pdpt = new_page_table();
+	if (window_pdpt == nullptr) {
+		LOG_ERROR("failed to allocate the kernel stack window");
+		return;
+	}
+
+	const vaddr_t base{ KERNEL_STACK_WINDOW_BASE };
+	get_active_page_table()[base.part(4)].data =
+			reinterpret_cast<uint64_t>(window_pdpt) | PTE_KERNEL_FLAGS;
+}
+
+uint64_t* alloc_kernel_stack()
+{
+	if (window_pdpt == nullptr) {
+		return nullptr;
+	}
+
+	const IrqGuard guard;
+	const uint64_t slot =
+			stack_space.allocate(KERNEL_STACK_SLOT_PAGES, KERNEL_STACK_SLOT_PAGES);
+	if (slot == 0) {
+		return nullptr;
+	}
+
+	// The top page of each stack; the rest is backed as it is reached
+	const uint64_t fault_stack_top = page_in_slot(slot, GUARD_OFFSET - 1);
+	const uint64_t initial = page_in_slot(
+			slot, KERNEL_STACK_SLOT_PAGES - KERNEL_STACK_INITIAL_PAGES);
+	if (IS_ERR(map_pages(fault_stack_top, 1)) ||
+		IS_ERR(map_pages(initial, KERNEL_STACK_INITIAL_PAGES))) {
+		unmap_slot(slot);
+		stack_space.release(slot, KERNEL_STACK_SLOT_PAGES);
+		return nullptr;
+	}
+
+	return reinterpret_cast<uint64_t*>(page_in_slot(slot, STACK_OFFSET));
+}
+
+void free_kernel_stack(uint64_t* stack)
+{
+	if (stack == nullptr) {
+		return;
+	}
+
+	const IrqGuard guard;
+	const uint64_t slot = slot_of(reinterpret_cast<uint64_t>(stack));
+	unmap_slot(slot);
+	if (IS_ERR(stack_space.release(slot, KERNEL_STACK_SLOT_PAGES))) {
+		LOG_ERROR("failed to release kernel stack slot %p",
+				  reinterpret_cast<void*>(slot));
+	}
+}
+
+error_t copy_kernel_stack(uint64_t* dst, const uint64_t* src)
+{
+	const IrqGuard guard;
+	const auto dst_addr = reinterpret_cast<uint64_t>(dst);
+	const auto src_addr = reinterpret_cast<uint64_t>(src);
+	for (size_t i = 0; i < KERNEL_STACK_PAGES; ++i) {
+		const uint64_t offset = i * PAGE_SIZE;
+		if (!is_backed(src_addr + offset)) {
+			continue;
+		}
+
+		RETURN_IF_ERROR(map_pages(dst_addr + offset, 1));
+		memcpy(reinterpret_cast<void*>(dst_addr + offset),
+			   reinterpret_cast<const void*>(src_addr + offset), PAGE_SIZE);
+	}
+
+	return OK;
+}
+
+void* fault_stack_top(const uint64_t* stack)
+{
+	const uint64_t slot = slot_of(reinterpret_cast<uint64_t>(stack));
+	return reinterpret_cast<void*>(page_in_slot(slot, GUARD_OFFSET));
+}
+
+bool is_kernel_stack_guard(uint64_t addr)
+{
+	return is_kernel_stack_addr(addr) &&
+		   addr - slot_of(addr) >= GUARD_OFFSET * PAGE_SIZE &&
+		   addr - slot_of(addr) < STACK_OFFSET * PAGE_SIZE;
+}
+
+error_t grow_kernel_stack(uint64_t fault_addr)
+{
+	const IrqGuard guard;
+	const uint64_t slot = slot_of(fault_addr);
+	const size_t offset = (fault_addr - slot) / PAGE_SIZE;
+
+	// A slot belongs to a task while the top page of its stack is backed
+	const bool live = window_pdpt != nullptr &&
+					  is_backed(page_in_slot(slot, KERNEL_STACK_SLOT_PAGES - 1));
+	if (live && offset == GUARD_OFFSET) {
+		LOG_ERROR("kernel stack overflow: %p is the guard page",
+				  reinterpret_cast<void*>(fault_addr));
+		return ERR_PAGE_NOT_PRESENT;
+	}
+
+	if (!live || offset < FAULT_STACK_OFFSET) {
+		LOG_ERROR("access to unmapped kernel stack page %p",
+				  reinterpret_cast<void*>(fault_addr));
+		return ERR_PAGE_NOT_PRESENT;
+	}
+
+	// Back down from the top of whichever stack the page is in. This runs
+	// on the page fault IST, where allocating must not sleep.
+	const size_t end = offset > GUARD_OFFSET ? KERNEL_STACK_SLOT_PAGES : GUARD_OFFSET;
+	return map_pages(page_in_slot(slot, offset), end - offset,
+					 ALLOC_ZEROED | ALLOC_ATOMIC);
+}
+
+KernelStackUsage kernel_stack_usage(const uint64_t* stack)
+{
+	KernelStackUsage usage = { 0, 0 };
+	if (stack == nullptr) {
+		return usage;
+	}
+
+	const IrqGuard guard;
+	const auto base = reinterpret_cast<uint64_t>(stack);
+	const uint64_t top = base + KERNEL_STACK_PAGES * PAGE_SIZE;
+	uint64_t lowest = top;
+	for (uint64_t page = top - PAGE_SIZE; page >= base; page -= PAGE_SIZE) {
+		if (!is_backed(page)) {
+			break;
+		}
+		++usage.backed_pages;
+		lowest = page;
+	}
+
+	const auto* word = reinterpret_cast<const uint64_t*>(lowest);
+	const auto* end = reinterpret_cast<const uint64_t*>(top);
+	while (word < end && *word == 0) {
+		++word;
+	}
+	usage.peak_bytes = top - reinterpret_cast<uint64_t>(word);
+
+	return usage;
+}
+
+} // namespace kernel::memory
@@ -0,0 +1,131 @@
+/**
+ * @file memory/kernel_stack.hpp
+ * @brief Virtually mapped kernel stacks with guard pages
+ *
+ * Task kernel stacks live in a window of the kernel half of their own
+ * (KERNEL_STACK_WINDOW_BASE..KERNEL_STACK_WINDOW_END) instead of the
+ * identity map, so each can have an unmapped guard page below it. Every
+ * task gets a slot of KERNEL_STACK_SLOT_PAGES pages, laid out from the top:
+ *
+ *   - KERNEL_STACK_PAGES of stack, of which only the top
+ *     KERNEL_STACK_INITIAL_PAGES are backed when the task is created. A
+ *     kernel-mode fault below them backs the pages down to the faulting one
+ *     (grow_kernel_stack()).
+ *   - One guard page that is never mapped: running into it is reported as a
+ *     stack overflow and the kernel panics, where a contiguous slab stack
+ *     used to overwrite whatever object sat below it.
+ *   - FAULT_STACK_PAGES of stack, the task's fault stack, grown the same way
+ *     from its top page. The scheduler points RSP0 at the running task's,
+ *     so faults and interrupts from user mode land there rather than on a
+ *     stack shared by every task, and a user-mode page fault may sleep on it
+ *     (swap-in).
+ *   - Unmapped pages up to the slot below, catching fault stack overflows.
+ *
+ * A fault on a stack page cannot push its frame on that stack, so page
+ * faults enter on a small per-CPU stack (IST_FOR_PAGE_FAULT). The entry
+ * (on_page_fault in interrupt/handler.asm) backs stack pages right there
+ * and returns; any other fault moves to the stack it interrupted, or to
+ * RSP0 for user mode, before it is handled, so faults nest as usual.
+ *
+ * The window has one PDPT, installed in the boot table before the first task
+ * is created, so every address space shares the mappings below it.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <libs/common/types.hpp>
+
+namespace kernel::memory
+{
+
+/// PML4 slot 255, the last of the kernel half
+constexpr uint64_t KERNEL_STACK_WINDOW_BASE = 0x0000'7f80'0000'0000;
+constexpr uint64_t KERNEL_STACK_WINDOW_END = 0x0000'8000'0000'0000;
+
+/// Size of a task's kernel stack when fully grown
+constexpr size_t KERNEL_STACK_PAGES = 8;
+
+/// Pages of the kernel stack backed when the task is created
+constexpr size_t KERNEL_STACK_INITIAL_PAGES = 2;
+
+/// Size of a task's fault stack when fully grown
+constexpr size_t FAULT_STACK_PAGES = 4;
+
+/// Virtual pages one task takes in the window (a power of two)
+constexpr size_t KERNEL_STACK_SLOT_PAGES = 16;
+
+/**
+ * @brief What a kernel stack has used so far
+ */
+struct KernelStackUsage {
+	size_t backed_pages; ///< Stack pages mapped, the initial ones included
+	size_t peak_bytes;	 ///< Deepest the stack has been, from its top
+};
+
+inline bool is_kernel_stack_addr(uint64_t addr)
+{
+	return addr >= KERNEL_STACK_WINDOW_BASE && addr < KERNEL_STACK_WINDOW_END;
+}
+
+/**
+ * @brief Install the window's PDPT in the active (boot) root table
+ *
+ * Runs once the slab allocator is up and before the first task copies the
+ * kernel half (copy_kernel_space()).
+ */
+void initialize_kernel_stacks();
+
+/**
+ * @brief Set up a kernel stack and its fault stack in a new slot
+ * @return Lowest address of the stack (its top is KERNEL_STACK_PAGES pages
+ * higher), or nullptr when the window or memory is exhausted
+ */
+uint64_t* alloc_kernel_stack();
+
+/**
+ * @brief Unmap a slot and free the frames backing it
+ * @param stack Value returned by alloc_kernel_stack() (nullptr is ignored)
+ */
+void free_kernel_stack(uint64_t* stack);
+
+/**
+ * @brief Give dst the backed pages of src, with the same contents (fork)
+ * @return OK, or ERR_NO_MEMORY
+ */
+error_t copy_kernel_stack(uint64_t* dst, const uint64_t* src);
+
+/**
+ * @brief Initial stack pointer of the fault stack of a kernel stack
+ */
+void* fault_stack_top(const uint64_t* stack);
+
+/**
+ * @brief Whether addr is in the guard page below some kernel stack
+ */
+bool is_kernel_stack_guard(uint64_t addr);
+
+/**
+ * @brief Back the kernel or fault stack page a kernel-mode fault hit
+ *
+ * Pages between the faulting one and the backed part are backed too. Runs
+ * on the page fault IST, so it must not fault or sleep itself.
+ *
+ * @param fault_addr Faulting address, inside the window
+ * @return OK, or ERR_PAGE_NOT_PRESENT for the guard page (stack overflow),
+ * a slot no task owns or the unmapped bottom of a slot, or ERR_NO_MEMORY
+ */
+error_t grow_kernel_stack(uint64_t fault_addr);
+
+/**
+ * @brief High-water mark of a kernel stack
+ *
+ * Pages are zeroed when they are backed, so the deepest non-zero word is
+ * taken as the peak (zeros pushed below everything else are missed).
+ */
+KernelStackUsage kernel_stack_usage(const uint64_t* stack);
+
+} // namespace kernel::memory
@@ -0,0 +1,214 @@
+#include "memory/lz4.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace kernel::memory::lz4
+{
+namespace
+{
+
+constexpr size_t MIN_MATCH = 4;
+
+// The block format requires the last 5 bytes to be literals, and the last
+// match to start at least 12 bytes before the end
+constexpr size_t LAST_LITERALS = 5;
+constexpr size_t MATCH_FIND_LIMIT = 12;
+
+constexpr size_t MAX_OFFSET = 65535;
+
+// Length nibble value meaning "more length bytes follow"
+constexpr size_t RUN_MASK = 15;
+
+uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint32_t hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Bytes needed to encode a length of which the token holds the first 15
+size_t length_bytes(size_t n) { return n < RUN_MASK ? 0 : (n - RUN_MASK) / 255 + 1; }
+
+uint8_t* write_length(uint8_t* op, size_t n)
+{
+	for (n -= RUN_MASK; n >= 255; n -= 255) {
+		*op++ = 255;
+	}
+	*op++ = static_cast<uint8_t>(n);
+	return op;
+}
+
+// Append one sequence (a match of match_len at offset, or none when
+// match_len is 0) after the literals [anchor, ip). nullptr if it does not fit.
+uint8_t* emit(uint8_t* op,
+			  const uint8_t* op_end,
+			  const uint8_t* anchor,
+			  const uint8_t* ip,
+			  size_t offset,
+			  size_t match_len)
+{
+	const size_t literals = ip - anchor;
+	size_t needed = 1 + length_bytes(literals) + literals;
+	if (match_len != 0) {
+		needed += 2 + length_bytes(match_len - MIN_MATCH);
+	}
+	if (needed > static_cast<size_t>(op_end - op)) {
+		return nullptr;
+	}
+
+	uint8_t* token = op++;
+	*token = (literals < RUN_MASK ? literals : RUN_MASK) << 4;
+	if (literals >= RUN_MASK) {
+		op = write_length(op, literals);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+
+	if (match_len == 0) {
+		return op;
+	}
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	const size_t extra = match_len - MIN_MATCH;
+	*token |= extra < RUN_MASK ? extra : RUN_MASK;
+	if (extra >= RUN_MASK) {
+		op = write_length(op, extra);
+	}
+
+	return op;
+}
+
+// Length encoded after a token nibble; false if the block ends first
+bool read_length(const uint8_t*& ip, const uint8_t* ip_end, size_t* n)
+{
+	uint8_t byte;
+	do {
+		if (ip == ip_end) {
+			return false;
+		}
+		byte = *ip++;
+		*n += byte;
+	} while (byte == 255);
+
+	return true;
+}
+
+} // namespace
+
+size_t compress(const void* src, size_t len, void* dst, size_t capacity, Workspace& ws)
+{
+	if (len > MAX_INPUT_SIZE) {
+		return 0;
+	}
+
+	const auto* base = static_cast<const uint8_t*>(src);
+	const uint8_t* const end = base + len;
+	auto* op = static_cast<uint8_t*>(dst);
+	const uint8_t* const op_end = op + capacity;
+
+	const uint8_t* anchor = base;
+	if (len > MATCH_FIND_LIMIT) {
+		memset(ws.table, 0, sizeof(ws.table));
+
+		const uint8_t* const match_limit = end - LAST_LITERALS;
+		const uint8_t* ip = base;
+		while (ip < end - MATCH_FIND_LIMIT) {
+			const uint32_t sequence = read32(ip);
+			const uint32_t h = hash(sequence);
+			const uint8_t* ref = base + ws.table[h];
+			ws.table[h] = ip - base;
+
+			if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+				++ip;
+				continue;
+			}
+
+			size_t match_len = MIN_MATCH;
+			while (ip + match_len < match_limit && ip[match_len] == ref[match_len]) {
+				++match_len;
+			}
+
+			op = emit(op, op_end, anchor, ip, ip - ref, match_len);
+			if (op == nullptr) {
+				return 0;
+			}
+
+			ip += match_len;
+			anchor = ip;
+		}
+	}
+
+	op = emit(op, op_end, anchor, end, 0, 0);
+	if (op == nullptr) {
+		return 0;
+	}
+
+	return op - static_cast<uint8_t*>(dst);
+}
+
+bool decompress(const void* src, size_t len, void* dst, size_t out_len)
+{
+	const auto* ip = static_cast<const uint8_t*>(src);
+	const uint8_t* const ip_end = ip + len;
+	auto* const out = static_cast<uint8_t*>(dst);
+	uint8_t* op = out;
+	const uint8_t* const op_end = out + out_len;
+
+	while (ip < ip_end) {
+		const uint8_t token = *ip++;
+
+		size_t literals = token >> 4;
+		if (literals == RUN_MASK && !read_length(ip, ip_end, &literals)) {
+			return false;
+		}
+		if (literals > static_cast<size_t>(ip_end - ip) ||
+			literals > static_cast<size_t>(op_end - op)) {
+			return false;
+		}
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence has literals only
+		if (ip == ip_end) {
+			break;
+		}
+
+		if (ip_end - ip < 2) {
+			return false;
+		}
+		const size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > static_cast<size_t>(op - out)) {
+			return false;
+		}
+
+		size_t match_len = token & RUN_MASK;
+		if (match_len == RUN_MASK && !read_length(ip, ip_end, &match_len)) {
+			return false;
+		}
+		match_len += MIN_MATCH;
+		if (match_len > static_cast<size_t>(op_end - op)) {
+			return false;
+		}
+
+		// Byte by byte: a match may overlap the bytes it produces
+		const uint8_t* ref = op - offset;
+		for (size_t i = 0; i < match_len; ++i) {
+			op[i] = ref[i];
+		}
+		op += match_len;
+	}
+
+	return op == op_end;
+}
+
+} // namespace kernel::memory::lz4
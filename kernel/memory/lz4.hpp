@@ -0,0 +1,57 @@
+/**
+ * @file memory/lz4.hpp
+ * @brief LZ4 block compression for the swap store
+ *
+ * Produces and reads the standard LZ4 block format (no frame header): a
+ * series of sequences, each a token, literal bytes, a 16-bit offset and a
+ * match length. The compressor is the greedy single-hash variant, which
+ * trades some ratio for speed; it compresses a 4 KiB page in one pass with
+ * no allocation.
+ *
+ * @see https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace kernel::memory::lz4
+{
+
+/// Largest input compress() accepts: positions are kept as 16-bit values
+constexpr size_t MAX_INPUT_SIZE = 65535;
+
+constexpr size_t HASH_BITS = 12;
+
+/**
+ * @brief Scratch space of one compression: the last position seen per hash
+ *
+ * Callers that may compress concurrently need one each.
+ */
+struct Workspace {
+	uint16_t table[1UL << HASH_BITS];
+};
+
+/**
+ * @brief Compress src into dst
+ * @param src Input, at most MAX_INPUT_SIZE bytes
+ * @param len Input length
+ * @param dst Output buffer
+ * @param capacity Size of dst
+ * @param ws Scratch space
+ * @return Compressed length, or 0 if the result does not fit in capacity
+ */
+size_t compress(const void* src, size_t len, void* dst, size_t capacity, Workspace& ws);
+
+/**
+ * @brief Decompress a block that expands to exactly out_len bytes
+ * @param src Compressed block
+ * @param len Length of the block
+ * @param dst Output buffer of out_len bytes
+ * @param out_len Expected decompressed length
+ * @return false if the block is malformed or does not expand to out_len
+ */
+bool decompress(const void* src, size_t len, void* dst, size_t out_len);
+
+} // namespace kernel::memory::lz4
@@ -1,56 +1,182 @@
 #include "memory/page.hpp"
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
-#include <vector>
+#include <new>
+#include "log/log.hpp"
 #include "memory/bootstrap_allocator.hpp"
+#include "memory/slab.hpp"
 
 namespace kernel::memory
 {
 
-std::vector<Page> pages;
+PageRegion page_regions[MAX_PAGE_REGIONS];
+size_t num_page_regions = 0;
 
-void initialize_pages()
+namespace
+{
+
+const PageRegion* find_region(size_t pfn)
 {
-	const size_t memory_end_index = boot_allocator->end_index();
+	size_t lo = 0;
+	size_t hi = num_page_regions;
 
-	pages.resize(memory_end_index);
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const PageRegion& region = page_regions[mid];
 
-	for (size_t i = 0; i < memory_end_index; ++i) {
-		pages[i].set_ptr(reinterpret_cast<void*>(i * PAGE_SIZE));
-		if (boot_allocator->is_bit_set(i)) {
-			pages[i].set_used();
+		if (pfn < region.start_pfn) {
+			hi = mid;
+		} else if (pfn >= region.start_pfn + region.num_pages) {
+			lo = mid + 1;
 		} else {
-			pages[i].set_free();
+			return &region;
 		}
 	}
+
+	return nullptr;
 }
 
-Page* get_page(void* ptr)
+} // namespace
+
+static_assert(MAX_PAGE_REGIONS <= 256, "Page::region() holds 8 bits");
+
+size_t Page::index() const
 {
-	if (ptr == nullptr) {
-		return nullptr;
+	const PageRegion& region = page_regions[this->region()];
+	return region.start_pfn + static_cast<size_t>(this - region.pages);
+}
+
+MCache* Page::cache() const { return slab_ != nullptr ? slab_->cache() : nullptr; }
+
+void add_page_region(size_t start_pfn, size_t num_pages)
+{
+	if (num_pages == 0) {
+		return;
+	}
+
+	size_t end_pfn = start_pfn + num_pages;
+
+	// Find the insertion point and swallow every region the new range
+	// touches, so the table stays sorted and disjoint.
+	size_t pos = 0;
+	while (pos < num_page_regions &&
+		   page_regions[pos].start_pfn + page_regions[pos].num_pages < start_pfn) {
+		++pos;
+	}
+
+	size_t last = pos;
+	while (last < num_page_regions && page_regions[last].start_pfn <= end_pfn) {
+		start_pfn = std::min(start_pfn, page_regions[last].start_pfn);
+		end_pfn = std::max(end_pfn, page_regions[last].start_pfn +
+											page_regions[last].num_pages);
+		++last;
+	}
+
+	const size_t merged = last - pos;
+	if (merged == 0 && num_page_regions == MAX_PAGE_REGIONS) {
+		// Table full: widen a neighbour instead. This allocates descriptors
+		// for the hole in between, which is wasteful but still correct.
+		const size_t neighbour = pos == 0 ? 0 : pos - 1;
+		PageRegion& region = page_regions[neighbour];
+		const size_t region_end = region.start_pfn + region.num_pages;
+		region.start_pfn = std::min(region.start_pfn, start_pfn);
+		region.num_pages = std::max(region_end, end_pfn) - region.start_pfn;
+		return;
+	}
+
+	if (merged == 0) {
+		std::copy_backward(page_regions + pos, page_regions + num_page_regions,
+						   page_regions + num_page_regions + 1);
+		++num_page_regions;
+	} else if (merged > 1) {
+		std::copy(page_regions + last, page_regions + num_page_regions,
+				  page_regions + pos + 1);
+		num_page_regions -= merged - 1;
+	}
+
+	page_regions[pos] = { start_pfn, end_pfn - start_pfn, nullptr };
+}
+
+void initialize_pages()
+{
+	size_t total_pages = 0;
+	size_t metadata_bytes = 0;
+
+	// Allocate every array before reading the bitmap so that the metadata
+	// pages themselves are seen as used by whichever region covers them.
+	for (size_t r = 0; r < num_page_regions; ++r) {
+		PageRegion& region = page_regions[r];
+		const size_t bytes = region.num_pages * sizeof(Page);
+
+		auto* storage = boot_allocator->allocate(bytes);
+		if (storage == nullptr) {
+			LOG_ERROR("failed to allocate page metadata for region %lu", r);
+			continue;
+		}
+
+		region.pages = new (storage) Page[region.num_pages];
+		for (size_t i = 0; i < region.num_pages; ++i) {
+			region.pages[i].set_region(r);
+		}
+		metadata_bytes += pages_for_bytes(bytes) * PAGE_SIZE;
 	}
 
-	const size_t index = reinterpret_cast<uintptr_t>(ptr) / PAGE_SIZE;
-	if (index >= pages.size()) {
+	for (size_t r = 0; r < num_page_regions; ++r) {
+		PageRegion& region = page_regions[r];
+		if (region.pages == nullptr) {
+			continue;
+		}
+
+		// Descriptors start out free; only used runs are written, found a
+		// bitmap word at a time
+		const size_t end_pfn = region.start_pfn + region.num_pages;
+		size_t pfn = boot_allocator->find_next(region.start_pfn, end_pfn, true);
+		while (pfn < end_pfn) {
+			const size_t run_end = boot_allocator->find_next(pfn, end_pfn, false);
+			for (; pfn < run_end; ++pfn) {
+				region.pages[pfn - region.start_pfn].set_used();
+			}
+
+			pfn = boot_allocator->find_next(run_end, end_pfn, true);
+		}
+
+		total_pages += region.num_pages;
+	}
+
+	LOG_INFO("page metadata: %lu KiB for %lu pages in %lu regions (%lu bytes/page)",
+			 metadata_bytes / 1024, total_pages, num_page_regions, sizeof(Page));
+}
+
+Page* pfn_to_page(size_t pfn)
+{
+	const PageRegion* region = find_region(pfn);
+	if (region == nullptr || region->pages == nullptr) {
 		return nullptr;
 	}
 
-	return &pages[index];
+	return &region->pages[pfn - region->start_pfn];
 }
 
-void get_memory_usage(size_t* total_mem, size_t* used_mem)
+Page* get_page(void* ptr)
 {
-	size_t available_pages = 0;
+	if (ptr == nullptr) {
+		return nullptr;
+	}
 
-	for (const auto& page : pages) {
-		if (page.is_free()) {
-			available_pages++;
+	return pfn_to_page(reinterpret_cast<uintptr_t>(ptr) / PAGE_SIZE);
+}
+
+size_t total_ram_pages()
+{
+	size_t total_pages = 0;
+	for (size_t r = 0; r < num_page_regions; ++r) {
+		if (page_regions[r].pages != nullptr) {
+			total_pages += page_regions[r].num_pages;
 		}
 	}
 
-	*used_mem = (pages.size() - available_pages) * PAGE_SIZE;
-	*total_mem = pages.size() * PAGE_SIZE;
+	return total_pages;
 }
 
 } // namespace kernel::memory
@@ -7,7 +7,6 @@
 
 #include <cstddef>
 #include <cstdint>
-#include <vector>
 
 namespace kernel::memory
 {
@@ -39,12 +38,31 @@ constexpr size_t pages_for_bytes(size_t size)
 	return (size + PAGE_SIZE - 1) / PAGE_SIZE;
 }
 
+/**
+ * @brief What an accounted slab object starting on a page holds
+ *
+ * Set by the slab allocator for ALLOC_PAGE_TABLE / ALLOC_OOL allocations so
+ * free() can keep the matching usage counter in step without the caller's
+ * help.
+ */
+enum class PageUsage : uint8_t {
+	NONE,
+	PAGE_TABLE,
+	OOL,
+};
+
 /**
  * @brief Represents a single memory page in the system
  *
  * This class manages individual pages of memory, tracking their allocation
  * status and association with slab allocator structures. Pages can be free
  * or allocated to a specific cache/slab.
+ *
+ * One descriptor exists per physical frame, so the layout is kept to 16
+ * bytes: the frame address is derived from the descriptor's position in its
+ * PageRegion instead of being stored, the owning cache is reached through
+ * the slab, and the reference count and status share the second word. The
+ * status keeps the index of the descriptor's region, so the lookup is O(1).
  */
 class Page
 {
@@ -52,23 +70,16 @@ public:
 	/**
 	 * @brief Default constructor
 	 *
-	 * Initializes a page as free with no associated pointer.
-	 */
-	Page()
-		: status_{ 0 },
-		  cache_{ nullptr },
-		  slab_{ nullptr },
-		  ref_count_{ 0 },
-		  ptr_{ nullptr }
-	{
-	}
+	 * Initializes a page as free with no associated slab.
+	 */
+	Page() : slab_{ nullptr }, ref_count_{ 0 }, flags_{ 0 } {}
 
 	/**
-	 * @brief Get the page index based on its memory address
+	 * @brief Get the page frame number of this page
 	 *
-	 * @return size_t Page index calculated from the pointer address
+	 * @return size_t Physical address of the page divided by PAGE_SIZE
 	 */
-	size_t index() const { return reinterpret_cast<uintptr_t>(ptr_) / PAGE_SIZE; }
+	size_t index() const;
 
 	/**
 	 * @brief Check if the page is free
@@ -76,7 +87,7 @@ public:
 	 * @return true if the page is not allocated
 	 * @return false if the page is in use
 	 */
-	bool is_free() const { return status_ == 0; }
+	bool is_free() const { return (flags_ & FLAG_USED) == 0; }
 
 	/**
 	 * @brief Check if the page is in use
@@ -84,52 +95,56 @@ public:
 	 * @return true if the page is allocated
 	 * @return false if the page is free
 	 */
-	bool is_used() const { return status_ == 1; }
+	bool is_used() const { return (flags_ & FLAG_USED) != 0; }
 
 	/**
 	 * @brief Get the memory pointer for this page
 	 *
-	 * @return void* Pointer to the start of the page memory
+	 * @return void* Pointer to the start of the page memory (identity mapped)
 	 */
-	void* ptr() const { return ptr_; }
+	void* ptr() const { return reinterpret_cast<void*>(index() * PAGE_SIZE); }
 
 	/**
-	 * @brief Set the memory pointer for this page
-	 *
-	 * @param ptr Pointer to the start of the page memory
+	 * @brief Mark the page as free
 	 */
-	void set_ptr(void* ptr) { ptr_ = ptr; }
+	void set_free() { flags_ &= ~FLAG_USED; }
 
 	/**
-	 * @brief Mark the page as free
+	 * @brief Mark the page as used
 	 */
-	void set_free() { status_ = 0; }
+	void set_used() { flags_ |= FLAG_USED; }
 
 	/**
-	 * @brief Mark the page as used
+	 * @brief Get the accounting tag of the slab object starting here
 	 */
-	void set_used() { status_ = 1; }
+	PageUsage usage() const
+	{
+		return static_cast<PageUsage>((flags_ & USAGE_MASK) >> USAGE_SHIFT);
+	}
 
 	/**
-	 * @brief Associate this page with a cache
-	 *
-	 * @param cache Pointer to the cache this page belongs to
+	 * @brief Set the accounting tag of the slab object starting here
 	 */
-	void set_cache(MCache* cache) { cache_ = cache; }
+	void set_usage(PageUsage usage)
+	{
+		flags_ = (flags_ & ~USAGE_MASK) |
+				 (static_cast<uint32_t>(usage) << USAGE_SHIFT);
+	}
 
 	/**
-	 * @brief Associate this page with a slab
+	 * @brief Associate this page with a slab (nullptr to detach)
 	 *
-	 * @param slab Pointer to the slab this page belongs to
+	 * @param slab Pointer to the slab this page belongs to; the owning cache
+	 * is recorded in the slab itself
 	 */
 	void set_slab(MSlab* slab) { slab_ = slab; }
 
 	/**
 	 * @brief Get the cache this page belongs to
 	 *
-	 * @return MCache* Pointer to the associated cache, or nullptr
+	 * @return MCache* Pointer to the cache owning the page's slab, or nullptr
 	 */
-	MCache* cache() const { return cache_; }
+	MCache* cache() const;
 
 	/**
 	 * @brief Get the slab this page belongs to
@@ -138,6 +153,20 @@ public:
 	 */
 	MSlab* slab() const { return slab_; }
 
+	/**
+	 * @brief Get the index of the PageRegion this descriptor belongs to
+	 */
+	size_t region() const { return (flags_ & REGION_MASK) >> REGION_SHIFT; }
+
+	/**
+	 * @brief Record the PageRegion this descriptor belongs to
+	 */
+	void set_region(size_t region)
+	{
+		flags_ = (flags_ & ~REGION_MASK) |
+				 (static_cast<uint32_t>(region) << REGION_SHIFT);
+	}
+
 	/**
 	 * @brief Add a reference to this page (shared user mapping)
 	 */
@@ -166,26 +195,61 @@ public:
 	size_t ref_count() const { return ref_count_; }
 
 private:
-	int status_;	   ///< Page status: 0 = free, 1 = used
-	MCache* cache_;	   ///< Associated cache (for slab allocator)
-	MSlab* slab_;	   ///< Associated slab (for slab allocator)
-	size_t ref_count_; ///< Number of user mappings (CoW sharing)
-	void* ptr_;		   ///< Pointer to the page's memory
+	static constexpr uint32_t FLAG_USED = 1U << 0; ///< Frame is allocated
+	static constexpr uint32_t USAGE_SHIFT = 8;
+	static constexpr uint32_t USAGE_MASK = 0xffU << USAGE_SHIFT; ///< PageUsage
+	static constexpr uint32_t REGION_SHIFT = 16;
+	static constexpr uint32_t REGION_MASK = 0xffU << REGION_SHIFT; ///< region()
+
+	MSlab* slab_;		 ///< Associated slab (for slab allocator)
+	uint32_t ref_count_; ///< Number of user mappings (CoW sharing)
+	uint32_t flags_;	 ///< FLAG_* status bits
 };
 
+static_assert(sizeof(Page) <= 16, "Page descriptors must stay compact");
+
 /**
- * @brief Global vector containing all system pages
+ * @brief Page descriptors for one contiguous range of physical RAM
  *
- * This vector tracks all pages in the system, allowing for efficient
- * page lookup and management.
+ * Metadata is only allocated for RAM the firmware memory map reports, one
+ * array per region, so address-space holes and high-mapped memory cost
+ * nothing.
  */
-extern std::vector<Page> pages;
+struct PageRegion {
+	size_t start_pfn; ///< First page frame number covered
+	size_t num_pages; ///< Number of frames (and descriptors) in the region
+	Page* pages;	  ///< Descriptor array, indexed by pfn - start_pfn
+};
+
+/// Capacity of the region table; later ranges extend the last region once
+/// it is full (correct, just less sparse)
+constexpr size_t MAX_PAGE_REGIONS = 32;
+
+/**
+ * @brief Region table, sorted by start_pfn
+ *
+ * Only the first num_page_regions entries are valid.
+ */
+extern PageRegion page_regions[MAX_PAGE_REGIONS];
+extern size_t num_page_regions;
+
+/**
+ * @brief Record a range of physical RAM that needs page descriptors
+ *
+ * Called for every RAM descriptor of the firmware memory map before
+ * initialize_pages(). Adjacent and overlapping ranges are coalesced.
+ *
+ * @param start_pfn First page frame number of the range
+ * @param num_pages Number of frames in the range
+ */
+void add_page_region(size_t start_pfn, size_t num_pages);
 
 /**
  * @brief Initialize the page management system
  *
- * Sets up the global page vector and initializes all pages based on
- * available physical memory.
+ * Allocates one descriptor array per recorded PageRegion from the
+ * bootstrap allocator and initializes every page based on available
+ * physical memory. Logs the resulting metadata overhead.
  */
 void initialize_pages();
 
@@ -198,11 +262,16 @@ void initialize_pages();
 Page* get_page(void* ptr);
 
 /**
- * @brief Get current memory usage statistics
+ * @brief Get the page object for a page frame number
  *
- * @param[out] total_mem Total memory in bytes
- * @param[out] used_mem Used memory in bytes
+ * @param pfn Physical address divided by PAGE_SIZE
+ * @return Page* Pointer to the page object, or nullptr if pfn is not RAM
+ */
+Page* pfn_to_page(size_t pfn);
+
+/**
+ * @brief Number of frames covered by page descriptors (all RAM)
  */
-void get_memory_usage(size_t* total_mem, size_t* used_mem);
+size_t total_ram_pages();
 
 } // namespace kernel::memory
@@ -3,10 +3,22 @@
 #include <cstdint>
 #include <cstring>
 #include <libs/common/types.hpp>
+#include "../../UchLoaderPkg/memory_map.hpp"
+#include "bit_utils.hpp"
+#include "cpuid.hpp"
 #include "error.hpp"
 #include "log/log.hpp"
+#include "mem_ops.hpp"
+#include "memory/bootstrap_allocator.hpp"
+#include "memory/buddy_system.hpp"
+#include "memory/exec_image.hpp"
+#include "memory/kernel_stack.hpp"
 #include "memory/page.hpp"
 #include "memory/slab.hpp"
+#include "memory/swap.hpp"
+#include "memory/tlb.hpp"
+#include "memory/vaddr_allocator.hpp"
+#include "memory/vm_area.hpp"
 #include "paging_utils.h"
 
 namespace kernel::memory
@@ -14,33 +26,127 @@ namespace kernel::memory
 
 namespace
 {
-constexpr uint64_t PAGE_2MIB = 512 * PAGE_SIZE;
+constexpr uint64_t PAGE_2MIB = HUGE_PAGE_SIZE;
 constexpr uint64_t PAGE_1GIB = 512 * PAGE_2MIB;
+constexpr uint64_t PML4_SLOT_SIZE = 512 * PAGE_1GIB;
 
-constexpr size_t PAGE_DIRECTORY_COUNT = 64;
+// Legacy MMIO (local APIC, I/O APIC, 32-bit BARs, the framebuffer) lives
+// below 4 GiB and is not necessarily in the memory map, so it is always
+// mapped.
+constexpr uint64_t LOW_MMIO_END = 4 * PAGE_1GIB;
+
+// Tasks copy the kernel half of the PML4 when they are created, so every
+// slot map_identity_range() may ever fill needs its PDPT before the first
+// task exists. 16 slots cover 8 TiB of physical address space.
+constexpr size_t MAX_IDENTITY_PML4_SLOTS = 16;
 
 alignas(PAGE_SIZE) std::array<uint64_t, 512> pml4_table;
-alignas(PAGE_SIZE) std::array<uint64_t, 512> pdp_table;
-alignas(PAGE_SIZE)
-		std::array<std::array<uint64_t, 512>, PAGE_DIRECTORY_COUNT> page_directory;
 
-void setup_identity_mapping()
+bool use_1gib_pages = false;
+size_t num_identity_slots = 0;
+size_t num_identity_tables = 0;
+
+uint64_t* alloc_identity_table()
 {
-	pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table) | PTE_KERNEL_FLAGS;
-	for (size_t i_pdpt = 0; i_pdpt < PAGE_DIRECTORY_COUNT; i_pdpt++) {
-		pdp_table[i_pdpt] = reinterpret_cast<uint64_t>(&page_directory[i_pdpt]) |
-							PTE_KERNEL_FLAGS;
-		for (size_t i_pd = 0; i_pd < 512; i_pd++) {
-			page_directory[i_pdpt][i_pd] =
-					i_pdpt * PAGE_1GIB + i_pd * PAGE_2MIB | PTE_KERNEL_HUGE_FLAGS;
+	void* table = nullptr;
+	if (boot_allocator != nullptr) {
+		table = boot_allocator->allocate(PAGE_SIZE);
+		if (table != nullptr) {
+			memset(table, 0, PAGE_SIZE);
 		}
+	} else {
+		table = new_page_table();
 	}
+
+	if (table != nullptr) {
+		++num_identity_tables;
+	}
+
+	return reinterpret_cast<uint64_t*>(table);
+}
+
+uint64_t* next_table(uint64_t entry)
+{
+	return reinterpret_cast<uint64_t*>(entry & ~(PAGE_SIZE - 1) & ((1ULL << 52) - 1));
+}
+
+error_t map_identity_granule(uint64_t paddr)
+{
+	const size_t slot = paddr / PML4_SLOT_SIZE;
+	if (slot >= num_identity_slots) {
+		return ERR_INVALID_ARG;
+	}
+
+	uint64_t* pdpt = next_table(pml4_table[slot]);
+	const size_t pdpt_index = (paddr / PAGE_1GIB) % 512;
+
+	if (use_1gib_pages) {
+		pdpt[pdpt_index] = paddr | PTE_KERNEL_HUGE_FLAGS;
+		return OK;
+	}
+
+	if ((pdpt[pdpt_index] & PTE_PRESENT) == 0) {
+		uint64_t* pd = alloc_identity_table();
+		if (pd == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+
+		pdpt[pdpt_index] = reinterpret_cast<uint64_t>(pd) | PTE_KERNEL_FLAGS;
+	}
+
+	uint64_t* pd = next_table(pdpt[pdpt_index]);
+	pd[(paddr / PAGE_2MIB) % 512] = paddr | PTE_KERNEL_HUGE_FLAGS;
+
+	return OK;
+}
+
+void setup_identity_mapping(const MemoryMap& mem_map)
+{
+	use_1gib_pages = kernel::cpu::has_1gib_pages();
+
+	const unsigned int phys_bits = kernel::cpu::physical_address_bits();
+	num_identity_slots = phys_bits > 39 ? 1UL << (phys_bits - 39) : 1;
+	if (num_identity_slots > MAX_IDENTITY_PML4_SLOTS) {
+		num_identity_slots = MAX_IDENTITY_PML4_SLOTS;
+	}
+
+	for (size_t slot = 0; slot < num_identity_slots; ++slot) {
+		uint64_t* pdpt = alloc_identity_table();
+		if (pdpt == nullptr) {
+			LOG_ERROR("failed to allocate identity map PDPT %u", slot);
+			num_identity_slots = slot;
+			break;
+		}
+
+		pml4_table[slot] = reinterpret_cast<uint64_t>(pdpt) | PTE_KERNEL_FLAGS;
+	}
+
+	map_identity_range(0, LOW_MMIO_END);
+
+	const auto mem_map_base = reinterpret_cast<uintptr_t>(mem_map.buffer);
+	const auto mem_map_end = mem_map_base + mem_map.map_size;
+
+	for (uintptr_t iter = mem_map_base; iter < mem_map_end;
+		 iter += mem_map.descriptor_size) {
+		auto* desc = reinterpret_cast<MemoryDescriptor*>(iter);
+		const error_t err = map_identity_range(desc->physical_start,
+											   desc->number_of_pages * PAGE_SIZE);
+		if (IS_ERR(err)) {
+			LOG_ERROR("failed to identity-map %p (%u pages)",
+					  reinterpret_cast<void*>(desc->physical_start),
+					  desc->number_of_pages);
+		}
+	}
+
+	LOG_INFO("identity map: %s pages, %u PML4 slots, %u tables",
+			 use_1gib_pages ? "1 GiB" : "2 MiB", num_identity_slots,
+			 num_identity_tables);
 }
 } // anonymous namespace
 
 page_table_entry* get_active_page_table()
 {
-	return reinterpret_cast<page_table_entry*>(get_cr3());
+	return cr3_to_table(get_cr3());
 }
 
 page_table_entry* get_pte(page_table_entry* table, vaddr_t addr, int level)
@@ -49,7 +155,8 @@ page_table_entry* get_pte(page_table_entry* table, vaddr_t addr, int level)
 	for (int i = 4; i > level; --i) {
 		const int index = addr.part(i);
 		auto entry = next_table[index];
-		if (!entry.bits.present) {
+		if (!entry.bits.present || entry.bits.huge_page) {
+			// A huge leaf has no lower-level table to descend into
 			return nullptr;
 		}
 
@@ -61,6 +168,12 @@ page_table_entry* get_pte(page_table_entry* table, vaddr_t addr, int level)
 
 paddr_t get_paddr(page_table_entry* table, vaddr_t addr)
 {
+	auto* pde = get_pte(table, addr, 2);
+	if (pde != nullptr && pde->bits.present && pde->bits.huge_page) {
+		return paddr_t{ (pde->bits.address << PAGE_SHIFT) +
+						(addr.data & (HUGE_PAGE_SIZE - 1)) };
+	}
+
 	auto* pte = get_pte(table, addr, 1);
 	if (pte == nullptr) {
 		return paddr_t{ 0 };
@@ -94,18 +207,292 @@ void dump_page_tables(vaddr_t addr)
 page_table_entry* new_page_table()
 {
 	void* addr;
-	ALLOC_OR_RETURN_NULL(addr, PAGE_SIZE, ALLOC_ZEROED);
+	ALLOC_OR_RETURN_NULL(addr, PAGE_SIZE, ALLOC_ZEROED | ALLOC_PAGE_TABLE);
 
 	return reinterpret_cast<page_table_entry*>(addr);
 }
 
-page_table_entry* set_new_page_table(page_table_entry& entry)
+namespace
+{
+// A user 2 MiB page is an order-9 buddy block. Every mapping of it holds a
+// reference on all PT_ENTRIES descriptors, so splitting it into 4 KiB
+// entries leaves the counts untouched and the pieces can later be released
+// one by one.
+void* alloc_huge_frame()
+{
+	void* frame = memory_manager->allocate(HUGE_PAGE_SIZE);
+	if (frame == nullptr) {
+		return nullptr;
+	}
+
+	clear_pages(frame, PT_ENTRIES);
+
+	Page* head = get_page(frame);
+	for (size_t i = 0; i < PT_ENTRIES; ++i) {
+		head[i].inc_ref();
+	}
+
+	return frame;
+}
+
+void ref_huge_frame(void* frame)
+{
+	Page* head = get_page(frame);
+	if (head == nullptr) {
+		return;
+	}
+
+	for (size_t i = 0; i < PT_ENTRIES; ++i) {
+		head[i].inc_ref();
+	}
+}
+
+void release_huge_frame(void* frame, FrameFreeBatch& frames)
+{
+	Page* head = get_page(frame);
+	if (head == nullptr) {
+		return;
+	}
+
+	// Pages still referenced elsewhere (a split copy in another address
+	// space) stay; the rest go back, merged into runs by the batch.
+	for (size_t i = 0; i < PT_ENTRIES; ++i) {
+		if (head[i].dec_ref() == 0) {
+			frames.add(static_cast<char*>(frame) + i * PAGE_SIZE, 1);
+		}
+	}
+}
+
+// Release a 4 KiB user frame whose last reference is gone
+void release_user_frame(void* frame, FrameFreeBatch& frames)
+{
+	Page* page = get_page(frame);
+	if (page != nullptr && page->slab() == nullptr) {
+		// A piece of a split 2 MiB page: back to the buddy system, with its
+		// neighbours when they go too
+		frames.add(frame, 1);
+		return;
+	}
+
+	free(frame);
+}
+
+// Drop one mapping's reference to an owned 4 KiB user frame
+void put_user_frame(void* frame, FrameFreeBatch& frames)
+{
+	Page* page = get_page(frame);
+	if (page == nullptr || page->dec_ref() == 0) {
+		// Last reference (or untracked page): release it
+		release_user_frame(frame, frames);
+	}
+}
+
+// Forked address spaces share intermediate tables until one of them writes
+// below them. A table's descriptor counts the address spaces sharing it;
+// 0 means a single owner, so private tables never touch the count.
+void get_table(page_table_entry* table)
+{
+	Page* page = get_page(table);
+	if (page == nullptr) {
+		return;
+	}
+
+	if (page->ref_count() == 0) {
+		page->inc_ref();
+	}
+	page->inc_ref();
+}
+
+bool is_shared_table(page_table_entry* table)
+{
+	Page* page = get_page(table);
+	return page != nullptr && page->ref_count() > 1;
+}
+
+// Drop one sharer. Returns true when the caller was the only owner and has
+// to release the table and everything below it.
+bool put_table(page_table_entry* table)
+{
+	Page* page = get_page(table);
+	if (page == nullptr || page->ref_count() == 0) {
+		return true;
+	}
+
+	if (page->dec_ref() == 1) {
+		page->dec_ref();
+	}
+
+	return false;
+}
+
+// Take a reference for one more address space on whatever the entry maps,
+// and write-protect the entry so that the first write through it faults.
+// A read-only intermediate entry therefore means "shared below here".
+void share_entry(page_table_entry& entry, int page_table_level)
+{
+	void* target = entry.get_next_level_table();
+
+	if (page_table_level == 1) {
+		if (entry.bits.owned) {
+			Page* page = get_page(target);
+			if (page != nullptr) {
+				page->inc_ref();
+			}
+		}
+	} else if (page_table_level == 2 && entry.bits.huge_page) {
+		if (entry.bits.owned) {
+			ref_huge_frame(target);
+		}
+	} else {
+		get_table(entry.get_next_level_table());
+	}
+
+	entry.bits.writable = 0;
+}
+
+// Make the table an intermediate entry points to private to this address
+// space. A shared table is copied, and its entries become shared one level
+// further down.
+error_t unshare_entry(page_table_entry& entry, int page_table_level)
+{
+	if (entry.bits.writable) {
+		return OK;
+	}
+
+	page_table_entry* table = entry.get_next_level_table();
+	if (is_shared_table(table)) {
+		page_table_entry* copy = new_page_table();
+		if (copy == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+
+		for (int i = 0; i < PT_ENTRIES; ++i) {
+			if (table[i].bits.present) {
+				share_entry(table[i], page_table_level - 1);
+				copy[i] = table[i];
+			} else if (table[i].bits.swapped) {
+				swap::dup(table[i].bits.address);
+				copy[i] = table[i];
+			}
+		}
+
+		put_table(table);
+		entry.set_next_level_table(copy);
+	}
+
+	entry.bits.writable = 1;
+	return OK;
+}
+
+// Unshare every table on the path to addr above the given level
+error_t unshare_path(page_table_entry* root, vaddr_t addr, int level)
+{
+	bool changed = false;
+	page_table_entry* table = root;
+
+	for (int i = 4; i > level; --i) {
+		page_table_entry& entry = table[addr.part(i)];
+		if (!entry.bits.present || entry.bits.huge_page) {
+			break;
+		}
+
+		if (!entry.bits.writable) {
+			RETURN_IF_ERROR(unshare_entry(entry, i));
+			changed = true;
+		}
+
+		table = entry.get_next_level_table();
+	}
+
+	if (changed) {
+		TlbFlushBatch batch(root);
+		batch.add(addr.data);
+	}
+
+	return OK;
+}
+
+// Replace a 2 MiB leaf with a page table of equivalent 4 KiB entries. The
+// translation is unchanged, so nothing is flushed here: INVLPG of any page
+// the caller goes on to change drops the cached 2 MiB entry as a whole.
+error_t split_huge_page(page_table_entry& pde, vaddr_t addr)
+{
+	page_table_entry* pt = new_page_table();
+	if (pt == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	const uint64_t first_pfn = pde.bits.address;
+	for (size_t i = 0; i < PT_ENTRIES; ++i) {
+		pt[i].bits.present = 1;
+		pt[i].bits.writable = pde.bits.writable;
+		pt[i].bits.user_accessible = pde.bits.user_accessible;
+		pt[i].bits.owned = pde.bits.owned;
+		pt[i].bits.address = first_pfn + i;
+	}
+
+	page_table_entry table_entry{ 0 };
+	table_entry.bits.present = 1;
+	table_entry.bits.writable = 1;
+	table_entry.bits.user_accessible = 1;
+	table_entry.set_next_level_table(pt);
+	pde = table_entry;
+
+	return OK;
+}
+
+// Level-2 fast path of setup_page_table(): back an aligned, fully covered
+// 2 MiB extent with one huge page. Returns false when the extent does not
+// qualify or no order-9 block is free, leaving it to the 4 KiB path.
+bool try_map_user_huge_page(page_table_entry& pde,
+							vaddr_t addr,
+							size_t num_pages,
+							bool writable)
+{
+	if (num_pages < PT_ENTRIES || addr.part(1) != 0 || addr.part(0) != 0) {
+		return false;
+	}
+
+	if (pde.bits.present) {
+		// Keep an existing huge page, as the 4 KiB path keeps present pages.
+		// One with other permissions is split, so each 4 KiB page gets them.
+		return pde.bits.huge_page != 0 && pde.bits.writable == writable;
+	}
+
+	void* frame = alloc_huge_frame();
+	if (frame == nullptr) {
+		return false;
+	}
+
+	pde.data = reinterpret_cast<uint64_t>(frame) | PTE_PRESENT | PTE_HUGE;
+	pde.bits.writable = writable;
+	pde.bits.user_accessible = 1;
+	pde.bits.owned = 1;
+
+	return true;
+}
+} // namespace
+
+page_table_entry* set_new_page_table(page_table_entry& entry, int page_table_level)
 {
 	if (entry.bits.present) {
+		if (page_table_level > 1 && !entry.bits.huge_page &&
+			IS_ERR(unshare_entry(entry, page_table_level))) {
+			return nullptr;
+		}
+
 		return entry.get_next_level_table();
 	}
 
-	auto* child_table = new_page_table();
+	// A level-1 entry points at a user data page, not at another table
+	page_table_entry* child_table = nullptr;
+	if (page_table_level == 1) {
+		child_table = reinterpret_cast<page_table_entry*>(
+				alloc(PAGE_SIZE, ALLOC_ZEROED));
+	} else {
+		child_table = new_page_table();
+	}
+
 	if (child_table == nullptr) {
 		return nullptr;
 	}
@@ -125,8 +512,43 @@ int setup_page_table(page_table_entry* page_table,
 {
 	while (num_pages > 0) {
 		const int page_table_index = addr.part(page_table_level);
+		page_table_entry& entry = page_table[page_table_index];
+
+		if (page_table_level == 2) {
+			if (try_map_user_huge_page(entry, addr, num_pages, writable)) {
+				num_pages -= PT_ENTRIES;
+				if (page_table_index == 511) {
+					break;
+				}
+
+				addr.set_part(2, page_table_index + 1);
+				addr.set_part(1, 0);
+				continue;
+			}
+
+			// Mapping part of an existing huge page, or all of it with other
+			// permissions: go back to 4 KiB pages
+			if (entry.bits.present && entry.bits.huge_page &&
+				IS_ERR(split_huge_page(entry, addr))) {
+				LOG_ERROR("Failed to split huge page at %p", addr.data);
+				return -1;
+			}
+		}
+
+		// A swapped-out page is kept like a present one; it faults back in
+		if (page_table_level == 1 && entry.bits.swapped) {
+			--num_pages;
+			if (page_table_index == 511) {
+				break;
+			}
+
+			addr.set_part(1, page_table_index + 1);
+			continue;
+		}
+
 		const bool was_present = page_table[page_table_index].bits.present;
-		auto* child_table = set_new_page_table(page_table[page_table_index]);
+		auto* child_table = set_new_page_table(page_table[page_table_index],
+												page_table_level);
 		if (child_table == nullptr) {
 			LOG_ERROR("Failed to setup page table: level=%d", page_table_level);
 			return -1;
@@ -177,9 +599,8 @@ error_t setup_page_tables(vaddr_t addr, size_t num_pages, bool writable)
 		return ERR_NO_MEMORY;
 	}
 
-	for (size_t i = 0; i < num_pages; i++) {
-		flush_tlb(addr.data + i * PAGE_SIZE);
-	}
+	TlbFlushBatch batch(get_active_page_table());
+	batch.add_range(addr.data, num_pages);
 
 	return OK;
 }
@@ -192,56 +613,74 @@ page_table_entry* config_new_page_table()
 	}
 
 	copy_kernel_space(page_table);
-	set_cr3(reinterpret_cast<uint64_t>(page_table));
+	switch_page_table(page_table);
 
 	return page_table;
 }
 
-void clean_page_table(page_table_entry* table, int page_table_level)
+namespace
+{
+// Release what a table about to be freed maps. Its entries are left as
+// they are: the table goes back to the slab, which zeroes it on reuse.
+void clean_page_table(page_table_entry* table,
+					  int page_table_level,
+					  FrameFreeBatch& frames)
 {
-	for (int i = 0; i < 512; ++i) {
-		auto entry = table[i];
+	for (int i = 0; i < PT_ENTRIES; ++i) {
+		const page_table_entry entry = table[i];
 		if (!entry.bits.present) {
+			if (page_table_level == 1 && entry.bits.swapped) {
+				swap::release(entry.bits.address);
+			}
 			continue;
 		}
 
-		if (page_table_level > 1) {
-			// Intermediate tables are exclusively owned by this address
-			// space (clones deep-copy them), so always free them.
-			clean_page_table(entry.get_next_level_table(), page_table_level - 1);
-			free(entry.get_next_level_table());
-			table[i].data = 0;
+		if (page_table_level == 2 && entry.bits.huge_page) {
+			if (entry.bits.owned) {
+				release_huge_frame(entry.get_next_level_table(), frames);
+			}
 			continue;
 		}
 
-		// Level 1: leaf data page
-		if (!entry.bits.owned) {
-			// Foreign frame mapping (e.g. IPC shared memory): unmap only
-			table[i].data = 0;
+		if (page_table_level > 1) {
+			// A table still shared with a forked address space only loses
+			// this sharer; the last one releases it and what it maps.
+			page_table_entry* child = entry.get_next_level_table();
+			if (put_table(child)) {
+				clean_page_table(child, page_table_level - 1, frames);
+				free(child);
+			}
 			continue;
 		}
 
-		void* data_page = entry.get_next_level_table();
-		Page* page = get_page(data_page);
-		if (page == nullptr || page->dec_ref() == 0) {
-			// Last reference (or untracked page): release it
-			free(data_page);
+		// Level 1: leaf data page. Foreign frames (e.g. IPC shared memory)
+		// are only unmapped.
+		if (entry.bits.owned) {
+			put_user_frame(entry.get_next_level_table(), frames);
 		}
-		table[i].data = 0;
 	}
 }
+} // namespace
 
 void clean_page_tables(page_table_entry* table)
 {
-	for (int i = USER_SPACE_START_INDEX; i < 512; ++i) {
-		auto entry = table[i];
+	// The table is not loaded (the task is gone, or exec switched away), so
+	// no TLB entry is reached through it but those under its PCID. Drop
+	// them before the walk, since a full batch frees frames on the way.
+	forget_page_table(table);
+
+	FrameFreeBatch frames;
+	for (int i = USER_SPACE_START_INDEX; i < PT_ENTRIES; ++i) {
+		const page_table_entry entry = table[i];
 		if (!entry.bits.present) {
 			continue;
 		}
 
-		clean_page_table(entry.get_next_level_table(), 3);
-		free(entry.get_next_level_table());
-		table[i].data = 0;
+		page_table_entry* pdpt = entry.get_next_level_table();
+		if (put_table(pdpt)) {
+			clean_page_table(pdpt, 3, frames);
+			free(pdpt);
+		}
 	}
 
 	free(table);
@@ -266,10 +705,24 @@ void copy_page_tables(page_table_entry* dst,
 						page->inc_ref();
 					}
 				}
+			} else if (src[i].bits.swapped) {
+				// Both faults read the same swap entry back
+				dst[i] = src[i];
+				swap::dup(src[i].bits.address);
 			}
 		}
 	} else {
 		for (int i = start_index; i < 512; ++i) {
+			if (level == 2 && src[i].bits.present && src[i].bits.huge_page) {
+				// 2 MiB leaf: share it like a 4 KiB one
+				dst[i] = src[i];
+				dst[i].bits.writable = writable;
+				if (src[i].bits.owned) {
+					ref_huge_frame(src[i].get_next_level_table());
+				}
+				continue;
+			}
+
 			if (src[i].bits.present) {
 				auto* new_table = new_page_table();
 				dst[i] = src[i];
@@ -294,19 +747,28 @@ void set_page_table_entry(page_table_entry* table,
 	pt[pt_index].bits.owned = 1;
 	pt[pt_index].bits.present = 1;
 
-	flush_tlb(addr.data);
+	TlbFlushBatch batch(table);
+	batch.add(addr.data);
 }
 
 error_t copy_target_page(uint64_t addr)
 {
-	auto* page = new_page_table();
+	// CoW works at 4 KiB granularity: split a shared 2 MiB page first and
+	// copy only the page that was written
+	auto* pde = get_pte(get_active_page_table(), vaddr_t{ addr }, 2);
+	if (pde != nullptr && pde->bits.present && pde->bits.huge_page) {
+		RETURN_IF_ERROR(split_huge_page(*pde, vaddr_t{ addr }));
+	}
+
+	auto* page = reinterpret_cast<page_table_entry*>(
+			alloc(PAGE_SIZE, ALLOC_UNINITIALIZED));
 	if (page == nullptr) {
-		LOG_ERROR("Failed to allocate memory for page table.");
+		LOG_ERROR("Failed to allocate memory for CoW page copy.");
 		return ERR_NO_MEMORY;
 	}
 
 	const auto aligned_addr = addr & ~(PAGE_SIZE - 1);
-	memcpy(page, reinterpret_cast<void*>(aligned_addr), PAGE_SIZE);
+	copy_page(page, reinterpret_cast<void*>(aligned_addr));
 
 	// This address space stops referencing the shared CoW page
 	void* shared_page = nullptr;
@@ -323,10 +785,8 @@ error_t copy_target_page(uint64_t addr)
 	set_page_table_entry(get_active_page_table(), vaddr_t{ addr }, page);
 
 	if (shared_page != nullptr) {
-		Page* old_page = get_page(shared_page);
-		if (old_page == nullptr || old_page->dec_ref() == 0) {
-			free(shared_page);
-		}
+		FrameFreeBatch frames;
+		put_user_frame(shared_page, frames);
 	}
 
 	return OK;
@@ -352,117 +812,615 @@ page_table_entry* clone_page_table(page_table_entry* src, bool writable)
 	return table;
 }
 
-error_t handle_page_fault(uint64_t error_code, uint64_t fault_addr)
+page_table_entry* share_page_table(page_table_entry* src)
+{
+	auto* table = new_page_table();
+	if (table == nullptr) {
+		LOG_ERROR("Failed to allocate memory for page table.");
+		return nullptr;
+	}
+
+	copy_kernel_space(table);
+	for (int i = USER_SPACE_START_INDEX; i < PT_ENTRIES; ++i) {
+		if (src[i].bits.present) {
+			share_entry(src[i], 4);
+			table[i] = src[i];
+		}
+	}
+
+	// The source just lost write access to its whole user half
+	TlbFlushBatch batch(src);
+	batch.add_all();
+
+	return table;
+}
+
+namespace
+{
+// Write to a present user page: unshare the tables above it, then either
+// the page was writable all along (a stale TLB entry from before the
+// unshare), it is private and only write-protected (mprotect, or a fork
+// whose other side has let go of it), or it is a CoW page that needs its
+// own copy.
+error_t handle_write_fault(vaddr_t addr, const VmArea* area)
+{
+	page_table_entry* table = get_active_page_table();
+	RETURN_IF_ERROR(unshare_path(table, addr, 1));
+
+	TlbFlushBatch batch(table);
+	auto* pde = get_pte(table, addr, 2);
+	auto* pte = get_pte(table, addr, 1);
+	if ((pde != nullptr && pde->bits.present && pde->bits.huge_page &&
+		 pde->bits.writable) ||
+		(pte != nullptr && pte->bits.present && pte->bits.writable)) {
+		batch.add(addr.data);
+		return OK;
+	}
+
+	if (area != nullptr && pte != nullptr && pte->bits.present && pte->bits.owned) {
+		Page* page = get_page(pte->get_next_level_table());
+		if (page != nullptr && page->ref_count() == 1) {
+			pte->bits.writable = 1;
+			batch.add(addr.data);
+			return OK;
+		}
+	}
+
+	return copy_target_page(addr.data);
+}
+
+// Backs every untouched anonymous page that has only been read. Kernel
+// image memory, so it is mapped unowned and never freed with a table.
+alignas(PAGE_SIZE) const std::array<uint8_t, PAGE_SIZE> zero_page{};
+
+// Walk to the table of the given level covering addr (the page table by
+// default), creating the missing tables and unsharing the ones forked
+// address spaces still share
+page_table_entry* user_page_table(page_table_entry* table,
+								 vaddr_t addr,
+								 int level = 1)
+{
+	for (int l = 4; l > level; --l) {
+		page_table_entry& entry = table[addr.part(l)];
+		table = set_new_page_table(entry, l);
+		if (table == nullptr) {
+			return nullptr;
+		}
+		entry.bits.writable = 1;
+	}
+
+	return table;
+}
+
+// First write into a 2 MiB extent of an anonymous area that covers all of
+// it and has nothing mapped there yet: back the extent with one huge page.
+// Returns false to leave the fault to the 4 KiB path.
+bool fault_in_huge_page(vaddr_t addr, const VmArea* area)
+{
+	const vaddr_t extent{ addr.data & ~(HUGE_PAGE_SIZE - 1) };
+	if (extent.data < area->start || extent.data + HUGE_PAGE_SIZE > area->end) {
+		return false;
+	}
+
+	page_table_entry* pd = user_page_table(get_active_page_table(), extent, 2);
+	if (pd == nullptr) {
+		return false;
+	}
+
+	// A page table there holds pages already touched (or swapped out)
+	page_table_entry& pde = pd[extent.part(2)];
+	if (pde.bits.present) {
+		return false;
+	}
+
+	return try_map_user_huge_page(pde, extent, PT_ENTRIES, area->writable);
+}
+
+// First touch of a program page: a read maps the image's copy, shared with
+// every process running the program, a write gets a private copy of it.
+// Either way the mapping owns a reference, so a shared page in a writable
+// segment is copied by handle_write_fault() like any CoW page.
+error_t map_image_page(vaddr_t page_addr, bool write, const VmArea* area)
+{
+	const ExecSegment& segment = area->image->segment(area->segment);
+	const size_t index = (page_addr.data - segment_page_base(segment)) / PAGE_SIZE;
+	void* shared = area->image->page(area->segment, index);
+	if (shared == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	page_table_entry* table = user_page_table(get_active_page_table(), page_addr);
+	if (table == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	void* frame = shared;
+	if (write) {
+		frame = alloc(PAGE_SIZE, ALLOC_UNINITIALIZED);
+		if (frame == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+		copy_page(frame, shared);
+	}
+
+	Page* page = get_page(frame);
+	if (page != nullptr) {
+		page->inc_ref();
+	}
+
+	page_table_entry& pte = table[page_addr.part(1)];
+	pte.data = 0;
+	pte.set_next_level_table(static_cast<page_table_entry*>(frame));
+	pte.bits.present = 1;
+	pte.bits.user_accessible = 1;
+	pte.bits.writable = write;
+	pte.bits.owned = 1;
+
+	return OK;
+}
+
+// A page reclaim moved to the swap store comes back in a new private
+// frame. When it is only on disk the task is marked waiting for the swap
+// task to read it, sleeps on the way out of the fault handler, and the
+// access faults again.
+error_t swap_in_page(page_table_entry& pte, const VmArea* area)
+{
+	const uint32_t slot = pte.bits.address;
+	void* frame = alloc(PAGE_SIZE, ALLOC_UNINITIALIZED);
+	if (frame == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	const error_t err = swap::load(slot, frame);
+	if (IS_ERR(err)) {
+		free(frame);
+		return err == ERR_PAGE_NOT_PRESENT ? OK : err;
+	}
+
+	Page* page = get_page(frame);
+	if (page != nullptr) {
+		page->inc_ref();
+	}
+
+	pte.data = 0;
+	pte.set_next_level_table(static_cast<page_table_entry*>(frame));
+	pte.bits.present = 1;
+	pte.bits.user_accessible = 1;
+	pte.bits.writable = area->writable;
+	pte.bits.owned = 1;
+	swap::release(slot);
+
+	return OK;
+}
+
+// First touch of an anonymous page: a write gets a private zeroed page (a
+// whole huge page when the area covers its 2 MiB extent and nothing there is
+// mapped yet), a read the shared zero page, which a later write replaces
+// through CoW
+error_t handle_not_present_fault(vaddr_t addr, bool write, const VmArea* area)
+{
+	const vaddr_t page_addr{ addr.data & ~(PAGE_SIZE - 1) };
+	const page_table_entry* old_pte = get_pte(get_active_page_table(), page_addr, 1);
+	if (old_pte != nullptr && old_pte->bits.swapped) {
+		// Unshare the table before the entry in it changes
+		page_table_entry* table =
+				user_page_table(get_active_page_table(), page_addr);
+		if (table == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+
+		return swap_in_page(table[page_addr.part(1)], area);
+	}
+
+	if (area->image != nullptr) {
+		return map_image_page(page_addr, write, area);
+	}
+
+	if (write) {
+		if (fault_in_huge_page(page_addr, area)) {
+			return OK;
+		}
+
+		if (setup_page_table(get_active_page_table(), 4, page_addr, 1, true) == -1) {
+			return ERR_NO_MEMORY;
+		}
+
+		return OK;
+	}
+
+	page_table_entry* table = user_page_table(get_active_page_table(), page_addr);
+	if (table == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	page_table_entry& pte = table[page_addr.part(1)];
+	pte.data = 0;
+	pte.set_next_level_table(
+			reinterpret_cast<page_table_entry*>(const_cast<uint8_t*>(zero_page.data())));
+	pte.bits.present = 1;
+	pte.bits.user_accessible = 1;
+
+	return OK;
+}
+} // namespace
+
+error_t handle_page_fault(uint64_t error_code,
+						  uint64_t fault_addr,
+						  const VmAreaTree* vmas)
 {
 	auto exist = error_code & 1;
 	auto rw = (error_code >> 1) & 1;
 	auto user = (error_code >> 2) & 1;
 
-	if ((user != 0) && (rw != 0) && (exist != 0)) {
-		RETURN_IF_ERROR(copy_target_page(fault_addr));
-	} else {
-		LOG_ERROR("Page fault: user=%d, rw=%d, exist=%d", user, rw, exist);
+	// The kernel writing into a user buffer (syscall results) shares the
+	// same tables as the task, so it unshares them the same way
+	const vaddr_t addr{ fault_addr };
+	const bool user_addr = addr.part(4) >= USER_SPACE_START_INDEX;
+	const VmArea* area = vmas != nullptr ? vmas->find(fault_addr) : nullptr;
+
+	// Pages outside every area (argv, ELF segments loaded eagerly) keep
+	// plain CoW
+	if (user_addr && (rw != 0) && (exist != 0) &&
+		(area == nullptr || area->writable)) {
+		RETURN_IF_ERROR(handle_write_fault(addr, area));
+		return OK;
+	}
+
+	if (user_addr && exist == 0 && area != nullptr && (rw == 0 || area->writable)) {
+		return handle_not_present_fault(addr, rw != 0, area);
+	}
+
+	if (!user_addr && is_kernel_stack_guard(fault_addr)) {
+		LOG_ERROR("kernel stack overflow: %016lx is a guard page", fault_addr);
 		return ERR_PAGE_NOT_PRESENT;
 	}
 
-	return OK;
+	LOG_ERROR("Page fault: user=%d, rw=%d, exist=%d", user, rw, exist);
+	return ERR_PAGE_NOT_PRESENT;
+}
+
+namespace
+{
+// Table of the given level covering addr, with the tables above it created
+// or unshared on the way down (nullptr if out of memory or under a huge page)
+page_table_entry* walk_and_create(page_table_entry* table, vaddr_t addr, int level)
+{
+	for (int l = 4; l > level; --l) {
+		page_table_entry& entry = table[addr.part(l)];
+		if (entry.bits.present && entry.bits.huge_page) {
+			return nullptr;
+		}
+
+		table = set_new_page_table(entry, l);
+		if (table == nullptr) {
+			return nullptr;
+		}
+		entry.bits.writable = 1;
+	}
+
+	return table;
 }
 
-vaddr_t create_vaddr_from_index(int pml4_i, int pdpt_i, int pd_i, int pt_i)
+// Map frames read-only at addr, a range nothing else maps. Whole 2 MiB
+// chunks of a 2 MiB-aligned buffer (large OOL payloads) take huge pages.
+error_t map_frames_at(page_table_entry* table,
+					  vaddr_t addr,
+					  uint64_t frame,
+					  size_t num_pages,
+					  size_t* num_mapped,
+					  TlbFlushBatch& batch)
 {
-	vaddr_t addr;
-	addr.data = 0;
+	size_t i = 0;
+	while (i < num_pages) {
+		const vaddr_t target{ addr.data + i * PAGE_SIZE };
+		const uint64_t paddr = frame + i * PAGE_SIZE;
+		*num_mapped = i;
+
+		if (target.part(1) == 0 && paddr % HUGE_PAGE_SIZE == 0 &&
+			num_pages - i >= PT_ENTRIES) {
+			page_table_entry* pd = walk_and_create(table, target, 2);
+			if (pd == nullptr) {
+				return ERR_NO_MEMORY;
+			}
 
-	addr.set_part(4, pml4_i & PT_INDEX_MASK);
-	addr.set_part(3, pdpt_i & PT_INDEX_MASK);
-	addr.set_part(2, pd_i & PT_INDEX_MASK);
-	addr.set_part(1, pt_i & PT_INDEX_MASK);
+			// A page table left by an earlier 4 KiB mapping is reused below
+			page_table_entry& pde = pd[target.part(2)];
+			if (!pde.bits.present) {
+				pde.data = paddr | PTE_PRESENT | PTE_HUGE;
+				pde.bits.user_accessible = 1;
+				batch.add(target.data);
+				i += PT_ENTRIES;
+				continue;
+			}
+		}
 
-	if ((addr.bits.page_map_level_4_index & 0x100) != 0) {
-		addr.bits.canonical = 0xFFFF;
-	} else {
-		addr.bits.canonical = 0x0000;
+		page_table_entry* pt = walk_and_create(table, target, 1);
+		if (pt == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+
+		page_table_entry& pte = pt[target.part(1)];
+		pte.data = 0;
+		pte.bits.present = 1;
+		pte.bits.user_accessible = 1;
+		pte.bits.address = paddr >> PAGE_SHIFT;
+		batch.add(target.data);
+		++i;
 	}
 
-	return addr;
+	*num_mapped = num_pages;
+	return OK;
 }
+} // namespace
 
 error_t map_frame_to_vaddr(page_table_entry* table,
+						   VaddrAllocator& space,
 						   uint64_t frame,
 						   size_t num_pages,
 						   vaddr_t* start_addr)
 {
-	int indices[] = { 0, 0, 0, 0 };
-	size_t consecutive_pages = 0;
-
-	for (int level = 4; level >= 1; --level) {
-		const int start = (level == 4) ? USER_SPACE_START_INDEX : 0;
-		for (int i = start; i < PT_ENTRIES; ++i) {
-			if (level == 1) {
-				for (size_t j = 0; j < num_pages; ++j) {
-					if (!table[i + j].bits.present) {
-						++consecutive_pages;
-					} else {
-						consecutive_pages = 0;
-						break;
-					}
-				}
+	// A 2 MiB-aligned buffer gets a 2 MiB-aligned range to map as huge pages
+	uint64_t addr = 0;
+	if (frame % HUGE_PAGE_SIZE == 0 && num_pages >= PT_ENTRIES) {
+		addr = space.allocate(num_pages, PT_ENTRIES);
+	}
+	if (addr == 0) {
+		addr = space.allocate(num_pages);
+	}
+	if (addr == 0) {
+		return ERR_NO_MEMORY;
+	}
 
-				if (consecutive_pages < num_pages) {
-					continue;
-				}
+	size_t num_mapped = 0;
+	error_t err = OK;
+	{
+		TlbFlushBatch batch(table);
+		err = map_frames_at(table, vaddr_t{ addr }, frame, num_pages, &num_mapped,
+							batch);
+	}
 
-				for (size_t j = 0; j < num_pages; ++j) {
-					table[i + j].bits.present = 1;
-					table[i + j].bits.writable = 0;
-					table[i + j].bits.user_accessible = 1;
-					table[i + j].bits.address =
-							(frame + j * PAGE_SIZE) >> PAGE_SHIFT;
+	if (IS_ERR(err)) {
+		unmap_frame(table, vaddr_t{ addr }, num_mapped);
+		space.release(addr, num_pages);
+		return err;
+	}
 
-					indices[4 - level] = i;
+	*start_addr = vaddr_t{ addr };
+	return OK;
+}
 
-					const vaddr_t addr = create_vaddr_from_index(
-							indices[0], indices[1], indices[2], indices[3]);
+error_t unmap_frame(page_table_entry* table, vaddr_t addr, size_t num_pages)
+{
+	TlbFlushBatch batch(table);
+	size_t i = 0;
+	while (i < num_pages) {
+		const vaddr_t target_addr{ addr.data + i * PAGE_SIZE };
+		RETURN_IF_ERROR(unshare_path(table, target_addr, 1));
+
+		auto* pde = get_pte(table, target_addr, 2);
+		if (pde != nullptr && pde->bits.present && pde->bits.huge_page) {
+			if (target_addr.part(1) == 0 && num_pages - i >= PT_ENTRIES) {
+				pde->data = 0;
+				batch.add(target_addr.data);
+				i += PT_ENTRIES;
+				continue;
+			}
 
-					if (j == 0) {
-						*start_addr = addr;
-					}
+			// Partial unmap of a 2 MiB page: fall back to 4 KiB entries
+			RETURN_IF_ERROR(split_huge_page(*pde, target_addr));
+		}
 
-					flush_tlb(addr.data);
-				}
-			} else {
-				if (!table[i].bits.present) {
-					continue;
-				}
+		auto* pte = get_pte(table, target_addr, 1);
+		if (pte == nullptr) {
+			return ERR_INVALID_ARG;
+		}
 
-				indices[4 - level] = i;
-				table = table[i].get_next_level_table();
-				break;
+		pte->data = 0;
+		batch.add(target_addr.data);
+		++i;
+	}
+
+	return OK;
+}
+
+error_t release_user_pages(page_table_entry* table, vaddr_t addr, size_t num_pages)
+{
+	TlbFlushBatch batch(table);
+	FrameFreeBatch frames(&batch);
+	size_t i = 0;
+	while (i < num_pages) {
+		const vaddr_t target_addr{ addr.data + i * PAGE_SIZE };
+		RETURN_IF_ERROR(unshare_path(table, target_addr, 1));
+
+		auto* pde = get_pte(table, target_addr, 2);
+		if (pde == nullptr || !pde->bits.present) {
+			// Nothing mapped in this 2 MiB extent
+			i += PT_ENTRIES - target_addr.part(1);
+			continue;
+		}
+
+		if (pde->bits.huge_page) {
+			if (target_addr.part(1) == 0 && num_pages - i >= PT_ENTRIES) {
+				if (pde->bits.owned) {
+					release_huge_frame(pde->get_next_level_table(), frames);
+				}
+				pde->data = 0;
+				batch.add(target_addr.data);
+				i += PT_ENTRIES;
+				continue;
 			}
 
-			return OK;
+			RETURN_IF_ERROR(split_huge_page(*pde, target_addr));
 		}
+
+		auto* pte = get_pte(table, target_addr, 1);
+		if (pte->bits.present) {
+			if (pte->bits.owned) {
+				put_user_frame(pte->get_next_level_table(), frames);
+			}
+			pte->data = 0;
+			batch.add(target_addr.data);
+		} else if (pte->bits.swapped) {
+			swap::release(pte->bits.address);
+			pte->data = 0;
+		}
+		++i;
 	}
 
-	return ERR_NO_MEMORY;
+	return OK;
 }
 
-error_t unmap_frame(page_table_entry* table, vaddr_t addr, size_t num_pages)
+error_t write_protect_user_pages(page_table_entry* table,
+								 vaddr_t addr,
+								 size_t num_pages)
 {
-	for (size_t i = 0; i < num_pages; i++) {
+	TlbFlushBatch batch(table);
+	size_t i = 0;
+	while (i < num_pages) {
 		const vaddr_t target_addr{ addr.data + i * PAGE_SIZE };
-		auto* pte = get_pte(table, target_addr, 1);
-		if (pte == nullptr) {
-			return ERR_INVALID_ARG;
+		RETURN_IF_ERROR(unshare_path(table, target_addr, 1));
+
+		auto* pde = get_pte(table, target_addr, 2);
+		if (pde == nullptr || !pde->bits.present) {
+			i += PT_ENTRIES - target_addr.part(1);
+			continue;
 		}
 
-		pte->data = 0;
-		flush_tlb(target_addr.data);
+		if (pde->bits.huge_page) {
+			if (target_addr.part(1) == 0 && num_pages - i >= PT_ENTRIES) {
+				pde->bits.writable = 0;
+				batch.add(target_addr.data);
+				i += PT_ENTRIES;
+				continue;
+			}
+
+			RETURN_IF_ERROR(split_huge_page(*pde, target_addr));
+		}
+
+		auto* pte = get_pte(table, target_addr, 1);
+		if (pte->bits.present && pte->bits.writable) {
+			pte->bits.writable = 0;
+			batch.add(target_addr.data);
+		}
+		++i;
 	}
 
 	return OK;
 }
 
+namespace
+{
+constexpr uint64_t USER_HALF_START = 0xffff'8000'0000'0000;
+
+// Clock step on a leaf entry: age it, or swap it out when it has stayed
+// cold since the previous sweep. Returns true if the page went.
+bool reclaim_entry(page_table_entry& pte,
+				   vaddr_t addr,
+				   const VmAreaTree& vmas,
+				   ReclaimScan& scan,
+				   TlbFlushBatch& batch,
+				   FrameFreeBatch& frames)
+{
+	if (!pte.bits.present || !pte.bits.owned) {
+		return false;
+	}
+
+	// Clearing the bit is not flushed: while the translation stays cached
+	// the page is not marked again and may look cold once too often
+	if (pte.bits.accessed) {
+		pte.bits.accessed = 0;
+		return false;
+	}
+
+	if (scan.max_reclaim == 0) {
+		return false;
+	}
+
+	void* frame = pte.get_next_level_table();
+	Page* page = get_page(frame);
+	if (page == nullptr || page->slab() == nullptr || page->ref_count() != 1) {
+		return false;
+	}
+
+	const VmArea* area = vmas.find(addr.data);
+	if (area == nullptr || area->image != nullptr) {
+		return false;
+	}
+
+	uint32_t slot;
+	const error_t err = swap::store(frame, &slot);
+	if (err == ERR_INVALID_ARG) {
+		// Incompressible and no swap area to move it to: it stays
+		return false;
+	}
+	if (IS_ERR(err)) {
+		scan.error = err;
+		return false;
+	}
+
+	pte.data = 0;
+	pte.bits.swapped = 1;
+	pte.bits.address = slot;
+	batch.add(addr.data);
+	put_user_frame(frame, frames);
+	--scan.max_reclaim;
+
+	return true;
+}
+
+// Sweep a table from addr on. Returns false when a budget ran out; addr is
+// then where the next sweep resumes.
+bool reclaim_table(page_table_entry* table,
+				   int page_table_level,
+				   vaddr_t& addr,
+				   const VmAreaTree& vmas,
+				   ReclaimScan& scan,
+				   TlbFlushBatch& batch,
+				   FrameFreeBatch& frames)
+{
+	for (int i = addr.part(page_table_level); i < PT_ENTRIES; ++i) {
+		addr.set_part(page_table_level, i);
+		if (scan.max_scan == 0 || IS_ERR(scan.error)) {
+			return false;
+		}
+		--scan.max_scan;
+
+		page_table_entry& entry = table[i];
+		if (page_table_level == 1) {
+			if (reclaim_entry(entry, addr, vmas, scan, batch, frames) &&
+				scan.max_reclaim == 0) {
+				return false;
+			}
+		} else if (entry.bits.present && entry.bits.writable &&
+				   !entry.bits.huge_page) {
+			// A read-only entry leads to tables shared with a fork
+			if (!reclaim_table(entry.get_next_level_table(), page_table_level - 1,
+							   addr, vmas, scan, batch, frames)) {
+				return false;
+			}
+		}
+
+		for (int level = page_table_level - 1; level >= 1; --level) {
+			addr.set_part(level, 0);
+		}
+	}
+
+	return true;
+}
+} // namespace
+
+void reclaim_user_pages(page_table_entry* table,
+						const VmAreaTree& vmas,
+						ReclaimScan& scan)
+{
+	vaddr_t addr{ scan.cursor != 0 ? scan.cursor : USER_HALF_START };
+
+	TlbFlushBatch batch(table);
+	FrameFreeBatch frames(&batch);
+	const bool done = reclaim_table(table, 4, addr, vmas, scan, batch, frames);
+	scan.cursor = done ? 0 : addr.data;
+}
+
 size_t calc_required_pages(vaddr_t start, size_t size)
 {
 	const vaddr_t end{ start.data + size };
@@ -471,11 +1429,30 @@ size_t calc_required_pages(vaddr_t start, size_t size)
 	return (end_page.data - start_page.data) / PAGE_SIZE;
 }
 
-void initialize_paging()
+error_t map_identity_range(uint64_t paddr, size_t size)
+{
+	if (size == 0) {
+		return OK;
+	}
+
+	const uint64_t granule = use_1gib_pages ? PAGE_1GIB : PAGE_2MIB;
+	// align_up() works on unsigned int; these are 64-bit physical addresses
+	const uint64_t start = paddr & ~(granule - 1);
+	const uint64_t end = (paddr + size + granule - 1) & ~(granule - 1);
+
+	for (uint64_t addr = start; addr < end; addr += granule) {
+		RETURN_IF_ERROR(map_identity_granule(addr));
+	}
+
+	return OK;
+}
+
+void initialize_paging(const MemoryMap& mem_map)
 {
 	LOG_INFO("Initializing paging...");
-	setup_identity_mapping();
+	setup_identity_mapping(mem_map);
 	set_cr3(reinterpret_cast<uint64_t>(&pml4_table));
+	initialize_pcid();
 	LOG_INFO("Paging initialized successfully.");
 }
 
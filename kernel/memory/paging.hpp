@@ -10,6 +10,8 @@
 #include <cstdint>
 #include <libs/common/types.hpp>
 
+struct MemoryMap;
+
 namespace kernel::memory
 {
 
@@ -19,6 +21,9 @@ constexpr size_t PT_ENTRIES = 512;
 /// Mask for a single 9-bit page-table level index (PT_ENTRIES - 1)
 constexpr int PT_INDEX_MASK = static_cast<int>(PT_ENTRIES) - 1;
 
+/// Size of a page-directory leaf (2 MiB): PT_ENTRIES 4 KiB pages
+constexpr uint64_t HUGE_PAGE_SIZE = PT_ENTRIES * 4096;
+
 union vaddr_t {
 	uint64_t data;
 
@@ -100,7 +105,9 @@ union page_table_entry {
 		uint64_t global : 1;
 		uint64_t owned : 1; ///< OS bit: leaf page is owned (slab-backed user
 							///< page freed via ref count on clean)
-		uint64_t : 2;
+		uint64_t swapped : 1; ///< OS bit: leaf not present, address holds a
+							  ///< swap store slot (memory/swap.hpp)
+		uint64_t : 1;
 		uint64_t address : 40;
 		uint64_t : 11;
 		uint64_t no_execute : 1;
@@ -165,9 +172,118 @@ void copy_kernel_space(page_table_entry* dst);
 
 page_table_entry* clone_page_table(page_table_entry* src, bool writable);
 
-error_t handle_page_fault(uint64_t error_code, uint64_t fault_addr);
+/**
+ * @brief Create a fork of an address space that shares its page tables
+ *
+ * Only the root table is copied. Every user PML4 entry is write-protected in
+ * both tables and the PDPTs below are reference counted, so fork costs the
+ * same for any heap size; the first write below a shared table copies that
+ * one table (see handle_page_fault()), down to the data page itself.
+ *
+ * @param src Root table of the address space to fork
+ * @return page_table_entry* New root table, or nullptr on allocation failure
+ */
+page_table_entry* share_page_table(page_table_entry* src);
+
+class VaddrAllocator;
+class VmAreaTree;
+
+/**
+ * @brief Resolve a page fault on a user address
+ *
+ * Write faults on present pages unshare forked page tables and copy CoW
+ * pages. Faults on unmapped pages inside one of the areas fault the page
+ * in: a read maps the shared zero page read-only, a write allocates a
+ * private zeroed page. In a program segment the page comes from the
+ * segment's ExecImage instead: shared on a read, copied on a write. A page
+ * reclaim swapped out comes back from the swap store. Writes to read-only
+ * areas and faults outside every area are errors.
+ *
+ * @param error_code Error code pushed by the CPU
+ * @param fault_addr Faulting address (CR2)
+ * @param vmas Memory areas of the faulting address space (may be nullptr)
+ * @return OK when the access can be retried, or an error code otherwise
+ */
+error_t handle_page_fault(uint64_t error_code,
+						  uint64_t fault_addr,
+						  const VmAreaTree* vmas);
+
+/**
+ * @brief Progress of the reclaim clock, carried between
+ * reclaim_user_pages() calls
+ */
+struct ReclaimScan {
+	uint64_t cursor;	///< Next address to visit; 0 starts at the user half
+	size_t max_scan;	///< Page table entries left to visit
+	size_t max_reclaim; ///< Pages left to swap out; 0 only ages
+	error_t error;		///< Set when the swap store refused a page
+};
+
+/**
+ * @brief Advance the reclaim clock over one address space
+ *
+ * Visits the leaf entries of the user half from scan.cursor on. A present
+ * page with its accessed bit set has the bit cleared; an anonymous page
+ * this mapping owns alone whose bit is already clear is moved to the swap
+ * store (memory/swap.hpp) and its frame freed. Tables still shared with a
+ * fork and 2 MiB pages are skipped. Stops when a budget of scan runs out
+ * or the store refuses a page. The caller keeps interrupts disabled.
+ *
+ * @param table Root table of the address space
+ * @param vmas Its memory areas
+ * @param scan Budgets and cursor, updated; cursor is 0 once the walk
+ * reached the end of the address space
+ */
+void reclaim_user_pages(page_table_entry* table,
+						const VmAreaTree& vmas,
+						ReclaimScan& scan);
+
+/**
+ * @brief Unmap user pages and release the ones this mapping owns
+ *
+ * Unlike unmap_frame(), owned pages lose their reference and are freed
+ * with the last one, and swapped-out pages their swap entry. Unmapped
+ * holes in the range are skipped.
+ *
+ * @param table Root table of the address space
+ * @param addr First page, page aligned
+ * @param num_pages Number of pages
+ * @return OK, or ERR_NO_MEMORY when a table could not be unshared
+ */
+error_t release_user_pages(page_table_entry* table, vaddr_t addr, size_t num_pages);
 
+/**
+ * @brief Write-protect the mapped pages of a range
+ *
+ * Making a range writable needs no page table change: the next write
+ * faults and the fault handler grants it according to the area.
+ *
+ * @param table Root table of the address space
+ * @param addr First page, page aligned
+ * @param num_pages Number of pages
+ * @return OK, or ERR_NO_MEMORY when a table could not be unshared or split
+ */
+error_t write_protect_user_pages(page_table_entry* table,
+								 vaddr_t addr,
+								 size_t num_pages);
+
+/**
+ * @brief Map physical frames read-only at a range taken from space
+ *
+ * A 2 MiB-aligned buffer of at least 2 MiB is given a 2 MiB-aligned range
+ * and mapped with huge pages. The frames stay the caller's: unmap_frame()
+ * and then space.release() undo the mapping.
+ *
+ * @param table Root table of the address space
+ * @param space Free ranges of the window the mapping goes in
+ * @param frame First frame, page aligned
+ * @param num_pages Number of pages
+ * @param start_addr Where the first page got mapped
+ * @return OK, or ERR_NO_MEMORY when no range is free or a table could not
+ * be allocated
+ */
 error_t map_frame_to_vaddr(page_table_entry* table,
+						   VaddrAllocator& space,
 						   uint64_t frame,
 						   size_t num_pages,
 						   vaddr_t* start_addr);
@@ -176,6 +292,31 @@ error_t unmap_frame(page_table_entry* table, vaddr_t addr, size_t num_pages);
 
 size_t calc_required_pages(vaddr_t start, size_t size);
 
-void initialize_paging();
+/**
+ * @brief Identity-map a physical range in the kernel half
+ *
+ * The range is widened to whole 1 GiB pages (2 MiB when the CPU lacks
+ * PDPE1GB); mapping an already mapped range is harmless. Used for device
+ * MMIO that the firmware memory map does not describe, such as 64-bit BARs
+ * placed above RAM (issue #374).
+ *
+ * @param paddr Start physical address
+ * @param size Length in bytes
+ * @return OK on success, ERR_INVALID_ARG if the range lies beyond the
+ * PML4 slots set up at boot, ERR_NO_MEMORY if a page directory could not be
+ * allocated
+ */
+error_t map_identity_range(uint64_t paddr, size_t size);
+
+/**
+ * @brief Build the kernel identity map and switch to it
+ *
+ * Maps the low 4 GiB plus every range of the firmware memory map, using
+ * 1 GiB pages when the CPU supports them. Page tables come from the
+ * bootstrap allocator, so this runs after kernel::memory::initialize().
+ *
+ * @param mem_map Firmware memory map handed over by the loader
+ */
+void initialize_paging(const MemoryMap& mem_map);
 
 } // namespace kernel::memory
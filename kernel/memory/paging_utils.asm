@@ -35,3 +35,22 @@ global get_cr2
 get_cr2:
     mov rax, cr2
     ret
+
+global get_cr4
+get_cr4:
+    mov rax, cr4
+    ret
+
+global set_cr4 ; rdi = value
+set_cr4:
+    mov cr4, rdi
+    ret
+
+global invpcid ; void invpcid(uint64_t type, uint64_t pcid, uint64_t addr);
+invpcid:
+    ; 128-bit descriptor on the stack: PCID, then the linear address
+    push rdx
+    push rsi
+    invpcid rdi, [rsp]
+    add rsp, 16
+    ret
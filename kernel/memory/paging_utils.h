@@ -86,4 +86,28 @@ void set_cr3(uint64_t addr);
  * @return Current value of CR3 (page table base + flags)
  */
 uint64_t get_cr3();
+
+/**
+ * @brief Read the CR4 control register
+ * @return Current value of CR4
+ */
+uint64_t get_cr4();
+
+/**
+ * @brief Write to the CR4 control register
+ * @param value New value of CR4
+ */
+void set_cr4(uint64_t value);
+
+/**
+ * @brief Invalidate TLB entries by PCID
+ *
+ * @param type 0: one address of one PCID, 1: every entry of one PCID,
+ * 2: everything including global entries, 3: everything except global entries
+ * @param pcid PCID the invalidation applies to (types 0 and 1)
+ * @param addr Linear address (type 0)
+ *
+ * @note Uses the INVPCID instruction; check CPUID before calling
+ */
+void invpcid(uint64_t type, uint64_t pcid, uint64_t addr);
 }
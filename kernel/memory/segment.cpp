@@ -16,6 +16,10 @@ namespace
 std::array<segment_descriptor, 7> gdt;
 std::array<uint32_t, 26> tss;
 
+// Where faults and interrupts from user mode land for the tasks without a
+// kernel stack of their own (the boot task)
+void* boot_user_fault_stack = nullptr;
+
 static_assert((TSS >> 3) + 1 < gdt.size());
 } // namespace
 
@@ -103,15 +107,23 @@ void initialize_tss()
 	void* stack1 = allocate_stack(stack_size);
 	void* stack2 = allocate_stack(stack_size);
 	void* stack3 = allocate_stack(stack_size);
-	if (stack1 == nullptr || stack2 == nullptr) {
+	void* stack4 = allocate_stack(stack_size);
+	void* stack5 = allocate_stack(stack_size);
+	void* stack6 = allocate_stack(stack_size);
+	if (stack1 == nullptr || stack2 == nullptr || stack4 == nullptr ||
+		stack5 == nullptr || stack6 == nullptr) {
 		LOG_ERROR("Failed to allocate stack for TSS.");
 		return;
 	}
 
-	set_tss(1, stack1);
+	boot_user_fault_stack = stack1;
+	set_user_fault_stack(nullptr);
 	set_tss(7 + 2 * kernel::interrupt::IST_FOR_TIMER, stack2);
 	set_tss(7 + 2 * kernel::interrupt::IST_FOR_XHCI, stack3);
 	set_tss(7 + 2 * kernel::interrupt::IST_FOR_SWITCH_TASK, stack3);
+	set_tss(7 + 2 * kernel::interrupt::IST_FOR_PAGE_FAULT, stack4);
+	set_tss(7 + 2 * kernel::interrupt::IST_FOR_DOUBLE_FAULT, stack5);
+	set_tss(7 + 2 * kernel::interrupt::IST_FOR_DEVICE, stack6);
 
 	const uint64_t tss_addr = reinterpret_cast<uint64_t>(tss.data());
 	set_system_segment(gdt[TSS >> 3], descriptor_type::TSS_AVAILABLE, 0,
@@ -119,6 +131,18 @@ void initialize_tss()
 	gdt[(TSS >> 3) + 1].data = tss_addr >> 32;
 
 	load_tr(TSS);
+	kernel::interrupt::use_fault_stacks();
+}
+
+void set_user_fault_stack(void* top)
+{
+	set_tss(1, top != nullptr ? top : boot_user_fault_stack);
+}
+
+void* user_fault_stack()
+{
+	return reinterpret_cast<void*>(static_cast<uint64_t>(tss[1]) |
+								   static_cast<uint64_t>(tss[2]) << 32);
 }
 
 } // namespace kernel::memory
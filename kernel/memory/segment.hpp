@@ -130,4 +130,18 @@ void initialize_segmentation();
  */
 void initialize_tss();
 
+/**
+ * @brief Point RSP0 at a task's fault stack
+ *
+ * Faults and interrupts without an IST entry that arrive in user mode run
+ * on RSP0.
+ *
+ * @param top Top of the stack (fault_stack_top()), or nullptr for the boot
+ * task's
+ */
+void set_user_fault_stack(void* top);
+
+/// @brief Stack pointer RSP0 currently holds
+void* user_fault_stack();
+
 } // namespace kernel::memory
\ No newline at end of file
@@ -1,17 +1,25 @@
 #include "slab.hpp"
 #include <stdio.h>
+#include <algorithm>
+#include <array>
 #include <cstdint>
 #include <cstring>
 #include <iterator>
 #include <list>
 #include <memory>
+#include <new>
 #include <unordered_map>
 #include <utility>
 #include "bit_utils.hpp"
 #include "buddy_system.hpp"
 #include "heap_debug.hpp"
+#include "heap_profile.hpp"
+#include "interrupt/irq_guard.hpp"
+#include "kasan.hpp"
 #include "log/log.hpp"
+#include "mem_ops.hpp"
 #include "page.hpp"
+#include "swap.hpp"
 
 namespace kernel::memory
 {
@@ -31,8 +39,109 @@ MCache* get_cache_in_chain(const char* name)
 	return nullptr;
 }
 
+namespace
+{
+// The kernel runs on the BSP only; this becomes an APIC-id (or GS-based
+// per-CPU area) lookup once application processors are brought up.
+size_t this_cpu() { return 0; }
+
+// Magazines come from a cache of their own with the magazine layer off, so
+// freeing one never lands in a magazine. Created by
+// initialize_slab_allocator(); until then no cache stocks magazines.
+MCache* magazine_cache = nullptr;
+
+// Set while a cache stocks its depot: growing the magazine cache allocates
+// slab metadata, whose cache must not start stocking in turn
+bool stocking_magazines = false;
+
+void free_magazine(Magazine* mag)
+{
+	magazine_cache->free(get_page(mag)->slab(), mag);
+}
+
+#ifdef KERNEL_KASAN_ENABLED
+// Objects free()d recently, oldest first. Their shadow says free, and
+// they stay out of their cache until pushed out by newer ones (or until
+// their cache would otherwise grow), so a use after free keeps faulting
+// at the access rather than landing in the object's next owner.
+constexpr size_t QUARANTINE_CAPACITY = 256;
+constexpr size_t QUARANTINE_BYTES = 4UL * 1024 * 1024;
+
+struct Quarantine {
+	std::array<void*, QUARANTINE_CAPACITY> objects;
+	size_t count;
+	size_t bytes;
+};
+
+Quarantine quarantine{};
+
+size_t object_size_of(void* raw) { return get_page(raw)->cache()->object_size(); }
+
+// Returns the object that leaves the quarantine to make room, if any
+void* quarantine_push(void* raw)
+{
+	const kernel::interrupt::IrqGuard guard;
+	void* evicted = nullptr;
+	if (quarantine.count == QUARANTINE_CAPACITY ||
+		(quarantine.count > 0 && quarantine.bytes > QUARANTINE_BYTES)) {
+		evicted = quarantine.objects[0];
+		quarantine.bytes -= object_size_of(evicted);
+		std::copy(quarantine.objects.begin() + 1,
+				  quarantine.objects.begin() + quarantine.count,
+				  quarantine.objects.begin());
+		--quarantine.count;
+	}
+
+	quarantine.objects[quarantine.count++] = raw;
+	quarantine.bytes += object_size_of(raw);
+	return evicted;
+}
+
+bool in_quarantine(void* raw)
+{
+	const kernel::interrupt::IrqGuard guard;
+	return std::find(quarantine.objects.begin(),
+					 quarantine.objects.begin() + quarantine.count,
+					 raw) != quarantine.objects.begin() + quarantine.count;
+}
+
+// Give every quarantined object of cache back to it
+void release_quarantine(MCache* cache)
+{
+	std::array<void*, QUARANTINE_CAPACITY> released;
+	size_t num_released = 0;
+	{
+		const kernel::interrupt::IrqGuard guard;
+		size_t kept = 0;
+		for (size_t i = 0; i < quarantine.count; ++i) {
+			void* raw = quarantine.objects[i];
+			if (get_page(raw)->cache() == cache) {
+				released[num_released++] = raw;
+				quarantine.bytes -= cache->object_size();
+			} else {
+				quarantine.objects[kept++] = raw;
+			}
+		}
+		quarantine.count = kept;
+	}
+
+	// Outside the guard and the loop: freeing may allocate a magazine
+	for (size_t i = 0; i < num_released; ++i) {
+		cache->free(get_page(released[i])->slab(), released[i]);
+	}
+}
+#endif
+} // namespace
+
 MCache::MCache(const char* name, size_t object_size)
-	: object_size_(object_size), num_pages_per_slab_(0)
+	: object_size_(object_size),
+	  num_pages_per_slab_(0),
+	  magazines_enabled_(object_size <= MAGAZINE_MAX_OBJECT_SIZE),
+	  cpu_magazines_{},
+	  depot_full_(nullptr),
+	  depot_empty_(nullptr),
+	  num_depot_full_(0),
+	  num_depot_empty_(0)
 {
 	strncpy(name_, name, sizeof(name_) - 1);
 	name_[sizeof(name_) - 1] = '\0';
@@ -44,8 +153,8 @@ MCache::MCache(const char* name, size_t object_size)
 	}
 }
 
-MSlab::MSlab(void* base_addr, size_t num_objs)
-	: base_addr_(base_addr), num_in_use_(0)
+MSlab::MSlab(MCache* cache, void* base_addr, size_t num_objs)
+	: cache_(cache), base_addr_(base_addr), num_in_use_(0)
 {
 	objects_.resize(num_objs);
 
@@ -79,7 +188,7 @@ bool MCache::grow()
 	}
 
 	size_t const num_objs = bytes_per_slab / object_size_;
-	auto slab = std::make_unique<MSlab>(addr, num_objs);
+	auto slab = std::make_unique<MSlab>(this, addr, num_objs);
 
 	// Mark every page of the slab so that free() can resolve the owning
 	// cache/slab from any object address.
@@ -91,10 +200,15 @@ bool MCache::grow()
 			return false;
 		}
 
-		page->set_cache(this);
 		page->set_slab(slab.get());
 	}
 
+	slab_usage.slab_pages += num_pages_per_slab_;
+
+#ifdef KERNEL_KASAN_ENABLED
+	kasan::poison(addr, bytes_per_slab, kasan::SLAB_FREE);
+#endif
+
 	slab->set_status(SlabStatus::FREE);
 	slabs_free_.push_back(std::move(slab));
 	auto last_it = std::prev(slabs_free_.end());
@@ -105,6 +219,33 @@ bool MCache::grow()
 
 void* MCache::alloc()
 {
+	void* addr = magazines_enabled_ ? alloc_from_magazine() : nullptr;
+	if (addr == nullptr) {
+		addr = alloc_from_slab();
+		if (magazines_enabled_) {
+			stock_empty_magazines();
+		}
+	}
+
+#ifdef KERNEL_KASAN_ENABLED
+	// The whole object; alloc() narrows this down to what was asked for
+	if (addr != nullptr) {
+		kasan::unpoison(addr, object_size_);
+	}
+#endif
+
+	return addr;
+}
+
+void* MCache::alloc_from_slab()
+{
+#ifdef KERNEL_KASAN_ENABLED
+	// Reuse quarantined objects before taking fresh pages
+	if (slabs_partial_.empty() && slabs_free_.empty()) {
+		release_quarantine(this);
+	}
+#endif
+
 	if (slabs_partial_.empty()) {
 		if (slabs_free_.empty() && !grow()) {
 			LOG_ERROR("failed to grow");
@@ -131,6 +272,236 @@ void* MCache::alloc()
 	return addr;
 }
 
+void MCache::free(MSlab* slab, void* addr)
+{
+	if (magazines_enabled_) {
+		// Validates the object (double free, foreign pointer) exactly like
+		// free_object() does, so the fast path loses no checking
+		if (!slab->park_object(addr, object_size_)) {
+			return;
+		}
+
+#ifdef KERNEL_KASAN_ENABLED
+		kasan::poison(addr, object_size_, kasan::SLAB_FREE);
+#endif
+
+		if (free_to_magazine(addr)) {
+			return;
+		}
+
+		// No magazine could take it (the depot had no empty one): fall back
+		// to the slab layer
+		slab->unpark_object(addr, object_size_);
+	}
+
+	free_to_slab(slab, addr);
+}
+
+void MCache::free_to_slab(MSlab* slab, void* addr)
+{
+	if (!slab->free_object(addr, object_size_)) {
+		return;
+	}
+
+#ifdef KERNEL_KASAN_ENABLED
+	kasan::poison(addr, object_size_, kasan::SLAB_FREE);
+#endif
+
+	if (slab->status() == SlabStatus::FULL) {
+		slab->move_list(*this, SlabStatus::PARTIAL);
+	}
+
+	if (slab->is_empty()) {
+		slab->move_list(*this, SlabStatus::FREE);
+	}
+}
+
+void* MCache::alloc_from_magazine()
+{
+	// Only CPU-local state is touched here; interrupts are off just long
+	// enough that a handler allocating from the same cache cannot interleave
+	const kernel::interrupt::IrqGuard guard;
+	CpuMagazines& cpu = cpu_magazines_[this_cpu()];
+
+	if (cpu.loaded == nullptr || cpu.loaded->is_empty()) {
+		if (cpu.previous != nullptr && !cpu.previous->is_empty()) {
+			std::swap(cpu.loaded, cpu.previous);
+		} else if (depot_full_ != nullptr) {
+			// Trade the empty previous magazine for a full one
+			if (cpu.previous != nullptr) {
+				cpu.previous->next = depot_empty_;
+				depot_empty_ = cpu.previous;
+				++num_depot_empty_;
+			}
+			cpu.previous = cpu.loaded;
+			cpu.loaded = depot_full_;
+			depot_full_ = depot_full_->next;
+			--num_depot_full_;
+		} else {
+			return nullptr;
+		}
+	}
+
+	void* addr = cpu.loaded->objects[--cpu.loaded->rounds];
+	get_page(addr)->slab()->unpark_object(addr, object_size_);
+
+	return addr;
+}
+
+bool MCache::free_to_magazine(void* addr)
+{
+	const kernel::interrupt::IrqGuard guard;
+	CpuMagazines& cpu = cpu_magazines_[this_cpu()];
+
+	if (cpu.loaded == nullptr || cpu.loaded->is_full()) {
+		if (cpu.previous != nullptr && !cpu.previous->is_full()) {
+			std::swap(cpu.loaded, cpu.previous);
+		} else {
+			// Trade the full previous magazine for an empty one. None is
+			// allocated here: this runs inside a free, with interrupts off
+			Magazine* empty = depot_empty_;
+			if (empty == nullptr) {
+				return false;
+			}
+			depot_empty_ = empty->next;
+			--num_depot_empty_;
+
+			if (cpu.previous != nullptr) {
+				if (num_depot_full_ >= MAGAZINE_DEPOT_LIMIT) {
+					// The depot already covers the working set: give the
+					// surplus back to the slabs instead of hoarding it
+					drain_magazine(cpu.previous);
+					cpu.previous->next = depot_empty_;
+					depot_empty_ = cpu.previous;
+					++num_depot_empty_;
+				} else {
+					cpu.previous->next = depot_full_;
+					depot_full_ = cpu.previous;
+					++num_depot_full_;
+				}
+			}
+			cpu.previous = cpu.loaded;
+			cpu.loaded = empty;
+		}
+	}
+
+	cpu.loaded->objects[cpu.loaded->rounds++] = addr;
+
+	return true;
+}
+
+void MCache::drain_magazine(Magazine* mag)
+{
+	while (!mag->is_empty()) {
+		void* addr = mag->objects[--mag->rounds];
+		MSlab* slab = get_page(addr)->slab();
+		slab->unpark_object(addr, object_size_);
+		free_to_slab(slab, addr);
+	}
+}
+
+void MCache::stock_empty_magazines()
+{
+	if (magazine_cache == nullptr || stocking_magazines) {
+		return;
+	}
+
+	stocking_magazines = true;
+	while (num_depot_empty_ < MAGAZINE_DEPOT_LIMIT) {
+		void* mem = magazine_cache->alloc();
+		if (mem == nullptr) {
+			break;
+		}
+
+		auto* mag = new (mem) Magazine{};
+		const kernel::interrupt::IrqGuard guard;
+		mag->next = depot_empty_;
+		depot_empty_ = mag;
+		++num_depot_empty_;
+	}
+	stocking_magazines = false;
+}
+
+void MCache::drain_magazines()
+{
+	const kernel::interrupt::IrqGuard guard;
+
+	// Detach every magazine before draining or freeing any, so nothing
+	// below can reach one through the per-CPU slots or the depot
+	Magazine* detached = nullptr;
+	auto detach = [&detached](Magazine* mag) {
+		if (mag != nullptr) {
+			mag->next = detached;
+			detached = mag;
+		}
+	};
+
+	for (auto& cpu : cpu_magazines_) {
+		detach(cpu.loaded);
+		detach(cpu.previous);
+		cpu = CpuMagazines{};
+	}
+
+	for (auto* list : { &depot_full_, &depot_empty_ }) {
+		while (*list != nullptr) {
+			Magazine* mag = *list;
+			*list = mag->next;
+			detach(mag);
+		}
+	}
+
+	num_depot_full_ = 0;
+	num_depot_empty_ = 0;
+
+	while (detached != nullptr) {
+		Magazine* mag = detached;
+		detached = mag->next;
+		drain_magazine(mag);
+		free_magazine(mag);
+	}
+}
+
+void MCache::set_magazines_enabled(bool enabled)
+{
+	magazines_enabled_ = enabled;
+	if (!enabled) {
+		drain_magazines();
+	}
+}
+
+size_t MCache::shrink()
+{
+	const kernel::interrupt::IrqGuard guard;
+	drain_magazines();
+
+	const size_t bytes_per_slab = num_pages_per_slab_ * PAGE_SIZE;
+	size_t released = 0;
+	while (!slabs_free_.empty()) {
+		// Off the list first: destroying the slab frees its metadata, which
+		// may empty (and list) another slab of this cache
+		std::unique_ptr<MSlab> slab = std::move(slabs_free_.front());
+		slabs_free_.pop_front();
+
+		void* addr = slab->base_addr();
+		for (size_t i = 0; i < num_pages_per_slab_; ++i) {
+			get_page(static_cast<char*>(addr) + i * PAGE_SIZE)->set_slab(nullptr);
+		}
+		slab.reset();
+
+#ifdef KERNEL_HEAP_DEBUG_ENABLED
+		heap_debug::on_release(addr, bytes_per_slab, object_size_);
+#endif
+#ifdef KERNEL_KASAN_ENABLED
+		kasan::unpoison(addr, bytes_per_slab);
+#endif
+		memory_manager->free(addr, bytes_per_slab);
+		slab_usage.slab_pages -= num_pages_per_slab_;
+		released += num_pages_per_slab_;
+	}
+
+	return released;
+}
+
 namespace
 {
 // Single lookup shared by both ends of the move in move_list(), instead of
@@ -212,6 +583,41 @@ bool MSlab::free_object(void* addr, size_t obj_size)
 	return true;
 }
 
+bool MSlab::park_object(void* addr, size_t obj_size)
+{
+	const uintptr_t offset = reinterpret_cast<uintptr_t>(addr) -
+							 reinterpret_cast<uintptr_t>(base_addr_);
+	if (offset % obj_size != 0) {
+		LOG_ERROR("free: %p is not an object boundary", addr);
+		return false;
+	}
+
+	const size_t objs_index = offset / obj_size;
+	if (objs_index >= objects_.size()) {
+		LOG_ERROR("free: %p is out of slab range", addr);
+		return false;
+	}
+
+	if (!objects_[objs_index].is_in_use()) {
+		LOG_ERROR("double free detected at address: %p", addr);
+		return false;
+	}
+
+	objects_[objs_index].set_in_use(false);
+
+	return true;
+}
+
+void MSlab::unpark_object(void* addr, size_t obj_size)
+{
+	const uintptr_t offset = reinterpret_cast<uintptr_t>(addr) -
+							 reinterpret_cast<uintptr_t>(base_addr_);
+	const size_t objs_index = offset / obj_size;
+
+	objects_[objs_index].increase_usage_count();
+	objects_[objs_index].set_in_use(true);
+}
+
 bool MSlab::is_object_in_use(void* addr, size_t obj_size) const
 {
 	const uintptr_t offset = reinterpret_cast<uintptr_t>(addr) -
@@ -228,6 +634,197 @@ bool MSlab::is_object_in_use(void* addr, size_t obj_size) const
 	return objects_[objs_index].is_in_use();
 }
 
+SlabUsage slab_usage{};
+
+namespace
+{
+
+size_t* usage_counter(PageUsage usage)
+{
+	switch (usage) {
+		case PageUsage::PAGE_TABLE:
+			return &slab_usage.page_table_pages;
+		case PageUsage::OOL:
+			return &slab_usage.ool_pages;
+		default:
+			return nullptr;
+	}
+}
+
+// Tag the first page of a raw slab object so free() can find the counter
+// again. Only page-sized objects are tagged: smaller ones share a page.
+void account_object(void* raw, size_t object_size, unsigned flags)
+{
+	if (object_size < PAGE_SIZE) {
+		return;
+	}
+
+	PageUsage usage = PageUsage::NONE;
+	if ((flags & ALLOC_PAGE_TABLE) != 0) {
+		usage = PageUsage::PAGE_TABLE;
+	} else if ((flags & ALLOC_OOL) != 0) {
+		usage = PageUsage::OOL;
+	} else {
+		return;
+	}
+
+	Page* page = get_page(raw);
+	if (page == nullptr) {
+		return;
+	}
+
+	page->set_usage(usage);
+	*usage_counter(usage) += object_size / PAGE_SIZE;
+}
+
+void unaccount_object(Page* page, size_t object_size)
+{
+	size_t* counter = usage_counter(page->usage());
+	if (counter == nullptr) {
+		return;
+	}
+
+	*counter -= object_size / PAGE_SIZE;
+	page->set_usage(PageUsage::NONE);
+}
+
+// Object size of the cache alloc() serves a request from
+size_t class_size(size_t size, int align)
+{
+#ifdef KERNEL_HEAP_DEBUG_ENABLED
+	// Room for the tail redzone after the payload
+	size += heap_debug::redzone_reserve();
+#elif defined(KERNEL_KASAN_ENABLED)
+	size += kasan::REDZONE_SIZE;
+#endif
+	return 1UL << bit_width_ceil(size + align - 1);
+}
+
+MCache* cache_for(size_t object_size)
+{
+	char name[20];
+	sprintf(name, "cache-%d", static_cast<int>(object_size));
+
+	auto* cache = get_cache_in_chain(name);
+	if (cache == nullptr) {
+		cache = &m_cache_create(name, object_size);
+	}
+
+	return cache;
+}
+
+// Drain every cache's magazines, then release the slabs left empty
+size_t shrink_slab_caches()
+{
+	for (auto& cache : cache_chain) {
+		cache->drain_magazines();
+	}
+
+	size_t released = 0;
+	for (auto& cache : cache_chain) {
+		released += cache->shrink();
+	}
+
+	return released;
+}
+
+// Objects of the class alloc(PAGE_SIZE) lands in, zeroed ahead of time.
+// The cache counts them as allocated until free() returns them.
+struct ZeroPool {
+	std::array<void*, ZERO_POOL_CAPACITY> objects;
+	size_t count;
+	size_t hits;
+	size_t misses;
+};
+
+ZeroPool zero_pool{};
+
+size_t zero_pool_class() { return class_size(PAGE_SIZE, 1); }
+
+void* zero_pool_pop()
+{
+	const kernel::interrupt::IrqGuard guard;
+	if (zero_pool.count == 0) {
+		++zero_pool.misses;
+		return nullptr;
+	}
+
+	++zero_pool.hits;
+	return zero_pool.objects[--zero_pool.count];
+}
+
+bool zero_pool_push(void* raw)
+{
+	const kernel::interrupt::IrqGuard guard;
+	if (zero_pool.count == ZERO_POOL_CAPACITY) {
+		return false;
+	}
+
+	zero_pool.objects[zero_pool.count++] = raw;
+	return true;
+}
+
+void release_raw(void* raw)
+{
+	Page* p = get_page(raw);
+	p->cache()->free(p->slab(), raw);
+}
+
+// Objects set aside for ALLOC_ATOMIC requests, one stack per power-of-two
+// class. Like the zero pool, the caches count them as allocated.
+constexpr size_t NUM_RESERVE_CLASSES = RESERVE_MAX_SHIFT - RESERVE_MIN_SHIFT + 1;
+
+struct EmergencyReserve {
+	std::array<std::array<void*, RESERVE_CAPACITY>, NUM_RESERVE_CLASSES> objects;
+	std::array<size_t, NUM_RESERVE_CLASSES> counts;
+	size_t hits;
+	size_t misses;
+};
+
+EmergencyReserve reserve{};
+
+size_t reserve_class_size(size_t index)
+{
+	return 1UL << (RESERVE_MIN_SHIFT + index);
+}
+
+// An object of the smallest class that fits size and still has one; a
+// larger object than asked for beats failing an interrupt handler
+void* reserve_pop(size_t size)
+{
+	const kernel::interrupt::IrqGuard guard;
+	for (size_t i = 0; i < NUM_RESERVE_CLASSES; ++i) {
+		if (reserve_class_size(i) < size || reserve.counts[i] == 0) {
+			continue;
+		}
+
+		++reserve.hits;
+		return reserve.objects[i][--reserve.counts[i]];
+	}
+
+	++reserve.misses;
+	return nullptr;
+}
+
+bool reserve_push(size_t index, void* raw)
+{
+	const kernel::interrupt::IrqGuard guard;
+	if (reserve.counts[index] == RESERVE_CAPACITY) {
+		return false;
+	}
+
+	reserve.objects[index][reserve.counts[index]++] = raw;
+	return true;
+}
+
+size_t reserve_count(size_t index)
+{
+	const kernel::interrupt::IrqGuard guard;
+	return reserve.counts[index];
+}
+
+} // namespace
+
 // Table mapping an aligned allocation back to the raw slab object it was
 // carved from; only used on the non-heap-debug path (see alloc()/free()
 // below), where alignment padding must be undone before resolving the page.
@@ -254,34 +851,61 @@ void* alloc(size_t size, unsigned flags, int align)
 		return nullptr;
 	}
 
-#ifdef KERNEL_HEAP_DEBUG_ENABLED
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+	const size_t requested = size;
+#endif
+
+#if defined(KERNEL_HEAP_DEBUG_ENABLED) || defined(KERNEL_KASAN_ENABLED)
 	// Reserve room for the head and tail redzones around the payload before
 	// rounding up to a cache size class.
 	const size_t user_size = size;
-	size = 1UL << bit_width_ceil(size + align - 1 + heap_debug::redzone_reserve());
+	size = class_size(size, align);
 	if (size > MAX_ALLOC_SIZE) {
-		LOG_ERROR("alloc: size %lu too large once heap-debug redzones are added",
-				  user_size);
+		LOG_ERROR("alloc: size %lu too large once redzones are added", user_size);
 		return nullptr;
 	}
 #else
-	size = 1UL << bit_width_ceil(size + align - 1);
+	size = class_size(size, align);
 #endif
 
-	char name[20];
-	sprintf(name, "cache-%d", static_cast<int>(size));
+	auto* cache = cache_for(size);
 
-	auto* cache = get_cache_in_chain(name);
-	if (cache == nullptr) {
-		cache = &m_cache_create(name, size);
+	// Zeroed requests of the page-sized class pop an object the idle task
+	// already cleared
+	const bool zeroed = (flags & ALLOC_ZEROED) != 0;
+	void* addr = zeroed && size == zero_pool_class() ? zero_pool_pop() : nullptr;
+	const bool prezeroed = addr != nullptr;
+	if (addr == nullptr) {
+		addr = cache->alloc();
+	}
+	if (addr == nullptr && drain_zero_pool() != 0) {
+		addr = cache->alloc();
+	}
+	// Objects idle in magazines keep whole slabs of other classes busy:
+	// drain them and give the emptied slabs back to the buddy system
+	if (addr == nullptr && shrink_slab_caches() != 0) {
+		addr = cache->alloc();
+	}
+	// Page-sized objects also come back by swapping out cold user pages
+	if (addr == nullptr && size == zero_pool_class() &&
+		(flags & ALLOC_NO_RECLAIM) == 0 && swap::reclaim(swap::RECLAIM_BATCH) != 0) {
+		addr = cache->alloc();
+	}
+	// Atomic requests cannot wait for memory to come back: they fall back on
+	// the reserve, whose object may belong to a larger class
+	if (addr == nullptr && (flags & ALLOC_ATOMIC) == ALLOC_ATOMIC) {
+		addr = reserve_pop(size);
+		if (addr != nullptr) {
+			cache = get_page(addr)->cache();
+		}
 	}
-
-	void* addr = cache->alloc();
 	if (addr == nullptr) {
 		LOG_ERROR("failed to allocate memory");
 		return nullptr;
 	}
 
+	account_object(addr, cache->object_size(), flags);
+
 #ifdef KERNEL_HEAP_DEBUG_ENABLED
 	// on_alloc lays the tail redzone, checks the freed-poison, records
 	// provenance, and hands back the object boundary (natural alignment kept).
@@ -289,12 +913,20 @@ void* alloc(size_t size, unsigned flags, int align)
 	addr = heap_debug::on_alloc(addr, user_size, cache->object_size(),
 								__builtin_return_address(0));
 
-	if ((flags & ALLOC_ZEROED) != 0) {
+	if (zeroed && !prezeroed) {
 		memset(addr, 0, user_size);
 	}
 
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+	heap_profile::on_alloc(addr, requested);
+#endif
+
 	return addr;
 #else
+#ifdef KERNEL_KASAN_ENABLED
+	void* const raw = addr;
+#endif
+
 	if (align != 1) {
 		auto* aligned_addr = reinterpret_cast<void*>(
 				align_up(reinterpret_cast<uintptr_t>(addr), align));
@@ -306,10 +938,20 @@ void* alloc(size_t size, unsigned flags, int align)
 		addr = aligned_addr;
 	}
 
-	if ((flags & ALLOC_ZEROED) != 0) {
+#ifdef KERNEL_KASAN_ENABLED
+	// Only the requested bytes are addressable, so an overflow into the
+	// rest of the object faults at the access
+	kasan::on_alloc(raw, cache->object_size(), addr, user_size);
+#endif
+
+	if (zeroed && !prezeroed) {
 		memset(addr, 0, size);
 	}
 
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+	heap_profile::on_alloc(addr, requested);
+#endif
+
 	return addr;
 #endif
 }
@@ -320,6 +962,10 @@ void free(void* addr)
 		return;
 	}
 
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+	heap_profile::on_free(addr);
+#endif
+
 #ifdef KERNEL_HEAP_DEBUG_ENABLED
 	// Validate the payload pointer, check its redzones, poison the object, and
 	// translate back to the raw slab object. A double/invalid free returns
@@ -329,6 +975,13 @@ void free(void* addr)
 		return;
 	}
 #else
+#ifdef KERNEL_KASAN_ENABLED
+	// A double or invalid free has been reported already
+	if (!kasan::check_free(addr, __builtin_return_address(0))) {
+		return;
+	}
+#endif
+
 	auto it = aligned_to_raw_addr_map.find(addr);
 	if (it != aligned_to_raw_addr_map.end()) {
 		addr = it->second;
@@ -349,17 +1002,24 @@ void free(void* addr)
 		return;
 	}
 
-	if (!slab->free_object(addr, cache->object_size())) {
-		return;
-	}
+	unaccount_object(p, cache->object_size());
 
-	if (slab->status() == SlabStatus::FULL) {
-		slab->move_list(*cache, SlabStatus::PARTIAL);
-	}
+#ifdef KERNEL_KASAN_ENABLED
+	// Anything but a live object goes straight to the cache, which reports it
+	if (slab->is_object_in_use(addr, cache->object_size())) {
+		kasan::poison(addr, cache->object_size(), kasan::SLAB_FREE);
+		addr = quarantine_push(addr);
+		if (addr == nullptr) {
+			return;
+		}
 
-	if (slab->is_empty()) {
-		slab->move_list(*cache, SlabStatus::FREE);
+		p = get_page(addr);
+		cache = p->cache();
+		slab = p->slab();
 	}
+#endif
+
+	cache->free(slab, addr);
 }
 
 bool is_slab_object_in_use(void* addr)
@@ -382,6 +1042,13 @@ bool is_slab_object_in_use(void* addr)
 	}
 #endif
 
+#ifdef KERNEL_KASAN_ENABLED
+	// Still counted by its slab, but freed as far as callers are concerned
+	if (in_quarantine(addr)) {
+		return false;
+	}
+#endif
+
 	Page* p = get_page(addr);
 	if (p == nullptr || p->cache() == nullptr || p->slab() == nullptr) {
 		return false;
@@ -390,6 +1057,109 @@ bool is_slab_object_in_use(void* addr)
 	return p->slab()->is_object_in_use(addr, p->cache()->object_size());
 }
 
+size_t refill_zero_pool(size_t max_objects)
+{
+	MCache* cache = cache_for(zero_pool_class());
+	const size_t num_pages = cache->object_size() / PAGE_SIZE;
+
+	size_t added = 0;
+	while (added < max_objects && zero_pool_stats().pooled < ZERO_POOL_CAPACITY) {
+		void* raw = cache->alloc();
+		if (raw == nullptr) {
+			break;
+		}
+
+#ifdef KERNEL_HEAP_DEBUG_ENABLED
+		heap_debug::on_reserve(raw, __builtin_return_address(0));
+#endif
+		// Nothing reads the object until some later allocation: keep it out
+		// of the cache
+		clear_pages(raw, num_pages);
+#ifdef KERNEL_KASAN_ENABLED
+		kasan::poison(raw, cache->object_size(), kasan::SLAB_FREE);
+#endif
+
+		if (!zero_pool_push(raw)) {
+			// Another refill got there first
+			release_raw(raw);
+			break;
+		}
+		++added;
+	}
+
+	return added;
+}
+
+size_t drain_zero_pool()
+{
+	size_t drained = 0;
+	while (true) {
+		void* raw = nullptr;
+		{
+			const kernel::interrupt::IrqGuard guard;
+			if (zero_pool.count == 0) {
+				break;
+			}
+			raw = zero_pool.objects[--zero_pool.count];
+		}
+
+		release_raw(raw);
+		++drained;
+	}
+
+	return drained;
+}
+
+ZeroPoolStats zero_pool_stats()
+{
+	const kernel::interrupt::IrqGuard guard;
+	return ZeroPoolStats{ zero_pool.count, zero_pool.hits, zero_pool.misses };
+}
+
+size_t refill_emergency_reserve()
+{
+	size_t added = 0;
+	for (size_t i = 0; i < NUM_RESERVE_CLASSES; ++i) {
+		if (reserve_count(i) >= RESERVE_LOW_WATERMARK) {
+			continue;
+		}
+
+		MCache* cache = cache_for(reserve_class_size(i));
+		while (reserve_count(i) < RESERVE_CAPACITY) {
+			void* raw = cache->alloc();
+			if (raw == nullptr) {
+				break;
+			}
+
+#ifdef KERNEL_HEAP_DEBUG_ENABLED
+			heap_debug::on_reserve(raw, __builtin_return_address(0));
+#endif
+#ifdef KERNEL_KASAN_ENABLED
+			kasan::poison(raw, cache->object_size(), kasan::SLAB_FREE);
+#endif
+
+			if (!reserve_push(i, raw)) {
+				release_raw(raw);
+				break;
+			}
+			++added;
+		}
+	}
+
+	return added;
+}
+
+ReserveStats emergency_reserve_stats()
+{
+	const kernel::interrupt::IrqGuard guard;
+	size_t pooled = 0;
+	for (size_t count : reserve.counts) {
+		pooled += count;
+	}
+
+	return ReserveStats{ pooled, reserve.hits, reserve.misses };
+}
+
 std::list<std::unique_ptr<MCache>> cache_chain;
 
 void initialize_slab_allocator()
@@ -398,12 +1168,26 @@ void initialize_slab_allocator()
 
 	aligned_to_raw_addr_map = std::unordered_map<void*, void*>();
 
+	// The pooled objects belong to the caches dropped below
+	zero_pool = ZeroPool{};
+	reserve = EmergencyReserve{};
+#ifdef KERNEL_KASAN_ENABLED
+	quarantine = Quarantine{};
+#endif
+	magazine_cache = nullptr;
 	cache_chain.clear();
 
+	magazine_cache = &m_cache_create("magazine", sizeof(Magazine));
+	magazine_cache->set_magazines_enabled(false);
+
 #ifdef KERNEL_HEAP_DEBUG_ENABLED
 	heap_debug::initialize();
 #endif
 
+	// Filled while memory is plentiful, so the first interrupt under
+	// pressure already finds it
+	refill_emergency_reserve();
+
 	LOG_INFO("Initializing slab allocator successfully.");
 }
 
@@ -18,12 +18,53 @@
 #include <memory>
 #include <vector>
 #include "error.hpp"
+#include "memory/page.hpp"
 
 namespace kernel::memory
 {
 
 constexpr int ALLOC_UNINITIALIZED = 0;
 constexpr int ALLOC_ZEROED = (1 << 0);
+/// Account the object's frames as page tables (see SlabUsage)
+constexpr int ALLOC_PAGE_TABLE = (1 << 1);
+/// Account the object's frames as IPC OOL buffers (see SlabUsage)
+constexpr int ALLOC_OOL = (1 << 2);
+/// Never swap out user pages to make room (callers reclaim itself depends on)
+constexpr int ALLOC_NO_RECLAIM = (1 << 3);
+/// Interrupt and I/O completion paths: no reclaim, and the emergency
+/// reserve may be used once the caches are exhausted (see
+/// refill_emergency_reserve())
+constexpr int ALLOC_ATOMIC = ALLOC_NO_RECLAIM | (1 << 4);
+
+/// Objects the pre-zeroed page pool holds at most (see refill_zero_pool())
+constexpr size_t ZERO_POOL_CAPACITY = 64;
+
+/// Size classes the emergency reserve keeps objects of: 2^RESERVE_MIN_SHIFT
+/// bytes up to 2^RESERVE_MAX_SHIFT (a page-sized request with redzones)
+constexpr size_t RESERVE_MIN_SHIFT = 5;
+constexpr size_t RESERVE_MAX_SHIFT = 13;
+
+/// Objects the emergency reserve holds per size class when full
+constexpr size_t RESERVE_CAPACITY = 8;
+
+/// A class is refilled once it holds fewer objects than this
+constexpr size_t RESERVE_LOW_WATERMARK = 4;
+
+/// Upper bound on the CPUs the per-CPU magazine layer keeps slots for. The
+/// kernel still runs on the BSP only, so every caller lands in slot 0.
+constexpr size_t MAX_CPUS = 1;
+
+/// Rounds (objects) a single magazine holds
+constexpr size_t MAGAZINE_SIZE = 16;
+
+/// Full magazines the depot keeps per cache before surplus ones are drained
+/// back into their slabs, so an idle cache cannot pin memory indefinitely.
+/// Also the number of empty ones it is stocked with ahead of frees.
+constexpr size_t MAGAZINE_DEPOT_LIMIT = 4;
+
+/// Largest object size served through magazines. Bigger objects are rare
+/// and back whole pages each; caching them would only hoard memory.
+constexpr size_t MAGAZINE_MAX_OBJECT_SIZE = PAGE_SIZE;
 
 enum class SlabStatus : uint8_t {
 	FULL,
@@ -52,7 +93,15 @@ class MCache;
 class MSlab
 {
 public:
-	MSlab(void* base_addr, size_t num_objs);
+	MSlab(MCache* cache, void* base_addr, size_t num_objs);
+
+	/**
+	 * @brief Cache this slab was grown for
+	 *
+	 * Page descriptors only store the slab, so this is how get_page() users
+	 * reach the owning cache.
+	 */
+	MCache* cache() const { return cache_; }
 
 	void set_position_in_list(std::list<std::unique_ptr<MSlab>>::iterator it)
 	{
@@ -86,10 +135,33 @@ public:
 	 */
 	bool is_object_in_use(void* addr, size_t obj_size) const;
 
+	/**
+	 * @brief Hand an object over to the magazine layer
+	 *
+	 * The object stays counted against this slab (it is neither on the free
+	 * index list nor reusable by alloc_object), but is no longer in use, so
+	 * a second free() of it is still detected.
+	 *
+	 * @param addr Object being freed by its owner
+	 * @param obj_size Object size of the owning cache
+	 * @return true on success, false if addr is not a live object of this slab
+	 */
+	bool park_object(void* addr, size_t obj_size);
+
+	/**
+	 * @brief Take an object back out of the magazine layer for a new owner
+	 * @param addr Object previously passed to park_object()
+	 * @param obj_size Object size of the owning cache
+	 */
+	void unpark_object(void* addr, size_t obj_size);
+
 	void move_list(MCache& cache, SlabStatus to);
 
+	void* base_addr() const { return base_addr_; }
+
 private:
 	std::list<std::unique_ptr<MSlab>>::iterator position_in_list_;
+	MCache* cache_;
 	std::vector<MObject> objects_;
 	void* base_addr_;
 	size_t num_in_use_;
@@ -97,6 +169,35 @@ private:
 	SlabStatus status_;
 };
 
+/**
+ * @brief Fixed-capacity stack of free objects (Bonwick's magazine)
+ *
+ * Magazines circulate between the per-CPU layer and the cache's depot: a
+ * CPU allocates by popping rounds off its loaded magazine and frees by
+ * pushing onto it, and only swaps whole magazines with the depot when the
+ * loaded one runs empty or full.
+ */
+struct Magazine {
+	Magazine* next; ///< Link in the depot's full or empty list
+	size_t rounds;	///< Number of objects currently held
+	void* objects[MAGAZINE_SIZE];
+
+	bool is_empty() const { return rounds == 0; }
+	bool is_full() const { return rounds == MAGAZINE_SIZE; }
+};
+
+/**
+ * @brief Per-CPU magazine pair of one cache
+ *
+ * Keeping the previously loaded magazine around absorbs alloc/free
+ * patterns that oscillate around a magazine boundary without a depot
+ * round trip (Bonwick's loaded/previous scheme).
+ */
+struct CpuMagazines {
+	Magazine* loaded;
+	Magazine* previous;
+};
+
 class MCache
 {
 public:
@@ -108,14 +209,66 @@ public:
 	bool grow();
 	void* alloc();
 
+	/**
+	 * @brief Return an object to this cache
+	 * @param slab Slab owning addr (resolved through the page metadata)
+	 * @param addr Object to free
+	 */
+	void free(MSlab* slab, void* addr);
+
+	/**
+	 * @brief Turn the per-CPU magazine layer on or off for this cache
+	 *
+	 * Disabling drains every cached object back into its slab first.
+	 * Caches above MAGAZINE_MAX_OBJECT_SIZE start out disabled.
+	 *
+	 * @param enabled Whether alloc()/free() go through magazines
+	 */
+	void set_magazines_enabled(bool enabled);
+
+	bool magazines_enabled() const { return magazines_enabled_; }
+
+	/**
+	 * @brief Return every object held in magazines to its slab
+	 *
+	 * Releases the magazines themselves as well; the layer refills lazily.
+	 */
+	void drain_magazines();
+
+	/**
+	 * @brief Drain the magazines and give the empty slabs back to the buddy
+	 * system
+	 * @return Pages released
+	 */
+	size_t shrink();
+
 	std::list<std::unique_ptr<MSlab>> slabs_full_;
 	std::list<std::unique_ptr<MSlab>> slabs_partial_;
 	std::list<std::unique_ptr<MSlab>> slabs_free_;
 
 private:
+	void* alloc_from_slab();
+	void free_to_slab(MSlab* slab, void* addr);
+
+	void* alloc_from_magazine();
+	bool free_to_magazine(void* addr);
+
+	/// Give every round of mag back to its slab and leave it empty
+	void drain_magazine(Magazine* mag);
+
+	/// Fill the depot with empty magazines, which free() cannot allocate
+	void stock_empty_magazines();
+
 	char name_[20];
 	size_t object_size_;
 	size_t num_pages_per_slab_;
+
+	bool magazines_enabled_;
+	CpuMagazines cpu_magazines_[MAX_CPUS];
+	Magazine* depot_full_;	///< Depot: magazines with MAGAZINE_SIZE rounds
+	Magazine* depot_empty_; ///< Depot: magazines with no rounds
+	size_t num_depot_full_;
+	size_t num_depot_empty_;
 };
 
 extern std::list<std::unique_ptr<MCache>> cache_chain;
@@ -189,6 +342,79 @@ inline unique_kbuf<> make_kbuf(size_t size, unsigned flags, int align = 1)
 	return unique_kbuf<>(alloc(size, flags, align));
 }
 
+/**
+ * @brief Frame counters maintained by the slab allocator
+ *
+ * slab_pages grows as caches grow. page_table_pages and ool_pages are the
+ * subsets of it handed out with ALLOC_PAGE_TABLE / ALLOC_OOL; free() drops
+ * them again, so reading any field is O(1).
+ */
+struct SlabUsage {
+	size_t slab_pages;
+	size_t page_table_pages;
+	size_t ool_pages;
+};
+
+extern SlabUsage slab_usage;
+
+/**
+ * @brief Counters of the pre-zeroed page pool
+ *
+ * A hit is an ALLOC_ZEROED request of the page-sized class served from the
+ * pool; a miss is one that found it empty and zeroed synchronously.
+ */
+struct ZeroPoolStats {
+	size_t pooled; ///< Objects in the pool now
+	size_t hits;
+	size_t misses;
+};
+
+/**
+ * @brief Zero objects of the page-sized class ahead of ALLOC_ZEROED requests
+ *
+ * Takes objects from their cache and clears them with non-temporal stores
+ * until the pool holds ZERO_POOL_CAPACITY objects. Called by the idle task,
+ * so zeroed page allocations become a pop off the pool.
+ *
+ * @param max_objects Objects to add at most in this call
+ * @return Objects added (0 when the pool is full or memory ran out)
+ */
+size_t refill_zero_pool(size_t max_objects);
+
+/**
+ * @brief Give every pooled object back to its cache
+ * @return Objects returned
+ */
+size_t drain_zero_pool();
+
+ZeroPoolStats zero_pool_stats();
+
+/**
+ * @brief Counters of the emergency reserve
+ *
+ * A hit is an ALLOC_ATOMIC request its cache could not serve that the
+ * reserve did; a miss is one that found the reserve empty too and failed.
+ */
+struct ReserveStats {
+	size_t pooled; ///< Objects in the reserve now, all classes
+	size_t hits;
+	size_t misses;
+};
+
+/**
+ * @brief Top up the emergency reserve
+ *
+ * Every size class holding fewer than RESERVE_LOW_WATERMARK objects is
+ * filled back to RESERVE_CAPACITY from its cache; the others are left alone,
+ * so calling this often costs a scan of the counts. Called by the idle task
+ * and the swap task's sweep, which run when memory may have come back.
+ *
+ * @return Objects added
+ */
+size_t refill_emergency_reserve();
+
+ReserveStats emergency_reserve_stats();
+
 /**
  * @brief Initialize the slab allocator
  * @note Must be called once during kernel initialization
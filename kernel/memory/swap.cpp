@@ -0,0 +1,632 @@
+/**
+ * @file memory/swap.cpp
+ * @brief Swap store, reclaim clock and the swap task
+ *
+ * Entries live in a fixed table and sit on at most one list: ram_list (in
+ * RAM, oldest first, the write-out order) or read_list (only on disk, a
+ * fault is waiting for it). An entry the swap task is reading or writing is
+ * on neither and marked IO_BUSY; releasing its last reference then only
+ * marks it DEAD, and the swap task frees it once the I/O is over.
+ *
+ * All of the state is shared with page faults and alloc(), so it is only
+ * touched under an IrqGuard. The swap task drops the guard around its
+ * block device calls.
+ */
+
+#include "memory/swap.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <libs/common/message.hpp>
+#include <libs/common/process_id.hpp>
+#include <libs/common/types.hpp>
+#include "fs/fat/fat.hpp"
+#include "hardware/virtio/blk.hpp"
+#include "interrupt/irq_guard.hpp"
+#include "log/log.hpp"
+#include "memory/lz4.hpp"
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/slab.hpp"
+#include "task/ipc.hpp"
+#include "task/task.hpp"
+#include "timers/timer.hpp"
+
+namespace kernel::memory::swap
+{
+namespace
+{
+
+using kernel::interrupt::IrqGuard;
+using kernel::task::Task;
+
+constexpr uint32_t NIL = UINT32_MAX;
+
+// Slab size classes are powers of two, so a copy larger than this takes
+// a whole page-sized object and frees nothing
+constexpr size_t MAX_COMPRESSED_SIZE = PAGE_SIZE / 2;
+
+// Every entry fits one disk slot, and there is a slot for every entry
+constexpr size_t DISK_SLOT_SECTORS = MAX_COMPRESSED_SIZE / SECTOR_SIZE;
+constexpr size_t DISK_SLOTS = DISK_AREA_SIZE / MAX_COMPRESSED_SIZE;
+constexpr uint64_t DISK_AREA_SECTORS = DISK_AREA_SIZE / SECTOR_SIZE;
+static_assert(DISK_SLOTS >= MAX_ENTRIES);
+
+// Page table entries the sweep ages per tick, and a direct reclaim visits
+// at most before it gives up
+constexpr size_t AGE_SCAN_BATCH = 2048;
+constexpr size_t RECLAIM_SCAN_LIMIT = 65536;
+
+// Entry flags
+constexpr uint8_t IO_BUSY = 1 << 0;		///< The swap task is reading or writing it
+constexpr uint8_t READ_QUEUED = 1 << 1; ///< On read_list
+constexpr uint8_t DEAD = 1 << 2;		///< Released during its I/O
+
+struct Entry {
+	void* data;		   ///< Compressed page; nullptr while only on disk
+	uint16_t len;	   ///< Compressed length
+	uint16_t refs;	   ///< Swapped page table entries naming it; 0 when free
+	uint8_t flags;	   ///< IO_BUSY, READ_QUEUED, DEAD
+	int32_t disk_slot; ///< Copy in the swap area, -1 if none
+	uint32_t prev;	   ///< Links of the list the entry is on
+	uint32_t next;
+};
+
+struct EntryList {
+	uint32_t head = NIL;
+	uint32_t tail = NIL;
+};
+
+enum class DiskState : uint8_t {
+	UNPROBED,  ///< The blk task is not up yet
+	ABSENT,	   ///< No disk, or no room past the FAT volume
+	ACTIVE,	   ///< Entries are written out and read back
+	READ_ONLY, ///< A write failed; entries on disk are still read back
+};
+
+Entry entries[MAX_ENTRIES];
+uint32_t num_touched = 0; // [num_touched, MAX_ENTRIES) were never used
+
+EntryList free_list;
+EntryList ram_list;
+EntryList read_list;
+
+Stats g_stats = { 0, 0, 0, 0, 0, 0, 0 };
+
+lz4::Workspace workspace;
+uint8_t scratch[MAX_COMPRESSED_SIZE];
+
+DiskState disk_state = DiskState::UNPROBED;
+uint64_t disk_start = 0; // First sector of the swap area
+uint64_t disk_used[DISK_SLOTS / 64];
+size_t disk_hint = 0;
+
+// The clock hand: the task being swept and where in its address space
+size_t clock_task = 0;
+uint64_t clock_cursor = 0;
+
+bool reclaiming = false;
+
+void push_back(EntryList& list, uint32_t i)
+{
+	entries[i].prev = list.tail;
+	entries[i].next = NIL;
+	if (list.tail != NIL) {
+		entries[list.tail].next = i;
+	} else {
+		list.head = i;
+	}
+	list.tail = i;
+}
+
+void push_front(EntryList& list, uint32_t i)
+{
+	entries[i].prev = NIL;
+	entries[i].next = list.head;
+	if (list.head != NIL) {
+		entries[list.head].prev = i;
+	} else {
+		list.tail = i;
+	}
+	list.head = i;
+}
+
+void unlink(EntryList& list, uint32_t i)
+{
+	const Entry& e = entries[i];
+	if (e.prev != NIL) {
+		entries[e.prev].next = e.next;
+	} else {
+		list.head = e.next;
+	}
+	if (e.next != NIL) {
+		entries[e.next].prev = e.prev;
+	} else {
+		list.tail = e.prev;
+	}
+}
+
+uint32_t pop_front(EntryList& list)
+{
+	const uint32_t i = list.head;
+	if (i != NIL) {
+		unlink(list, i);
+	}
+	return i;
+}
+
+bool has_free_entry() { return free_list.head != NIL || num_touched < MAX_ENTRIES; }
+
+uint32_t take_entry()
+{
+	const uint32_t i = free_list.head != NIL ? pop_front(free_list) : num_touched++;
+	entries[i] = Entry{ nullptr, 0, 1, 0, -1, NIL, NIL };
+	++g_stats.entries;
+	return i;
+}
+
+int32_t alloc_disk_slot()
+{
+	for (size_t n = 0; n < DISK_SLOTS; ++n) {
+		const size_t slot = (disk_hint + n) % DISK_SLOTS;
+		if ((disk_used[slot / 64] & (1UL << (slot % 64))) == 0) {
+			disk_used[slot / 64] |= 1UL << (slot % 64);
+			disk_hint = slot + 1;
+			return static_cast<int32_t>(slot);
+		}
+	}
+
+	return -1;
+}
+
+void free_disk_slot(int32_t slot) { disk_used[slot / 64] &= ~(1UL << (slot % 64)); }
+
+uint64_t sector_of(int32_t disk_slot)
+{
+	return disk_start + disk_slot * DISK_SLOT_SECTORS;
+}
+
+size_t disk_bytes(size_t len)
+{
+	return (len + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+bool over_budget()
+{
+	return g_stats.ram_bytes > total_ram_pages() * PAGE_SIZE / RAM_BUDGET_DIVISOR;
+}
+
+// The entry must be off every list
+void free_entry(uint32_t i)
+{
+	Entry& e = entries[i];
+	if (e.data != nullptr) {
+		g_stats.ram_bytes -= e.len;
+		free(e.data);
+	} else {
+		--g_stats.disk_pages;
+	}
+	if (e.disk_slot >= 0) {
+		free_disk_slot(e.disk_slot);
+	}
+
+	e.data = nullptr;
+	e.refs = 0;
+	e.flags = 0;
+	push_back(free_list, i);
+	--g_stats.entries;
+}
+
+// Free the copy in RAM of an entry that has one on disk
+void drop_data(Entry& e)
+{
+	g_stats.ram_bytes -= e.len;
+	++g_stats.disk_pages;
+	free(e.data);
+	e.data = nullptr;
+}
+
+// Marked under the store's guard, so a read that completes before the task
+// sleeps still makes it runnable again
+void wait_for_read(uint32_t i)
+{
+	Entry& e = entries[i];
+	if ((e.flags & (IO_BUSY | READ_QUEUED)) == 0) {
+		e.flags |= READ_QUEUED;
+		push_back(read_list, i);
+	}
+
+	Task* t = kernel::task::CURRENT_TASK;
+	t->wait_reason = kernel::task::WaitReason::SWAP_IN;
+	t->state = kernel::task::TASK_WAITING;
+	kernel::task::notify(process_ids::SWAP, kernel::task::NotifyType::TIMER);
+}
+
+void wake_swap_in_waiters()
+{
+	for (Task* t : kernel::task::tasks) {
+		if (t != nullptr && t->state == kernel::task::TASK_WAITING &&
+			t->wait_reason == kernel::task::WaitReason::SWAP_IN) {
+			kernel::task::schedule_task(t->id);
+		}
+	}
+}
+
+// A task preempted inside the kernel may be halfway through changing its
+// page tables or areas; one that is asleep stopped at a known point
+bool can_reclaim_from(const Task* t)
+{
+	if (t == nullptr || t->ctx.cr3 == 0 || t->vmas.size() == 0 || t->just_forked ||
+		t->state == kernel::task::TASK_EXITED) {
+		return false;
+	}
+
+	return t == kernel::task::CURRENT_TASK ||
+		   t->state == kernel::task::TASK_WAITING || (t->ctx.cs & 3) != 0;
+}
+
+// Move the clock hand over up to max_scan entries, swapping out up to
+// max_reclaim cold pages. Returns the pages swapped out.
+size_t advance_clock(size_t max_scan, size_t max_reclaim, error_t* error)
+{
+	ReclaimScan scan = { clock_cursor, max_scan, max_reclaim, OK };
+	for (size_t step = 0; step <= 2 * kernel::task::MAX_TASKS; ++step) {
+		Task* t = kernel::task::tasks[clock_task];
+		if (can_reclaim_from(t)) {
+			reclaim_user_pages(t->get_page_table(), t->vmas, scan);
+			if (scan.cursor != 0) {
+				// A budget ran out inside this address space
+				break;
+			}
+		} else {
+			scan.cursor = 0;
+		}
+		clock_task = (clock_task + 1) % kernel::task::MAX_TASKS;
+	}
+
+	clock_cursor = scan.cursor;
+	*error = scan.error;
+	return max_reclaim - scan.max_reclaim;
+}
+
+kernel::memory::unique_kbuf<> read_swap(uint64_t sector, size_t len)
+{
+	Message m = { .type = MsgType::BLK_READ, .sender = process_ids::SWAP };
+	m.data.blk.sector = sector;
+	m.data.blk.len = len;
+
+	const error_t err = kernel::task::call(process_ids::VIRTIO_BLK, &m);
+	if (IS_ERR(err) || IS_ERR(m.result) || m.ool.size == 0) {
+		LOG_ERROR("swap: read failed: sector=%lu err=%d result=%d", sector, err,
+				  m.result);
+		return kernel::memory::unique_kbuf<>{};
+	}
+
+	return kernel::memory::unique_kbuf<>{ reinterpret_cast<void*>(m.ool.addr) };
+}
+
+// Takes ownership of buffer
+error_t write_swap(void* buffer, uint64_t sector, size_t len)
+{
+	Message m = { .type = MsgType::BLK_WRITE, .sender = process_ids::SWAP };
+	m.data.blk.sector = sector;
+	m.data.blk.len = len;
+	m.ool.addr = reinterpret_cast<uint64_t>(buffer);
+	m.ool.size = len;
+
+	const error_t err = kernel::task::call(process_ids::VIRTIO_BLK, &m);
+	if (IS_ERR(err)) {
+		free(buffer);
+		return err;
+	}
+
+	return m.result;
+}
+
+// The swap area is the disk's tail, and only used if the FAT volume at the
+// start of the disk ends before it
+void probe_disk_area()
+{
+	const Task* blk = kernel::task::get_task(process_ids::VIRTIO_BLK);
+	if (blk == nullptr || !blk->is_initialized) {
+		return;
+	}
+
+	disk_state = DiskState::ABSENT;
+
+	const uint64_t capacity = kernel::hw::virtio::blk_device_capacity();
+	if (capacity < 2 * DISK_AREA_SECTORS) {
+		LOG_INFO("swap: no swap disk, the store stays in RAM");
+		return;
+	}
+
+	const auto boot_sector = read_swap(0, SECTOR_SIZE);
+	if (!boot_sector) {
+		return;
+	}
+
+	const auto* bytes = static_cast<const uint8_t*>(boot_sector.get());
+	const auto* bpb = static_cast<const kernel::fs::BiosParameterBlock*>(
+			boot_sector.get());
+	if (bytes[510] != 0x55 || bytes[511] != 0xaa || bpb->bytes_per_sector == 0 ||
+		bpb->bytes_per_sector % SECTOR_SIZE != 0) {
+		LOG_ERROR("swap: no FAT volume on the disk, not using it");
+		return;
+	}
+
+	const uint64_t volume_sectors =
+			(bpb->total_sectors_16 != 0 ? bpb->total_sectors_16
+										: bpb->total_sectors_32) *
+			static_cast<uint64_t>(bpb->bytes_per_sector / SECTOR_SIZE);
+	const uint64_t area_start = capacity - DISK_AREA_SECTORS;
+	if (volume_sectors > area_start) {
+		LOG_INFO("swap: the FAT volume fills the disk, the store stays in RAM");
+		return;
+	}
+
+	disk_start = area_start;
+	disk_state = DiskState::ACTIVE;
+	LOG_INFO("swap: %lu MiB swap area at sector %lu", DISK_AREA_SIZE >> 20,
+			 disk_start);
+}
+
+void read_queued_entries()
+{
+	while (true) {
+		uint32_t i;
+		uint64_t sector;
+		size_t len;
+		{
+			const IrqGuard guard;
+			i = pop_front(read_list);
+			if (i == NIL) {
+				return;
+			}
+
+			Entry& e = entries[i];
+			e.flags = (e.flags & ~READ_QUEUED) | IO_BUSY;
+			sector = sector_of(e.disk_slot);
+			len = disk_bytes(e.len);
+		}
+
+		auto buf = read_swap(sector, len);
+
+		const IrqGuard guard;
+		Entry& e = entries[i];
+		e.flags &= ~IO_BUSY;
+		if ((e.flags & DEAD) != 0) {
+			free_entry(i);
+			continue;
+		}
+		if (!buf) {
+			// Retried on the next sweep
+			e.flags |= READ_QUEUED;
+			push_back(read_list, i);
+			return;
+		}
+
+		// The disk copy stays: if the entry is written out again, its RAM
+		// copy is simply dropped
+		e.data = buf.release();
+		g_stats.ram_bytes += e.len;
+		--g_stats.disk_pages;
+		++g_stats.disk_reads;
+		push_back(ram_list, i);
+		wake_swap_in_waiters();
+	}
+}
+
+void write_out_entries()
+{
+	while (true) {
+		uint32_t i;
+		int32_t disk_slot;
+		{
+			const IrqGuard guard;
+			if (disk_state != DiskState::ACTIVE || !over_budget()) {
+				return;
+			}
+
+			i = pop_front(ram_list);
+			if (i == NIL) {
+				return;
+			}
+
+			Entry& e = entries[i];
+			if (e.disk_slot >= 0) {
+				drop_data(e);
+				continue;
+			}
+
+			disk_slot = alloc_disk_slot();
+			if (disk_slot < 0) {
+				push_front(ram_list, i);
+				return;
+			}
+			e.disk_slot = disk_slot;
+			e.flags |= IO_BUSY;
+		}
+
+		// IO_BUSY keeps data in place while the guard is dropped
+		const Entry& busy = entries[i];
+		const size_t len = disk_bytes(busy.len);
+		error_t err = ERR_NO_MEMORY;
+		// Writing out is what frees memory: it may use the reserve
+		void* buf = alloc(len, ALLOC_ATOMIC | ALLOC_ZEROED);
+		if (buf != nullptr) {
+			memcpy(buf, busy.data, busy.len);
+			err = write_swap(buf, sector_of(disk_slot), len);
+		}
+
+		const IrqGuard guard;
+		Entry& e = entries[i];
+		e.flags &= ~IO_BUSY;
+		if (IS_ERR(err)) {
+			free_disk_slot(disk_slot);
+			e.disk_slot = -1;
+		}
+		if ((e.flags & DEAD) != 0) {
+			free_entry(i);
+		} else if (IS_ERR(err)) {
+			push_front(ram_list, i);
+		} else {
+			drop_data(e);
+			++g_stats.disk_writes;
+		}
+
+		if (err == ERR_NO_MEMORY) {
+			return;
+		}
+		if (IS_ERR(err)) {
+			LOG_ERROR("swap: write failed (%d), no more write-out", err);
+			disk_state = DiskState::READ_ONLY;
+			return;
+		}
+	}
+}
+
+void handle_sweep(const Message&)
+{
+	if (disk_state == DiskState::UNPROBED) {
+		probe_disk_area();
+	}
+
+	read_queued_entries();
+
+	{
+		const IrqGuard guard;
+		error_t err;
+		advance_clock(AGE_SCAN_BATCH, 0, &err);
+	}
+
+	write_out_entries();
+
+	// Under load the idle task may not run for a while: whatever the
+	// write-out freed goes to the emergency reserve first
+	refill_emergency_reserve();
+}
+
+} // namespace
+
+error_t store(const void* page, uint32_t* slot)
+{
+	const IrqGuard guard;
+	if (!has_free_entry()) {
+		return ERR_NO_SPACE;
+	}
+
+	const size_t len =
+			lz4::compress(page, PAGE_SIZE, scratch, MAX_COMPRESSED_SIZE, workspace);
+	if (len == 0) {
+		return ERR_INVALID_ARG;
+	}
+
+	// Runs inside reclaim, and each entry frees a whole page for at most half
+	// of one, so the reserve is fair game
+	void* data = alloc(len, ALLOC_ATOMIC);
+	if (data == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+	memcpy(data, scratch, len);
+
+	const uint32_t i = take_entry();
+	entries[i].data = data;
+	entries[i].len = len;
+	push_back(ram_list, i);
+
+	g_stats.ram_bytes += len;
+	++g_stats.swapped_out;
+	*slot = i;
+
+	return OK;
+}
+
+error_t load(uint32_t slot, void* page)
+{
+	const IrqGuard guard;
+	if (slot >= num_touched || entries[slot].refs == 0) {
+		LOG_ERROR("swap: entry %u is not in use", slot);
+		return ERR_INVALID_ARG;
+	}
+
+	const Entry& e = entries[slot];
+	if (e.data == nullptr) {
+		wait_for_read(slot);
+		return ERR_PAGE_NOT_PRESENT;
+	}
+
+	if (!lz4::decompress(e.data, e.len, page, PAGE_SIZE)) {
+		LOG_ERROR("swap: entry %u is corrupt", slot);
+		return ERR_INVALID_ARG;
+	}
+
+	++g_stats.swapped_in;
+	return OK;
+}
+
+void dup(uint32_t slot)
+{
+	const IrqGuard guard;
+	++entries[slot].refs;
+}
+
+void release(uint32_t slot)
+{
+	const IrqGuard guard;
+	Entry& e = entries[slot];
+	if (--e.refs != 0) {
+		return;
+	}
+
+	if ((e.flags & IO_BUSY) != 0) {
+		e.flags |= DEAD;
+		return;
+	}
+
+	if (e.data != nullptr) {
+		unlink(ram_list, slot);
+	} else if ((e.flags & READ_QUEUED) != 0) {
+		unlink(read_list, slot);
+	}
+	free_entry(slot);
+}
+
+size_t reclaim(size_t num_pages)
+{
+	const IrqGuard guard;
+	if (reclaiming) {
+		return 0;
+	}
+
+	reclaiming = true;
+	error_t err;
+	const size_t freed = advance_clock(RECLAIM_SCAN_LIMIT, num_pages, &err);
+	reclaiming = false;
+
+	// Freeing older entries to disk makes room for the next ones
+	if (disk_state == DiskState::ACTIVE && (IS_ERR(err) || over_budget())) {
+		kernel::task::notify(process_ids::SWAP, kernel::task::NotifyType::TIMER);
+	}
+
+	return freed;
+}
+
+Stats stats()
+{
+	const IrqGuard guard;
+	return g_stats;
+}
+
+void swap_service()
+{
+	Task* t = kernel::task::CURRENT_TASK;
+
+	t->add_msg_handler(MsgType::NOTIFY_TIMER_TIMEOUT, handle_sweep);
+	kernel::timers::ktimer->add_periodic_timer_event(SWEEP_INTERVAL_MS, t->id);
+
+	t->is_initialized = true;
+
+	kernel::task::process_messages(t);
+}
+
+} // namespace kernel::memory::swap
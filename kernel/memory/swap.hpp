@@ -0,0 +1,125 @@
+/**
+ * @file memory/swap.hpp
+ * @brief Compressed swap for anonymous user pages
+ *
+ * Slab pages never go back to the buddy system, so once it runs dry only
+ * the page-sized objects already carved out can be handed out again. When
+ * alloc() cannot find one it reclaims: a clock hand sweeps the user
+ * address spaces, and a present anonymous page whose accessed bit is
+ * still clear since the last sweep is compressed into this store (memory/
+ * lz4.hpp) and its frame freed. The page table entry keeps the store slot
+ * (page_table_entry::bits.swapped), and the next access faults the page
+ * back in through handle_page_fault(). Pages that do not compress to half
+ * their size would free nothing and stay.
+ *
+ * The swap task (swap_service) moves the store's oldest entries out to the
+ * swap area when the compressed data outgrows its RAM budget, and reads
+ * them back for faults on pages that are only on disk. The swap area is the
+ * last DISK_AREA_SIZE bytes of the virtio-blk disk, past the end of the
+ * FAT volume (scripts/create_disk_img.sh leaves them unformatted). Without
+ * such a disk the store stays in RAM.
+ *
+ * A task that faults on a page on disk sleeps (WaitReason::SWAP_IN) until
+ * the swap task has read it. load() only queues the read and marks the
+ * task waiting; the page fault handler switches tasks once the fault path
+ * has returned and holds nothing (interrupt/fault.cpp), and the access
+ * faults again when the task runs. Faults run on a stack of the task's own
+ * (memory/kernel_stack.hpp), so that one may sleep.
+ *
+ * Only 4 KiB pages are reclaimed that one mapping owns alone: CoW pages
+ * shared after fork, program pages and pieces of split 2 MiB pages stay.
+ * Tables still shared with a fork are skipped as a whole.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <libs/common/types.hpp>
+
+namespace kernel::memory::swap
+{
+
+/// Pages the store can hold at once, in RAM or on disk
+constexpr size_t MAX_ENTRIES = 16384;
+
+/// Size of the swap area at the end of the virtio-blk disk
+constexpr size_t DISK_AREA_SIZE = 32UL * 1024 * 1024;
+
+/// Share of RAM the compressed data may take before it spills to disk
+constexpr size_t RAM_BUDGET_DIVISOR = 16;
+
+/// Pages one direct reclaim tries to free
+constexpr size_t RECLAIM_BATCH = 32;
+
+/// Period of the swap task's sweep: aging, write-out and pending reads
+constexpr unsigned long SWEEP_INTERVAL_MS = 200;
+
+/**
+ * @brief Store counters
+ */
+struct Stats {
+	size_t entries;	   ///< Slots in use
+	size_t ram_bytes;  ///< Compressed bytes held in RAM
+	size_t disk_pages; ///< Entries only on disk
+	size_t swapped_out; ///< Pages reclaimed since boot
+	size_t swapped_in;	///< Pages faulted back since boot
+	size_t disk_writes; ///< Entries written to the swap area since boot
+	size_t disk_reads;	///< Entries read back since boot
+};
+
+/**
+ * @brief Compress a page into a new store entry
+ *
+ * The entry holds one reference, for the page table entry the caller
+ * turns into a swapped one.
+ *
+ * @param page Page to store, PAGE_SIZE bytes
+ * @param slot Receives the entry index
+ * @return OK, ERR_NO_SPACE when every entry is in use, ERR_NO_MEMORY when
+ * the compressed copy cannot be allocated, ERR_INVALID_ARG when the page
+ * does not compress to half its size (it would free nothing)
+ */
+error_t store(const void* page, uint32_t* slot);
+
+/**
+ * @brief Copy the page of an entry into a frame
+ *
+ * An entry that is only on disk is queued for the swap task instead, and
+ * the current task is marked waiting for it; the caller has to switch
+ * tasks once it holds nothing (see the file comment).
+ *
+ * @param slot Entry index
+ * @param page Destination, PAGE_SIZE bytes
+ * @return OK if page holds the data, ERR_PAGE_NOT_PRESENT if the access
+ * has to be retried after the read, ERR_INVALID_ARG if the stored copy is
+ * corrupt
+ */
+error_t load(uint32_t slot, void* page);
+
+/// @brief One more swapped page table entry names slot (fork)
+void dup(uint32_t slot);
+
+/// @brief Drop one reference; the last frees the entry
+void release(uint32_t slot);
+
+/**
+ * @brief Swap out cold pages to free page-sized slab objects
+ *
+ * Called by alloc() when the page-sized class is exhausted. Reentrant
+ * calls (the store allocating while it reclaims) return 0 at once.
+ *
+ * @param num_pages Pages to free
+ * @return Pages freed
+ */
+size_t reclaim(size_t num_pages);
+
+/// @brief Snapshot of the store counters
+Stats stats();
+
+/**
+ * @brief Swap task: sweeps the clock, writes out and reads back entries
+ */
+void swap_service();
+
+} // namespace kernel::memory::swap
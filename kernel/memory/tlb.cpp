@@ -0,0 +1,195 @@
+#include "memory/tlb.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "cpuid.hpp"
+#include "log/log.hpp"
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/paging_utils.h"
+
+namespace kernel::memory
+{
+
+namespace
+{
+constexpr uint64_t CR4_PCIDE = 1ULL << 17;
+constexpr uint64_t CR3_NO_FLUSH = 1ULL << 63;
+constexpr uint64_t CR3_PCID_MASK = 0xfff;
+
+constexpr uint64_t INVPCID_ADDRESS = 0;
+constexpr uint64_t INVPCID_CONTEXT = 1;
+constexpr uint64_t INVPCID_ALL_NON_GLOBAL = 3;
+
+// PCID 0 is left to the boot table and to raw set_cr3() callers
+constexpr size_t NUM_PCIDS = 4096;
+
+bool pcid_enabled = false;
+bool invpcid_supported = false;
+
+// Root table whose entries the TLB may hold under each PCID
+std::array<page_table_entry*, NUM_PCIDS> pcid_owner{};
+
+uint64_t pcid_of(page_table_entry* table)
+{
+	return (reinterpret_cast<uint64_t>(table) / PAGE_SIZE) % (NUM_PCIDS - 1) + 1;
+}
+
+uint64_t current_pcid() { return get_cr3() & CR3_PCID_MASK; }
+
+// Flush every non-global entry of the current PCID
+void flush_current()
+{
+	if (pcid_enabled && invpcid_supported) {
+		invpcid(INVPCID_CONTEXT, current_pcid(), 0);
+		return;
+	}
+
+	set_cr3(get_cr3());
+}
+
+// Entries of table tagged with its PCID can no longer be trusted. With
+// INVPCID they are dropped now, otherwise the next load of the PCID flushes.
+void drop_ownership(page_table_entry* table)
+{
+	const uint64_t pcid = pcid_of(table);
+	if (pcid_owner[pcid] != table) {
+		return;
+	}
+
+	pcid_owner[pcid] = nullptr;
+	if (invpcid_supported) {
+		invpcid(INVPCID_CONTEXT, pcid, 0);
+	}
+}
+} // namespace
+
+void initialize_pcid()
+{
+	if (!kernel::cpu::has_pcid()) {
+		LOG_INFO("PCID not supported: address space switches flush the TLB");
+		return;
+	}
+
+	set_cr4(get_cr4() | CR4_PCIDE);
+	pcid_enabled = true;
+	invpcid_supported = kernel::cpu::has_invpcid();
+	LOG_INFO("PCID enabled (INVPCID %s)", invpcid_supported ? "on" : "off");
+}
+
+uint64_t cr3_value_for(page_table_entry* table)
+{
+	if (table == get_active_page_table()) {
+		return get_cr3();
+	}
+
+	const auto cr3 = reinterpret_cast<uint64_t>(table);
+	if (!pcid_enabled || table == nullptr) {
+		return cr3;
+	}
+
+	const uint64_t pcid = pcid_of(table);
+	if (pcid_owner[pcid] == table) {
+		return cr3 | pcid | CR3_NO_FLUSH;
+	}
+
+	// Another table used this PCID last: loading without the no-flush bit
+	// drops its entries
+	pcid_owner[pcid] = table;
+	return cr3 | pcid;
+}
+
+void switch_page_table(page_table_entry* table)
+{
+	const uint64_t cr3 = cr3_value_for(table);
+	if (cr3 != get_cr3()) {
+		set_cr3(cr3);
+	}
+}
+
+void forget_page_table(page_table_entry* table)
+{
+	if (pcid_enabled) {
+		drop_ownership(table);
+	}
+}
+
+void flush_kernel_range(uint64_t addr, size_t num_pages)
+{
+	if (pcid_enabled && invpcid_supported) {
+		invpcid(INVPCID_ALL_NON_GLOBAL, 0, 0);
+		return;
+	}
+
+	for (size_t i = 0; i < num_pages; ++i) {
+		flush_tlb(addr + i * PAGE_SIZE);
+	}
+
+	// No way to reach the other PCIDs: every table flushes its own on its
+	// next load
+	if (pcid_enabled) {
+		pcid_owner.fill(nullptr);
+	}
+}
+
+void TlbFlushBatch::add(uint64_t addr)
+{
+	if (flush_all_) {
+		return;
+	}
+
+	if (num_pending_ == MAX_PENDING) {
+		flush_all_ = true;
+		return;
+	}
+
+	pending_[num_pending_++] = addr;
+}
+
+void TlbFlushBatch::add_range(uint64_t addr, size_t num_pages)
+{
+	if (num_pages > MAX_PENDING - num_pending_) {
+		flush_all_ = true;
+		return;
+	}
+
+	for (size_t i = 0; i < num_pages; ++i) {
+		pending_[num_pending_++] = addr + i * PAGE_SIZE;
+	}
+}
+
+void TlbFlushBatch::flush()
+{
+	if (num_pending_ == 0 && !flush_all_) {
+		return;
+	}
+
+	if (table_ == get_active_page_table()) {
+		if (flush_all_) {
+			flush_current();
+		} else {
+			for (size_t i = 0; i < num_pending_; ++i) {
+				flush_tlb(pending_[i]);
+			}
+		}
+
+		// Running under a foreign PCID (a raw set_cr3()): the entries this
+		// table left under its own PCID missed the flush
+		if (pcid_enabled && current_pcid() != pcid_of(table_)) {
+			drop_ownership(table_);
+		}
+	} else if (pcid_enabled && pcid_owner[pcid_of(table_)] == table_) {
+		if (invpcid_supported && !flush_all_) {
+			for (size_t i = 0; i < num_pending_; ++i) {
+				invpcid(INVPCID_ADDRESS, pcid_of(table_), pending_[i]);
+			}
+		} else {
+			drop_ownership(table_);
+		}
+	}
+
+	num_pending_ = 0;
+	flush_all_ = false;
+}
+
+} // namespace kernel::memory
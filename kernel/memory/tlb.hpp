@@ -0,0 +1,112 @@
+/**
+ * @file memory/tlb.hpp
+ * @brief TLB invalidation and PCID-tagged address space switches
+ *
+ * Page table changes queue their invalidations in a TlbFlushBatch, which
+ * issues one INVLPG run, or a single flush of the whole address space past
+ * a threshold, when it goes out of scope.
+ *
+ * When the CPU has PCIDs, every root table gets one (derived from its
+ * address), so switching address spaces keeps the TLB entries of the one
+ * switched to. A PCID is trusted only while the table that last loaded it
+ * owns it; changes to a table that is not active make it drop the
+ * ownership, or are invalidated precisely with INVPCID when the CPU has it.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "memory/paging.hpp"
+
+namespace kernel::memory
+{
+
+/**
+ * @brief Enable PCIDs when the CPU supports them
+ *
+ * Runs once the kernel's own root table is loaded (CR3[11:0] must be 0).
+ */
+void initialize_pcid();
+
+/**
+ * @brief Root table of a CR3 value, without the PCID and no-flush bits
+ */
+inline page_table_entry* cr3_to_table(uint64_t cr3)
+{
+	return reinterpret_cast<page_table_entry*>(cr3 & 0x000f'ffff'ffff'f000);
+}
+
+/**
+ * @brief The CR3 value that switches to table
+ *
+ * The active table gets the current CR3 back unchanged, so the switch can
+ * skip the write. Otherwise the value carries the table's PCID, and the
+ * no-flush bit when that PCID still holds only this table's entries.
+ *
+ * @note The caller must load the value before touching another table
+ */
+uint64_t cr3_value_for(page_table_entry* table);
+
+/**
+ * @brief Load table into CR3 (see cr3_value_for())
+ */
+void switch_page_table(page_table_entry* table);
+
+/**
+ * @brief Drop every TLB entry tagged for a root table about to be freed
+ */
+void forget_page_table(page_table_entry* table);
+
+/**
+ * @brief Drop a kernel-half range from the TLB of every address space
+ *
+ * The kernel half is shared by all root tables, so its entries may be
+ * cached under any PCID, not only the current one.
+ *
+ * @param addr First page
+ * @param num_pages Number of 4 KiB pages
+ */
+void flush_kernel_range(uint64_t addr, size_t num_pages);
+
+/**
+ * @brief Invalidations gathered while changing one address space
+ *
+ * Pending addresses are flushed by flush() or the destructor. Past
+ * MAX_PENDING pages the whole address space is flushed instead.
+ */
+class TlbFlushBatch
+{
+public:
+	static constexpr size_t MAX_PENDING = 32;
+
+	explicit TlbFlushBatch(page_table_entry* table)
+		: table_{ table }, num_pending_{ 0 }, flush_all_{ false }
+	{
+	}
+	~TlbFlushBatch() { flush(); }
+
+	TlbFlushBatch(const TlbFlushBatch&) = delete;
+	TlbFlushBatch& operator=(const TlbFlushBatch&) = delete;
+
+	/// Queue the page (4 KiB or 2 MiB) containing addr
+	void add(uint64_t addr);
+
+	/// Queue num_pages 4 KiB pages from addr
+	void add_range(uint64_t addr, size_t num_pages);
+
+	/// Queue the whole address space
+	void add_all() { flush_all_ = true; }
+
+	void flush();
+
+private:
+	page_table_entry* table_;
+	uint64_t pending_[MAX_PENDING];
+	size_t num_pending_;
+	bool flush_all_;
+};
+
+} // namespace kernel::memory
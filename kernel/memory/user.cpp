@@ -1,52 +1,50 @@
 #include "user.hpp"
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include "log/log.hpp"
+#include "memory/user_copy.h"
+
+namespace
+{
+constexpr uintptr_t USER_START = 0xffff'8000'0000'0000;
+constexpr uintptr_t USER_END = 0xffff'ffff'ffff'ffff;
+} // namespace
 
 bool is_user_address(const void* addr, size_t n)
 {
-	const uintptr_t user_start = 0xffff'8000'0000'0000;
-	const uintptr_t user_end = 0xffff'ffff'ffff'ffff;
 	const uintptr_t addr_val = reinterpret_cast<uintptr_t>(addr);
 
-	return addr_val >= user_start && addr_val < user_end && addr_val + n < user_end;
+	return addr_val >= USER_START && addr_val < USER_END && addr_val + n < USER_END;
 }
 
 size_t copy_to_user(void __user* to, const void* from, size_t n)
 {
 	if (to == nullptr || from == nullptr) {
-		return 0;
+		return n;
 	}
 
 	if (!is_user_address(to, n)) {
 		LOG_ERROR("invalid address for copy_to_user: %p", to);
-		return 0;
+		return n;
 	}
 
-	for (size_t i = 0; i < n; ++i) {
-		((uint8_t*)to)[i] = ((uint8_t*)from)[i];
-	}
-
-	return n;
+	return user_copy(to, from, n);
 }
 
 size_t copy_from_user(void* to, const void __user* from, size_t n)
 {
 	if (to == nullptr || from == nullptr) {
 		LOG_ERROR("null pointer in copy_from_user");
-		return 0;
+		return n;
 	}
 
 	if (!is_user_address(from, n)) {
 		LOG_ERROR("invalid address for copy_from_user: %p", from);
-		return 0;
+		return n;
 	}
 
-	for (size_t i = 0; i < n; ++i) {
-		((uint8_t*)to)[i] = ((uint8_t*)from)[i];
-	}
-
-	return n;
+	return user_copy(to, from, n);
 }
 
 ssize_t copy_string_from_user(char* to, const char __user* from, size_t max_len)
@@ -55,21 +53,38 @@ ssize_t copy_string_from_user(char* to, const char __user* from, size_t max_len)
 		return -1;
 	}
 
-	const char* src = from;
-	for (size_t i = 0; i < max_len; ++i) {
-		if (!is_user_address(&src[i], 1)) {
-			LOG_ERROR("invalid address for copy_string_from_user: %p", &src[i]);
-			to[0] = '\0';
-			return -1;
-		}
+	if (!is_user_address(from, 1)) {
+		LOG_ERROR("invalid address for copy_string_from_user: %p", from);
+		to[0] = '\0';
+		return -1;
+	}
 
-		to[i] = src[i];
-		if (src[i] == '\0') {
-			return static_cast<ssize_t>(i);
+	// The copy stops at the NUL, so only the end of the user half bounds it
+	const auto addr = reinterpret_cast<uintptr_t>(from);
+	const size_t limit = std::min<size_t>(max_len, USER_END - 1 - addr);
+	const ssize_t len = user_strncpy(to, from, limit);
+	if (len < 0) {
+		LOG_ERROR("fault in copy_string_from_user: %p", from);
+		to[0] = '\0';
+		return -1;
+	}
+
+	if (static_cast<size_t>(len) == limit) {
+		// No terminator within max_len: the string does not fit
+		to[limit - 1] = '\0';
+		return -1;
+	}
+
+	return len;
+}
+
+uint64_t find_user_access_fixup(uint64_t rip)
+{
+	for (const auto* e = user_access_ex_table; e != user_access_ex_table_end; ++e) {
+		if (e->insn == rip) {
+			return e->fixup;
 		}
 	}
 
-	// No terminator within max_len: the string does not fit
-	to[max_len - 1] = '\0';
-	return -1;
+	return 0;
 }
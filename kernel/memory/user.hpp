@@ -3,8 +3,10 @@
  * @brief User space memory access utilities
  *
  * This file provides safe functions for copying data between kernel and
- * user space. These functions include proper validation and error handling
- * to prevent security vulnerabilities and kernel crashes.
+ * user space. The range is checked against the user half once; the copy
+ * itself runs in assembly, 8 bytes at a time, and a fault on an unmapped
+ * or read-only user page ends it through the exception table (see
+ * memory/user_copy.h) instead of crashing the kernel.
  *
  * @date 2024
  */
@@ -13,6 +15,7 @@
 
 #include <sys/types.h>
 #include <cstddef>
+#include <cstdint>
 
 /**
  * @brief Annotation for user space pointers
@@ -46,9 +49,10 @@ bool is_user_address(const void* addr, size_t n);
  * @param to User space destination buffer
  * @param from Kernel space source buffer
  * @param n Number of bytes to copy
- * @return Number of bytes copied: n on success, 0 on failure
+ * @return Number of bytes not copied: 0 on success, n if the address is
+ * invalid, or the bytes from the first faulting one to the end
  *
- * @note Callers must treat a return value different from n as a failure
+ * @note Callers must treat a non-zero return value as a failure
  * @warning The user space buffer must be writable
  */
 size_t copy_to_user(void __user* to, const void* from, size_t n);
@@ -62,9 +66,10 @@ size_t copy_to_user(void __user* to, const void* from, size_t n);
  * @param to Kernel space destination buffer
  * @param from User space source buffer
  * @param n Number of bytes to copy
- * @return Number of bytes copied: n on success, 0 on failure
+ * @return Number of bytes not copied: 0 on success, n if the address is
+ * invalid, or the bytes from the first faulting one to the end
  *
- * @note Callers must treat a return value different from n as a failure
+ * @note Callers must treat a non-zero return value as a failure
  * @warning The kernel buffer must be large enough to hold n bytes
  */
 size_t copy_from_user(void* to, const void __user* from, size_t n);
@@ -72,8 +77,9 @@ size_t copy_from_user(void* to, const void __user* from, size_t n);
 /**
  * @brief Copy a NUL-terminated string from user space
  *
- * Validates every byte as a user-space address and always leaves a
- * NUL-terminated string in the destination buffer.
+ * Checks the start as a user-space address, copies up to the NUL (a
+ * fault ends the copy) and always leaves a NUL-terminated string in the
+ * destination buffer.
  *
  * @param to Kernel destination buffer of at least max_len bytes
  * @param from User space string
@@ -82,3 +88,11 @@ size_t copy_from_user(void* to, const void __user* from, size_t n);
  * if the pointer is invalid or the string does not fit in max_len bytes
  */
 ssize_t copy_string_from_user(char* to, const char __user* from, size_t max_len);
+
+/**
+ * @brief Resume point for a page fault raised inside a user copy
+ *
+ * @param rip Address of the faulting instruction
+ * @return Address of the fixup code, or 0 if rip is not a user access
+ */
+uint64_t find_user_access_fixup(uint64_t rip);
@@ -0,0 +1,62 @@
+; System V AMD64 Calling Convention
+; Registers(args): RDI, RSI, RDX, RCX, R8, R9
+; Caller-saved registers: RAX, RDI, RSI, RDX, RCX, R8, R9, R10, R11
+; Callee-saved registers: RBX, RBP, R12, R13, R14, R15
+;
+; Every instruction here that touches a user address has an entry in
+; user_access_ex_table: a page fault the fault handler cannot resolve
+; resumes at the entry's fixup instead of panicking.
+
+bits 64
+section .text
+
+global user_copy ; size_t user_copy(void* to, const void* from, size_t n);
+user_copy:
+    mov rcx, rdx
+    shr rcx, 3
+    and rdx, 7
+.qwords:
+    rep movsq
+    mov rcx, rdx
+.bytes:
+    rep movsb
+    xor eax, eax
+    ret
+.qword_fault:
+    ; Finish byte by byte: a qword straddling the faulting page still has
+    ; its bytes before the boundary copied
+    lea rcx, [rdx + rcx * 8]
+    jmp .bytes
+.byte_fault:
+    mov rax, rcx ; bytes left, from the first that faulted
+    ret
+
+global user_strncpy ; ssize_t user_strncpy(char* to, const char* from, size_t max_len);
+user_strncpy:
+    xor eax, eax
+.next:
+    cmp rax, rdx
+    je .done
+.load:
+    movzx ecx, byte [rsi + rax]
+    mov [rdi + rax], cl
+    test cl, cl
+    jz .done
+    inc rax
+    jmp .next
+.done:
+    ret
+.fault:
+    mov rax, -1
+    ret
+
+section .rodata
+
+; { faulting instruction, fixup } pairs
+global user_access_ex_table
+global user_access_ex_table_end
+user_access_ex_table:
+    dq user_copy.qwords, user_copy.qword_fault
+    dq user_copy.bytes, user_copy.byte_fault
+    dq user_strncpy.load, user_strncpy.fault
+user_access_ex_table_end:
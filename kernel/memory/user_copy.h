@@ -0,0 +1,45 @@
+/**
+ * @file memory/user_copy.h
+ * @brief Assembly routines that touch user memory
+ *
+ * The routines do no address checks of their own: callers validate the
+ * range first (see memory/user.hpp). A fault on a user page that cannot be
+ * resolved lands on the routine's fixup through user_access_ex_table.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+/**
+ * @brief One exception table entry
+ */
+struct ExceptionTableEntry {
+	uint64_t insn;	///< Instruction that may fault
+	uint64_t fixup; ///< Where execution resumes when it does
+};
+
+/**
+ * @brief Copy n bytes, 8 at a time with a byte tail
+ *
+ * @return Number of bytes not copied: 0, or the bytes from the first one
+ * that faulted to the end
+ */
+size_t user_copy(void* to, const void* from, size_t n);
+
+/**
+ * @brief Copy a string up to and including its NUL, at most max_len bytes
+ *
+ * @return Length of the string, max_len if no NUL was found within
+ * max_len bytes, or -1 if reading from faulted
+ */
+ssize_t user_strncpy(char* to, const char* from, size_t max_len);
+
+extern const ExceptionTableEntry user_access_ex_table[];
+extern const ExceptionTableEntry user_access_ex_table_end[];
+}
@@ -0,0 +1,397 @@
+#include "memory/vaddr_allocator.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include "error.hpp"
+#include "memory/page.hpp"
+#include "memory/slab.hpp"
+
+namespace kernel::memory
+{
+
+namespace
+{
+VaddrExtent* alloc_extent()
+{
+	return static_cast<VaddrExtent*>(alloc(sizeof(VaddrExtent), ALLOC_ZEROED));
+}
+
+int height(const VaddrExtent* n) { return n != nullptr ? n->height : 0; }
+
+void update(VaddrExtent* n)
+{
+	n->height = 1 + std::max(height(n->left), height(n->right));
+}
+
+VaddrExtent* rotate_right(VaddrExtent* n)
+{
+	VaddrExtent* l = n->left;
+	n->left = l->right;
+	l->right = n;
+	update(n);
+	update(l);
+	return l;
+}
+
+VaddrExtent* rotate_left(VaddrExtent* n)
+{
+	VaddrExtent* r = n->right;
+	n->right = r->left;
+	r->left = n;
+	update(n);
+	update(r);
+	return r;
+}
+
+VaddrExtent* balance(VaddrExtent* n)
+{
+	update(n);
+
+	const int factor = height(n->left) - height(n->right);
+	if (factor > 1) {
+		if (height(n->left->left) < height(n->left->right)) {
+			n->left = rotate_left(n->left);
+		}
+		return rotate_right(n);
+	}
+
+	if (factor < -1) {
+		if (height(n->right->right) < height(n->right->left)) {
+			n->right = rotate_right(n->right);
+		}
+		return rotate_left(n);
+	}
+
+	return n;
+}
+
+VaddrExtent* insert_node(VaddrExtent* root, VaddrExtent* node)
+{
+	if (root == nullptr) {
+		node->left = nullptr;
+		node->right = nullptr;
+		update(node);
+		return node;
+	}
+
+	if (node->start < root->start) {
+		root->left = insert_node(root->left, node);
+	} else {
+		root->right = insert_node(root->right, node);
+	}
+
+	return balance(root);
+}
+
+VaddrExtent* detach_min(VaddrExtent* n, VaddrExtent** min)
+{
+	if (n->left == nullptr) {
+		*min = n;
+		return n->right;
+	}
+
+	n->left = detach_min(n->left, min);
+	return balance(n);
+}
+
+// Unlink the extent starting at start without freeing it
+VaddrExtent* detach_node(VaddrExtent* root, uint64_t start, VaddrExtent** out)
+{
+	if (root == nullptr) {
+		return nullptr;
+	}
+
+	if (start < root->start) {
+		root->left = detach_node(root->left, start, out);
+	} else if (start > root->start) {
+		root->right = detach_node(root->right, start, out);
+	} else {
+		*out = root;
+		VaddrExtent* left = root->left;
+		VaddrExtent* right = root->right;
+		if (right == nullptr) {
+			return left;
+		}
+
+		VaddrExtent* successor = nullptr;
+		right = detach_min(right, &successor);
+		successor->left = left;
+		successor->right = right;
+		return balance(successor);
+	}
+
+	return balance(root);
+}
+
+// Highest extent starting at or below addr
+VaddrExtent* floor_node(VaddrExtent* n, uint64_t addr)
+{
+	VaddrExtent* best = nullptr;
+	while (n != nullptr) {
+		if (n->start <= addr) {
+			best = n;
+			n = n->right;
+		} else {
+			n = n->left;
+		}
+	}
+
+	return best;
+}
+
+// Lowest extent starting above addr
+VaddrExtent* ceiling_node(VaddrExtent* n, uint64_t addr)
+{
+	VaddrExtent* best = nullptr;
+	while (n != nullptr) {
+		if (n->start > addr) {
+			best = n;
+			n = n->left;
+		} else {
+			n = n->right;
+		}
+	}
+
+	return best;
+}
+
+void free_subtree(VaddrExtent* n)
+{
+	if (n == nullptr) {
+		return;
+	}
+
+	free_subtree(n->left);
+	free_subtree(n->right);
+	free(n);
+}
+
+int floor_log2(uint64_t x) { return 63 - __builtin_clzll(x); }
+
+int ceil_log2(uint64_t x) { return x <= 1 ? 0 : 64 - __builtin_clzll(x - 1); }
+
+uint64_t align_up(uint64_t value, uint64_t align)
+{
+	return (value + align - 1) / align * align;
+}
+
+bool fits(const VaddrExtent* extent, size_t size, size_t align)
+{
+	const uint64_t addr = align_up(extent->start, align);
+	return addr < extent->end && extent->end - addr >= size;
+}
+} // namespace
+
+VaddrAllocator::VaddrAllocator(uint64_t base, uint64_t end)
+	: base_{ base },
+	  end_{ end },
+	  fresh_{ base < end },
+	  root_{ nullptr },
+	  count_{ 0 },
+	  nonempty_classes_{ 0 },
+	  free_lists_{}
+{
+}
+
+error_t VaddrAllocator::populate()
+{
+	if (!fresh_) {
+		return OK;
+	}
+
+	VaddrExtent* whole = alloc_extent();
+	if (whole == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	whole->start = base_;
+	whole->end = end_;
+	root_ = insert_node(root_, whole);
+	count_ = 1;
+	link_free(whole);
+	fresh_ = false;
+	return OK;
+}
+
+void VaddrAllocator::link_free(VaddrExtent* extent)
+{
+	const int size_class = floor_log2((extent->end - extent->start) / PAGE_SIZE);
+	extent->size_class = size_class;
+	extent->prev_free = nullptr;
+	extent->next_free = free_lists_[size_class];
+	if (extent->next_free != nullptr) {
+		extent->next_free->prev_free = extent;
+	}
+
+	free_lists_[size_class] = extent;
+	nonempty_classes_ |= 1ULL << size_class;
+}
+
+void VaddrAllocator::unlink_free(VaddrExtent* extent)
+{
+	const int size_class = extent->size_class;
+	if (extent->prev_free != nullptr) {
+		extent->prev_free->next_free = extent->next_free;
+	} else {
+		free_lists_[size_class] = extent->next_free;
+	}
+
+	if (extent->next_free != nullptr) {
+		extent->next_free->prev_free = extent->prev_free;
+	}
+
+	if (free_lists_[size_class] == nullptr) {
+		nonempty_classes_ &= ~(1ULL << size_class);
+	}
+}
+
+VaddrExtent* VaddrAllocator::find_fit(size_t size, size_t align)
+{
+	// Any extent of size + align - PAGE_SIZE bytes holds an aligned range
+	const uint64_t needed_pages = (size + align) / PAGE_SIZE - 1;
+	const int guaranteed = ceil_log2(needed_pages);
+	if (guaranteed < NUM_SIZE_CLASSES) {
+		const uint64_t classes = nonempty_classes_ & (~0ULL << guaranteed);
+		if (classes != 0) {
+			return free_lists_[__builtin_ctzll(classes)];
+		}
+	}
+
+	// Nothing that large: smaller extents may still fit, depending on where
+	// they start. Unaligned requests only look at their own class.
+	const int top = std::min(guaranteed, NUM_SIZE_CLASSES);
+	for (int c = floor_log2(size / PAGE_SIZE); c < top; ++c) {
+		for (VaddrExtent* e = free_lists_[c]; e != nullptr; e = e->next_free) {
+			if (fits(e, size, align)) {
+				return e;
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+uint64_t VaddrAllocator::allocate(size_t num_pages, size_t align_pages)
+{
+	if (num_pages == 0 || align_pages == 0 ||
+		num_pages > (end_ - base_) / PAGE_SIZE ||
+		align_pages > (end_ - base_) / PAGE_SIZE || IS_ERR(populate())) {
+		return 0;
+	}
+
+	const size_t size = num_pages * PAGE_SIZE;
+	const size_t align = align_pages * PAGE_SIZE;
+	VaddrExtent* extent = find_fit(size, align);
+	if (extent == nullptr) {
+		return 0;
+	}
+
+	const uint64_t addr = align_up(extent->start, align);
+	const uint64_t tail_start = addr + size;
+	const bool has_head = addr > extent->start;
+	const bool has_tail = tail_start < extent->end;
+
+	// Alignment in the middle of an extent leaves free space on both sides
+	VaddrExtent* tail = nullptr;
+	if (has_head && has_tail) {
+		tail = alloc_extent();
+		if (tail == nullptr) {
+			return 0;
+		}
+	}
+
+	unlink_free(extent);
+	if (tail != nullptr) {
+		tail->start = tail_start;
+		tail->end = extent->end;
+		extent->end = addr;
+		root_ = insert_node(root_, tail);
+		++count_;
+		link_free(tail);
+		link_free(extent);
+	} else if (has_head) {
+		extent->end = addr;
+		link_free(extent);
+	} else if (has_tail) {
+		// Still between the same neighbours: the tree order holds
+		extent->start = tail_start;
+		link_free(extent);
+	} else {
+		VaddrExtent* detached = nullptr;
+		root_ = detach_node(root_, extent->start, &detached);
+		free(detached);
+		--count_;
+	}
+
+	return addr;
+}
+
+error_t VaddrAllocator::release(uint64_t addr, size_t num_pages)
+{
+	if (num_pages == 0 || addr % PAGE_SIZE != 0 || addr < base_ || addr >= end_ ||
+		num_pages > (end_ - addr) / PAGE_SIZE) {
+		return ERR_INVALID_ARG;
+	}
+
+	RETURN_IF_ERROR(populate());
+
+	const uint64_t end = addr + num_pages * PAGE_SIZE;
+	VaddrExtent* prev = floor_node(root_, addr);
+	VaddrExtent* next = ceiling_node(root_, addr);
+	if ((prev != nullptr && prev->end > addr) ||
+		(next != nullptr && next->start < end)) {
+		return ERR_INVALID_ARG;
+	}
+
+	const bool join_prev = prev != nullptr && prev->end == addr;
+	const bool join_next = next != nullptr && next->start == end;
+	if (join_prev && join_next) {
+		unlink_free(prev);
+		unlink_free(next);
+		prev->end = next->end;
+		VaddrExtent* detached = nullptr;
+		root_ = detach_node(root_, next->start, &detached);
+		free(detached);
+		--count_;
+		link_free(prev);
+	} else if (join_prev) {
+		unlink_free(prev);
+		prev->end = end;
+		link_free(prev);
+	} else if (join_next) {
+		unlink_free(next);
+		next->start = addr;
+		link_free(next);
+	} else {
+		VaddrExtent* extent = alloc_extent();
+		if (extent == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+
+		extent->start = addr;
+		extent->end = end;
+		root_ = insert_node(root_, extent);
+		++count_;
+		link_free(extent);
+	}
+
+	return OK;
+}
+
+void VaddrAllocator::reset()
+{
+	clear();
+	fresh_ = base_ < end_;
+}
+
+void VaddrAllocator::clear()
+{
+	free_subtree(root_);
+	root_ = nullptr;
+	count_ = 0;
+	nonempty_classes_ = 0;
+	std::fill(std::begin(free_lists_), std::end(free_lists_), nullptr);
+}
+
+} // namespace kernel::memory
@@ -0,0 +1,98 @@
+/**
+ * @file memory/vaddr_allocator.hpp
+ * @brief Allocator of page ranges inside a window of virtual addresses
+ *
+ * Hands out and takes back page-aligned ranges of a fixed window, for
+ * mappings whose address the kernel picks (OOL buffers in a user address
+ * space, kernel-side mappings). Free ranges are extents kept twice: in an
+ * AVL tree by address, so a released range finds and merges with its
+ * neighbours, and in lists segregated by power-of-two size, so allocation
+ * takes the head of the first list whose extents are all large enough.
+ * Both run in O(log n) of the number of extents; only when every list that
+ * large is empty are the smaller extents searched one by one.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "error.hpp"
+
+namespace kernel::memory
+{
+
+/**
+ * @brief One free range of a VaddrAllocator
+ */
+struct VaddrExtent {
+	uint64_t start; ///< First byte, page aligned
+	uint64_t end;	///< One past the last byte, page aligned
+
+	VaddrExtent* left;
+	VaddrExtent* right;
+	int height;
+
+	VaddrExtent* prev_free; ///< Neighbours in the size class list
+	VaddrExtent* next_free;
+	int size_class;
+};
+
+class VaddrAllocator
+{
+public:
+	/// Extents of [2^k, 2^(k+1)) pages are on list k
+	static constexpr int NUM_SIZE_CLASSES = 64;
+
+	/**
+	 * @brief Manage [base, end), all free
+	 *
+	 * Nothing is allocated until the first allocate() or release().
+	 */
+	VaddrAllocator(uint64_t base, uint64_t end);
+	~VaddrAllocator() { clear(); }
+
+	VaddrAllocator(const VaddrAllocator&) = delete;
+	VaddrAllocator& operator=(const VaddrAllocator&) = delete;
+
+	/**
+	 * @brief Take num_pages pages starting on a multiple of align_pages pages
+	 * @return uint64_t Start of the range, or 0 when no free range fits (or
+	 * the bookkeeping could not allocate)
+	 */
+	uint64_t allocate(size_t num_pages, size_t align_pages = 1);
+
+	/**
+	 * @brief Give back a range returned by allocate(), or part of one
+	 * @return OK, ERR_INVALID_ARG if the range is outside the window or
+	 * partly free already, or ERR_NO_MEMORY
+	 */
+	error_t release(uint64_t addr, size_t num_pages);
+
+	/// Make the whole window free again
+	void reset();
+
+	/// Number of free extents (1 for an untouched window)
+	size_t num_extents() const { return fresh_ ? 1 : count_; }
+
+	uint64_t base() const { return base_; }
+	uint64_t end() const { return end_; }
+
+private:
+	error_t populate();
+	void link_free(VaddrExtent* extent);
+	void unlink_free(VaddrExtent* extent);
+	VaddrExtent* find_fit(size_t size, size_t align);
+	void clear();
+
+	uint64_t base_;
+	uint64_t end_;
+	bool fresh_; ///< Nothing handed out yet: the tree is not built
+	VaddrExtent* root_;
+	size_t count_;
+	uint64_t nonempty_classes_; ///< Bit k set when list k has extents
+	VaddrExtent* free_lists_[NUM_SIZE_CLASSES];
+};
+
+} // namespace kernel::memory
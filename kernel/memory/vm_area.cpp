@@ -0,0 +1,439 @@
+#include "memory/vm_area.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include "error.hpp"
+#include "memory/slab.hpp"
+
+namespace kernel::memory
+{
+
+namespace
+{
+VmArea* alloc_area() { return static_cast<VmArea*>(alloc(sizeof(VmArea), ALLOC_ZEROED)); }
+
+int height(const VmArea* n) { return n != nullptr ? n->height : 0; }
+
+// Give a piece split off an area the same backing
+void copy_kind(VmArea* to, const VmArea* from)
+{
+	to->writable = from->writable;
+	to->image = from->image;
+	to->segment = from->segment;
+}
+
+bool mergeable(const VmArea* area, bool writable, const ExecImage* image)
+{
+	return area != nullptr && area->writable == writable &&
+		   area->image == nullptr && image == nullptr;
+}
+
+// Recompute the height and the span/gap summary from the children
+void update(VmArea* n)
+{
+	n->height = 1 + std::max(height(n->left), height(n->right));
+	n->subtree_start = n->left != nullptr ? n->left->subtree_start : n->start;
+	n->subtree_end = n->right != nullptr ? n->right->subtree_end : n->end;
+
+	uint64_t gap = 0;
+	if (n->left != nullptr) {
+		gap = std::max(n->left->max_gap, n->start - n->left->subtree_end);
+	}
+	if (n->right != nullptr) {
+		gap = std::max({ gap, n->right->max_gap, n->right->subtree_start - n->end });
+	}
+	n->max_gap = gap;
+}
+
+VmArea* rotate_right(VmArea* n)
+{
+	VmArea* l = n->left;
+	n->left = l->right;
+	l->right = n;
+	update(n);
+	update(l);
+	return l;
+}
+
+VmArea* rotate_left(VmArea* n)
+{
+	VmArea* r = n->right;
+	n->right = r->left;
+	r->left = n;
+	update(n);
+	update(r);
+	return r;
+}
+
+VmArea* balance(VmArea* n)
+{
+	update(n);
+
+	const int factor = height(n->left) - height(n->right);
+	if (factor > 1) {
+		if (height(n->left->left) < height(n->left->right)) {
+			n->left = rotate_left(n->left);
+		}
+		return rotate_right(n);
+	}
+
+	if (factor < -1) {
+		if (height(n->right->right) < height(n->right->left)) {
+			n->right = rotate_right(n->right);
+		}
+		return rotate_left(n);
+	}
+
+	return n;
+}
+
+VmArea* insert_node(VmArea* root, VmArea* node)
+{
+	if (root == nullptr) {
+		node->left = nullptr;
+		node->right = nullptr;
+		update(node);
+		return node;
+	}
+
+	if (node->start < root->start) {
+		root->left = insert_node(root->left, node);
+	} else {
+		root->right = insert_node(root->right, node);
+	}
+
+	return balance(root);
+}
+
+VmArea* detach_min(VmArea* n, VmArea** min)
+{
+	if (n->left == nullptr) {
+		*min = n;
+		return n->right;
+	}
+
+	n->left = detach_min(n->left, min);
+	return balance(n);
+}
+
+// Unlink the area starting at start without freeing it
+VmArea* detach_node(VmArea* root, uint64_t start, VmArea** out)
+{
+	if (root == nullptr) {
+		return nullptr;
+	}
+
+	if (start < root->start) {
+		root->left = detach_node(root->left, start, out);
+	} else if (start > root->start) {
+		root->right = detach_node(root->right, start, out);
+	} else {
+		*out = root;
+		VmArea* left = root->left;
+		VmArea* right = root->right;
+		if (right == nullptr) {
+			return left;
+		}
+
+		VmArea* successor = nullptr;
+		right = detach_min(right, &successor);
+		successor->left = left;
+		successor->right = right;
+		return balance(successor);
+	}
+
+	return balance(root);
+}
+
+// Lowest area ending above addr. Areas never overlap, so ends are sorted
+// like starts.
+VmArea* first_ending_after(VmArea* n, uint64_t addr)
+{
+	VmArea* best = nullptr;
+	while (n != nullptr) {
+		if (n->end > addr) {
+			best = n;
+			n = n->left;
+		} else {
+			n = n->right;
+		}
+	}
+
+	return best;
+}
+
+// Lowest fitting start among the holes in front of each area of the
+// subtree; lower is the end of whatever precedes the subtree
+uint64_t search_gap(const VmArea* n,
+					uint64_t lower,
+					size_t size,
+					uint64_t lo,
+					uint64_t hi)
+{
+	if (n == nullptr || lower >= hi || n->subtree_end <= lo) {
+		return 0;
+	}
+
+	const uint64_t front = n->subtree_start > lower ? n->subtree_start - lower : 0;
+	if (std::max(front, n->max_gap) < size) {
+		return 0;
+	}
+
+	const uint64_t found = search_gap(n->left, lower, size, lo, hi);
+	if (found != 0) {
+		return found;
+	}
+
+	const uint64_t prev_end = n->left != nullptr ? n->left->subtree_end : lower;
+	const uint64_t gap_start = std::max(prev_end, lo);
+	const uint64_t gap_end = std::min(n->start, hi);
+	if (gap_start < gap_end && gap_end - gap_start >= size) {
+		return gap_start;
+	}
+
+	return search_gap(n->right, n->end, size, lo, hi);
+}
+
+VmArea* clone_subtree(const VmArea* n, bool* failed)
+{
+	if (n == nullptr || *failed) {
+		return nullptr;
+	}
+
+	VmArea* copy = alloc_area();
+	if (copy == nullptr) {
+		*failed = true;
+		return nullptr;
+	}
+
+	*copy = *n;
+	copy->left = clone_subtree(n->left, failed);
+	copy->right = clone_subtree(n->right, failed);
+	return copy;
+}
+
+void free_subtree(VmArea* n)
+{
+	if (n == nullptr) {
+		return;
+	}
+
+	free_subtree(n->left);
+	free_subtree(n->right);
+	free(n);
+}
+} // namespace
+
+error_t VmAreaTree::insert(uint64_t start,
+						   uint64_t end,
+						   bool writable,
+						   ExecImage* image,
+						   int segment)
+{
+	if (start >= end) {
+		return ERR_INVALID_ARG;
+	}
+
+	const VmArea* overlap = first_ending_after(root_, start);
+	if (overlap != nullptr && overlap->start < end) {
+		return ERR_INVALID_ARG;
+	}
+
+	VmArea* node = alloc_area();
+	if (node == nullptr) {
+		return ERR_NO_MEMORY;
+	}
+
+	node->start = start;
+	node->end = end;
+	node->writable = writable;
+	node->image = image;
+	node->segment = segment;
+
+	// Grow a neighbour instead of adding a node, so that a brk heap moving
+	// one page at a time stays a single area
+	const VmArea* prev = start != 0 ? find(start - 1) : nullptr;
+	if (mergeable(prev, writable, image)) {
+		VmArea* detached = nullptr;
+		node->start = prev->start;
+		root_ = detach_node(root_, prev->start, &detached);
+		free(detached);
+		--count_;
+	}
+
+	const VmArea* next = find(end);
+	if (mergeable(next, writable, image) && next->start == end) {
+		VmArea* detached = nullptr;
+		node->end = next->end;
+		root_ = detach_node(root_, next->start, &detached);
+		free(detached);
+		--count_;
+	}
+
+	root_ = insert_node(root_, node);
+	++count_;
+	return OK;
+}
+
+error_t VmAreaTree::remove(uint64_t start, uint64_t end)
+{
+	while (start < end) {
+		VmArea* area = first_ending_after(root_, start);
+		if (area == nullptr || area->start >= end) {
+			break;
+		}
+
+		// Straddling both ends: the tail becomes a new area
+		VmArea* tail = nullptr;
+		if (area->start < start && area->end > end) {
+			tail = alloc_area();
+			if (tail == nullptr) {
+				return ERR_NO_MEMORY;
+			}
+
+			tail->start = end;
+			tail->end = area->end;
+			copy_kind(tail, area);
+		}
+
+		VmArea* detached = nullptr;
+		root_ = detach_node(root_, area->start, &detached);
+
+		if (detached->start < start) {
+			detached->end = start;
+			root_ = insert_node(root_, detached);
+		} else if (detached->end > end) {
+			detached->start = end;
+			root_ = insert_node(root_, detached);
+		} else {
+			free(detached);
+			--count_;
+		}
+
+		if (tail != nullptr) {
+			root_ = insert_node(root_, tail);
+			++count_;
+		}
+	}
+
+	return OK;
+}
+
+error_t VmAreaTree::protect(uint64_t start, uint64_t end, bool writable)
+{
+	for (uint64_t addr = start; addr < end;) {
+		const VmArea* area = find(addr);
+		if (area == nullptr) {
+			return ERR_NO_MEMORY;
+		}
+		addr = area->end;
+	}
+
+	for (uint64_t addr = start; addr < end;) {
+		VmArea* area = first_ending_after(root_, addr);
+		const uint64_t area_end = area->end;
+		if (area->writable == writable) {
+			addr = area_end;
+			continue;
+		}
+
+		// Up to three pieces: [head | changed | tail]
+		const uint64_t mid_start = std::max(area->start, start);
+		const uint64_t mid_end = std::min(area->end, end);
+		VmArea* head = nullptr;
+		VmArea* tail = nullptr;
+		if (area->start < mid_start) {
+			head = alloc_area();
+		}
+		if (mid_end < area->end) {
+			tail = alloc_area();
+		}
+		if ((area->start < mid_start && head == nullptr) ||
+			(mid_end < area->end && tail == nullptr)) {
+			free(head);
+			free(tail);
+			return ERR_NO_MEMORY;
+		}
+
+		VmArea* detached = nullptr;
+		root_ = detach_node(root_, area->start, &detached);
+
+		if (head != nullptr) {
+			head->start = detached->start;
+			head->end = mid_start;
+			copy_kind(head, detached);
+			root_ = insert_node(root_, head);
+			++count_;
+		}
+		if (tail != nullptr) {
+			tail->start = mid_end;
+			tail->end = detached->end;
+			copy_kind(tail, detached);
+			root_ = insert_node(root_, tail);
+			++count_;
+		}
+
+		detached->start = mid_start;
+		detached->end = mid_end;
+		detached->writable = writable;
+		root_ = insert_node(root_, detached);
+
+		addr = area_end;
+	}
+
+	return OK;
+}
+
+const VmArea* VmAreaTree::find(uint64_t addr) const
+{
+	const VmArea* area = first_ending_after(root_, addr);
+	if (area == nullptr || area->start > addr) {
+		return nullptr;
+	}
+
+	return area;
+}
+
+uint64_t VmAreaTree::find_free(size_t size, uint64_t lo, uint64_t hi) const
+{
+	if (size == 0 || lo >= hi) {
+		return 0;
+	}
+
+	const uint64_t found = search_gap(root_, lo, size, lo, hi);
+	if (found != 0) {
+		return found;
+	}
+
+	const uint64_t last_end = root_ != nullptr ? root_->subtree_end : lo;
+	const uint64_t gap_start = std::max(last_end, lo);
+	if (gap_start < hi && hi - gap_start >= size) {
+		return gap_start;
+	}
+
+	return 0;
+}
+
+error_t VmAreaTree::copy_from(const VmAreaTree& other)
+{
+	clear();
+
+	bool failed = false;
+	root_ = clone_subtree(other.root_, &failed);
+	if (failed) {
+		clear();
+		return ERR_NO_MEMORY;
+	}
+
+	count_ = other.count_;
+	return OK;
+}
+
+void VmAreaTree::clear()
+{
+	free_subtree(root_);
+	root_ = nullptr;
+	count_ = 0;
+}
+
+} // namespace kernel::memory
@@ -0,0 +1,111 @@
+/**
+ * @file memory/vm_area.hpp
+ * @brief Per-process tree of virtual memory areas
+ *
+ * Every demand-paged range of a user address space (stack, brk heap,
+ * anonymous mmap, the load segments of the program) is a VmArea. The areas
+ * live in an AVL tree keyed by start address; each node also records the
+ * span and the largest gap between areas of its subtree, so a free range of
+ * a given size is found without visiting every area.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "error.hpp"
+
+namespace kernel::memory
+{
+
+class ExecImage;
+
+/**
+ * @brief One contiguous range of user memory
+ */
+struct VmArea {
+	uint64_t start; ///< First byte, page aligned
+	uint64_t end;	///< One past the last byte, page aligned
+	bool writable;
+	ExecImage* image; ///< Program the area is a segment of, nullptr if anonymous
+	int segment;	  ///< Segment index in image
+
+	VmArea* left;
+	VmArea* right;
+	int height;
+	uint64_t subtree_start; ///< Lowest start in this subtree
+	uint64_t subtree_end;	///< Highest end in this subtree
+	uint64_t max_gap;		///< Largest hole between areas of this subtree
+};
+
+class VmAreaTree
+{
+public:
+	VmAreaTree() : root_{ nullptr }, count_{ 0 } {}
+	~VmAreaTree() { clear(); }
+
+	VmAreaTree(const VmAreaTree&) = delete;
+	VmAreaTree& operator=(const VmAreaTree&) = delete;
+
+	/**
+	 * @brief Add [start, end), merging with adjacent areas of the same kind
+	 *
+	 * Segments of a program (image is not nullptr) never merge.
+	 *
+	 * @return OK, ERR_INVALID_ARG if the range is empty or overlaps an area,
+	 * or ERR_NO_MEMORY
+	 */
+	error_t insert(uint64_t start,
+				   uint64_t end,
+				   bool writable,
+				   ExecImage* image = nullptr,
+				   int segment = 0);
+
+	/**
+	 * @brief Remove [start, end) from every area it overlaps
+	 *
+	 * Areas sticking out of the range are trimmed, one straddling it on
+	 * both sides is split in two. Holes in the range are fine.
+	 *
+	 * @return OK, or ERR_NO_MEMORY when a split could not allocate
+	 */
+	error_t remove(uint64_t start, uint64_t end);
+
+	/**
+	 * @brief Change the protection of [start, end)
+	 *
+	 * @return OK, ERR_NO_MEMORY when part of the range is not mapped (the
+	 * tree is left untouched then) or a split could not allocate
+	 */
+	error_t protect(uint64_t start, uint64_t end, bool writable);
+
+	/**
+	 * @brief Find the area containing addr
+	 * @return const VmArea* The area, or nullptr
+	 */
+	const VmArea* find(uint64_t addr) const;
+
+	/**
+	 * @brief Find the lowest free range of size bytes inside [lo, hi)
+	 * @return uint64_t Start of the range, or 0 when none is large enough
+	 */
+	uint64_t find_free(size_t size, uint64_t lo, uint64_t hi) const;
+
+	/**
+	 * @brief Replace the contents with a copy of other (fork)
+	 * @return OK, or ERR_NO_MEMORY (the tree is empty then)
+	 */
+	error_t copy_from(const VmAreaTree& other);
+
+	void clear();
+
+	size_t size() const { return count_; }
+
+private:
+	VmArea* root_;
+	size_t count_;
+};
+
+} // namespace kernel::memory
@@ -23,6 +23,7 @@
 #include "hardware/virtio/net.hpp"
 #include "log/log.hpp"
 #include "memory/slab.hpp"
+#include "memory/swap.hpp"
 #include "net/packet_handler.hpp"
 #include "task/ipc.hpp"
 #include "task/task.hpp"
@@ -60,9 +61,9 @@ void shell_service()
 #ifdef KERNEL_SMOKE_TEST_ENABLED
 	// argv[1] tells the shell to run one fork→exec→wait round-trip on its
 	// own and report the outcome to KERNEL (issue #374)
-	exec_elf(std::move(shell_elf), "shell", "-smoke");
+	exec_elf(std::move(shell_elf), m.ool.size, "shell", "-smoke");
 #else
-	exec_elf(std::move(shell_elf), "shell", nullptr);
+	exec_elf(std::move(shell_elf), m.ool.size, "shell", nullptr);
 #endif
 }
 
@@ -81,6 +82,8 @@ constexpr InitialTaskInfo SERVICE_MANIFEST[] = {
 	  &kernel::hw::virtio::virtio_net_service, true, false },
 	{ SystemProcessId::NET, "net", &kernel::net::packet_handler_service, true,
 	  false },
+	{ SystemProcessId::SWAP, "swap", &kernel::memory::swap::swap_service, true,
+	  false },
 };
 
 constexpr size_t SERVICE_COUNT =
@@ -11,6 +11,7 @@ extern get_current_task_stack
 
 global syscall_entry
 syscall_entry:
+    ; DF is already clear: IA32_FMASK masks it on SYSCALL (syscall.cpp)
     push rbp
     push rcx ; save RIP
     push r11 ; save RFLAGS
@@ -5,7 +5,9 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <libs/common/memory_layout.h>
 #include <libs/common/message.hpp>
+#include <libs/common/mman.h>
 #include <libs/common/process_id.hpp>
 #include <libs/common/types.hpp>
 #include <utility>
@@ -18,6 +20,7 @@
 #include "memory/paging.hpp"
 #include "memory/slab.hpp"
 #include "memory/user.hpp"
+#include "memory/vm_area.hpp"
 #include "point2d.hpp"
 #include "syscall.hpp"
 #include "task/context.hpp"
@@ -82,7 +85,7 @@ ssize_t sys_read(uint64_t arg1, uint64_t arg2, uint64_t arg3)
 			}
 
 			const size_t n = std::min(count, req.data.fs.len);
-			if (copy_to_user(buf, data.get(), n) != n) {
+			if (copy_to_user(buf, data.get(), n) != 0) {
 				return ERR_INVALID_ARG;
 			}
 
@@ -168,7 +171,7 @@ ssize_t sys_write(uint64_t arg1, uint64_t arg2, uint64_t arg3)
 			if (!kbuf) {
 				return ERR_NO_MEMORY;
 			}
-			if (copy_from_user(kbuf.get(), buf, count) != count) {
+			if (copy_from_user(kbuf.get(), buf, count) != 0) {
 				return ERR_INVALID_ARG;
 			}
 			req.ool.addr = reinterpret_cast<uint64_t>(kbuf.get());
@@ -269,7 +272,7 @@ error_t sys_ipc(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4)
 		// reaches user space (the only kernel->user translation point)
 		kernel::task::deliver_ool_to_user(t, &received);
 
-		if (copy_to_user(m, &received, sizeof(*m)) != sizeof(*m)) {
+		if (copy_to_user(m, &received, sizeof(*m)) != 0) {
 			return ERR_INVALID_ARG;
 		}
 
@@ -278,7 +281,7 @@ error_t sys_ipc(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4)
 
 	if (flags == IPC_SEND) {
 		Message copy_m;
-		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != sizeof(copy_m)) {
+		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != 0) {
 			return ERR_INVALID_ARG;
 		}
 
@@ -305,7 +308,7 @@ error_t sys_ipc(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4)
 
 	if (flags == IPC_CALL) {
 		Message copy_m;
-		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != sizeof(copy_m)) {
+		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != 0) {
 			return ERR_INVALID_ARG;
 		}
 
@@ -323,7 +326,7 @@ error_t sys_ipc(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4)
 		// copy_m now holds the reply; map its OOL payload if it has one
 		kernel::task::deliver_ool_to_user(t, &copy_m);
 
-		if (copy_to_user(m, &copy_m, sizeof(copy_m)) != sizeof(copy_m)) {
+		if (copy_to_user(m, &copy_m, sizeof(copy_m)) != 0) {
 			return ERR_INVALID_ARG;
 		}
 
@@ -332,7 +335,7 @@ error_t sys_ipc(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4)
 
 	if (flags == IPC_REPLY) {
 		Message copy_m;
-		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != sizeof(copy_m)) {
+		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != 0) {
 			return ERR_INVALID_ARG;
 		}
 
@@ -359,7 +362,7 @@ error_t sys_ipc(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4)
 
 	if (flags == IPC_OOL_RELEASE) {
 		Message copy_m;
-		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != sizeof(copy_m)) {
+		if (copy_from_user(&copy_m, m, sizeof(copy_m)) != 0) {
 			return ERR_INVALID_ARG;
 		}
 
@@ -463,7 +466,7 @@ error_t sys_exec(uint64_t arg1, uint64_t arg2, uint64_t arg3)
 	// The kernel's only remaining exec duty: map the segments and jump to
 	// ring 3. Everything filesystem-shaped already happened in the FS task
 	// (issue #315: sys_exec must not know how files are stored).
-	exec_elf(std::move(elf_buf), "", copy_args);
+	exec_elf(std::move(elf_buf), msg.ool.size, "", copy_args);
 
 	return OK;
 }
@@ -502,13 +505,163 @@ ProcessId sys_wait(uint64_t arg1)
 		kernel::task::switch_next_task(false);
 	}
 
-	if (copy_to_user(status, &record.status, sizeof(int)) != sizeof(int)) {
+	if (copy_to_user(status, &record.status, sizeof(int)) != 0) {
 		return ProcessId::from_raw(-1);
 	}
 
 	return ProcessId::from_raw(record.pid);
 }
 
+namespace
+{
+uint64_t page_align_up(uint64_t value)
+{
+	return (value + kernel::memory::PAGE_SIZE - 1) & ~(kernel::memory::PAGE_SIZE - 1);
+}
+
+// munmap and mprotect only reach the brk heap and the mmap window: the
+// image, stack and OOL mappings are the kernel's to manage
+bool in_vm_window(uint64_t start, uint64_t end)
+{
+	return (start >= USER_HEAP_BASE && end <= USER_HEAP_BASE + USER_HEAP_SIZE) ||
+		   (start >= USER_MMAP_BASE && end <= USER_MMAP_END);
+}
+
+// Validate an (addr, length) pair and turn it into a page range
+error_t to_vm_range(uint64_t addr, uint64_t length, uint64_t* start, uint64_t* end)
+{
+	if (length == 0 || addr % kernel::memory::PAGE_SIZE != 0 ||
+		length > USER_MMAP_END - USER_HEAP_BASE) {
+		return ERR_INVALID_ARG;
+	}
+
+	*start = addr;
+	*end = addr + page_align_up(length);
+	if (*end < *start || !in_vm_window(*start, *end)) {
+		return ERR_INVALID_ARG;
+	}
+
+	return OK;
+}
+
+error_t unmap_vm_range(kernel::task::Task* t, uint64_t start, uint64_t end)
+{
+	RETURN_IF_ERROR(t->vmas.remove(start, end));
+	return kernel::memory::release_user_pages(t->get_page_table(),
+											  kernel::memory::vaddr_t{ start },
+											  (end - start) / kernel::memory::PAGE_SIZE);
+}
+} // namespace
+
+uint64_t sys_brk(uint64_t arg1)
+{
+	const uint64_t new_brk = arg1;
+	kernel::task::Task* t = kernel::task::CURRENT_TASK;
+
+	// Out of range (including brk(0), the usual query) reports the current
+	// end unchanged, as Linux does
+	if (new_brk < USER_HEAP_BASE || new_brk > USER_HEAP_BASE + USER_HEAP_SIZE) {
+		return t->brk;
+	}
+
+	const uint64_t old_end = page_align_up(t->brk);
+	const uint64_t new_end = page_align_up(new_brk);
+	if (new_end > old_end) {
+		if (IS_ERR(t->vmas.insert(old_end, new_end, true))) {
+			return t->brk;
+		}
+	} else if (new_end < old_end) {
+		if (IS_ERR(unmap_vm_range(t, new_end, old_end))) {
+			return t->brk;
+		}
+	}
+
+	t->brk = new_brk;
+	return new_brk;
+}
+
+uint64_t sys_mmap(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4)
+{
+	const uint64_t hint = arg1;
+	const uint64_t length = arg2;
+	const int prot = static_cast<int>(arg3);
+	const int flags = static_cast<int>(arg4);
+	kernel::task::Task* t = kernel::task::CURRENT_TASK;
+
+	// Private anonymous memory only. x86 pages cannot be write-only or
+	// inaccessible yet present, so PROT_READ is required.
+	if ((flags & MAP_ANONYMOUS) == 0 || (flags & MAP_PRIVATE) == 0 ||
+		(prot & PROT_READ) == 0 || length == 0 ||
+		length > USER_MMAP_END - USER_MMAP_BASE) {
+		return ERR_INVALID_ARG;
+	}
+
+	const uint64_t size = page_align_up(length);
+	uint64_t addr = 0;
+
+	if ((flags & MAP_FIXED) != 0) {
+		uint64_t end = 0;
+		RETURN_IF_ERROR(to_vm_range(hint, size, &addr, &end));
+		if (addr < USER_MMAP_BASE) {
+			return ERR_INVALID_ARG;
+		}
+
+		// A fixed mapping replaces whatever was there
+		RETURN_IF_ERROR(unmap_vm_range(t, addr, end));
+	} else {
+		if (hint % kernel::memory::PAGE_SIZE == 0 && hint >= USER_MMAP_BASE &&
+			hint < USER_MMAP_END &&
+			t->vmas.find_free(size, hint, USER_MMAP_END) == hint) {
+			addr = hint;
+		} else {
+			addr = t->vmas.find_free(size, USER_MMAP_BASE, USER_MMAP_END);
+		}
+
+		if (addr == 0) {
+			return ERR_NO_MEMORY;
+		}
+	}
+
+	RETURN_IF_ERROR(t->vmas.insert(addr, addr + size, (prot & PROT_WRITE) != 0));
+
+	return addr;
+}
+
+error_t sys_munmap(uint64_t arg1, uint64_t arg2)
+{
+	uint64_t start = 0;
+	uint64_t end = 0;
+	RETURN_IF_ERROR(to_vm_range(arg1, arg2, &start, &end));
+
+	return unmap_vm_range(kernel::task::CURRENT_TASK, start, end);
+}
+
+error_t sys_mprotect(uint64_t arg1, uint64_t arg2, uint64_t arg3)
+{
+	const int prot = static_cast<int>(arg3);
+	if ((prot & PROT_READ) == 0) {
+		return ERR_INVALID_ARG;
+	}
+
+	uint64_t start = 0;
+	uint64_t end = 0;
+	RETURN_IF_ERROR(to_vm_range(arg1, arg2, &start, &end));
+
+	kernel::task::Task* t = kernel::task::CURRENT_TASK;
+	const bool writable = (prot & PROT_WRITE) != 0;
+	RETURN_IF_ERROR(t->vmas.protect(start, end, writable));
+
+	// Granting write access needs no page table change: the next write
+	// faults and the handler checks the area
+	if (!writable) {
+		RETURN_IF_ERROR(kernel::memory::write_protect_user_pages(
+				t->get_page_table(), kernel::memory::vaddr_t{ start },
+				(end - start) / kernel::memory::PAGE_SIZE));
+	}
+
+	return OK;
+}
+
 ProcessId sys_getpid(void) { return kernel::task::CURRENT_TASK->id; }
 
 ProcessId sys_getppid(void) { return kernel::task::CURRENT_TASK->parent_id; }
@@ -546,6 +699,18 @@ extern "C" uint64_t handle_syscall(uint64_t arg1,
 		case kernel::syscall::SYS_IPC:
 			result = kernel::syscall::sys_ipc(arg1, arg2, arg3, arg4);
 			break;
+		case kernel::syscall::SYS_MMAP:
+			result = kernel::syscall::sys_mmap(arg1, arg2, arg3, arg4);
+			break;
+		case kernel::syscall::SYS_MPROTECT:
+			result = kernel::syscall::sys_mprotect(arg1, arg2, arg3);
+			break;
+		case kernel::syscall::SYS_MUNMAP:
+			result = kernel::syscall::sys_munmap(arg1, arg2);
+			break;
+		case kernel::syscall::SYS_BRK:
+			result = kernel::syscall::sys_brk(arg1);
+			break;
 		case kernel::syscall::SYS_FORK:
 			result = kernel::syscall::sys_fork().raw();
 			break;
@@ -22,6 +22,10 @@ constexpr uint64_t EFER_LMA = 1U << 10; ///< Long Mode Active
 // expects.
 constexpr uint64_t SYSRET_SELECTOR_BASE = kernel::memory::KERNEL_SS;
 constexpr uint64_t RPL_USER = 3;
+
+// Cleared on entry: the kernel's string instructions assume DF = 0, whatever
+// the user left in RFLAGS
+constexpr uint64_t RFLAGS_DF = 1U << 10;
 static_assert(SYSRET_SELECTOR_BASE + 8 == kernel::memory::USER_SS - RPL_USER);
 static_assert(SYSRET_SELECTOR_BASE + 16 == kernel::memory::USER_CS - RPL_USER);
 } // namespace
@@ -39,6 +43,6 @@ void initialize()
 								 ((SYSRET_SELECTOR_BASE | RPL_USER) << 48));
 
 	// Set syscall/sysret RFLAGS
-	write_msr(IA32_FMASK, 0);
+	write_msr(IA32_FMASK, RFLAGS_DF);
 }
 } // namespace kernel::syscall
@@ -20,6 +20,10 @@ constexpr int SYS_DRAW_TEXT = 4;
 constexpr int SYS_FILL_RECT = 5;
 constexpr int SYS_TIME = 6;
 constexpr int SYS_IPC = 7;
+constexpr int SYS_MMAP = 9;
+constexpr int SYS_MPROTECT = 10;
+constexpr int SYS_MUNMAP = 11;
+constexpr int SYS_BRK = 12;
 constexpr int SYS_GETPID = 39;
 constexpr int SYS_GETPPID = 40;
 constexpr int SYS_FORK = 57;
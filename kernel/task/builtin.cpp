@@ -1,16 +1,49 @@
 #include "task/builtin.hpp"
 #include <cstddef>
+#include <cstring>
 #include <libs/common/message.hpp>
 #include <libs/common/process_id.hpp>
 #include <libs/common/types.hpp>
 #include <utility>
 #include "hardware/pci.hpp"
+#include "memory/buddy_system.hpp"
+#include "memory/heap_profile.hpp"
+#include "memory/kernel_stack.hpp"
 #include "memory/page.hpp"
+#include "memory/slab.hpp"
 #include "task/ipc.hpp"
 #include "task/task.hpp"
+#include "timers/timer.hpp"
 
 namespace
 {
+// Objects the idle task zeroes between checks for an empty pool
+constexpr size_t ZERO_POOL_REFILL_BATCH = 8;
+
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+uint64_t next_heap_profile_tick =
+		kernel::memory::heap_profile::DUMP_INTERVAL_SEC *
+		kernel::timers::TIMER_FREQUENCY;
+
+// Dumped from the idle task so the serial output never delays real work;
+// under full load the dump waits for the next idle moment
+void dump_heap_profile_if_due()
+{
+	namespace heap_profile = kernel::memory::heap_profile;
+
+	const uint64_t now = kernel::timers::ktimer->current_tick();
+	if (now < next_heap_profile_tick) {
+		return;
+	}
+
+	next_heap_profile_tick =
+			now + heap_profile::DUMP_INTERVAL_SEC * kernel::timers::TIMER_FREQUENCY;
+	if (heap_profile::stats().live_samples != 0) {
+		heap_profile::dump();
+	}
+}
+#endif
+
 void handle_task_ready(const Message& m)
 {
 	Message send_m = { .type = MsgType::KERNEL_TASK_READY,
@@ -19,18 +52,34 @@ void handle_task_ready(const Message& m)
 	kernel::task::send_message(m.sender, send_m);
 }
 
+static_assert(MEMORY_USAGE_ORDERS == kernel::memory::MAX_ORDER + 1,
+			  "memory_usage.free_blocks must cover every buddy order");
+
 void handle_memory_usage(const Message& m)
 {
 	Message resp = { .type = MsgType::KERNEL_MEMORY_USAGE,
 					 .sender = process_ids::KERNEL };
 
-	size_t used_mem = 0;
-	size_t total_mem = 0;
-
-	kernel::memory::get_memory_usage(&total_mem, &used_mem);
+	kernel::memory::MemoryUsage usage;
+	kernel::memory::get_memory_usage(&usage);
+
+	auto& out = resp.data.memory_usage;
+	out.total = usage.total_pages * kernel::memory::PAGE_SIZE;
+	out.used = (usage.total_pages - usage.free_pages) * kernel::memory::PAGE_SIZE;
+	out.free_pages = usage.free_pages;
+	out.slab_pages = usage.slab_pages;
+	out.page_table_pages = usage.page_table_pages;
+	out.ool_pages = usage.ool_pages;
+	for (size_t order = 0; order < MEMORY_USAGE_ORDERS; ++order) {
+		out.free_blocks[order] = usage.free_blocks[order];
+	}
+	out.fragmentation = usage.fragmentation;
 
-	resp.data.memory_usage.total = total_mem;
-	resp.data.memory_usage.used = used_mem;
+	const auto zero_pool = kernel::memory::zero_pool_stats();
+	out.zero_pool_objects = zero_pool.pooled;
+	out.zero_pool_hits = zero_pool.hits;
+	out.zero_pool_misses = zero_pool.misses;
+	out.reserve_objects = kernel::memory::emergency_reserve_stats().pooled;
 	resp.result = OK;
 
 	kernel::task::reply(m, &resp);
@@ -72,6 +121,58 @@ void handle_pci(const Message& m)
 								 count * sizeof(PciDeviceInfo));
 }
 
+void handle_kernel_stacks(const Message& m)
+{
+	Message resp = {
+		.type = MsgType::KERNEL_STACK_USAGE,
+		.sender = process_ids::KERNEL,
+	};
+
+	// Tasks without a kernel stack of their own (the boot task) are left out
+	size_t count = 0;
+	for (const kernel::task::Task* t : kernel::task::tasks) {
+		if (t != nullptr && t->stack != nullptr) {
+			++count;
+		}
+	}
+
+	if (count == 0) {
+		resp.result = OK;
+		kernel::task::reply(m, &resp);
+		return;
+	}
+
+	auto buf = kernel::task::make_ool_buffer(count * sizeof(KernelStackInfo));
+	if (!buf) {
+		resp.result = ERR_NO_MEMORY;
+		kernel::task::reply(m, &resp);
+		return;
+	}
+
+	auto* infos = static_cast<KernelStackInfo*>(buf.get());
+	size_t i = 0;
+	for (const kernel::task::Task* t : kernel::task::tasks) {
+		if (t == nullptr || t->stack == nullptr) {
+			continue;
+		}
+		if (i == count) {
+			break;
+		}
+
+		const auto usage = kernel::memory::kernel_stack_usage(t->stack);
+		infos[i].task_id = t->id.raw();
+		strncpy(infos[i].name, t->name, sizeof(infos[i].name) - 1);
+		infos[i].name[sizeof(infos[i].name) - 1] = '\0';
+		infos[i].backed_pages = usage.backed_pages;
+		infos[i].peak_bytes = usage.peak_bytes;
+		++i;
+	}
+
+	resp.result = OK;
+	kernel::task::reply_with_ool(m, &resp, std::move(buf),
+								 i * sizeof(KernelStackInfo));
+}
+
 } // namespace
 
 namespace kernel::task
@@ -80,7 +181,17 @@ namespace kernel::task
 void idle_service()
 {
 	while (true) {
-		__asm__("hlt");
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+		dump_heap_profile_if_due();
+#endif
+
+		// Nothing else wants the CPU: top up the emergency reserve, zero
+		// pages for later ALLOC_ZEROED requests, and sleep once the pool is
+		// full
+		kernel::memory::refill_emergency_reserve();
+		if (kernel::memory::refill_zero_pool(ZERO_POOL_REFILL_BATCH) == 0) {
+			__asm__("hlt");
+		}
 	}
 }
 
@@ -91,6 +202,7 @@ void kernel_service()
 	t->add_msg_handler(MsgType::KERNEL_TASK_READY, handle_task_ready);
 	t->add_msg_handler(MsgType::KERNEL_MEMORY_USAGE, handle_memory_usage);
 	t->add_msg_handler(MsgType::KERNEL_PCI_LIST, handle_pci);
+	t->add_msg_handler(MsgType::KERNEL_STACK_USAGE, handle_kernel_stacks);
 
 	kernel::task::process_messages(t);
 }
@@ -11,9 +11,10 @@ namespace kernel::task
 /**
  * @brief The system idle task
  *
- * This task runs when no other tasks are ready to execute. It puts
- * the CPU into a low-power state (typically using HLT instruction)
- * until an interrupt occurs.
+ * This task runs when no other tasks are ready to execute. It tops up
+ * the pre-zeroed page pool (see refill_zero_pool()) and, once that is
+ * full, puts the CPU into a low-power state (HLT) until an interrupt
+ * occurs.
  *
  * @note This function never returns
  * @note Has the lowest priority in the system
@@ -59,8 +59,13 @@ ExecuteContextSwitch:
 
     fxrstor [rdi + 0xC0] ; load FPU state
 
+    ; writing CR3 flushes the TLB: skip it when the address space is unchanged
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    cmp rax, rcx
+    je .same_cr3
     mov cr3, rax
+.same_cr3:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -98,7 +103,11 @@ restore_context:
     fxrstor [rdi + 0xC0] ; load FPU state
 
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    cmp rax, rcx
+    je .same_cr3
     mov cr3, rax
+.same_cr3:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -58,8 +58,9 @@ kernel::memory::unique_kbuf<> make_ool_buffer(size_t size)
 
 	// PAGE_SIZE alignment forces the slab object past PAGE_SIZE, which gives
 	// it dedicated pages: nothing else can sit on a page a user may see
-	return kernel::memory::make_kbuf(size, kernel::memory::ALLOC_ZEROED,
-									 kernel::memory::PAGE_SIZE);
+	return kernel::memory::make_kbuf(
+			size, kernel::memory::ALLOC_ZEROED | kernel::memory::ALLOC_OOL,
+			kernel::memory::PAGE_SIZE);
 }
 
 error_t reply_with_ool(const Message& req,
@@ -125,7 +126,7 @@ error_t copy_in_ool_from_user(Message* m)
 		return ERR_NO_MEMORY;
 	}
 
-	if (copy_from_user(buf.get(), uaddr, m->ool.size) != m->ool.size) {
+	if (copy_from_user(buf.get(), uaddr, m->ool.size) != 0) {
 		return ERR_INVALID_ARG;
 	}
 
@@ -173,7 +174,7 @@ void deliver_ool_to_user(Task* t, Message* m)
 	// its physical frame address
 	kernel::memory::vaddr_t uaddr;
 	const error_t err = kernel::memory::map_frame_to_vaddr(
-			t->get_page_table(), m->ool.addr, pages, &uaddr);
+			t->get_page_table(), t->ool_space, m->ool.addr, pages, &uaddr);
 	if (IS_ERR(err)) {
 		LOG_ERROR_CODE(err, "failed to map ool buffer: task %d", t->id.raw());
 		free_message_ool(*m);
@@ -194,6 +195,7 @@ error_t release_ool_region(Task* t, uint64_t uaddr)
 
 		kernel::memory::unmap_frame(t->get_page_table(),
 									kernel::memory::vaddr_t{ r.uaddr }, r.pages);
+		t->ool_space.release(r.uaddr, r.pages);
 		kernel::memory::free(reinterpret_cast<void*>(r.kaddr));
 		r = OolRegion{};
 		return OK;
@@ -212,6 +214,9 @@ void release_ool_regions(Task* t)
 			r = OolRegion{};
 		}
 	}
+
+	// The mappings go with the page table, so the window is free again
+	t->ool_space.reset();
 }
 
 void release_all_ool(Task* t)
@@ -2,6 +2,7 @@
 #include <array>
 #include <cstdint>
 #include <cstring>
+#include <libs/common/memory_layout.h>
 #include <libs/common/message.hpp>
 #include <libs/common/process_id.hpp>
 #include <libs/common/types.hpp>
@@ -9,6 +10,7 @@
 #include "interrupt/vector.hpp"
 #include "list.hpp"
 #include "log/log.hpp"
+#include "memory/kernel_stack.hpp"
 #include "memory/page.hpp"
 #include "memory/paging.hpp"
 #include "memory/paging_utils.h"
@@ -86,12 +88,12 @@ error_t Task::copy_parent_stack(const Context& parent_ctx)
 	}
 
 	stack_size = parent->stack_size;
+	stack = kernel::memory::alloc_kernel_stack();
+	if (stack == nullptr) {
+		return ERR_NO_MEMORY;
+	}
 
-	void* stack_ptr;
-	ALLOC_OR_RETURN_ERROR(stack_ptr, stack_size, kernel::memory::ALLOC_ZEROED);
-	stack = static_cast<uint64_t*>(stack_ptr);
-
-	memcpy(stack, parent->stack, stack_size);
+	RETURN_IF_ERROR(kernel::memory::copy_kernel_stack(stack, parent->stack));
 
 	auto parent_stack_top = reinterpret_cast<uint64_t>(parent->stack) + stack_size;
 	auto child_stack_top = reinterpret_cast<uint64_t>(stack) + stack_size;
@@ -114,33 +116,16 @@ error_t Task::copy_parent_page_table()
 		return ERR_NO_TASK;
 	}
 
-	kernel::memory::page_table_entry* snapshot =
-			reinterpret_cast<kernel::memory::page_table_entry*>(parent->ctx.cr3);
-
-	kernel::memory::page_table_entry* parent_table =
-			kernel::memory::clone_page_table(snapshot, false);
-	if (parent_table == nullptr) {
-		return ERR_NO_MEMORY;
-	}
-
-	// Move the running parent onto its CoW clone. Update ctx.cr3 too so an
-	// exit before the next context save does not tear down the wrong table.
-	set_cr3(reinterpret_cast<uint64_t>(parent_table));
-	parent->ctx.cr3 = reinterpret_cast<uint64_t>(parent_table);
-
+	// Parent and child share the page tables until either writes; the
+	// parent keeps running on its own root table.
 	kernel::memory::page_table_entry* child_table =
-			kernel::memory::clone_page_table(snapshot, false);
+			kernel::memory::share_page_table(parent->get_page_table());
 	if (child_table == nullptr) {
 		return ERR_NO_MEMORY;
 	}
 
 	ctx.cr3 = reinterpret_cast<uint64_t>(child_table);
 
-	// Both clones hold their own references to the CoW data pages now, and
-	// nothing runs on the pre-fork table anymore; release it (issue #313
-	// page table leak).
-	kernel::memory::clean_page_tables(snapshot);
-
 	return OK;
 }
 
@@ -175,6 +160,13 @@ Task* copy_task(Task* parent, Context* parent_ctx)
 	child->just_forked = true;
 
 	memcpy(&child->ctx, parent_ctx, sizeof(Context));
+	child->brk = parent->brk;
+	child->image = parent->image;
+	kernel::memory::get_exec_image(child->image);
+	if (IS_ERR(child->vmas.copy_from(parent->vmas))) {
+		LOG_ERROR("Failed to copy memory areas : %s", parent->name);
+		return nullptr;
+	}
 
 	// Copy parent's file descriptor table
 	if (IS_ERR(kernel::fs::copy_fd_table(child->fd_table.data(),
@@ -286,7 +278,14 @@ void switch_task(const Context& current_ctx)
 		}
 	}
 
-	restore_context(&pick_next_task()->ctx);
+	// Switch address spaces through the next task's PCID so its TLB entries
+	// survive; restore_context() skips the CR3 write when it is unchanged
+	Task* next = pick_next_task();
+	next->ctx.cr3 = kernel::memory::cr3_value_for(next->get_page_table());
+	kernel::memory::set_user_fault_stack(
+			next->stack != nullptr ? kernel::memory::fault_stack_top(next->stack)
+								   : nullptr);
+	restore_context(&next->ctx);
 }
 
 void switch_next_task(bool sleep_current_task)
@@ -404,9 +403,6 @@ void start_scheduling() { kernel::timers::ktimer->add_switch_task_event(200); }
 
 namespace
 {
-// Number of PAGE_SIZE pages allocated for a task's stack.
-constexpr size_t KERNEL_STACK_PAGES = 8;
-
 // Initial RFLAGS for a new task: bit 1 is Intel-reserved and must always
 // read as 1; bit 9 (IF) enables interrupts.
 constexpr uint64_t RFLAGS_RESERVED1 = 1U << 1;
@@ -439,6 +435,10 @@ Task::Task(int raw_id,
 	  exit_records{},
 	  num_exit_records{ 0 },
 	  ool_regions{},
+	  ool_space{ USER_OOL_BASE, USER_OOL_END },
+	  vmas{},
+	  brk{ 0 },
+	  image{ nullptr },
 	  message_handlers({ std::array<message_handler_t, TOTAL_MESSAGE_TYPES>() }),
 	  fd_table()
 {
@@ -458,10 +458,12 @@ Task::Task(int raw_id,
 		return;
 	}
 
-	stack_size = kernel::memory::PAGE_SIZE * KERNEL_STACK_PAGES;
-	void* stack_ptr;
-	ALLOC_OR_RETURN(stack_ptr, stack_size, kernel::memory::ALLOC_ZEROED);
-	stack = static_cast<uint64_t*>(stack_ptr);
+	stack_size = kernel::memory::PAGE_SIZE * kernel::memory::KERNEL_STACK_PAGES;
+	stack = kernel::memory::alloc_kernel_stack();
+	if (stack == nullptr) {
+		LOG_ERROR("failed to allocate the kernel stack of %s", name);
+		return;
+	}
 
 	const uint64_t stack_end = reinterpret_cast<uint64_t>(stack) + stack_size;
 
@@ -8,8 +8,13 @@
 #include <libs/common/types.hpp>
 #include "fs/file_descriptor.hpp"
 #include "list.hpp"
+#include "memory/exec_image.hpp"
+#include "memory/kernel_stack.hpp"
 #include "memory/paging.hpp"
 #include "memory/slab.hpp"
+#include "memory/tlb.hpp"
+#include "memory/vaddr_allocator.hpp"
+#include "memory/vm_area.hpp"
 #include "task/context.hpp"
 #include "task/message_queue.hpp"
 
@@ -60,6 +65,7 @@ enum class WaitReason : uint8_t {
 	NOTIFY,	 ///< Blocked in wait_notification(); only masked doorbells wake it
 	REPLY,	 ///< Blocked in call(); only the matching reply wakes it
 	CHILD,	 ///< Blocked in sys_wait; only a child's exit wakes it
+	SWAP_IN, ///< Faulted on a swapped-out page; the swap task wakes it
 };
 
 /**
@@ -122,6 +128,16 @@ struct Task {
 	/// inherited by fork: the child's copied mappings are unowned and just
 	/// vanish with its page table, while the parent keeps the buffers.
 	std::array<OolRegion, MAX_OOL_REGIONS> ool_regions;
+	/// Free ranges of the OOL window (USER_OOL_BASE..USER_OOL_END) that
+	/// the regions above are mapped from
+	kernel::memory::VaddrAllocator ool_space;
+	/// Demand-paged areas of the user address space (stack, brk heap,
+	/// mmap). Set up by exec and inherited by fork with the page tables.
+	kernel::memory::VmAreaTree vmas;
+	uint64_t brk; ///< Current end of the brk heap (USER_HEAP_BASE at exec)
+	/// Program whose segments the image areas of vmas fault in from; one
+	/// user is held per task that runs it (nullptr if not demand-loaded)
+	kernel::memory::ExecImage* image;
 	std::array<message_handler_t, TOTAL_MESSAGE_TYPES> message_handlers;
 	std::array<kernel::fs::FileDescriptor, MAX_FDS_PER_PROCESS> fd_table;
 
@@ -135,11 +151,11 @@ struct Task {
 	~Task()
 	{
 		if (ctx.cr3 != 0) {
-			kernel::memory::clean_page_tables(
-					reinterpret_cast<kernel::memory::page_table_entry*>(ctx.cr3));
+			kernel::memory::clean_page_tables(get_page_table());
 		}
+		kernel::memory::put_exec_image(image);
 
-		kernel::memory::free(stack);
+		kernel::memory::free_kernel_stack(stack);
 	}
 
 	static void* operator new(size_t size)
@@ -166,9 +182,10 @@ struct Task {
 
 	bool has_parent() const { return parent_id.raw() != -1; }
 
+	/// Root table of the address space; ctx.cr3 may carry a PCID
 	kernel::memory::page_table_entry* get_page_table() const
 	{
-		return reinterpret_cast<kernel::memory::page_table_entry*>(ctx.cr3);
+		return kernel::memory::cr3_to_table(ctx.cr3);
 	}
 };
 
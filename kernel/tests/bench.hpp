@@ -0,0 +1,31 @@
+/**
+ * @file tests/bench.hpp
+ * @brief Cycle-counting helpers for the in-kernel micro-benchmarks
+ *
+ * Benchmarks run inside the regular test suites and report through a
+ * "BENCH: <name> ..." serial line so CI logs can be grepped and compared
+ * across runs. They never fail a suite on timing alone: QEMU's TCG clock
+ * is far too noisy for that.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include "tsc.hpp"
+
+namespace kernel::tests
+{
+
+using kernel::cpu::read_tsc;
+
+/**
+ * @brief Cycles per operation, rounded down
+ * @param cycles Total cycles measured
+ * @param ops Operations performed in that time (0 reports 0)
+ */
+inline uint64_t cycles_per_op(uint64_t cycles, uint64_t ops)
+{
+	return ops == 0 ? 0 : cycles / ops;
+}
+
+} // namespace kernel::tests
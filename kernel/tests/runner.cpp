@@ -11,18 +11,26 @@
 #include "task/task.hpp"
 #include "tests/framework.hpp"
 #include "tests/test_cases/bit_utils_test.hpp"
+#include "tests/test_cases/exec_image_test.hpp"
 #include "tests/test_cases/fd_test.hpp"
 #include "tests/test_cases/fs_test.hpp"
 #include "tests/test_cases/graphics_test.hpp"
 #include "tests/test_cases/heap_debug_test.hpp"
+#include "tests/test_cases/heap_profile_test.hpp"
 #include "tests/test_cases/ipc_test.hpp"
+#include "tests/test_cases/kasan_test.hpp"
+#include "tests/test_cases/mem_ops_test.hpp"
 #include "tests/test_cases/memory_test.hpp"
 #include "tests/test_cases/paging_test.hpp"
 #include "tests/test_cases/stdio_test.hpp"
+#include "tests/test_cases/swap_test.hpp"
 #include "tests/test_cases/task_test.hpp"
 #include "tests/test_cases/timer_test.hpp"
+#include "tests/test_cases/tlb_test.hpp"
 #include "tests/test_cases/user_test.hpp"
+#include "tests/test_cases/vaddr_allocator_test.hpp"
 #include "tests/test_cases/virtio_blk_test.hpp"
+#include "tests/test_cases/vm_area_test.hpp"
 
 #ifdef KERNEL_TEST_EXIT_ENABLED
 #include "tests/qemu_exit.hpp"
@@ -81,10 +89,17 @@ void run_main_stage_tests()
 	run_test_suite(register_buddy_system_tests);
 	run_test_suite(register_slab_tests);
 	run_test_suite(register_alloc_macro_tests);
-
-	// Not leak-checked yet: paging retains page tables and user_copy sets up
-	// user mappings that outlive the suite. Re-enable once audited (#313).
+	run_test_suite(register_mem_ops_tests);
+	run_test_suite(register_vm_area_tests);
+	run_test_suite(register_exec_image_tests);
+	run_test_suite(register_tlb_tests);
+	run_test_suite(register_vaddr_allocator_tests);
+
+	// Not leak-checked yet: paging and swap retain page tables and user_copy
+	// sets up user mappings that outlive the suite. Re-enable once audited
+	// (#313).
 	run_test_suite(register_paging_tests, /*check_leaks=*/false);
+	run_test_suite(register_swap_tests, /*check_leaks=*/false);
 	run_test_suite(register_user_copy_tests, /*check_leaks=*/false);
 
 	run_test_suite(register_graphics_tests);
@@ -105,6 +120,12 @@ void run_main_stage_tests()
 #ifdef KERNEL_HEAP_DEBUG_ENABLED
 	run_test_suite(register_heap_debug_tests);
 #endif
+#ifdef KERNEL_KASAN_ENABLED
+	run_test_suite(register_kasan_tests);
+#endif
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+	run_test_suite(register_heap_profile_tests);
+#endif
 
 	// The stdio suites exercise sys_write(stdout/stderr), which queues
 	// NOTIFY_WRITE on the real SHELL task. Drain it so boot-time tests
@@ -0,0 +1,236 @@
+#include "tests/test_cases/exec_image_test.hpp"
+#include <cstdint>
+#include <cstring>
+#include "memory/exec_image.hpp"
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/paging_utils.h"
+#include "memory/slab.hpp"
+#include "memory/vm_area.hpp"
+#include "tests/bench.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+using kernel::memory::ExecSegment;
+using kernel::memory::PAGE_SIZE;
+
+// User half, away from the addresses the paging tests use
+constexpr uint64_t IMAGE_VADDR = 0xffff'8000'5670'0000;
+
+// Page fault error code bits: P (present) and W/R (write)
+constexpr uint64_t PF_PRESENT = 1;
+constexpr uint64_t PF_WRITE = 2;
+
+uint8_t file_byte(size_t offset, uint8_t seed)
+{
+	return static_cast<uint8_t>(offset % 251 + seed);
+}
+
+// Three pages of file: a read-only segment over the first page and a bit,
+// a writable one with a little data and two pages of bss
+constexpr size_t FILE_SIZE = 3 * PAGE_SIZE;
+
+kernel::memory::unique_kbuf<> make_file(uint8_t seed)
+{
+	auto file = kernel::memory::make_kbuf(FILE_SIZE, kernel::memory::ALLOC_ZEROED);
+	auto* bytes = static_cast<uint8_t*>(file.get());
+	if (bytes != nullptr) {
+		for (size_t i = 0; i < FILE_SIZE; ++i) {
+			bytes[i] = file_byte(i, seed);
+		}
+	}
+
+	return file;
+}
+
+constexpr ExecSegment TEST_SEGMENTS[] = {
+	{ IMAGE_VADDR, 0, PAGE_SIZE + 100, PAGE_SIZE + 100, false },
+	{ IMAGE_VADDR + 4 * PAGE_SIZE + 0x10, 2 * PAGE_SIZE + 0x10, 200, 2 * PAGE_SIZE,
+	  true },
+};
+constexpr int NUM_TEST_SEGMENTS = 2;
+
+kernel::memory::ExecImage* acquire_test_image(kernel::memory::unique_kbuf<>& file)
+{
+	return kernel::memory::acquire_exec_image(file, FILE_SIZE, TEST_SEGMENTS,
+											  NUM_TEST_SEGMENTS);
+}
+
+error_t insert_image_areas(kernel::memory::VmAreaTree& vmas,
+						   kernel::memory::ExecImage* image)
+{
+	RETURN_IF_ERROR(
+			vmas.insert(IMAGE_VADDR, IMAGE_VADDR + 2 * PAGE_SIZE, false, image, 0));
+	return vmas.insert(IMAGE_VADDR + 4 * PAGE_SIZE, IMAGE_VADDR + 7 * PAGE_SIZE,
+					   true, image, 1);
+}
+} // namespace
+
+void test_exec_image_builds_pages_on_demand()
+{
+	using namespace kernel::memory;
+
+	auto file = make_file(1);
+	ASSERT_NOT_NULL(file.get());
+	ExecImage* image = acquire_test_image(file);
+	ASSERT_NOT_NULL(image);
+	ASSERT_NULL(file.get());
+
+	// The tail of the text page is file data up to the segment end, then zero
+	auto* text = static_cast<uint8_t*>(image->page(0, 1));
+	ASSERT_NOT_NULL(text);
+	ASSERT_EQ(text[0], file_byte(PAGE_SIZE, 1));
+	ASSERT_EQ(text[99], file_byte(PAGE_SIZE + 99, 1));
+	ASSERT_EQ(text[100], 0);
+	ASSERT_TRUE(image->page(0, 1) == text);
+
+	// The data segment starts 0x10 into its page and is mostly bss
+	auto* data = static_cast<uint8_t*>(image->page(1, 0));
+	ASSERT_NOT_NULL(data);
+	ASSERT_EQ(data[0xf], 0);
+	ASSERT_EQ(data[0x10], file_byte(2 * PAGE_SIZE + 0x10, 1));
+	ASSERT_EQ(data[0x10 + 200], 0);
+	ASSERT_NULL(image->page(1, 3));
+	ASSERT_NULL(image->page(2, 0));
+
+	// The same contents find the same image and leave the buffer alone
+	auto same = make_file(1);
+	ExecImage* again = acquire_test_image(same);
+	ASSERT_TRUE(again == image);
+	ASSERT_NOT_NULL(same.get());
+
+	auto other = make_file(2);
+	ExecImage* different = acquire_test_image(other);
+	ASSERT_NOT_NULL(different);
+	ASSERT_TRUE(different != image);
+
+	put_exec_image(different);
+	put_exec_image(again);
+	put_exec_image(image);
+}
+
+void test_exec_image_segments_fault_in_shared()
+{
+	using namespace kernel::memory;
+
+	auto file = make_file(3);
+	ExecImage* image = acquire_test_image(file);
+	ASSERT_NOT_NULL(image);
+
+	page_table_entry* saved = get_active_page_table();
+	VmAreaTree first_vmas;
+	VmAreaTree second_vmas;
+	ASSERT_EQ(insert_image_areas(first_vmas, image), OK);
+	ASSERT_EQ(insert_image_areas(second_vmas, image), OK);
+
+	// Two address spaces reading the same text page map the same frame,
+	// read-only, each with its own reference
+	page_table_entry* first = config_new_page_table();
+	ASSERT_NOT_NULL(first);
+	ASSERT_EQ(handle_page_fault(0, IMAGE_VADDR + 8, &first_vmas), OK);
+	auto* first_pte = get_pte(first, vaddr_t{ IMAGE_VADDR }, 1);
+	ASSERT_NOT_NULL(first_pte);
+	ASSERT_EQ(first_pte->bits.writable, 0UL);
+	ASSERT_EQ(first_pte->bits.owned, 1UL);
+	ASSERT_EQ(*reinterpret_cast<volatile uint8_t*>(IMAGE_VADDR + 8),
+			  file_byte(8, 3));
+
+	page_table_entry* second = config_new_page_table();
+	ASSERT_NOT_NULL(second);
+	ASSERT_EQ(handle_page_fault(0, IMAGE_VADDR + 8, &second_vmas), OK);
+	auto* second_pte = get_pte(second, vaddr_t{ IMAGE_VADDR }, 1);
+	ASSERT_NOT_NULL(second_pte);
+	void* text = image->page(0, 0);
+	ASSERT_TRUE(first_pte->get_next_level_table() == text);
+	ASSERT_TRUE(second_pte->get_next_level_table() == text);
+	ASSERT_EQ(get_page(text)->ref_count(), 3UL);
+
+	// Text is never written, nor faulted in past the segment
+	ASSERT_EQ(handle_page_fault(PF_PRESENT | PF_WRITE, IMAGE_VADDR, &second_vmas),
+			  ERR_PAGE_NOT_PRESENT);
+	ASSERT_EQ(handle_page_fault(0, IMAGE_VADDR + 2 * PAGE_SIZE, &second_vmas),
+			  ERR_PAGE_NOT_PRESENT);
+
+	// A read of data shares the image page until the first write copies it
+	const uint64_t data_addr = IMAGE_VADDR + 4 * PAGE_SIZE + 0x10;
+	ASSERT_EQ(handle_page_fault(0, data_addr, &second_vmas), OK);
+	auto* data_pte = get_pte(second, vaddr_t{ data_addr }, 1);
+	ASSERT_TRUE(data_pte->get_next_level_table() == image->page(1, 0));
+	ASSERT_EQ(handle_page_fault(PF_PRESENT | PF_WRITE, data_addr, &second_vmas), OK);
+	ASSERT_EQ(data_pte->bits.writable, 1UL);
+	ASSERT_TRUE(data_pte->get_next_level_table() != image->page(1, 0));
+	*reinterpret_cast<volatile uint8_t*>(data_addr) = 0xaa;
+	ASSERT_EQ(static_cast<uint8_t*>(image->page(1, 0))[0x10],
+			  file_byte(2 * PAGE_SIZE + 0x10, 3));
+
+	// A first write to bss copies straight away
+	ASSERT_EQ(handle_page_fault(PF_WRITE, data_addr + PAGE_SIZE, &second_vmas), OK);
+	ASSERT_EQ(get_pte(second, vaddr_t{ data_addr + PAGE_SIZE }, 1)->bits.writable,
+			  1UL);
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(second);
+	clean_page_tables(first);
+	ASSERT_EQ(get_page(text)->ref_count(), 1UL);
+
+	put_exec_image(image);
+}
+
+void test_exec_latency_by_image_size()
+{
+	using namespace kernel::memory;
+	using kernel::tests::read_tsc;
+
+	// Exec of a program that touches a single page: the eager loader maps
+	// and copies every page of the file, the lazy one registers the areas
+	// and faults in one page from the (already cached) image
+	constexpr size_t image_pages[] = { 16, 256 };
+	page_table_entry* saved = get_active_page_table();
+
+	for (const size_t pages : image_pages) {
+		auto file = make_kbuf(pages * PAGE_SIZE, ALLOC_ZEROED);
+		ASSERT_NOT_NULL(file.get());
+		static_cast<uint8_t*>(file.get())[0] = static_cast<uint8_t>(pages);
+		const ExecSegment segment = { IMAGE_VADDR, 0, pages * PAGE_SIZE,
+									  pages * PAGE_SIZE, false };
+
+		page_table_entry* eager = config_new_page_table();
+		ASSERT_NOT_NULL(eager);
+		uint64_t start = read_tsc();
+		ASSERT_EQ(setup_page_tables(vaddr_t{ IMAGE_VADDR }, pages, true), OK);
+		memcpy(reinterpret_cast<void*>(IMAGE_VADDR), file.get(), pages * PAGE_SIZE);
+		const uint64_t eager_cycles = read_tsc() - start;
+
+		ExecImage* cached = acquire_exec_image(file, pages * PAGE_SIZE, &segment, 1);
+		ASSERT_NOT_NULL(cached);
+
+		page_table_entry* lazy = config_new_page_table();
+		ASSERT_NOT_NULL(lazy);
+		VmAreaTree vmas;
+		start = read_tsc();
+		ASSERT_EQ(vmas.insert(IMAGE_VADDR, IMAGE_VADDR + pages * PAGE_SIZE, false,
+							  cached, 0),
+				  OK);
+		ASSERT_EQ(handle_page_fault(0, IMAGE_VADDR, &vmas), OK);
+		const uint64_t lazy_cycles = read_tsc() - start;
+
+		LOG_TEST("BENCH: exec image=%lu pages lazy %lu cycles, eager %lu cycles",
+				 pages, lazy_cycles, eager_cycles);
+
+		set_cr3(reinterpret_cast<uint64_t>(saved));
+		clean_page_tables(lazy);
+		clean_page_tables(eager);
+		put_exec_image(cached);
+	}
+}
+
+void register_exec_image_tests()
+{
+	test_register("exec_image_builds_pages_on_demand",
+				  test_exec_image_builds_pages_on_demand);
+	test_register("exec_image_segments_fault_in_shared",
+				  test_exec_image_segments_fault_in_shared);
+	test_register("exec_latency_by_image_size", test_exec_latency_by_image_size);
+}
@@ -9,11 +9,14 @@
 #include <libs/common/message.hpp>
 #include <libs/common/process_id.hpp>
 #include <libs/common/stat.hpp>
+#include "fs/fat/buffer_cache.hpp"
 #include "fs/fat/fat.hpp"
 #include "fs/fat/internal_common.hpp"
 #include "fs/file_descriptor.hpp"
 #include "fs/file_info.hpp"
+#include "log/log.hpp"
 #include "task/task.hpp"
+#include "tests/bench.hpp"
 #include "tests/framework.hpp"
 #include "tests/macros.hpp"
 
@@ -280,22 +283,22 @@ void test_cluster_chain_disk_full()
 		fake_fat[i] = canary_value;
 	}
 
-	const size_t free_before = count_free_clusters(fake_fat, total_test_clusters);
-	const cluster_t first_chain =
-			allocate_cluster_chain(fake_fat, total_test_clusters, 4);
-	const size_t free_mid = count_free_clusters(fake_fat, total_test_clusters);
+	ClusterMap map;
+	ASSERT_EQ(build_cluster_map(map, fake_fat, total_test_clusters, 2), OK);
+
+	const size_t free_before = count_free_clusters(map);
+	const cluster_t first_chain = allocate_cluster_chain(map, 4);
+	const size_t free_mid = count_free_clusters(map);
 
 	// Only 2 clusters left: this must fail and roll back, not scan past the
 	// end of the FAT
-	const cluster_t failed_chain =
-			allocate_cluster_chain(fake_fat, total_test_clusters, 4);
-	const size_t free_after = count_free_clusters(fake_fat, total_test_clusters);
+	const cluster_t failed_chain = allocate_cluster_chain(map, 4);
+	const size_t free_after = count_free_clusters(map);
 
 	// Fully exhaust the remaining clusters, then fail again
-	const cluster_t second_chain =
-			allocate_cluster_chain(fake_fat, total_test_clusters, 2);
-	const cluster_t exhausted_chain =
-			allocate_cluster_chain(fake_fat, total_test_clusters, 1);
+	const cluster_t second_chain = allocate_cluster_chain(map, 2);
+	const cluster_t exhausted_chain = allocate_cluster_chain(map, 1);
+	destroy_cluster_map(map);
 
 	bool canaries_intact = true;
 	for (size_t i = total_test_clusters; i < total_test_clusters + 4; ++i) {
@@ -312,6 +315,118 @@ void test_cluster_chain_disk_full()
 	ASSERT_TRUE(canaries_intact);
 }
 
+/**
+ * @brief Test that appends cost the same on an empty and a nearly full volume
+ *
+ * Allocation used to scan the FAT from cluster 2 and count the free
+ * clusters on every grow, so each append got slower as the volume filled.
+ */
+void test_cluster_map_fill_volume()
+{
+	using kernel::tests::cycles_per_op;
+	using kernel::tests::read_tsc;
+
+	constexpr size_t total_test_clusters = 64 * 1024;
+	constexpr size_t quarter = total_test_clusters / 4;
+	auto fat_buf = kernel::memory::make_kbuf(total_test_clusters * sizeof(uint32_t),
+											 kernel::memory::ALLOC_ZEROED);
+	ASSERT_TRUE(static_cast<bool>(fat_buf));
+	auto* fat = static_cast<uint32_t*>(fat_buf.get());
+	fat[0] = 0x0FFFFFF8;
+	fat[1] = 0x0FFFFFFF;
+
+	ClusterMap map;
+	ASSERT_EQ(build_cluster_map(map, fat, total_test_clusters, 2), OK);
+
+	// One file grows a cluster at a time, the way FS_WRITE appends do
+	const cluster_t first = allocate_cluster_chain(map, 1);
+	ASSERT_EQ(first, 2UL);
+	cluster_t last = first;
+	size_t appended = 1;
+	uint64_t first_quarter = 0;
+	uint64_t last_quarter = 0;
+	while (count_free_clusters(map) != 0) {
+		const uint64_t start = read_tsc();
+		last = extend_cluster_chain(map, last, 1);
+		const uint64_t cycles = read_tsc() - start;
+		ASSERT_NE(last, 0UL);
+		++appended;
+
+		if (appended <= quarter) {
+			first_quarter += cycles;
+		} else if (appended > total_test_clusters - quarter) {
+			last_quarter += cycles;
+		}
+	}
+
+	LOG_TEST("BENCH: cluster append empty volume %lu cycles/op, full %lu cycles/op",
+			 cycles_per_op(first_quarter, quarter - 1),
+			 cycles_per_op(last_quarter, quarter - 2));
+
+	// Every cluster went to the chain, in order
+	ASSERT_EQ(appended, total_test_clusters - 2);
+	ASSERT_EQ(last, total_test_clusters - 1);
+	ASSERT_EQ(fat[last], kernel::fs::END_OF_CLUSTER_CHAIN);
+	ASSERT_EQ(allocate_cluster_chain(map, 1), 0UL);
+
+	// Freed clusters are found again past the hint, after the wrap
+	free_cluster_chain(map, fat[first]);
+	fat[first] = kernel::fs::END_OF_CLUSTER_CHAIN;
+	ASSERT_EQ(count_free_clusters(map), total_test_clusters - 3);
+	ASSERT_EQ(allocate_cluster_chain(map, 1), 3UL);
+
+	destroy_cluster_map(map);
+}
+
+/**
+ * @brief Test that a small append dirties one FAT sector, not the whole FAT
+ *
+ * Every grow used to rewrite each FAT copy in full; now only the sectors
+ * whose entries changed are written, adjacent ones in a single request.
+ */
+void test_fat_dirty_sectors()
+{
+	constexpr size_t total_test_clusters = 16 * 1024;
+	auto fat_buf = kernel::memory::make_kbuf(total_test_clusters * sizeof(uint32_t),
+											 kernel::memory::ALLOC_ZEROED);
+	ASSERT_TRUE(static_cast<bool>(fat_buf));
+	auto* fat = static_cast<uint32_t*>(fat_buf.get());
+	fat[0] = 0x0FFFFFF8;
+	fat[1] = 0x0FFFFFFF;
+
+	ClusterMap map;
+	ASSERT_EQ(build_cluster_map(map, fat, total_test_clusters, 2), OK);
+	size_t first;
+	size_t count;
+	ASSERT_FALSE(next_dirty_run(map, 0, &first, &count));
+
+	// A file of one cluster grows by one: both entries share sector 0
+	const cluster_t file = allocate_cluster_chain(map, 1);
+	ASSERT_NE(file, 0UL);
+	ASSERT_NE(extend_cluster_chain(map, file, 1), 0UL);
+	ASSERT_EQ(map.num_dirty, 1UL);
+
+	const size_t whole_fat = total_test_clusters * sizeof(uint32_t);
+	LOG_TEST("BENCH: FAT bytes written per append: whole FAT %lu, dirty sectors %lu",
+			 whole_fat, map.num_dirty * SECTOR_SIZE);
+
+	// Adjacent dirty sectors form one run, a gap starts the next
+	set_fat_entry(map, FAT_ENTRIES_PER_SECTOR, 0);
+	set_fat_entry(map, 2 * FAT_ENTRIES_PER_SECTOR + 5, 0);
+	set_fat_entry(map, 7 * FAT_ENTRIES_PER_SECTOR, 0);
+	ASSERT_EQ(map.num_dirty, 4UL);
+
+	ASSERT_TRUE(next_dirty_run(map, 0, &first, &count));
+	ASSERT_EQ(first, 0UL);
+	ASSERT_EQ(count, 3UL);
+	ASSERT_TRUE(next_dirty_run(map, first + count, &first, &count));
+	ASSERT_EQ(first, 7UL);
+	ASSERT_EQ(count, 1UL);
+	ASSERT_FALSE(next_dirty_run(map, first + count, &first, &count));
+
+	destroy_cluster_map(map);
+}
+
 /**
  * @brief Register all file system test cases
  */
@@ -391,6 +506,164 @@ void test_cwd_ledger()
 	ASSERT_NULL(cwd_lookup(process_ids::INVALID));
 }
 
+namespace
+{
+// In-memory disk behind the buffer cache tests, in blocks of one sector
+constexpr size_t fake_disk_sectors = 64;
+uint8_t fake_disk[fake_disk_sectors * SECTOR_SIZE];
+size_t fake_disk_reads;
+size_t fake_disk_writes;
+
+kernel::memory::unique_kbuf<> fake_disk_read(unsigned int sector, size_t len)
+{
+	++fake_disk_reads;
+	auto buf = kernel::memory::make_kbuf(len, kernel::memory::ALLOC_UNINITIALIZED);
+	if (buf) {
+		memcpy(buf.get(), fake_disk + sector * SECTOR_SIZE, len);
+	}
+	return buf;
+}
+
+error_t fake_disk_write(void* buffer, unsigned int sector, size_t len)
+{
+	++fake_disk_writes;
+	memcpy(fake_disk + sector * SECTOR_SIZE, buffer, len);
+	kernel::memory::free(buffer);
+	return OK;
+}
+} // namespace
+
+/**
+ * @brief Test buffer cache hits, LRU eviction and deferred write-back
+ */
+void test_buffer_cache_lru_write_back()
+{
+	for (size_t i = 0; i < fake_disk_sectors; ++i) {
+		memset(fake_disk + i * SECTOR_SIZE, static_cast<int>(i), SECTOR_SIZE);
+	}
+	fake_disk_reads = 0;
+	fake_disk_writes = 0;
+
+	// A private cache of two blocks; the live one belongs to the FS task
+	BufferCache cache(BlockDevice{ fake_disk_read, fake_disk_write }, SECTOR_SIZE,
+					  2);
+
+	const auto* block = static_cast<const uint8_t*>(cache.read(1));
+	ASSERT_NOT_NULL(block);
+	ASSERT_EQ(block[0], 1);
+	ASSERT_NOT_NULL(cache.read(1));
+	ASSERT_EQ(fake_disk_reads, 1UL);
+
+	// Writes stay in the cache until the block is evicted
+	uint8_t data[SECTOR_SIZE];
+	memset(data, 0xab, sizeof(data));
+	ASSERT_EQ(cache.write(2, data), OK);
+	ASSERT_EQ(fake_disk_writes, 0UL);
+	ASSERT_EQ(cache.stats().dirty, 1UL);
+
+	// Sector 1 was used after 2 was written: reading 3 evicts 2
+	ASSERT_NOT_NULL(cache.read(1));
+	ASSERT_NOT_NULL(cache.read(3));
+	ASSERT_EQ(fake_disk_writes, 1UL);
+	ASSERT_EQ(fake_disk[2 * SECTOR_SIZE], 0xab);
+
+	ASSERT_EQ(cache.write(3, data), OK);
+	ASSERT_EQ(cache.sync(), OK);
+	ASSERT_EQ(fake_disk[3 * SECTOR_SIZE], 0xab);
+	ASSERT_EQ(cache.sync(), OK);
+
+	const BufferCacheStats stats = cache.stats();
+	ASSERT_EQ(stats.blocks, 2UL);
+	ASSERT_EQ(stats.dirty, 0UL);
+	ASSERT_EQ(stats.hits, 2UL);
+	ASSERT_EQ(stats.misses, 2UL);
+	ASSERT_EQ(stats.writebacks, 2UL);
+	ASSERT_EQ(stats.evictions, 1UL);
+}
+
+/**
+ * @brief Test that a contiguous file is read in one request per run
+ *
+ * Compares reading a file laid out in adjacent clusters with one of the
+ * same size in every other cluster, through a private cache and FAT over
+ * the fake disk: the first needs a single device read, the second one per
+ * cluster.
+ */
+void test_cluster_run_throughput()
+{
+	constexpr size_t file_clusters = 16;
+	constexpr size_t file_size = file_clusters * SECTOR_SIZE - 100;
+	constexpr cluster_t contiguous = 2;
+	constexpr cluster_t fragmented = contiguous + file_clusters;
+	static_assert(fragmented + 2 * file_clusters - 2 <= fake_disk_sectors);
+
+	for (size_t i = 0; i < fake_disk_sectors; ++i) {
+		memset(fake_disk + i * SECTOR_SIZE, static_cast<int>(i), SECTOR_SIZE);
+	}
+
+	// Cluster n is sector n - 2: one sector per cluster, data at sector 0
+	uint32_t fat[fake_disk_sectors + 2] = { 0x0FFFFFF8, 0x0FFFFFFF };
+	for (size_t i = 0; i < file_clusters; ++i) {
+		fat[contiguous + i] = contiguous + i + 1;
+		fat[fragmented + 2 * i] = fragmented + 2 * i + 2;
+	}
+	fat[contiguous + file_clusters - 1] = kernel::fs::END_OF_CLUSTER_CHAIN;
+	fat[fragmented + 2 * file_clusters - 2] = kernel::fs::END_OF_CLUSTER_CHAIN;
+
+	cluster_t next;
+	ASSERT_EQ(cluster_run_length(fat, contiguous, 64, &next), file_clusters);
+	ASSERT_EQ(next, kernel::fs::END_OF_CLUSTER_CHAIN);
+	ASSERT_EQ(cluster_run_length(fat, contiguous, 4, &next), 4UL);
+	ASSERT_EQ(next, contiguous + 4);
+	ASSERT_EQ(cluster_run_length(fat, fragmented, 64, &next), 1UL);
+	ASSERT_EQ(next, fragmented + 2);
+
+	// Nothing is cached, so every block comes from the device
+	BufferCache cache(BlockDevice{ fake_disk_read, fake_disk_write }, SECTOR_SIZE,
+					  2);
+	auto buf = kernel::memory::make_kbuf(file_size, kernel::memory::ALLOC_ZEROED);
+	ASSERT_TRUE(static_cast<bool>(buf));
+	auto* out = static_cast<uint8_t*>(buf.get());
+
+	fake_disk_reads = 0;
+	uint64_t start = kernel::tests::read_tsc();
+	ASSERT_EQ(read_cluster_chain(cache, fat, 0, contiguous, file_size, out), OK);
+	const uint64_t contiguous_cycles = kernel::tests::read_tsc() - start;
+	const size_t contiguous_reads = fake_disk_reads;
+	ASSERT_EQ(contiguous_reads, 1UL);
+	ASSERT_EQ(out[0], 0);
+	ASSERT_EQ(out[file_size - 1], file_clusters - 1);
+
+	fake_disk_reads = 0;
+	start = kernel::tests::read_tsc();
+	ASSERT_EQ(read_cluster_chain(cache, fat, 0, fragmented, file_size, out), OK);
+	const uint64_t fragmented_cycles = kernel::tests::read_tsc() - start;
+	const size_t fragmented_reads = fake_disk_reads;
+	ASSERT_EQ(fragmented_reads, file_clusters);
+	ASSERT_EQ(out[SECTOR_SIZE], fragmented - 2 + 2);
+	ASSERT_EQ(out[file_size - 1], fragmented - 2 + 2 * file_clusters - 2);
+
+	LOG_TEST("BENCH: %lu-cluster file read: contiguous %lu requests %lu cycles, "
+			 "fragmented %lu requests %lu cycles",
+			 file_clusters, contiguous_reads, contiguous_cycles, fragmented_reads,
+			 fragmented_cycles);
+
+	// A run write is one request, and leaves a cached copy clean and current
+	uint8_t data[4 * SECTOR_SIZE];
+	memset(data, 0xcd, sizeof(data));
+	uint8_t block[SECTOR_SIZE];
+	memset(block, 0xab, sizeof(block));
+	ASSERT_EQ(cache.write(1, block), OK);
+	fake_disk_writes = 0;
+	ASSERT_EQ(cache.write_run(0, 4, data), OK);
+	ASSERT_EQ(fake_disk_writes, 1UL);
+	ASSERT_EQ(fake_disk[3 * SECTOR_SIZE + 7], 0xcd);
+	ASSERT_EQ(cache.stats().dirty, 0UL);
+	const auto* cached = static_cast<const uint8_t*>(cache.read(1));
+	ASSERT_NOT_NULL(cached);
+	ASSERT_EQ(cached[0], 0xcd);
+}
+
 void register_fs_tests()
 {
 	test_register("test_write_existing_file", test_write_existing_file);
@@ -407,7 +680,12 @@ void register_fs_tests()
 	test_register("test_read_dir_entry_name_boundary",
 				  test_read_dir_entry_name_boundary);
 	test_register("test_cluster_chain_disk_full", test_cluster_chain_disk_full);
+	test_register("test_cluster_map_fill_volume", test_cluster_map_fill_volume);
+	test_register("test_fat_dirty_sectors", test_fat_dirty_sectors);
 	test_register("test_open_file_ledger_basic", test_open_file_ledger_basic);
 	test_register("test_open_file_ledger_sweep", test_open_file_ledger_sweep);
 	test_register("test_cwd_ledger", test_cwd_ledger);
+	test_register("test_buffer_cache_lru_write_back",
+				  test_buffer_cache_lru_write_back);
+	test_register("test_cluster_run_throughput", test_cluster_run_throughput);
 }
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "tests/test_cases/heap_profile_test.hpp"
+
+#ifdef KERNEL_HEAP_PROFILE_ENABLED
+
+#include <cstddef>
+#include <cstdint>
+#include "memory/heap_profile.hpp"
+#include "memory/slab.hpp"
+#include "tests/bench.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+
+namespace heap_profile = kernel::memory::heap_profile;
+
+// Generous bound on the size of the test function below
+constexpr uintptr_t TEST_FUNCTION_SPAN = 4096;
+
+// With every allocation sampled, the innermost frame is the alloc() call in
+// this function, and the sample goes away with free()
+void test_heap_profile_records_caller()
+{
+	const auto before = heap_profile::stats();
+	heap_profile::set_sample_interval(1);
+
+	void* p = kernel::memory::alloc(100, kernel::memory::ALLOC_UNINITIALIZED);
+	heap_profile::set_sample_interval(heap_profile::DEFAULT_SAMPLE_INTERVAL);
+	ASSERT_NOT_NULL(p);
+
+	uintptr_t frames[heap_profile::MAX_FRAMES];
+	const size_t depth = heap_profile::sampled_frames(p, frames);
+	ASSERT_TRUE(depth > 0);
+
+	const auto self = reinterpret_cast<uintptr_t>(&test_heap_profile_records_caller);
+	ASSERT_TRUE(frames[0] > self);
+	ASSERT_TRUE(frames[0] < self + TEST_FUNCTION_SPAN);
+
+	ASSERT_EQ(heap_profile::stats().live_samples, before.live_samples + 1);
+	ASSERT_TRUE(heap_profile::stats().live_bytes >= before.live_bytes + 100);
+	heap_profile::dump();
+
+	kernel::memory::free(p);
+	ASSERT_EQ(heap_profile::sampled_frames(p, frames), 0);
+	ASSERT_EQ(heap_profile::stats().live_samples, before.live_samples);
+	ASSERT_EQ(heap_profile::stats().live_bytes, before.live_bytes);
+}
+
+// Each sample stands for the bytes since the previous one, so the live
+// estimate falls short of the bytes allocated by less than one maximal gap
+// (1.5 intervals)
+void test_heap_profile_estimates_live_bytes()
+{
+	constexpr size_t INTERVAL = 4096;
+	constexpr size_t OBJECT_SIZE = 1024;
+	constexpr size_t NUM_OBJECTS = 64;
+	constexpr size_t TOTAL = OBJECT_SIZE * NUM_OBJECTS;
+
+	const size_t before = heap_profile::stats().live_bytes;
+	heap_profile::set_sample_interval(INTERVAL);
+
+	void* objects[NUM_OBJECTS] = {};
+	for (auto& object : objects) {
+		object = kernel::memory::alloc(OBJECT_SIZE,
+									   kernel::memory::ALLOC_UNINITIALIZED);
+	}
+	heap_profile::set_sample_interval(heap_profile::DEFAULT_SAMPLE_INTERVAL);
+
+	const size_t estimate = heap_profile::stats().live_bytes - before;
+	ASSERT_TRUE(estimate <= TOTAL);
+	ASSERT_TRUE(estimate + INTERVAL * 3 / 2 > TOTAL);
+
+	for (void* object : objects) {
+		ASSERT_NOT_NULL(object);
+		kernel::memory::free(object);
+	}
+	ASSERT_EQ(heap_profile::stats().live_bytes, before);
+}
+
+// Cycles per 64-byte alloc/free pair with sampling off, at the default
+// interval and on every allocation
+void test_heap_profile_overhead()
+{
+	using kernel::tests::read_tsc;
+
+	constexpr int ROUNDS = 10000;
+	constexpr size_t intervals[] = { 0, heap_profile::DEFAULT_SAMPLE_INTERVAL, 1 };
+
+	for (const size_t interval : intervals) {
+		heap_profile::set_sample_interval(interval);
+		const uint64_t start = read_tsc();
+		for (int i = 0; i < ROUNDS; ++i) {
+			void* p = kernel::memory::alloc(64, kernel::memory::ALLOC_UNINITIALIZED);
+			kernel::memory::free(p);
+		}
+		const uint64_t cycles = read_tsc() - start;
+
+		LOG_TEST("BENCH: heap profile interval %lu: %lu cycles per alloc/free",
+				 static_cast<unsigned long>(interval),
+				 kernel::tests::cycles_per_op(cycles, ROUNDS));
+	}
+
+	heap_profile::set_sample_interval(heap_profile::DEFAULT_SAMPLE_INTERVAL);
+}
+
+} // namespace
+
+void register_heap_profile_tests()
+{
+	test_register("heap_profile_records_caller", test_heap_profile_records_caller);
+	test_register("heap_profile_estimates_live_bytes",
+				  test_heap_profile_estimates_live_bytes);
+	test_register("heap_profile_overhead", test_heap_profile_overhead);
+}
+
+#else
+
+void register_heap_profile_tests() {}
+
+#endif // KERNEL_HEAP_PROFILE_ENABLED
@@ -0,0 +1,11 @@
+#pragma once
+
+/**
+ * @brief Register the allocation sampler tests
+ *
+ * The suite verifies that a sample names the allocation's caller, that the
+ * sample weights add up to the bytes allocated, and measures what sampling
+ * adds to an alloc/free pair. It registers no tests unless the kernel is
+ * built with KERNEL_HEAP_PROFILE.
+ */
+void register_heap_profile_tests();
@@ -0,0 +1,159 @@
+#include "tests/test_cases/kasan_test.hpp"
+
+#ifdef KERNEL_KASAN_ENABLED
+
+#include <cstddef>
+#include <cstdint>
+#include "memory/kasan.hpp"
+#include "memory/page.hpp"
+#include "memory/slab.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+
+namespace kasan = kernel::memory::kasan;
+
+// A size class large enough that a slab holds exactly one object, so a freed
+// object is deterministically handed back on the next allocation of that size.
+// 200000 + the redzone rounds up to a 256 KiB object, and 256 KiB / 256 KiB = 1.
+constexpr size_t SINGLE_OBJECT_SIZE = 200000;
+
+// Every byte asked for is addressable; the first byte after it is not, even
+// inside the same 8-byte granule. The access is caught when it happens, not
+// at free().
+void test_kasan_detects_overflow()
+{
+	const size_t before = kasan::stats().out_of_bounds;
+
+	constexpr size_t size = 61;
+	auto* p = static_cast<volatile uint8_t*>(
+			kernel::memory::alloc(size, kernel::memory::ALLOC_UNINITIALIZED));
+	ASSERT_NOT_NULL(p);
+
+	for (size_t i = 0; i < size; ++i) {
+		p[i] = static_cast<uint8_t>(i);
+	}
+	ASSERT_EQ(kasan::stats().out_of_bounds, before);
+
+	{
+		const kasan::ExpectedViolation expected;
+		p[size] = 0xAA; // one byte past the payload, same granule
+	}
+	ASSERT_EQ(kasan::stats().out_of_bounds, before + 1);
+
+	{
+		const kasan::ExpectedViolation expected;
+		p[size + kasan::GRANULE_SIZE] = 0xAA; // tail redzone
+	}
+	ASSERT_EQ(kasan::stats().out_of_bounds, before + 2);
+
+	kernel::memory::free(const_cast<uint8_t*>(p));
+}
+
+// The byte before an object is the previous slot's redzone or free shadow,
+// unless the object starts its slab's page.
+void test_kasan_detects_underflow()
+{
+	using kernel::memory::PAGE_SIZE;
+
+	const size_t before = kasan::stats().out_of_bounds +
+						  kasan::stats().use_after_free;
+
+	void* objects[4] = {};
+	volatile uint8_t* p = nullptr;
+	for (auto& object : objects) {
+		object = kernel::memory::alloc(64, kernel::memory::ALLOC_UNINITIALIZED);
+		ASSERT_NOT_NULL(object);
+		if (reinterpret_cast<uintptr_t>(object) % PAGE_SIZE != 0) {
+			p = static_cast<volatile uint8_t*>(object);
+			break;
+		}
+	}
+	ASSERT_NOT_NULL(p);
+
+	{
+		const kasan::ExpectedViolation expected;
+		(void)p[-1];
+	}
+	ASSERT_EQ(kasan::stats().out_of_bounds + kasan::stats().use_after_free,
+			  before + 1);
+
+	for (void* object : objects) {
+		kernel::memory::free(object);
+	}
+}
+
+// Reading a freed object is caught at the read; the object sits in quarantine
+// meanwhile and no longer counts as in use.
+void test_kasan_detects_use_after_free()
+{
+	const size_t before = kasan::stats().use_after_free;
+
+	auto* p = static_cast<volatile uint8_t*>(
+			kernel::memory::alloc(64, kernel::memory::ALLOC_ZEROED));
+	ASSERT_NOT_NULL(p);
+	ASSERT_EQ(p[0], 0);
+
+	kernel::memory::free(const_cast<uint8_t*>(p));
+	ASSERT_FALSE(kernel::memory::is_slab_object_in_use(const_cast<uint8_t*>(p)));
+
+	{
+		const kasan::ExpectedViolation expected;
+		(void)p[0];
+	}
+	ASSERT_EQ(kasan::stats().use_after_free, before + 1);
+}
+
+// Freeing the same pointer twice must be caught at the second free.
+void test_kasan_detects_double_free()
+{
+	const size_t before = kasan::stats().invalid_free;
+
+	void* p = kernel::memory::alloc(64, kernel::memory::ALLOC_UNINITIALIZED);
+	ASSERT_NOT_NULL(p);
+
+	kernel::memory::free(p);
+	{
+		const kasan::ExpectedViolation expected;
+		kernel::memory::free(p); // double free
+	}
+
+	ASSERT_EQ(kasan::stats().invalid_free, before + 1);
+}
+
+// Quarantine never makes a cache grow: an object in it is handed out again
+// before fresh pages are taken.
+void test_kasan_quarantine_released_before_growing()
+{
+	void* p = kernel::memory::alloc(SINGLE_OBJECT_SIZE,
+									kernel::memory::ALLOC_UNINITIALIZED);
+	ASSERT_NOT_NULL(p);
+	kernel::memory::free(p);
+
+	void* q = kernel::memory::alloc(SINGLE_OBJECT_SIZE,
+									kernel::memory::ALLOC_UNINITIALIZED);
+	ASSERT_EQ(q, p);
+	ASSERT_TRUE(kernel::memory::is_slab_object_in_use(q));
+
+	kernel::memory::free(q);
+}
+
+} // namespace
+
+void register_kasan_tests()
+{
+	test_register("kasan_overflow", test_kasan_detects_overflow);
+	test_register("kasan_underflow", test_kasan_detects_underflow);
+	test_register("kasan_use_after_free", test_kasan_detects_use_after_free);
+	test_register("kasan_double_free", test_kasan_detects_double_free);
+	test_register("kasan_quarantine_released_before_growing",
+				  test_kasan_quarantine_released_before_growing);
+}
+
+#else
+
+void register_kasan_tests() {}
+
+#endif // KERNEL_KASAN_ENABLED
@@ -0,0 +1,10 @@
+#pragma once
+
+/**
+ * @brief Register the shadow-memory checker tests
+ *
+ * The suite verifies that out-of-bounds accesses on either side of an
+ * allocation, a use after free and a double free are caught. It registers
+ * no tests unless the kernel is built with KERNEL_KASAN.
+ */
+void register_kasan_tests();
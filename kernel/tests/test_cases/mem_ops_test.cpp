@@ -0,0 +1,279 @@
+#include "tests/test_cases/mem_ops_test.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "mem_ops.hpp"
+#include "memory/page.hpp"
+#include "memory/slab.hpp"
+#include "tests/bench.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+constexpr size_t PAGE = kernel::memory::PAGE_SIZE;
+constexpr size_t BENCH_BUFFER_SIZE = 16 * PAGE;
+
+// Around the qword tail and the ERMS short-copy cutoff
+constexpr size_t test_sizes[] = {
+	0, 1, 7, 8, 9, 15, 16, 63, 64, 65, 127, 128, 129, 1000,
+};
+
+using copy_fn = void* (*)(void*, const void*, size_t);
+using fill_fn = void* (*)(void*, int, size_t);
+
+struct CopyVariant {
+	const char* name;
+	copy_fn copy;
+};
+
+struct FillVariant {
+	const char* name;
+	fill_fn fill;
+};
+
+// What the kernel ran on before it had its own memcpy/memset
+void* copy_bytes(void* dst, const void* src, size_t n)
+{
+	auto* d = static_cast<volatile uint8_t*>(dst);
+	const auto* s = static_cast<const uint8_t*>(src);
+	for (size_t i = 0; i < n; ++i) {
+		d[i] = s[i];
+	}
+
+	return dst;
+}
+
+void* fill_bytes(void* dst, int c, size_t n)
+{
+	auto* d = static_cast<volatile uint8_t*>(dst);
+	for (size_t i = 0; i < n; ++i) {
+		d[i] = static_cast<uint8_t>(c);
+	}
+
+	return dst;
+}
+
+const CopyVariant copy_variants[] = {
+	{ "bytes", copy_bytes },
+	{ "movsq", kernel::memory::copy_movsq },
+	{ "movsb", kernel::memory::copy_movsb },
+	{ "memcpy", memcpy },
+};
+
+const FillVariant fill_variants[] = {
+	{ "bytes", fill_bytes },
+	{ "stosq", kernel::memory::fill_stosq },
+	{ "stosb", kernel::memory::fill_stosb },
+	{ "memset", memset },
+};
+
+void fill_pattern(uint8_t* buf, size_t n, uint8_t seed)
+{
+	for (size_t i = 0; i < n; ++i) {
+		buf[i] = static_cast<uint8_t>(seed + i * 7);
+	}
+}
+
+// Bytes per cycle in hundredths, so the log line needs no floating point
+uint64_t bytes_per_cycle_x100(uint64_t bytes, uint64_t cycles)
+{
+	return kernel::tests::cycles_per_op(bytes * 100, cycles);
+}
+} // namespace
+
+void test_mem_ops_copy_sizes_and_offsets()
+{
+	using namespace kernel::memory;
+
+	constexpr size_t GUARD = 16;
+	constexpr size_t BUF_SIZE = 1024 + 2 * GUARD + 8;
+
+	auto* src = static_cast<uint8_t*>(alloc(BUF_SIZE, ALLOC_UNINITIALIZED));
+	auto* dst = static_cast<uint8_t*>(alloc(BUF_SIZE, ALLOC_UNINITIALIZED));
+	ASSERT_NOT_NULL(src);
+	ASSERT_NOT_NULL(dst);
+	fill_pattern(src, BUF_SIZE, 3);
+
+	for (const auto& variant : copy_variants) {
+		for (const size_t size : test_sizes) {
+			for (size_t offset = 0; offset < 8; ++offset) {
+				memset(dst, 0xee, BUF_SIZE);
+				uint8_t* d = dst + GUARD + offset;
+				const uint8_t* s = src + GUARD + (7 - offset);
+				ASSERT_TRUE(variant.copy(d, s, size) == d);
+
+				for (size_t i = 0; i < size; ++i) {
+					ASSERT_EQ(d[i], s[i]);
+				}
+				// Nothing written outside [d, d + size)
+				ASSERT_EQ(d[-1], 0xee);
+				ASSERT_EQ(d[size], 0xee);
+			}
+		}
+	}
+
+	free(dst);
+	free(src);
+}
+
+void test_mem_ops_fill_sizes_and_offsets()
+{
+	using namespace kernel::memory;
+
+	constexpr size_t GUARD = 16;
+	constexpr size_t BUF_SIZE = 1024 + 2 * GUARD + 8;
+
+	auto* buf = static_cast<uint8_t*>(alloc(BUF_SIZE, ALLOC_UNINITIALIZED));
+	ASSERT_NOT_NULL(buf);
+
+	for (const auto& variant : fill_variants) {
+		for (const size_t size : test_sizes) {
+			for (size_t offset = 0; offset < 8; ++offset) {
+				fill_pattern(buf, BUF_SIZE, 5);
+				uint8_t* d = buf + GUARD + offset;
+				const uint8_t before = d[-1];
+				const uint8_t after = d[size];
+				ASSERT_TRUE(variant.fill(d, 0x1a5, size) == d);
+
+				// Only the low byte of the value is stored
+				for (size_t i = 0; i < size; ++i) {
+					ASSERT_EQ(d[i], 0xa5);
+				}
+				ASSERT_EQ(d[-1], before);
+				ASSERT_EQ(d[size], after);
+			}
+		}
+	}
+
+	free(buf);
+}
+
+void test_mem_ops_page_clear_and_copy()
+{
+	using namespace kernel::memory;
+
+	auto* pages = static_cast<uint8_t*>(alloc(4 * PAGE, ALLOC_UNINITIALIZED, PAGE));
+	ASSERT_NOT_NULL(pages);
+
+	// Three whole pages cleared, the fourth left alone
+	fill_pattern(pages, 4 * PAGE, 1);
+	clear_pages(pages, 3);
+	for (size_t i = 0; i < 3 * PAGE; ++i) {
+		ASSERT_EQ(pages[i], 0);
+	}
+	ASSERT_EQ(pages[3 * PAGE], static_cast<uint8_t>(1 + 3 * PAGE * 7));
+
+	fill_pattern(pages + 3 * PAGE, PAGE, 9);
+	copy_page(pages, pages + 3 * PAGE);
+	ASSERT_EQ(memcmp(pages, pages + 3 * PAGE, PAGE), 0);
+
+	// Misaligned buffers take the cached path and give the same result
+	fill_pattern(pages, 4 * PAGE, 2);
+	copy_page(pages + 8, pages + 2 * PAGE);
+	ASSERT_EQ(memcmp(pages + 8, pages + 2 * PAGE, PAGE), 0);
+	ASSERT_EQ(pages[7], static_cast<uint8_t>(2 + 7 * 7));
+
+	fill_pattern(pages, 4 * PAGE, 2);
+	clear_pages(pages + 1, 1);
+	for (size_t i = 1; i <= PAGE; ++i) {
+		ASSERT_EQ(pages[i], 0);
+	}
+	ASSERT_EQ(pages[PAGE + 1], static_cast<uint8_t>(2 + (PAGE + 1) * 7));
+
+	free(pages);
+}
+
+void test_mem_ops_bytes_per_cycle()
+{
+	using namespace kernel::memory;
+	using kernel::tests::read_tsc;
+
+	constexpr size_t sizes[] = { 16, 64, 256, 1024, PAGE, BENCH_BUFFER_SIZE };
+	constexpr size_t BYTES_PER_SIZE = 256 * 1024;
+
+	auto* src = static_cast<uint8_t*>(alloc(BENCH_BUFFER_SIZE, ALLOC_ZEROED, PAGE));
+	auto* dst = static_cast<uint8_t*>(alloc(BENCH_BUFFER_SIZE, ALLOC_ZEROED, PAGE));
+	ASSERT_NOT_NULL(src);
+	ASSERT_NOT_NULL(dst);
+
+	LOG_TEST("BENCH: memcpy/memset variant %s", mem_ops_variant());
+
+	// The same number of bytes at every size, in calls of that size
+	for (const size_t size : sizes) {
+		const size_t calls = BYTES_PER_SIZE / size;
+		for (const auto& variant : copy_variants) {
+			const uint64_t start = read_tsc();
+			for (size_t i = 0; i < calls; ++i) {
+				variant.copy(dst, src, size);
+			}
+			const uint64_t cycles = read_tsc() - start;
+
+			LOG_TEST("BENCH: copy %s %lu bytes %lu bytes/cycle x100", variant.name,
+					 size, bytes_per_cycle_x100(calls * size, cycles));
+		}
+
+		for (const auto& variant : fill_variants) {
+			const uint64_t start = read_tsc();
+			for (size_t i = 0; i < calls; ++i) {
+				variant.fill(dst, 0, size);
+			}
+			const uint64_t cycles = read_tsc() - start;
+
+			LOG_TEST("BENCH: fill %s %lu bytes %lu bytes/cycle x100", variant.name,
+					 size, bytes_per_cycle_x100(calls * size, cycles));
+		}
+	}
+
+	// Whole pages: cached REP STOS/MOVS against the non-temporal stores
+	constexpr size_t NUM_PAGES = BENCH_BUFFER_SIZE / PAGE;
+	constexpr int ROUNDS = 16;
+	uint64_t start = read_tsc();
+	for (int r = 0; r < ROUNDS; ++r) {
+		memset(dst, 0, BENCH_BUFFER_SIZE);
+	}
+	const uint64_t cached_clear = read_tsc() - start;
+
+	start = read_tsc();
+	for (int r = 0; r < ROUNDS; ++r) {
+		kernel::memory::clear_pages(dst, NUM_PAGES);
+	}
+	const uint64_t streamed_clear = read_tsc() - start;
+
+	start = read_tsc();
+	for (int r = 0; r < ROUNDS; ++r) {
+		for (size_t i = 0; i < NUM_PAGES; ++i) {
+			memcpy(dst + i * PAGE, src + i * PAGE, PAGE);
+		}
+	}
+	const uint64_t cached_copy = read_tsc() - start;
+
+	start = read_tsc();
+	for (int r = 0; r < ROUNDS; ++r) {
+		for (size_t i = 0; i < NUM_PAGES; ++i) {
+			kernel::memory::copy_page(dst + i * PAGE, src + i * PAGE);
+		}
+	}
+	const uint64_t streamed_copy = read_tsc() - start;
+
+	const uint64_t total = ROUNDS * BENCH_BUFFER_SIZE;
+	LOG_TEST("BENCH: page clear cached %lu, non-temporal %lu bytes/cycle x100",
+			 bytes_per_cycle_x100(total, cached_clear),
+			 bytes_per_cycle_x100(total, streamed_clear));
+	LOG_TEST("BENCH: page copy cached %lu, non-temporal %lu bytes/cycle x100",
+			 bytes_per_cycle_x100(total, cached_copy),
+			 bytes_per_cycle_x100(total, streamed_copy));
+
+	free(dst);
+	free(src);
+}
+
+void register_mem_ops_tests()
+{
+	test_register("mem_ops_copy_sizes_and_offsets",
+				  test_mem_ops_copy_sizes_and_offsets);
+	test_register("mem_ops_fill_sizes_and_offsets",
+				  test_mem_ops_fill_sizes_and_offsets);
+	test_register("mem_ops_page_clear_and_copy", test_mem_ops_page_clear_and_copy);
+	test_register("mem_ops_bytes_per_cycle", test_mem_ops_bytes_per_cycle);
+}
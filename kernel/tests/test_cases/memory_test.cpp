@@ -8,6 +8,7 @@
 #include "memory/heap_debug.hpp"
 #include "memory/page.hpp"
 #include "memory/slab.hpp"
+#include "tests/bench.hpp"
 #include "tests/framework.hpp"
 #include "tests/macros.hpp"
 
@@ -72,6 +73,34 @@ void test_boot_allocator_alignment()
 	kernel::memory::boot_allocator->free(aligned_mem, kernel::memory::PAGE_SIZE);
 }
 
+void test_boot_allocator_find_next()
+{
+	using namespace kernel::memory;
+
+	// Wide enough that the run crosses at least one bitmap word boundary
+	constexpr size_t num_pages = BITMAP_ENTRY_SIZE + 3;
+	void* run = boot_allocator->allocate(PAGE_SIZE * num_pages);
+	ASSERT_NOT_NULL(run);
+
+	const size_t first = reinterpret_cast<uintptr_t>(run) / PAGE_SIZE;
+	const size_t end = first + num_pages;
+	ASSERT_EQ(boot_allocator->find_next(first, end, true), first);
+	ASSERT_EQ(boot_allocator->find_next(first, end, false), end);
+
+	boot_allocator->free(reinterpret_cast<void*>((first + 1) * PAGE_SIZE),
+						 PAGE_SIZE * (num_pages - 2));
+	ASSERT_EQ(boot_allocator->find_next(first, end, false), first + 1);
+	ASSERT_EQ(boot_allocator->find_next(first + 1, end, true), end - 1);
+
+	// Nothing past the end of usable memory is ever free
+	const size_t limit = boot_allocator->end_index();
+	ASSERT_EQ(boot_allocator->find_next(limit, limit + 1, false), limit + 1);
+	ASSERT_EQ(boot_allocator->find_next(limit, limit + 1, true), limit);
+
+	boot_allocator->free(run, PAGE_SIZE);
+	boot_allocator->free(reinterpret_cast<void*>((end - 1) * PAGE_SIZE), PAGE_SIZE);
+}
+
 void register_bootstrap_allocator_tests()
 {
 	test_register("boot_allocator", test_boot_allocator_basic);
@@ -79,6 +108,7 @@ void register_bootstrap_allocator_tests()
 	test_register("boot_allocator_allocation_and_free",
 				  test_boot_allocator_allocation_and_free);
 	test_register("boot_allocator_alignment", test_boot_allocator_alignment);
+	test_register("boot_allocator_find_next", test_boot_allocator_find_next);
 }
 
 void test_buddy_system_basic()
@@ -147,7 +177,9 @@ void test_get_page_bounds()
 	ASSERT_NULL(kernel::memory::get_page(nullptr));
 
 	// the last valid page resolves
-	const size_t num_pages = kernel::memory::pages.size();
+	const auto& last_region =
+			kernel::memory::page_regions[kernel::memory::num_page_regions - 1];
+	const size_t num_pages = last_region.start_pfn + last_region.num_pages;
 	void* last_page_addr =
 			reinterpret_cast<void*>((num_pages - 1) * kernel::memory::PAGE_SIZE);
 	ASSERT_NOT_NULL(kernel::memory::get_page(last_page_addr));
@@ -158,6 +190,30 @@ void test_get_page_bounds()
 	ASSERT_NULL(kernel::memory::get_page(out_of_range));
 }
 
+void test_page_descriptor_round_trip()
+{
+	// ptr()/index() are derived from the descriptor's region, not stored
+	for (size_t r = 0; r < kernel::memory::num_page_regions; ++r) {
+		const auto& region = kernel::memory::page_regions[r];
+		ASSERT_NOT_NULL(region.pages);
+
+		const size_t last_pfn = region.start_pfn + region.num_pages - 1;
+		for (size_t pfn : { region.start_pfn, last_pfn }) {
+			void* addr = reinterpret_cast<void*>(pfn * kernel::memory::PAGE_SIZE);
+			kernel::memory::Page* page = kernel::memory::get_page(addr);
+			ASSERT_NOT_NULL(page);
+			ASSERT_EQ(page->index(), pfn);
+			ASSERT_TRUE(page->ptr() == addr);
+		}
+
+		// regions are sorted and disjoint
+		if (r > 0) {
+			const auto& prev = kernel::memory::page_regions[r - 1];
+			ASSERT_TRUE(prev.start_pfn + prev.num_pages < region.start_pfn);
+		}
+	}
+}
+
 void test_bootstrap_buffer_stays_reserved()
 {
 	// The bootstrap allocator's static BSS buffer must stay marked used
@@ -172,6 +228,74 @@ void test_bootstrap_buffer_stays_reserved()
 	}
 }
 
+void test_memory_usage_counters()
+{
+	using kernel::memory::MemoryUsage;
+
+	MemoryUsage before;
+	kernel::memory::get_memory_usage(&before);
+
+	// the free-block histogram accounts for every free page
+	size_t histogram_pages = 0;
+	for (int order = 0; order <= kernel::memory::MAX_ORDER; ++order) {
+		histogram_pages += before.free_blocks[order] << order;
+	}
+	ASSERT_EQ(histogram_pages, before.free_pages);
+	ASSERT_TRUE(before.free_pages < before.total_pages);
+	ASSERT_TRUE(before.fragmentation <= 1000);
+	ASSERT_EQ(before.fragmentation,
+			  kernel::memory::fragmentation_index(before.free_blocks,
+												  before.free_pages));
+
+	// Free memory in many blocks of the largest order is not fragmented,
+	// however many blocks there are; only pages below the target order count
+	size_t blocks[kernel::memory::MAX_ORDER + 1] = {};
+	blocks[kernel::memory::MAX_ORDER] = 1000;
+	const size_t max_order_pages = 1000UL << kernel::memory::MAX_ORDER;
+	ASSERT_EQ(kernel::memory::fragmentation_index(blocks, max_order_pages), 0U);
+	blocks[0] = 3;
+	ASSERT_EQ(kernel::memory::fragmentation_index(blocks, max_order_pages + 3), 0U);
+	blocks[kernel::memory::MAX_ORDER] = 0;
+	ASSERT_EQ(kernel::memory::fragmentation_index(blocks, 3), 1000U);
+
+	// buddy allocations move the free counter without a page scan
+	void* block = kernel::memory::memory_manager->allocate(
+			4 * kernel::memory::PAGE_SIZE);
+	ASSERT_NOT_NULL(block);
+
+	MemoryUsage during;
+	kernel::memory::get_memory_usage(&during);
+	ASSERT_EQ(during.free_pages, before.free_pages - 4);
+
+	kernel::memory::memory_manager->free(block, 4 * kernel::memory::PAGE_SIZE);
+	kernel::memory::get_memory_usage(&during);
+	ASSERT_EQ(during.free_pages, before.free_pages);
+
+	// tagged slab objects are counted until they are freed
+	void* table = kernel::memory::alloc(
+			kernel::memory::PAGE_SIZE,
+			kernel::memory::ALLOC_ZEROED | kernel::memory::ALLOC_PAGE_TABLE);
+	void* ool = kernel::memory::alloc(
+			kernel::memory::PAGE_SIZE,
+			kernel::memory::ALLOC_ZEROED | kernel::memory::ALLOC_OOL,
+			kernel::memory::PAGE_SIZE);
+	ASSERT_NOT_NULL(table);
+	ASSERT_NOT_NULL(ool);
+
+	kernel::memory::get_memory_usage(&during);
+	ASSERT_TRUE(during.page_table_pages > before.page_table_pages);
+	ASSERT_TRUE(during.ool_pages > before.ool_pages);
+	ASSERT_TRUE(during.slab_pages >= before.slab_pages);
+
+	kernel::memory::free(table);
+	kernel::memory::free(ool);
+
+	MemoryUsage after;
+	kernel::memory::get_memory_usage(&after);
+	ASSERT_EQ(after.page_table_pages, before.page_table_pages);
+	ASSERT_EQ(after.ool_pages, before.ool_pages);
+}
+
 void register_buddy_system_tests()
 {
 	test_register("buddy_system_basic", test_buddy_system_basic);
@@ -179,6 +303,8 @@ void register_buddy_system_tests()
 	test_register("buddy_system_split_and_merge", test_buddy_system_split_and_merge);
 	test_register("buddy_system_error_handling", test_buddy_system_error_handling);
 	test_register("get_page_bounds", test_get_page_bounds);
+	test_register("page_descriptor_round_trip", test_page_descriptor_round_trip);
+	test_register("memory_usage_counters", test_memory_usage_counters);
 	test_register("bootstrap_buffer_stays_reserved",
 				  test_bootstrap_buffer_stays_reserved);
 }
@@ -460,6 +586,250 @@ void test_unique_kbuf_null_is_safe()
 	ASSERT_FALSE(static_cast<bool>(empty));
 }
 
+namespace
+{
+
+void cache_free(kernel::memory::MCache& cache, void* addr)
+{
+	cache.free(kernel::memory::get_page(addr)->slab(), addr);
+}
+
+} // namespace
+
+void test_slab_magazine_reuses_freed_object()
+{
+	auto& cache = kernel::memory::m_cache_create("magazine-reuse", 256);
+	ASSERT_TRUE(cache.magazines_enabled());
+
+	void* first = cache.alloc();
+	ASSERT_NOT_NULL(first);
+	cache_free(cache, first);
+
+	// A parked object is no longer in use, so a second free is still caught
+	ASSERT_FALSE(kernel::memory::is_slab_object_in_use(first));
+	{
+		const kernel::memory::heap_debug::ExpectedViolation expected;
+		cache_free(cache, first);
+	}
+
+	// The magazine is LIFO: the object just freed comes straight back, once
+	void* again = cache.alloc();
+	ASSERT_EQ(again, first);
+	ASSERT_TRUE(kernel::memory::is_slab_object_in_use(again));
+	void* other = cache.alloc();
+	ASSERT_NE(other, first);
+
+	cache_free(cache, again);
+	cache_free(cache, other);
+	cache.drain_magazines();
+}
+
+void test_slab_magazine_drain_empties_slabs()
+{
+	auto& cache = kernel::memory::m_cache_create("magazine-drain", 512);
+
+	// Several magazines' worth, so rounds also travel through the depot
+	constexpr int num_ptrs = 4 * kernel::memory::MAGAZINE_SIZE;
+	void* ptrs[num_ptrs] = {};
+	for (void*& ptr : ptrs) {
+		ptr = cache.alloc();
+		ASSERT_NOT_NULL(ptr);
+	}
+	for (void* ptr : ptrs) {
+		cache_free(cache, ptr);
+	}
+
+	// Cached rounds keep their slabs occupied until the layer is drained
+	cache.drain_magazines();
+	EXPECT_TRUE(cache.slabs_full_.empty());
+	EXPECT_TRUE(cache.slabs_partial_.empty());
+	EXPECT_FALSE(cache.slabs_free_.empty());
+
+	// Disabling the layer routes straight to the slabs
+	cache.set_magazines_enabled(false);
+	void* direct = cache.alloc();
+	ASSERT_NOT_NULL(direct);
+	cache_free(cache, direct);
+	EXPECT_TRUE(cache.slabs_partial_.empty());
+}
+
+void test_slab_shrink_releases_empty_slabs()
+{
+	auto& cache = kernel::memory::m_cache_create("slab-shrink", 512);
+
+	constexpr int num_ptrs = 4 * kernel::memory::MAGAZINE_SIZE;
+	void* ptrs[num_ptrs] = {};
+	for (void*& ptr : ptrs) {
+		ptr = cache.alloc();
+		ASSERT_NOT_NULL(ptr);
+	}
+	for (void* ptr : ptrs) {
+		cache_free(cache, ptr);
+	}
+
+	// The rounds sit in magazines until shrink() drains them, then every
+	// slab is empty and goes back to the buddy system
+	ASSERT_NE(cache.shrink(), 0UL);
+	EXPECT_TRUE(cache.slabs_full_.empty());
+	EXPECT_TRUE(cache.slabs_partial_.empty());
+	EXPECT_TRUE(cache.slabs_free_.empty());
+	EXPECT_FALSE(kernel::memory::is_slab_object_in_use(ptrs[0]));
+
+	// The cache grows again on demand
+	void* again = cache.alloc();
+	ASSERT_NOT_NULL(again);
+	cache_free(cache, again);
+	cache.shrink();
+}
+
+void test_slab_magazine_throughput()
+{
+	using kernel::tests::cycles_per_op;
+	using kernel::tests::read_tsc;
+
+	// Same cache both ways so only the magazine layer differs; a burst of
+	// allocations followed by frees is the pattern IPC and fork produce
+	auto& cache = kernel::memory::m_cache_create("magazine-bench", 256);
+	constexpr int burst = 8;
+	constexpr int rounds = 2000;
+
+	auto run = [&cache]() -> uint64_t {
+		void* ptrs[burst];
+		const uint64_t start = read_tsc();
+		for (int r = 0; r < rounds; ++r) {
+			for (void*& ptr : ptrs) {
+				ptr = cache.alloc();
+			}
+			for (void* ptr : ptrs) {
+				cache_free(cache, ptr);
+			}
+		}
+		return read_tsc() - start;
+	};
+
+	cache.set_magazines_enabled(false);
+	run(); // warm up: grow the slabs outside the timed runs
+	const uint64_t without = run();
+
+	cache.set_magazines_enabled(true);
+	run();
+	const uint64_t with = run();
+	cache.drain_magazines();
+
+	const uint64_t ops = 2ULL * burst * rounds;
+	LOG_TEST("BENCH: slab alloc/free magazines=on %lu cycles/op, off %lu cycles/op",
+			 cycles_per_op(with, ops), cycles_per_op(without, ops));
+	EXPECT_TRUE(cache.slabs_partial_.empty());
+}
+
+void test_zero_pool_serves_zeroed_pages()
+{
+	using namespace kernel::memory;
+
+	constexpr size_t num_pages = 4;
+
+	drain_zero_pool();
+	ASSERT_EQ(refill_zero_pool(num_pages), num_pages);
+	const ZeroPoolStats before = zero_pool_stats();
+	ASSERT_EQ(before.pooled, num_pages);
+
+	// Pooled pages go out zeroed; once they are gone the request misses
+	// and zeroes in place
+	void* pages[num_pages + 1];
+	for (void*& page : pages) {
+		page = alloc(PAGE_SIZE, ALLOC_ZEROED);
+		ASSERT_NOT_NULL(page);
+		const auto* bytes = static_cast<const uint8_t*>(page);
+		for (size_t i = 0; i < PAGE_SIZE; ++i) {
+			ASSERT_EQ(bytes[i], 0);
+		}
+		memset(page, 0xcc, PAGE_SIZE);
+	}
+
+	const ZeroPoolStats after = zero_pool_stats();
+	ASSERT_EQ(after.pooled, 0UL);
+	ASSERT_EQ(after.hits - before.hits, num_pages);
+	ASSERT_EQ(after.misses - before.misses, 1UL);
+
+	// Uninitialized requests leave the pool alone
+	ASSERT_EQ(refill_zero_pool(1), 1UL);
+	void* raw = alloc(PAGE_SIZE, ALLOC_UNINITIALIZED);
+	ASSERT_NOT_NULL(raw);
+	ASSERT_EQ(zero_pool_stats().pooled, 1UL);
+	free(raw);
+
+	for (void* page : pages) {
+		free(page);
+	}
+
+	// The pool stops at its capacity
+	ASSERT_EQ(refill_zero_pool(ZERO_POOL_CAPACITY + 8), ZERO_POOL_CAPACITY - 1);
+	ASSERT_EQ(refill_zero_pool(1), 0UL);
+	ASSERT_EQ(drain_zero_pool(), ZERO_POOL_CAPACITY);
+	ASSERT_EQ(zero_pool_stats().pooled, 0UL);
+}
+
+void test_emergency_reserve_refill()
+{
+	using namespace kernel::memory;
+
+	constexpr size_t num_classes = RESERVE_MAX_SHIFT - RESERVE_MIN_SHIFT + 1;
+
+	refill_emergency_reserve();
+	const ReserveStats before = emergency_reserve_stats();
+	ASSERT_EQ(before.pooled, num_classes * RESERVE_CAPACITY);
+
+	// The caches still have room: atomic requests do not touch the reserve
+	void* small = alloc(64, ALLOC_ATOMIC | ALLOC_ZEROED);
+	void* page = alloc(PAGE_SIZE, ALLOC_ATOMIC);
+	ASSERT_NOT_NULL(small);
+	ASSERT_NOT_NULL(page);
+	const ReserveStats after = emergency_reserve_stats();
+	ASSERT_EQ(after.pooled, before.pooled);
+	ASSERT_EQ(after.hits, before.hits);
+	free(small);
+	free(page);
+
+	// Full classes are above the watermark
+	ASSERT_EQ(refill_emergency_reserve(), 0UL);
+}
+
+void test_zero_pool_alloc_latency()
+{
+	using namespace kernel::memory;
+	using kernel::tests::cycles_per_op;
+	using kernel::tests::read_tsc;
+
+	constexpr size_t num_pages = 32;
+	void* pages[num_pages];
+
+	// Same allocations both ways: from the pool, then zeroed in place
+	drain_zero_pool();
+	ASSERT_EQ(refill_zero_pool(num_pages), num_pages);
+	uint64_t start = read_tsc();
+	for (void*& page : pages) {
+		page = alloc(PAGE_SIZE, ALLOC_ZEROED);
+	}
+	const uint64_t hit = read_tsc() - start;
+	for (void* page : pages) {
+		ASSERT_NOT_NULL(page);
+		free(page);
+	}
+
+	start = read_tsc();
+	for (void*& page : pages) {
+		page = alloc(PAGE_SIZE, ALLOC_ZEROED);
+	}
+	const uint64_t miss = read_tsc() - start;
+	for (void* page : pages) {
+		ASSERT_NOT_NULL(page);
+		free(page);
+	}
+
+	LOG_TEST("BENCH: zeroed page alloc pool hit %lu cycles, miss %lu cycles",
+			 cycles_per_op(hit, num_pages), cycles_per_op(miss, num_pages));
+}
+
 void register_slab_tests()
 {
 	test_register("slab_basic", test_slab_basic);
@@ -484,6 +854,17 @@ void register_slab_tests()
 				  test_unique_kbuf_move_transfers_ownership);
 	test_register("make_kbuf_zeroed", test_make_kbuf_zeroed);
 	test_register("unique_kbuf_null_is_safe", test_unique_kbuf_null_is_safe);
+	test_register("slab_magazine_reuses_freed_object",
+				  test_slab_magazine_reuses_freed_object);
+	test_register("slab_magazine_drain_empties_slabs",
+				  test_slab_magazine_drain_empties_slabs);
+	test_register("slab_shrink_releases_empty_slabs",
+				  test_slab_shrink_releases_empty_slabs);
+	test_register("slab_magazine_throughput", test_slab_magazine_throughput);
+	test_register("zero_pool_serves_zeroed_pages",
+				  test_zero_pool_serves_zeroed_pages);
+	test_register("zero_pool_alloc_latency", test_zero_pool_alloc_latency);
+	test_register("emergency_reserve_refill", test_emergency_reserve_refill);
 }
 
 namespace
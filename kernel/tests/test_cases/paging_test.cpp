@@ -1,9 +1,14 @@
 #include "tests/test_cases/paging_test.hpp"
 #include <cstdint>
+#include <libs/common/memory_layout.h>
 #include "memory/buddy_system.hpp"
 #include "memory/page.hpp"
 #include "memory/paging.hpp"
+#include "memory/paging_utils.h"
 #include "memory/slab.hpp"
+#include "memory/vaddr_allocator.hpp"
+#include "memory/vm_area.hpp"
+#include "tests/bench.hpp"
 #include "tests/framework.hpp"
 #include "tests/macros.hpp"
 
@@ -11,6 +16,36 @@ namespace
 {
 // PML4 index 256 = start of the user half of the address space
 constexpr uint64_t TEST_USER_VADDR = 0xffff'8000'1234'5000;
+// 2 MiB aligned, in the same PML4/PDPT slot as TEST_USER_VADDR
+constexpr uint64_t TEST_HUGE_VADDR = 0xffff'8000'0020'0000;
+
+// Page fault error code bits: P (present) and W/R (write)
+constexpr uint64_t PF_PRESENT = 1;
+constexpr uint64_t PF_WRITE = 2;
+
+// Walk the kernel identity map down to its huge-page leaf
+bool is_identity_mapped(uint64_t paddr)
+{
+	using namespace kernel::memory;
+
+	const vaddr_t addr{ paddr };
+	page_table_entry* pml4 = get_active_page_table();
+	if (!pml4[addr.part(4)].bits.present) {
+		return false;
+	}
+
+	page_table_entry pdpte = pml4[addr.part(4)].get_next_level_table()[addr.part(3)];
+	if (!pdpte.bits.present) {
+		return false;
+	}
+
+	if (pdpte.bits.huge_page) {
+		return true;
+	}
+
+	page_table_entry pde = pdpte.get_next_level_table()[addr.part(2)];
+	return pde.bits.present && pde.bits.huge_page;
+}
 } // namespace
 
 void test_clean_page_tables_frees_user_pages()
@@ -71,6 +106,201 @@ void test_cow_pages_freed_with_last_reference()
 	ASSERT_FALSE(is_slab_object_in_use(data_page));
 }
 
+void test_forked_tables_shared_until_write()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* origin = new_page_table();
+	ASSERT_NOT_NULL(origin);
+
+	const vaddr_t addr{ TEST_USER_VADDR };
+	ASSERT_EQ(setup_page_table(origin, 4, addr, 1, true), 0);
+	void* data_page = get_pte(origin, addr, 1)->get_next_level_table();
+
+	// Fork shares the PDPT and write-protects both PML4 entries
+	page_table_entry* fork = share_page_table(origin);
+	ASSERT_NOT_NULL(fork);
+
+	page_table_entry* pdpt = origin[addr.part(4)].get_next_level_table();
+	ASSERT_TRUE(fork[addr.part(4)].get_next_level_table() == pdpt);
+	ASSERT_EQ(origin[addr.part(4)].bits.writable, 0UL);
+	ASSERT_EQ(fork[addr.part(4)].bits.writable, 0UL);
+	ASSERT_EQ(get_page(pdpt)->ref_count(), 2UL);
+	ASSERT_EQ(get_page(data_page)->ref_count(), 1UL);
+
+	// Mapping a neighbour in the fork copies the path down to its page
+	// table; the data page is then referenced by both page tables
+	const vaddr_t next{ TEST_USER_VADDR + PAGE_SIZE };
+	ASSERT_EQ(setup_page_table(fork, 4, next, 1, true), 0);
+	ASSERT_TRUE(fork[addr.part(4)].get_next_level_table() != pdpt);
+	ASSERT_EQ(get_pte(fork, addr, 1)->bits.writable, 0UL);
+	ASSERT_TRUE(get_pte(fork, addr, 1)->get_next_level_table() == data_page);
+	ASSERT_EQ(get_pte(origin, next, 1)->bits.present, 0UL);
+	ASSERT_EQ(get_page(data_page)->ref_count(), 2UL);
+
+	// The origin's PDPT lost its only sharer and is private again
+	ASSERT_EQ(get_page(pdpt)->ref_count(), 0UL);
+
+	clean_page_tables(origin);
+	ASSERT_FALSE(is_slab_object_in_use(pdpt));
+	ASSERT_TRUE(is_slab_object_in_use(data_page));
+
+	clean_page_tables(fork);
+	ASSERT_FALSE(is_slab_object_in_use(data_page));
+}
+
+void test_fork_latency_by_heap_size()
+{
+	using namespace kernel::memory;
+	using kernel::tests::read_tsc;
+
+	// Off 2 MiB alignment, so the heap is all 4 KiB pages as in the worst
+	// case: the eager clone copies one page table per 2 MiB of heap
+	constexpr size_t heap_kib[] = { 64, 1024, 8192 };
+
+	for (const size_t kib : heap_kib) {
+		page_table_entry* origin = new_page_table();
+		ASSERT_NOT_NULL(origin);
+		ASSERT_EQ(setup_page_table(origin, 4, vaddr_t{ TEST_USER_VADDR },
+								   kib * 1024 / PAGE_SIZE, true),
+				  0);
+
+		uint64_t start = read_tsc();
+		page_table_entry* eager = clone_page_table(origin, false);
+		const uint64_t eager_cycles = read_tsc() - start;
+		ASSERT_NOT_NULL(eager);
+
+		start = read_tsc();
+		page_table_entry* lazy = share_page_table(origin);
+		const uint64_t lazy_cycles = read_tsc() - start;
+		ASSERT_NOT_NULL(lazy);
+
+		LOG_TEST("BENCH: fork heap=%lu KiB lazy %lu cycles, eager %lu cycles", kib,
+				 lazy_cycles, eager_cycles);
+
+		clean_page_tables(eager);
+		clean_page_tables(lazy);
+		clean_page_tables(origin);
+	}
+}
+
+void test_anon_area_faults_in_on_demand()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* saved = get_active_page_table();
+	page_table_entry* table = config_new_page_table();
+	ASSERT_NOT_NULL(table);
+
+	const uint64_t base = TEST_USER_VADDR;
+	VmAreaTree vmas;
+	ASSERT_EQ(vmas.insert(base, base + 4 * PAGE_SIZE, true), OK);
+	const vaddr_t addr{ base };
+
+	// Nothing is mapped until the first fault
+	ASSERT_NULL(get_pte(table, addr, 1));
+
+	// A read maps the shared zero page, read-only and unowned
+	ASSERT_EQ(handle_page_fault(0, base + 8, &vmas), OK);
+	auto* pte = get_pte(table, addr, 1);
+	ASSERT_NOT_NULL(pte);
+	ASSERT_EQ(pte->bits.present, 1UL);
+	ASSERT_EQ(pte->bits.writable, 0UL);
+	ASSERT_EQ(pte->bits.owned, 0UL);
+	ASSERT_EQ(*reinterpret_cast<volatile uint64_t*>(base + 8), 0UL);
+	void* zero = pte->get_next_level_table();
+
+	// Another page reads the same zero page
+	ASSERT_EQ(handle_page_fault(0, base + PAGE_SIZE, &vmas), OK);
+	ASSERT_TRUE(get_pte(table, vaddr_t{ base + PAGE_SIZE }, 1)->get_next_level_table() ==
+				zero);
+
+	// The first write replaces it with a private zeroed page
+	ASSERT_EQ(handle_page_fault(PF_PRESENT | PF_WRITE, base, &vmas), OK);
+	ASSERT_EQ(pte->bits.writable, 1UL);
+	ASSERT_EQ(pte->bits.owned, 1UL);
+	ASSERT_TRUE(pte->get_next_level_table() != zero);
+	ASSERT_EQ(*reinterpret_cast<volatile uint64_t*>(base + 8), 0UL);
+
+	// A write to an untouched page allocates straight away
+	ASSERT_EQ(handle_page_fault(PF_WRITE, base + 2 * PAGE_SIZE, &vmas), OK);
+	ASSERT_EQ(get_pte(table, vaddr_t{ base + 2 * PAGE_SIZE }, 1)->bits.owned, 1UL);
+
+	// Outside every area the fault is an error
+	ASSERT_EQ(handle_page_fault(0, base + 4 * PAGE_SIZE, &vmas), ERR_PAGE_NOT_PRESENT);
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(table);
+}
+
+void test_anon_area_write_faults_in_huge_page()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* saved = get_active_page_table();
+	page_table_entry* table = config_new_page_table();
+	ASSERT_NOT_NULL(table);
+
+	const uint64_t base = TEST_HUGE_VADDR;
+	VmAreaTree vmas;
+	ASSERT_EQ(vmas.insert(base, base + 2 * HUGE_PAGE_SIZE, true), OK);
+
+	// A write into an untouched extent the area covers whole maps all of it
+	ASSERT_EQ(handle_page_fault(PF_WRITE, base + 5 * PAGE_SIZE, &vmas), OK);
+	auto* pde = get_pte(table, vaddr_t{ base }, 2);
+	ASSERT_NOT_NULL(pde);
+	ASSERT_EQ(pde->bits.huge_page, 1UL);
+	ASSERT_EQ(pde->bits.writable, 1UL);
+	ASSERT_EQ(*reinterpret_cast<volatile uint64_t*>(base + HUGE_PAGE_SIZE - 8), 0UL);
+
+	// Once a read has mapped the zero page there, the extent stays 4 KiB
+	const uint64_t second = base + HUGE_PAGE_SIZE;
+	ASSERT_EQ(handle_page_fault(0, second, &vmas), OK);
+	ASSERT_EQ(handle_page_fault(PF_WRITE, second + PAGE_SIZE, &vmas), OK);
+	ASSERT_EQ(get_pte(table, vaddr_t{ second }, 2)->bits.huge_page, 0UL);
+	ASSERT_EQ(get_pte(table, vaddr_t{ second + PAGE_SIZE }, 1)->bits.owned, 1UL);
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(table);
+}
+
+void test_protect_and_release_user_pages()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* saved = get_active_page_table();
+	page_table_entry* table = config_new_page_table();
+	ASSERT_NOT_NULL(table);
+
+	const uint64_t base = TEST_USER_VADDR;
+	VmAreaTree vmas;
+	ASSERT_EQ(vmas.insert(base, base + 2 * PAGE_SIZE, true), OK);
+	ASSERT_EQ(handle_page_fault(PF_WRITE, base, &vmas), OK);
+	auto* pte = get_pte(table, vaddr_t{ base }, 1);
+	void* data_page = pte->get_next_level_table();
+
+	// mprotect(PROT_READ): writes are refused, not copied
+	ASSERT_EQ(vmas.protect(base, base + PAGE_SIZE, false), OK);
+	ASSERT_EQ(write_protect_user_pages(table, vaddr_t{ base }, 1), OK);
+	ASSERT_EQ(pte->bits.writable, 0UL);
+	ASSERT_EQ(handle_page_fault(PF_PRESENT | PF_WRITE, base, &vmas),
+			  ERR_PAGE_NOT_PRESENT);
+
+	// Writable again: the private page is reused in place
+	ASSERT_EQ(vmas.protect(base, base + PAGE_SIZE, true), OK);
+	ASSERT_EQ(handle_page_fault(PF_PRESENT | PF_WRITE, base, &vmas), OK);
+	ASSERT_EQ(pte->bits.writable, 1UL);
+	ASSERT_TRUE(pte->get_next_level_table() == data_page);
+
+	// munmap gives the page back; holes in the range are skipped
+	ASSERT_EQ(release_user_pages(table, vaddr_t{ base }, 2), OK);
+	ASSERT_EQ(pte->bits.present, 0UL);
+	ASSERT_FALSE(is_slab_object_in_use(data_page));
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(table);
+}
+
 void test_clean_page_tables_skips_foreign_frames()
 {
 	using namespace kernel::memory;
@@ -84,8 +314,9 @@ void test_clean_page_tables_skips_foreign_frames()
 	// Map a buddy-owned frame the way IPC shared memory does
 	void* frame = memory_manager->allocate(PAGE_SIZE);
 	ASSERT_NOT_NULL(frame);
+	VaddrAllocator space{ USER_OOL_BASE, USER_OOL_END };
 	vaddr_t mapped{ 0 };
-	ASSERT_EQ(map_frame_to_vaddr(table, reinterpret_cast<uint64_t>(frame), 1,
+	ASSERT_EQ(map_frame_to_vaddr(table, space, reinterpret_cast<uint64_t>(frame), 1,
 								 &mapped),
 			  OK);
 
@@ -103,12 +334,124 @@ void test_clean_page_tables_skips_foreign_frames()
 	memory_manager->free(frame, PAGE_SIZE);
 }
 
+void test_user_huge_page_mapped_and_freed()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* table = new_page_table();
+	ASSERT_NOT_NULL(table);
+
+	// One aligned 2 MiB extent plus one page: a huge page and a 4 KiB page
+	const vaddr_t addr{ TEST_HUGE_VADDR };
+	ASSERT_EQ(setup_page_table(table, 4, addr, PT_ENTRIES + 1, true), 0);
+
+	auto* pde = get_pte(table, addr, 2);
+	ASSERT_NOT_NULL(pde);
+	ASSERT_EQ(pde->bits.huge_page, 1UL);
+	ASSERT_EQ(pde->bits.owned, 1UL);
+	ASSERT_NULL(get_pte(table, addr, 1));
+
+	const auto frame = reinterpret_cast<uint64_t>(pde->get_next_level_table());
+	ASSERT_EQ(frame % HUGE_PAGE_SIZE, 0UL);
+	ASSERT_EQ(get_paddr(table, vaddr_t{ addr.data + 0x1234 }), frame + 0x1234);
+
+	auto* tail = get_pte(table, vaddr_t{ addr.data + HUGE_PAGE_SIZE }, 1);
+	ASSERT_NOT_NULL(tail);
+	ASSERT_EQ(tail->bits.present, 1UL);
+
+	// Mapping the huge page read-only splits it rather than keeping it
+	// writable
+	ASSERT_EQ(setup_page_table(table, 4, addr, PT_ENTRIES, false), 0);
+	ASSERT_EQ(pde->bits.huge_page, 0UL);
+	auto* pte = get_pte(table, addr, 1);
+	ASSERT_NOT_NULL(pte);
+	ASSERT_EQ(pte->bits.writable, 0UL);
+
+	clean_page_tables(table);
+
+	// The order-9 block is back in the buddy system
+	Page* head = get_page(reinterpret_cast<void*>(frame));
+	ASSERT_NOT_NULL(head);
+	ASSERT_TRUE(head->is_free());
+}
+
+void test_huge_page_split_on_partial_unmap()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* table = new_page_table();
+	ASSERT_NOT_NULL(table);
+	ASSERT_EQ(setup_page_table(table, 4, vaddr_t{ TEST_USER_VADDR }, 1, true), 0);
+
+	// A 2 MiB-aligned buffer (like a large OOL payload) maps as a huge page
+	void* frame = memory_manager->allocate(HUGE_PAGE_SIZE);
+	ASSERT_NOT_NULL(frame);
+	VaddrAllocator space{ USER_OOL_BASE, USER_OOL_END };
+	vaddr_t mapped{ 0 };
+	ASSERT_EQ(map_frame_to_vaddr(table, space, reinterpret_cast<uint64_t>(frame),
+								 PT_ENTRIES, &mapped),
+			  OK);
+	ASSERT_EQ(mapped.data % HUGE_PAGE_SIZE, 0UL);
+
+	auto* pde = get_pte(table, mapped, 2);
+	ASSERT_NOT_NULL(pde);
+	ASSERT_EQ(pde->bits.huge_page, 1UL);
+	ASSERT_EQ(pde->bits.owned, 0UL);
+
+	// Unmapping one page splits it; the neighbours stay mapped
+	ASSERT_EQ(unmap_frame(table, vaddr_t{ mapped.data + PAGE_SIZE }, 1), OK);
+	ASSERT_EQ(pde->bits.huge_page, 0UL);
+
+	auto* first = get_pte(table, mapped, 1);
+	ASSERT_NOT_NULL(first);
+	ASSERT_EQ(first->bits.present, 1UL);
+	ASSERT_EQ(first->bits.address, reinterpret_cast<uint64_t>(frame) >> PAGE_SHIFT);
+	ASSERT_EQ(get_pte(table, vaddr_t{ mapped.data + PAGE_SIZE }, 1)->bits.present,
+			  0UL);
+
+	clean_page_tables(table);
+	memory_manager->free(frame, HUGE_PAGE_SIZE);
+}
+
+void test_identity_map_covers_memory_map()
+{
+	using namespace kernel::memory;
+
+	// Low MMIO (local APIC) and every RAM region are reachable
+	ASSERT_TRUE(is_identity_mapped(0xfee0'0000));
+	for (size_t r = 0; r < num_page_regions; ++r) {
+		const PageRegion& region = page_regions[r];
+		ASSERT_TRUE(is_identity_mapped(region.start_pfn * PAGE_SIZE));
+		ASSERT_TRUE(is_identity_mapped(
+				(region.start_pfn + region.num_pages - 1) * PAGE_SIZE));
+	}
+
+	// Re-mapping is idempotent; addresses past the boot PML4 slots are refused
+	ASSERT_EQ(map_identity_range(0, PAGE_SIZE), OK);
+	ASSERT_EQ(map_identity_range(1ULL << 51, PAGE_SIZE), ERR_INVALID_ARG);
+}
+
 void register_paging_tests()
 {
 	test_register("clean_page_tables_frees_user_pages",
 				  test_clean_page_tables_frees_user_pages);
 	test_register("cow_pages_freed_with_last_reference",
 				  test_cow_pages_freed_with_last_reference);
+	test_register("user_huge_page_mapped_and_freed",
+				  test_user_huge_page_mapped_and_freed);
+	test_register("huge_page_split_on_partial_unmap",
+				  test_huge_page_split_on_partial_unmap);
+	test_register("identity_map_covers_memory_map",
+				  test_identity_map_covers_memory_map);
 	test_register("clean_page_tables_skips_foreign_frames",
 				  test_clean_page_tables_skips_foreign_frames);
+	test_register("forked_tables_shared_until_write",
+				  test_forked_tables_shared_until_write);
+	test_register("fork_latency_by_heap_size", test_fork_latency_by_heap_size);
+	test_register("anon_area_faults_in_on_demand",
+				  test_anon_area_faults_in_on_demand);
+	test_register("anon_area_write_faults_in_huge_page",
+				  test_anon_area_write_faults_in_huge_page);
+	test_register("protect_and_release_user_pages",
+				  test_protect_and_release_user_pages);
 }
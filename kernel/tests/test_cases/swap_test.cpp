@@ -0,0 +1,208 @@
+#include "tests/test_cases/swap_test.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "memory/lz4.hpp"
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/paging_utils.h"
+#include "memory/slab.hpp"
+#include "memory/swap.hpp"
+#include "memory/vm_area.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+// PML4 index 256 = start of the user half of the address space
+constexpr uint64_t TEST_USER_VADDR = 0xffff'8000'1234'5000;
+
+// Page fault error code bit W/R (write)
+constexpr uint64_t PF_WRITE = 2;
+
+namespace swap = kernel::memory::swap;
+namespace lz4 = kernel::memory::lz4;
+
+lz4::Workspace workspace;
+uint8_t compressed[kernel::memory::PAGE_SIZE];
+uint8_t restored[kernel::memory::PAGE_SIZE];
+
+// Repeats every 251 bytes: compresses to a small fraction of a page
+void fill_pattern(void* page)
+{
+	auto* bytes = static_cast<uint8_t*>(page);
+	for (size_t i = 0; i < kernel::memory::PAGE_SIZE; ++i) {
+		bytes[i] = i % 251;
+	}
+}
+
+void fill_random(void* page)
+{
+	auto* bytes = static_cast<uint8_t*>(page);
+	uint64_t x = 0x2545'f491'4f6c'dd1dULL;
+	for (size_t i = 0; i < kernel::memory::PAGE_SIZE; ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		bytes[i] = x;
+	}
+}
+
+kernel::memory::ReclaimScan reclaim_all()
+{
+	return kernel::memory::ReclaimScan{ 0, 1UL << 20, 1UL << 20, OK };
+}
+
+void test_lz4_round_trip()
+{
+	using kernel::memory::PAGE_SIZE;
+
+	static uint8_t page[PAGE_SIZE];
+	fill_pattern(page);
+	const size_t len = lz4::compress(page, PAGE_SIZE, compressed, sizeof(compressed),
+									 workspace);
+	ASSERT_GT(len, 0UL);
+	ASSERT_LT(len, PAGE_SIZE / 8);
+	ASSERT_TRUE(lz4::decompress(compressed, len, restored, PAGE_SIZE));
+	ASSERT_EQ(memcmp(page, restored, PAGE_SIZE), 0);
+
+	// A wrong output length or a cut block is rejected
+	ASSERT_FALSE(lz4::decompress(compressed, len, restored, PAGE_SIZE - 1));
+	ASSERT_FALSE(lz4::decompress(compressed, len - 1, restored, PAGE_SIZE));
+
+	// Random data does not fit in half a page
+	fill_random(page);
+	ASSERT_EQ(lz4::compress(page, PAGE_SIZE, compressed, PAGE_SIZE / 2, workspace),
+			  0UL);
+	const size_t raw_len = lz4::compress(page, PAGE_SIZE, compressed,
+										 sizeof(compressed), workspace);
+	ASSERT_GT(raw_len, 0UL);
+	ASSERT_TRUE(lz4::decompress(compressed, raw_len, restored, PAGE_SIZE));
+	ASSERT_EQ(memcmp(page, restored, PAGE_SIZE), 0);
+}
+
+// A page stays while its accessed bit is set, goes once the clock finds it
+// clear, and the next access faults it back in
+void test_cold_page_swapped_out_and_faulted_back()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* saved = get_active_page_table();
+	page_table_entry* table = config_new_page_table();
+	ASSERT_NOT_NULL(table);
+
+	const uint64_t base = TEST_USER_VADDR;
+	VmAreaTree vmas;
+	ASSERT_EQ(vmas.insert(base, base + PAGE_SIZE, true), OK);
+	ASSERT_EQ(handle_page_fault(PF_WRITE, base, &vmas), OK);
+	fill_pattern(reinterpret_cast<void*>(base));
+
+	auto* pte = get_pte(table, vaddr_t{ base }, 1);
+	ASSERT_EQ(pte->bits.accessed, 1UL);
+
+	const swap::Stats before = swap::stats();
+
+	// First pass only ages the page
+	ReclaimScan scan = reclaim_all();
+	reclaim_user_pages(table, vmas, scan);
+	ASSERT_EQ(scan.cursor, 0UL);
+	ASSERT_EQ(pte->bits.present, 1UL);
+	ASSERT_EQ(pte->bits.accessed, 0UL);
+
+	scan = reclaim_all();
+	reclaim_user_pages(table, vmas, scan);
+	ASSERT_EQ(scan.error, OK);
+	ASSERT_EQ(pte->bits.present, 0UL);
+	ASSERT_EQ(pte->bits.swapped, 1UL);
+	ASSERT_EQ(swap::stats().entries, before.entries + 1);
+	ASSERT_EQ(swap::stats().swapped_out, before.swapped_out + 1);
+
+	ASSERT_EQ(handle_page_fault(0, base, &vmas), OK);
+	ASSERT_EQ(pte->bits.present, 1UL);
+	ASSERT_EQ(pte->bits.swapped, 0UL);
+	ASSERT_EQ(pte->bits.owned, 1UL);
+	ASSERT_EQ(pte->bits.writable, 1UL);
+	fill_pattern(restored);
+	ASSERT_EQ(memcmp(reinterpret_cast<void*>(base), restored, PAGE_SIZE), 0);
+	ASSERT_EQ(swap::stats().entries, before.entries);
+	ASSERT_EQ(swap::stats().swapped_in, before.swapped_in + 1);
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(table);
+}
+
+// Pages that do not shrink to half a page stay where they are
+void test_incompressible_page_stays()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* table = new_page_table();
+	ASSERT_NOT_NULL(table);
+
+	const vaddr_t addr{ TEST_USER_VADDR };
+	ASSERT_EQ(setup_page_table(table, 4, addr, 1, true), 0);
+	VmAreaTree vmas;
+	ASSERT_EQ(vmas.insert(addr.data, addr.data + PAGE_SIZE, true), OK);
+
+	auto* pte = get_pte(table, addr, 1);
+	fill_random(pte->get_next_level_table());
+	pte->bits.accessed = 0;
+
+	const swap::Stats before = swap::stats();
+	ReclaimScan scan = reclaim_all();
+	reclaim_user_pages(table, vmas, scan);
+	ASSERT_EQ(scan.error, OK);
+	ASSERT_EQ(pte->bits.present, 1UL);
+	ASSERT_EQ(swap::stats().entries, before.entries);
+
+	clean_page_tables(table);
+}
+
+// Fork shares the swap entry; it goes with the last page table naming it
+void test_swap_entry_shared_with_fork()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* origin = new_page_table();
+	ASSERT_NOT_NULL(origin);
+
+	const vaddr_t addr{ TEST_USER_VADDR };
+	ASSERT_EQ(setup_page_table(origin, 4, addr, 1, true), 0);
+	VmAreaTree vmas;
+	ASSERT_EQ(vmas.insert(addr.data, addr.data + PAGE_SIZE, true), OK);
+
+	auto* pte = get_pte(origin, addr, 1);
+	fill_pattern(pte->get_next_level_table());
+	pte->bits.accessed = 0;
+
+	const swap::Stats before = swap::stats();
+	ReclaimScan scan = reclaim_all();
+	reclaim_user_pages(origin, vmas, scan);
+	ASSERT_EQ(pte->bits.swapped, 1UL);
+
+	page_table_entry* fork = share_page_table(origin);
+	ASSERT_NOT_NULL(fork);
+	ASSERT_EQ(get_pte(fork, addr, 1)->bits.swapped, 1UL);
+
+	// The shared tables are read-only now, so the clock leaves them alone
+	scan = reclaim_all();
+	reclaim_user_pages(fork, vmas, scan);
+	ASSERT_EQ(swap::stats().swapped_out, before.swapped_out + 1);
+
+	clean_page_tables(origin);
+	ASSERT_EQ(swap::stats().entries, before.entries + 1);
+
+	clean_page_tables(fork);
+	ASSERT_EQ(swap::stats().entries, before.entries);
+}
+
+} // namespace
+
+void register_swap_tests()
+{
+	test_register("lz4_round_trip", test_lz4_round_trip);
+	test_register("cold_page_swapped_out_and_faulted_back",
+				  test_cold_page_swapped_out_and_faulted_back);
+	test_register("incompressible_page_stays", test_incompressible_page_stays);
+	test_register("swap_entry_shared_with_fork", test_swap_entry_shared_with_fork);
+}
@@ -3,10 +3,16 @@
 #include <cstring>
 #include <libs/common/message.hpp>
 #include <libs/common/process_id.hpp>
+#include "memory/buddy_system.hpp"
+#include "memory/kernel_stack.hpp"
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/paging_utils.h"
 #include "memory/slab.hpp"
 #include "task/context.hpp"
 #include "task/ipc.hpp"
 #include "task/task.hpp"
+#include "tests/bench.hpp"
 #include "tests/framework.hpp"
 #include "tests/macros.hpp"
 #include "tests/test_utils.hpp"
@@ -152,15 +158,51 @@ void test_task_memory_management()
 	ASSERT_EQ(t->state, TASK_WAITING);
 	ASSERT_TRUE(t->is_initialized);
 
-	void* stack = t->stack;
+	const uint64_t* stack = t->stack;
 	ASSERT_NOT_NULL(stack);
-	ASSERT_TRUE(kernel::memory::is_slab_object_in_use(stack));
+	ASSERT_EQ(kernel::memory::kernel_stack_usage(stack).backed_pages,
+			  kernel::memory::KERNEL_STACK_INITIAL_PAGES);
 
 	// Test task deallocation with operator delete
 	delete t;
 
 	// ~Task must free the kernel stack along with the page tables (issue #313)
-	ASSERT_FALSE(kernel::memory::is_slab_object_in_use(stack));
+	ASSERT_EQ(kernel::memory::kernel_stack_usage(stack).backed_pages, 0);
+}
+
+void test_kernel_stack_grows_on_fault()
+{
+	using kernel::memory::KERNEL_STACK_PAGES;
+	using kernel::memory::PAGE_SIZE;
+
+	uint64_t* stack = kernel::memory::alloc_kernel_stack();
+	ASSERT_NOT_NULL(stack);
+	const auto base = reinterpret_cast<uint64_t>(stack);
+	ASSERT_TRUE(kernel::memory::is_kernel_stack_addr(base));
+
+	// The deepest word faults in every page below the initial ones
+	const size_t words = KERNEL_STACK_PAGES * PAGE_SIZE / sizeof(uint64_t);
+	stack[0] = 0x1234;
+	stack[words - 1] = 0x5678;
+
+	const auto usage = kernel::memory::kernel_stack_usage(stack);
+	ASSERT_EQ(usage.backed_pages, KERNEL_STACK_PAGES);
+	ASSERT_EQ(usage.peak_bytes, words * sizeof(uint64_t));
+
+	uint64_t* copy = kernel::memory::alloc_kernel_stack();
+	ASSERT_NOT_NULL(copy);
+	ASSERT_EQ(kernel::memory::copy_kernel_stack(copy, stack), OK);
+	ASSERT_EQ(copy[0], 0x1234);
+	ASSERT_EQ(copy[words - 1], 0x5678);
+
+	// The guard page below a stack stays unmapped
+	ASSERT_TRUE(kernel::memory::is_kernel_stack_guard(base - 1));
+	ASSERT_FALSE(kernel::memory::is_kernel_stack_guard(base));
+	ASSERT_NE(kernel::memory::grow_kernel_stack(base - PAGE_SIZE), OK);
+
+	kernel::memory::free_kernel_stack(copy);
+	kernel::memory::free_kernel_stack(stack);
+	ASSERT_EQ(kernel::memory::kernel_stack_usage(stack).backed_pages, 0);
 }
 
 void test_send_message_queue_cap()
@@ -221,6 +263,78 @@ void test_ipc_recv_returns_queued_message()
 	ASSERT_EQ(t->state, kernel::task::TASK_RUNNING);
 }
 
+namespace
+{
+// User half, 2 MiB aligned, away from the addresses the paging tests use
+constexpr uint64_t EXIT_TEST_VADDR = 0xffff'8000'a000'0000;
+constexpr size_t EXIT_SMALL_PAGES = 64;
+
+// Give t the memory of a finished shell command: a heap of 2 MiB pages, one
+// of them split by an munmap of a single page, and some 4 KiB pages of
+// stack and data after it
+bool populate_exit_space(Task* t, size_t heap_chunks)
+{
+	using namespace kernel::memory;
+
+	switch_page_table(t->get_page_table());
+	const uint64_t small = EXIT_TEST_VADDR + heap_chunks * HUGE_PAGE_SIZE;
+	return !IS_ERR(setup_page_tables(vaddr_t{ EXIT_TEST_VADDR },
+									 heap_chunks * PT_ENTRIES, true)) &&
+		   !IS_ERR(release_user_pages(t->get_page_table(),
+									  vaddr_t{ EXIT_TEST_VADDR + PAGE_SIZE }, 1)) &&
+		   !IS_ERR(setup_page_tables(vaddr_t{ small }, EXIT_SMALL_PAGES, true));
+}
+} // namespace
+
+void test_task_exit_teardown_latency()
+{
+	using namespace kernel::memory;
+	using kernel::tests::read_tsc;
+
+	constexpr size_t heap_chunks_list[] = { 1, 8 };
+	page_table_entry* saved = get_active_page_table();
+
+	for (const size_t chunks : heap_chunks_list) {
+		const size_t num_pages = chunks * PT_ENTRIES + EXIT_SMALL_PAGES;
+
+		// Exit: the whole address space goes in one pass over its tables
+		Task* bulk = new Task(0, "exit_bulk", 0, TASK_WAITING, true, true);
+		ASSERT_NOT_NULL(bulk);
+		ASSERT_TRUE(populate_exit_space(bulk, chunks));
+		set_cr3(reinterpret_cast<uint64_t>(saved));
+
+		const size_t free_before = memory_manager->free_pages();
+		uint64_t start = read_tsc();
+		delete bulk;
+		const uint64_t bulk_cycles = read_tsc() - start;
+
+		// The heap is back in the buddy system, the split chunk included
+		ASSERT_TRUE(memory_manager->free_pages() - free_before >=
+					chunks * PT_ENTRIES - 1);
+
+		// For reference: unmapping every page on its own first, each with
+		// its own INVLPG and buddy free
+		Task* paged = new Task(0, "exit_paged", 0, TASK_WAITING, true, true);
+		ASSERT_NOT_NULL(paged);
+		ASSERT_TRUE(populate_exit_space(paged, chunks));
+
+		start = read_tsc();
+		for (size_t i = 0; i < num_pages; ++i) {
+			ASSERT_EQ(release_user_pages(paged->get_page_table(),
+										 vaddr_t{ EXIT_TEST_VADDR + i * PAGE_SIZE },
+										 1),
+					  OK);
+		}
+		set_cr3(reinterpret_cast<uint64_t>(saved));
+		delete paged;
+		const uint64_t paged_cycles = read_tsc() - start;
+
+		LOG_TEST("BENCH: exit with %lu pages mapped: bulk %lu cycles, page by page "
+				 "%lu cycles",
+				 num_pages, bulk_cycles, paged_cycles);
+	}
+}
+
 void register_task_tests()
 {
 	test_register("task_creation_basic", test_task_creation_basic);
@@ -228,7 +342,9 @@ void register_task_tests()
 	test_register("task_message_handling", test_task_message_handling);
 	test_register("task_copy", test_task_copy);
 	test_register("task_memory_management", test_task_memory_management);
+	test_register("kernel_stack_grows_on_fault", test_kernel_stack_grows_on_fault);
 	test_register("send_message_queue_cap", test_send_message_queue_cap);
 	test_register("ipc_recv_returns_queued_message",
 				  test_ipc_recv_returns_queued_message);
+	test_register("task_exit_teardown_latency", test_task_exit_teardown_latency);
 }
@@ -0,0 +1,184 @@
+#include "tests/test_cases/tlb_test.hpp"
+#include <cstdint>
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/paging_utils.h"
+#include "memory/tlb.hpp"
+#include "tests/bench.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+// User half, away from the addresses the paging tests use
+constexpr uint64_t TLB_TEST_VADDR = 0xffff'8000'9870'0000;
+
+constexpr uint64_t CR4_PCIDE = 1ULL << 17;
+constexpr uint64_t CR3_NO_FLUSH = 1ULL << 63;
+constexpr uint64_t CR3_PCID_MASK = 0xfff;
+
+bool pcid_enabled() { return (get_cr4() & CR4_PCIDE) != 0; }
+
+void touch_pages(uint64_t addr, size_t num_pages)
+{
+	for (size_t i = 0; i < num_pages; ++i) {
+		const uint64_t page = addr + i * kernel::memory::PAGE_SIZE;
+		(void)*reinterpret_cast<volatile uint64_t*>(page);
+	}
+}
+} // namespace
+
+void test_cr3_value_tracks_pcid_owner()
+{
+	using namespace kernel::memory;
+
+	page_table_entry* saved = get_active_page_table();
+	page_table_entry* first = config_new_page_table();
+	ASSERT_NOT_NULL(first);
+
+	// The active table keeps its CR3, so the switch can skip the write
+	ASSERT_TRUE(cr3_value_for(first) == get_cr3());
+	ASSERT_TRUE(get_active_page_table() == first);
+
+	page_table_entry* second = new_page_table();
+	ASSERT_NOT_NULL(second);
+	copy_kernel_space(second);
+
+	const uint64_t to_second = cr3_value_for(second);
+	ASSERT_TRUE(cr3_to_table(to_second) == second);
+	ASSERT_EQ(to_second & CR3_NO_FLUSH, 0UL);
+	set_cr3(to_second);
+
+	const uint64_t back = cr3_value_for(first);
+	ASSERT_TRUE(cr3_to_table(back) == first);
+	if (pcid_enabled()) {
+		// first still owns its PCID: its entries survive the switch
+		ASSERT_TRUE((back & CR3_PCID_MASK) != 0);
+		ASSERT_TRUE((back & CR3_PCID_MASK) != (to_second & CR3_PCID_MASK));
+		ASSERT_EQ(back & CR3_NO_FLUSH, CR3_NO_FLUSH);
+
+		// Changing first while second runs makes its PCID untrusted
+		{
+			TlbFlushBatch batch(first);
+			batch.add_all();
+		}
+		ASSERT_EQ(cr3_value_for(first) & CR3_NO_FLUSH, 0UL);
+	} else {
+		ASSERT_TRUE(back == reinterpret_cast<uint64_t>(first));
+	}
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(second);
+	clean_page_tables(first);
+}
+
+void test_munmap_cost_by_flush_batching()
+{
+	using namespace kernel::memory;
+	using kernel::tests::read_tsc;
+
+	constexpr size_t num_pages_list[] = { 8, 256 };
+	page_table_entry* saved = get_active_page_table();
+	page_table_entry* table = config_new_page_table();
+	ASSERT_NOT_NULL(table);
+	const vaddr_t addr{ TLB_TEST_VADDR };
+
+	for (const size_t num_pages : num_pages_list) {
+		// One call: one INVLPG run, or a single flush past the threshold
+		ASSERT_EQ(setup_page_tables(addr, num_pages, true), OK);
+		touch_pages(addr.data, num_pages);
+		uint64_t start = read_tsc();
+		ASSERT_EQ(release_user_pages(table, addr, num_pages), OK);
+		const uint64_t batched_cycles = read_tsc() - start;
+
+		// Page by page, as every unmap used to flush
+		ASSERT_EQ(setup_page_tables(addr, num_pages, true), OK);
+		touch_pages(addr.data, num_pages);
+		start = read_tsc();
+		for (size_t i = 0; i < num_pages; ++i) {
+			const vaddr_t page{ addr.data + i * PAGE_SIZE };
+			ASSERT_EQ(release_user_pages(table, page, 1), OK);
+		}
+		const uint64_t per_page_cycles = read_tsc() - start;
+
+		LOG_TEST("BENCH: munmap %lu pages batched %lu cycles, per page %lu cycles",
+				 num_pages, batched_cycles, per_page_cycles);
+	}
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(table);
+}
+
+void test_address_space_switch_cost()
+{
+	using namespace kernel::memory;
+	using kernel::tests::read_tsc;
+
+	// Round trips between two address spaces that each touch a working set
+	// after the switch: the TLB refill is what a flushing switch costs
+	constexpr size_t WORKING_SET_PAGES = 64;
+	constexpr int ROUNDS = 100;
+
+	page_table_entry* saved = get_active_page_table();
+	page_table_entry* first = config_new_page_table();
+	ASSERT_NOT_NULL(first);
+	ASSERT_EQ(setup_page_tables(vaddr_t{ TLB_TEST_VADDR }, WORKING_SET_PAGES, true),
+			  OK);
+	page_table_entry* second = config_new_page_table();
+	ASSERT_NOT_NULL(second);
+	ASSERT_EQ(setup_page_tables(vaddr_t{ TLB_TEST_VADDR }, WORKING_SET_PAGES, true),
+			  OK);
+
+	uint64_t start = read_tsc();
+	for (int i = 0; i < ROUNDS; ++i) {
+		set_cr3(reinterpret_cast<uint64_t>(first));
+		touch_pages(TLB_TEST_VADDR, WORKING_SET_PAGES);
+		set_cr3(reinterpret_cast<uint64_t>(second));
+		touch_pages(TLB_TEST_VADDR, WORKING_SET_PAGES);
+	}
+	const uint64_t flushing = read_tsc() - start;
+
+	start = read_tsc();
+	for (int i = 0; i < ROUNDS; ++i) {
+		switch_page_table(first);
+		touch_pages(TLB_TEST_VADDR, WORKING_SET_PAGES);
+		switch_page_table(second);
+		touch_pages(TLB_TEST_VADDR, WORKING_SET_PAGES);
+	}
+	const uint64_t tagged = read_tsc() - start;
+
+	// Switching to the address space already loaded
+	start = read_tsc();
+	for (int i = 0; i < ROUNDS; ++i) {
+		set_cr3(get_cr3());
+	}
+	const uint64_t same_written = read_tsc() - start;
+
+	start = read_tsc();
+	for (int i = 0; i < ROUNDS; ++i) {
+		switch_page_table(second);
+	}
+	const uint64_t same_skipped = read_tsc() - start;
+
+	LOG_TEST("BENCH: address space switch (pcid %s) flushing %lu cycles, "
+			 "tagged %lu cycles",
+			 pcid_enabled() ? "on" : "off",
+			 kernel::tests::cycles_per_op(flushing, 2 * ROUNDS),
+			 kernel::tests::cycles_per_op(tagged, 2 * ROUNDS));
+	LOG_TEST("BENCH: same address space switch written %lu cycles, skipped %lu "
+			 "cycles",
+			 kernel::tests::cycles_per_op(same_written, ROUNDS),
+			 kernel::tests::cycles_per_op(same_skipped, ROUNDS));
+
+	set_cr3(reinterpret_cast<uint64_t>(saved));
+	clean_page_tables(second);
+	clean_page_tables(first);
+}
+
+void register_tlb_tests()
+{
+	test_register("cr3_value_tracks_pcid_owner", test_cr3_value_tracks_pcid_owner);
+	test_register("munmap_cost_by_flush_batching",
+				  test_munmap_cost_by_flush_batching);
+	test_register("address_space_switch_cost", test_address_space_switch_cost);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+void register_tlb_tests();
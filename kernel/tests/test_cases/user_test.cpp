@@ -2,8 +2,10 @@
 #include <string.h> // for strlcpy
 #include <cstdint>
 #include <cstring>
+#include "memory/page.hpp"
 #include "memory/paging.hpp"
 #include "memory/user.hpp"
+#include "tests/bench.hpp"
 #include "tests/framework.hpp"
 #include "tests/macros.hpp"
 
@@ -11,6 +13,12 @@ namespace
 {
 // A user-half address (PML4 index >= 256) reserved for these tests
 constexpr uint64_t TEST_USER_STR_VADDR = 0xffff'8000'2000'0000;
+
+// Two mapped pages with nothing mapped after them
+constexpr uint64_t TEST_USER_COPY_VADDR = 0xffff'8000'2010'0000;
+constexpr size_t TEST_USER_COPY_PAGES = 2;
+
+constexpr size_t PAGE = kernel::memory::PAGE_SIZE;
 } // namespace
 
 void test_copy_string_from_user_rejects_invalid_pointers()
@@ -42,10 +50,122 @@ void test_copy_string_from_user_roundtrip()
 	ASSERT_EQ(buf[2], '\0');
 }
 
+void test_copy_user_roundtrip()
+{
+	constexpr size_t sizes[] = { 1, 7, 8, 9, 63, 64, 100, PAGE + 5 };
+
+	const kernel::memory::vaddr_t addr{ TEST_USER_COPY_VADDR };
+	ASSERT_EQ(kernel::memory::setup_page_tables(addr, TEST_USER_COPY_PAGES, true),
+			  OK);
+	auto* user_buf = reinterpret_cast<uint8_t*>(addr.data);
+
+	static uint8_t src[PAGE + 16];
+	static uint8_t dst[PAGE + 16];
+	for (size_t i = 0; i < sizeof(src); ++i) {
+		src[i] = static_cast<uint8_t>(i * 13 + 1);
+	}
+
+	for (const size_t size : sizes) {
+		for (size_t offset = 0; offset < 8; ++offset) {
+			memset(dst, 0, sizeof(dst));
+			ASSERT_EQ(copy_to_user(user_buf + offset, src + 3, size), 0UL);
+			ASSERT_EQ(copy_from_user(dst, user_buf + offset, size), 0UL);
+			ASSERT_EQ(memcmp(dst, src + 3, size), 0);
+			ASSERT_EQ(dst[size], 0);
+		}
+	}
+
+	// Kernel addresses copy nothing
+	ASSERT_EQ(copy_to_user(dst, src, 16), 16UL);
+	ASSERT_EQ(copy_from_user(dst, src, 16), 16UL);
+
+	ASSERT_EQ(kernel::memory::release_user_pages(
+					  kernel::memory::get_active_page_table(), addr,
+					  TEST_USER_COPY_PAGES),
+			  OK);
+}
+
+void test_copy_user_stops_at_unmapped_page()
+{
+	const kernel::memory::vaddr_t addr{ TEST_USER_COPY_VADDR };
+	ASSERT_EQ(kernel::memory::setup_page_tables(addr, TEST_USER_COPY_PAGES, true),
+			  OK);
+	auto* user_end =
+			reinterpret_cast<uint8_t*>(addr.data + TEST_USER_COPY_PAGES * PAGE);
+
+	// The copies fault on the page after the mapping: the fault handler
+	// resumes them at their fixup and they report the bytes left
+	static uint8_t buf[64];
+	memset(buf, 0x5a, sizeof(buf));
+	ASSERT_EQ(copy_to_user(user_end - 13, buf, sizeof(buf)), sizeof(buf) - 13);
+	ASSERT_EQ(user_end[-1], 0x5a);
+	ASSERT_EQ(copy_to_user(user_end, buf, sizeof(buf)), sizeof(buf));
+
+	memset(buf, 0, sizeof(buf));
+	ASSERT_EQ(copy_from_user(buf, user_end - 20, sizeof(buf)), sizeof(buf) - 20);
+	ASSERT_EQ(buf[19], 0x5a);
+	ASSERT_EQ(buf[20], 0);
+
+	// A string running into the unmapped page has no terminator to find
+	char str[64];
+	memset(user_end - 4, 'a', 4);
+	ASSERT_EQ(copy_string_from_user(str, reinterpret_cast<char*>(user_end - 4),
+									sizeof(str)),
+			  -1);
+	ASSERT_EQ(str[0], '\0');
+
+	ASSERT_EQ(kernel::memory::release_user_pages(
+					  kernel::memory::get_active_page_table(), addr,
+					  TEST_USER_COPY_PAGES),
+			  OK);
+}
+
+void test_copy_user_throughput()
+{
+	using kernel::tests::read_tsc;
+
+	constexpr size_t sizes[] = { 16, 256, PAGE };
+	constexpr int ROUNDS = 256;
+
+	const kernel::memory::vaddr_t addr{ TEST_USER_COPY_VADDR };
+	ASSERT_EQ(kernel::memory::setup_page_tables(addr, TEST_USER_COPY_PAGES, true),
+			  OK);
+	auto* user_buf = reinterpret_cast<uint8_t*>(addr.data);
+	static uint8_t kbuf[PAGE];
+
+	for (const size_t size : sizes) {
+		uint64_t start = read_tsc();
+		for (int i = 0; i < ROUNDS; ++i) {
+			ASSERT_EQ(copy_to_user(user_buf, kbuf, size), 0UL);
+		}
+		const uint64_t to_cycles = read_tsc() - start;
+
+		start = read_tsc();
+		for (int i = 0; i < ROUNDS; ++i) {
+			ASSERT_EQ(copy_from_user(kbuf, user_buf, size), 0UL);
+		}
+		const uint64_t from_cycles = read_tsc() - start;
+
+		LOG_TEST("BENCH: copy_to_user %lu bytes %lu cycles, copy_from_user %lu "
+				 "cycles",
+				 size, kernel::tests::cycles_per_op(to_cycles, ROUNDS),
+				 kernel::tests::cycles_per_op(from_cycles, ROUNDS));
+	}
+
+	ASSERT_EQ(kernel::memory::release_user_pages(
+					  kernel::memory::get_active_page_table(), addr,
+					  TEST_USER_COPY_PAGES),
+			  OK);
+}
+
 void register_user_copy_tests()
 {
 	test_register("copy_string_from_user_rejects_invalid_pointers",
 				  test_copy_string_from_user_rejects_invalid_pointers);
 	test_register("copy_string_from_user_roundtrip",
 				  test_copy_string_from_user_roundtrip);
+	test_register("copy_user_roundtrip", test_copy_user_roundtrip);
+	test_register("copy_user_stops_at_unmapped_page",
+				  test_copy_user_stops_at_unmapped_page);
+	test_register("copy_user_throughput", test_copy_user_throughput);
 }
@@ -0,0 +1,228 @@
+#include "tests/test_cases/vaddr_allocator_test.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <libs/common/memory_layout.h>
+#include "memory/page.hpp"
+#include "memory/paging.hpp"
+#include "memory/slab.hpp"
+#include "memory/vaddr_allocator.hpp"
+#include "tests/bench.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+constexpr uint64_t BASE = 0xffff'f000'0000'0000;
+constexpr uint64_t PAGE = kernel::memory::PAGE_SIZE;
+
+uint64_t next_random(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+struct Range {
+	uint64_t start;
+	size_t pages;
+};
+
+bool overlaps(const Range& a, const Range& b)
+{
+	return a.start < b.start + b.pages * PAGE && b.start < a.start + a.pages * PAGE;
+}
+} // namespace
+
+void test_vaddr_allocator_merges_released_ranges()
+{
+	kernel::memory::VaddrAllocator space{ BASE, BASE + 64 * PAGE };
+	ASSERT_EQ(space.num_extents(), 1UL);
+
+	const uint64_t a = space.allocate(4);
+	const uint64_t b = space.allocate(4);
+	const uint64_t c = space.allocate(4);
+	ASSERT_TRUE(a == BASE);
+	ASSERT_TRUE(b == BASE + 4 * PAGE);
+	ASSERT_TRUE(c == BASE + 8 * PAGE);
+	ASSERT_EQ(space.num_extents(), 1UL);
+
+	// A hole in the middle is its own extent until its neighbours come back
+	ASSERT_EQ(space.release(b, 4), OK);
+	ASSERT_EQ(space.num_extents(), 2UL);
+	ASSERT_EQ(space.release(b, 4), ERR_INVALID_ARG);
+	ASSERT_EQ(space.release(b + 2 * PAGE, 4), ERR_INVALID_ARG);
+	ASSERT_EQ(space.release(BASE + 64 * PAGE, 1), ERR_INVALID_ARG);
+
+	// A request the hole fits goes there
+	ASSERT_TRUE(space.allocate(3) == b);
+	ASSERT_EQ(space.release(b, 3), OK);
+
+	ASSERT_EQ(space.release(a, 4), OK);
+	ASSERT_EQ(space.release(c, 4), OK);
+	ASSERT_EQ(space.num_extents(), 1UL);
+
+	// Too large for the window
+	ASSERT_TRUE(space.allocate(65) == 0);
+	ASSERT_TRUE(space.allocate(64) == BASE);
+	ASSERT_TRUE(space.allocate(1) == 0);
+	ASSERT_EQ(space.release(BASE, 64), OK);
+
+	space.reset();
+	ASSERT_EQ(space.num_extents(), 1UL);
+}
+
+void test_vaddr_allocator_aligns_ranges()
+{
+	using kernel::memory::PT_ENTRIES;
+
+	// Start one page past a 2 MiB boundary
+	const uint64_t base = BASE + PAGE;
+	kernel::memory::VaddrAllocator space{ base, base + 4 * PT_ENTRIES * PAGE };
+
+	const uint64_t small = space.allocate(1);
+	ASSERT_TRUE(small == base);
+
+	// The aligned range leaves free space on both sides of it
+	const uint64_t huge = space.allocate(PT_ENTRIES, PT_ENTRIES);
+	ASSERT_TRUE(huge == BASE + PT_ENTRIES * PAGE);
+	ASSERT_EQ(space.num_extents(), 2UL);
+	ASSERT_TRUE(space.allocate(PT_ENTRIES / 2) == base + PAGE);
+
+	ASSERT_EQ(space.release(huge, PT_ENTRIES), OK);
+	ASSERT_EQ(space.release(small, 1), OK);
+	ASSERT_EQ(space.release(base + PAGE, PT_ENTRIES / 2), OK);
+	ASSERT_EQ(space.num_extents(), 1UL);
+}
+
+void test_vaddr_allocator_stress()
+{
+	constexpr int OPS = 8000;
+	constexpr size_t MAX_LIVE = 128;
+	constexpr size_t WINDOW_PAGES = 16384;
+
+	kernel::memory::VaddrAllocator space{ BASE, BASE + WINDOW_PAGES * PAGE };
+	Range live[MAX_LIVE];
+	size_t num_live = 0;
+	uint64_t state = 0x9e37'79b9'7f4a'7c15;
+
+	for (int op = 0; op < OPS; ++op) {
+		const bool take = num_live == 0 ||
+						  (num_live < MAX_LIVE && next_random(state) % 3 != 0);
+		if (!take) {
+			const size_t victim = next_random(state) % num_live;
+			ASSERT_EQ(space.release(live[victim].start, live[victim].pages), OK);
+			live[victim] = live[--num_live];
+			continue;
+		}
+
+		const Range range{ 0, 1 + next_random(state) % 64 };
+		const uint64_t addr = space.allocate(range.pages);
+		ASSERT_TRUE(addr != 0);
+		ASSERT_TRUE(addr >= BASE);
+		ASSERT_TRUE(addr + range.pages * PAGE <= BASE + WINDOW_PAGES * PAGE);
+
+		live[num_live] = Range{ addr, range.pages };
+		for (size_t i = 0; i < num_live; ++i) {
+			ASSERT_FALSE(overlaps(live[i], live[num_live]));
+		}
+		++num_live;
+	}
+
+	while (num_live > 0) {
+		--num_live;
+		ASSERT_EQ(space.release(live[num_live].start, live[num_live].pages), OK);
+	}
+
+	// Every release merged back into the one window-sized extent
+	ASSERT_EQ(space.num_extents(), 1UL);
+	ASSERT_TRUE(space.allocate(WINDOW_PAGES) == BASE);
+}
+
+void test_ool_map_unmap_stress()
+{
+	using namespace kernel::memory;
+	using kernel::tests::read_tsc;
+
+	constexpr int ROUNDS = 4096;
+	constexpr size_t MAX_LIVE = 512;
+	constexpr size_t live_counts[] = { 16, MAX_LIVE };
+
+	page_table_entry* table = new_page_table();
+	ASSERT_NOT_NULL(table);
+	void* buffer = alloc(4 * PAGE, ALLOC_ZEROED, PAGE);
+	ASSERT_NOT_NULL(buffer);
+	const auto frame = reinterpret_cast<uint64_t>(buffer);
+
+	VaddrAllocator space{ USER_OOL_BASE, USER_OOL_END };
+	auto* live = static_cast<uint64_t*>(
+			alloc(MAX_LIVE * sizeof(uint64_t), ALLOC_UNINITIALIZED));
+	ASSERT_NOT_NULL(live);
+
+	// Deliveries and releases of OOL buffers, with up to MAX_LIVE mapped at
+	// once: every mapping lands on its own pages and resolves to the buffer
+	uint64_t state = 0x2545'f491'4f6c'dd1d;
+	size_t num_live = 0;
+	for (int round = 0; round < ROUNDS; ++round) {
+		if (num_live == MAX_LIVE || (num_live > 0 && next_random(state) % 2 == 0)) {
+			const size_t victim = next_random(state) % num_live;
+			ASSERT_EQ(unmap_frame(table, vaddr_t{ live[victim] }, 4), OK);
+			ASSERT_EQ(space.release(live[victim], 4), OK);
+			live[victim] = live[--num_live];
+			continue;
+		}
+
+		vaddr_t addr{ 0 };
+		ASSERT_EQ(map_frame_to_vaddr(table, space, frame, 4, &addr), OK);
+		ASSERT_TRUE(get_paddr(table, vaddr_t{ addr.data + 3 * PAGE }) ==
+					frame + 3 * PAGE);
+		live[num_live++] = addr.data;
+	}
+
+	// Cost of one more delivery and release as the window fills up
+	for (const size_t count : live_counts) {
+		while (num_live < count) {
+			vaddr_t addr{ 0 };
+			ASSERT_EQ(map_frame_to_vaddr(table, space, frame, 4, &addr), OK);
+			live[num_live++] = addr.data;
+		}
+		while (num_live > count) {
+			--num_live;
+			ASSERT_EQ(unmap_frame(table, vaddr_t{ live[num_live] }, 4), OK);
+			ASSERT_EQ(space.release(live[num_live], 4), OK);
+		}
+
+		const uint64_t start = read_tsc();
+		for (int i = 0; i < 256; ++i) {
+			vaddr_t addr{ 0 };
+			ASSERT_EQ(map_frame_to_vaddr(table, space, frame, 4, &addr), OK);
+			ASSERT_EQ(unmap_frame(table, addr, 4), OK);
+			ASSERT_EQ(space.release(addr.data, 4), OK);
+		}
+		const uint64_t cycles = read_tsc() - start;
+
+		LOG_TEST("BENCH: ool map+unmap with %lu regions mapped %lu cycles", count,
+				 kernel::tests::cycles_per_op(cycles, 256));
+	}
+
+	while (num_live > 0) {
+		--num_live;
+		ASSERT_EQ(unmap_frame(table, vaddr_t{ live[num_live] }, 4), OK);
+		ASSERT_EQ(space.release(live[num_live], 4), OK);
+	}
+	ASSERT_EQ(space.num_extents(), 1UL);
+
+	clean_page_tables(table);
+	free(live);
+	free(buffer);
+}
+
+void register_vaddr_allocator_tests()
+{
+	test_register("vaddr_allocator_merges_released_ranges",
+				  test_vaddr_allocator_merges_released_ranges);
+	test_register("vaddr_allocator_aligns_ranges",
+				  test_vaddr_allocator_aligns_ranges);
+	test_register("vaddr_allocator_stress", test_vaddr_allocator_stress);
+	test_register("ool_map_unmap_stress", test_ool_map_unmap_stress);
+}
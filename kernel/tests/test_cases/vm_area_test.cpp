@@ -0,0 +1,132 @@
+#include "tests/test_cases/vm_area_test.hpp"
+#include <cstdint>
+#include "memory/page.hpp"
+#include "memory/vm_area.hpp"
+#include "tests/framework.hpp"
+#include "tests/macros.hpp"
+
+namespace
+{
+constexpr uint64_t BASE = 0xffff'c000'0000'0000;
+constexpr uint64_t PAGE = kernel::memory::PAGE_SIZE;
+} // namespace
+
+void test_vm_area_insert_and_merge()
+{
+	kernel::memory::VmAreaTree vmas;
+
+	ASSERT_EQ(vmas.insert(BASE, BASE + 2 * PAGE, true), OK);
+	ASSERT_EQ(vmas.insert(BASE + 4 * PAGE, BASE + 5 * PAGE, true), OK);
+	ASSERT_EQ(vmas.size(), 2UL);
+
+	// Overlaps and empty ranges are refused
+	ASSERT_EQ(vmas.insert(BASE + PAGE, BASE + 3 * PAGE, true), ERR_INVALID_ARG);
+	ASSERT_EQ(vmas.insert(BASE + 3 * PAGE, BASE + 3 * PAGE, true), ERR_INVALID_ARG);
+
+	// Filling the hole joins all three into one area
+	ASSERT_EQ(vmas.insert(BASE + 2 * PAGE, BASE + 4 * PAGE, true), OK);
+	ASSERT_EQ(vmas.size(), 1UL);
+	const auto* area = vmas.find(BASE + 3 * PAGE);
+	ASSERT_NOT_NULL(area);
+	ASSERT_TRUE(area->start == BASE);
+	ASSERT_TRUE(area->end == BASE + 5 * PAGE);
+
+	// A neighbour with other protection stays separate
+	ASSERT_EQ(vmas.insert(BASE + 5 * PAGE, BASE + 6 * PAGE, false), OK);
+	ASSERT_EQ(vmas.size(), 2UL);
+	ASSERT_NULL(vmas.find(BASE + 6 * PAGE));
+	ASSERT_NULL(vmas.find(BASE - 1));
+}
+
+void test_vm_area_remove_and_protect_split()
+{
+	kernel::memory::VmAreaTree vmas;
+	ASSERT_EQ(vmas.insert(BASE, BASE + 8 * PAGE, true), OK);
+
+	// Punching a hole splits the area in two
+	ASSERT_EQ(vmas.remove(BASE + 2 * PAGE, BASE + 3 * PAGE), OK);
+	ASSERT_EQ(vmas.size(), 2UL);
+	ASSERT_NULL(vmas.find(BASE + 2 * PAGE));
+	ASSERT_TRUE(vmas.find(BASE + PAGE)->end == BASE + 2 * PAGE);
+	ASSERT_TRUE(vmas.find(BASE + 3 * PAGE)->start == BASE + 3 * PAGE);
+
+	// mprotect over a hole fails and changes nothing
+	ASSERT_EQ(vmas.protect(BASE, BASE + 4 * PAGE, false), ERR_NO_MEMORY);
+	ASSERT_TRUE(vmas.find(BASE)->writable);
+
+	// The middle of an area becomes its own area
+	ASSERT_EQ(vmas.protect(BASE + 4 * PAGE, BASE + 6 * PAGE, false), OK);
+	ASSERT_EQ(vmas.size(), 4UL);
+	ASSERT_TRUE(vmas.find(BASE + 3 * PAGE)->writable);
+	ASSERT_FALSE(vmas.find(BASE + 5 * PAGE)->writable);
+	ASSERT_TRUE(vmas.find(BASE + 6 * PAGE)->writable);
+
+	// Removing across several areas trims the ends and drops the rest
+	ASSERT_EQ(vmas.remove(BASE + PAGE, BASE + 7 * PAGE), OK);
+	ASSERT_EQ(vmas.size(), 2UL);
+	ASSERT_TRUE(vmas.find(BASE)->end == BASE + PAGE);
+	ASSERT_TRUE(vmas.find(BASE + 7 * PAGE)->start == BASE + 7 * PAGE);
+}
+
+void test_vm_area_find_free()
+{
+	kernel::memory::VmAreaTree vmas;
+	const uint64_t end = BASE + 64 * PAGE;
+
+	ASSERT_TRUE(vmas.find_free(4 * PAGE, BASE, end) == BASE);
+
+	// Areas at 0-1, 3-4, 10-20: holes of 2, 6 and 44 pages
+	ASSERT_EQ(vmas.insert(BASE, BASE + PAGE, true), OK);
+	ASSERT_EQ(vmas.insert(BASE + 3 * PAGE, BASE + 4 * PAGE, true), OK);
+	ASSERT_EQ(vmas.insert(BASE + 10 * PAGE, BASE + 20 * PAGE, true), OK);
+
+	ASSERT_TRUE(vmas.find_free(PAGE, BASE, end) == BASE + PAGE);
+	ASSERT_TRUE(vmas.find_free(3 * PAGE, BASE, end) == BASE + 4 * PAGE);
+	ASSERT_TRUE(vmas.find_free(7 * PAGE, BASE, end) == BASE + 20 * PAGE);
+	ASSERT_TRUE(vmas.find_free(PAGE, BASE + 5 * PAGE, end) == BASE + 5 * PAGE);
+	ASSERT_TRUE(vmas.find_free(45 * PAGE, BASE, end) == 0);
+}
+
+void test_vm_area_many_areas()
+{
+	using kernel::memory::VmAreaTree;
+
+	// Every other page, inserted in an order that would degenerate an
+	// unbalanced tree
+	constexpr int count = 256;
+	VmAreaTree vmas;
+	for (int i = 0; i < count; ++i) {
+		const uint64_t start = BASE + 2 * i * PAGE;
+		ASSERT_EQ(vmas.insert(start, start + PAGE, i % 2 == 0), OK);
+	}
+	ASSERT_EQ(vmas.size(), static_cast<size_t>(count));
+
+	for (int i = 0; i < count; ++i) {
+		const auto* area = vmas.find(BASE + 2 * i * PAGE + 8);
+		ASSERT_NOT_NULL(area);
+		ASSERT_TRUE(area->start == BASE + 2 * i * PAGE);
+		ASSERT_NULL(vmas.find(BASE + (2 * i + 1) * PAGE));
+	}
+
+	// The first hole of two pages is past the last area
+	ASSERT_TRUE(vmas.find_free(2 * PAGE, BASE, BASE + 4 * count * PAGE) ==
+				BASE + (2 * count - 1) * PAGE);
+
+	VmAreaTree copy;
+	ASSERT_EQ(copy.copy_from(vmas), OK);
+	ASSERT_EQ(copy.size(), vmas.size());
+	ASSERT_NOT_NULL(copy.find(BASE + 2 * (count - 1) * PAGE));
+
+	ASSERT_EQ(vmas.remove(BASE, BASE + 2 * count * PAGE), OK);
+	ASSERT_EQ(vmas.size(), 0UL);
+	ASSERT_EQ(copy.size(), static_cast<size_t>(count));
+}
+
+void register_vm_area_tests()
+{
+	test_register("vm_area_insert_and_merge", test_vm_area_insert_and_merge);
+	test_register("vm_area_remove_and_protect_split",
+				  test_vm_area_remove_and_protect_split);
+	test_register("vm_area_find_free", test_vm_area_find_free);
+	test_register("vm_area_many_areas", test_vm_area_many_areas);
+}
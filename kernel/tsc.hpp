@@ -0,0 +1,30 @@
+/**
+ * @file tsc.hpp
+ * @brief Time-stamp counter access
+ *
+ * Used for coarse cycle counts of boot phases and by the benchmarks. The
+ * raw counter is not serializing and is not converted to wall time here.
+ *
+ * @date 2024
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace kernel::cpu
+{
+
+/**
+ * @brief Read the time-stamp counter
+ * @return Current TSC value in cycles
+ */
+inline uint64_t read_tsc()
+{
+	uint32_t lo;
+	uint32_t hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
+} // namespace kernel::cpu
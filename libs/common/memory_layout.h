@@ -4,17 +4,27 @@
  * the user runtime
  *
  * Plain C header (macros, no C++) because libs/user/newlib_support.c
- * consumes it. The kernel side of the contract is kernel/elf.cpp: exec
- * maps the regions declared here before entering ring 3.
+ * consumes it. The kernel side of the contract is kernel/elf.cpp, which
+ * resets the heap at exec, and the memory syscalls in
+ * kernel/syscall/handler.cpp.
  */
 
 #pragma once
 
-/// Base of the per-process user heap. exec maps it eagerly (no demand
-/// paging yet); sbrk() hands it out linearly from this address.
+/// Base of the per-process user heap. It starts empty at exec and grows
+/// and shrinks with sys_brk; sbrk() in newlib_support.c wraps that.
 #define USER_HEAP_BASE 0xffffa00000000000ULL
 
-/// Heap bytes mapped at exec: 1 MiB. Grow this constant when a process
-/// (the future user-space FS server, issue #315 3b) needs more; there is
-/// deliberately no brk/mmap syscall for now.
-#define USER_HEAP_SIZE (1024ULL * 1024ULL)
+/// Furthest sys_brk will move the heap end past USER_HEAP_BASE: 256 MiB.
+/// Pages are only allocated when first touched.
+#define USER_HEAP_SIZE (256ULL * 1024ULL * 1024ULL)
+
+/// Window sys_mmap places anonymous mappings in. MAP_FIXED requests must
+/// fall inside it too, so a mapping can never replace the image or stack.
+#define USER_MMAP_BASE 0xffffc00000000000ULL
+#define USER_MMAP_END 0xfffff00000000000ULL
+
+/// Window the kernel maps received OOL buffers in, read-only. User code
+/// only ever sees addresses from it in received messages.
+#define USER_OOL_BASE 0xfffff00000000000ULL
+#define USER_OOL_END 0xfffff80000000000ULL
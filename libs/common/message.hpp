@@ -27,6 +27,9 @@ constexpr size_t SECTOR_SIZE = 512;
 /// Inline payload ceiling: anything larger travels as an OOL buffer.
 constexpr size_t MSG_INLINE_MAX = 128;
 
+/// Buddy orders reported in memory_usage.free_blocks (kernel MAX_ORDER + 1)
+constexpr size_t MEMORY_USAGE_ORDERS = 19;
+
 /**
  * @brief USB HID boot-protocol modifier bits carried in key_input.modifier
  *
@@ -70,6 +73,7 @@ enum class MsgType : int32_t {
 	KERNEL_TASK_READY,
 	KERNEL_MEMORY_USAGE,
 	KERNEL_PCI_LIST,
+	KERNEL_STACK_USAGE,
 	/// Claim the keyboard focus: raw NOTIFY_KEY_INPUT events are delivered
 	/// to the sender from now on. Handled by the USB handler task.
 	INPUT_SET_FOCUS,
@@ -90,6 +94,9 @@ enum class MsgType : int32_t {
 	FS_PWD,
 	FS_CHANGE_DIR,
 	FS_DUP2,
+	/// Write the FAT32 buffer cache's dirty blocks and FAT sectors back
+	FS_SYNC,
+	FS_CACHE_STATS,
 	/// Ring-3 smoke result the shell sends to KERNEL in KERNEL_SMOKE_TEST
 	/// builds: one fork→exec→wait round-trip, judged by the kernel (#374)
 	SMOKE_REPORT,
@@ -120,6 +127,14 @@ struct PciDeviceInfo {
 	char bus_address[8];
 };
 
+/// One task record in the KERNEL_STACK_USAGE reply's OOL array.
+struct KernelStackInfo {
+	int32_t task_id;
+	char name[16];
+	uint32_t backed_pages; ///< 4 KiB pages of kernel stack mapped so far
+	uint32_t peak_bytes;   ///< High-water mark, from the top of the stack
+};
+
 struct Message {
 	MsgType type;
 	ProcessId sender;
@@ -151,9 +166,26 @@ struct Message {
 			char buf[MSG_INLINE_MAX];
 		} write;
 
+		/// KERNEL_MEMORY_USAGE reply; every value comes from a counter the
+		/// kernel allocators keep, so polling it is cheap
 		struct {
-			unsigned int total;
-			unsigned int used;
+			uint64_t total; ///< bytes of RAM
+			uint64_t used;	///< bytes not on the free lists
+			uint32_t free_pages;
+			uint32_t slab_pages;
+			uint32_t page_table_pages; ///< subset of slab_pages
+			uint32_t ool_pages;		   ///< subset of slab_pages
+			/// free blocks per buddy order (block = 4 KiB << order)
+			uint32_t free_blocks[MEMORY_USAGE_ORDERS];
+			/// free memory in blocks below 2 MiB, per mille
+			uint32_t fragmentation;
+			/// pre-zeroed page pool: objects held, and ALLOC_ZEROED
+			/// requests it served / found it empty
+			uint32_t zero_pool_objects;
+			uint32_t zero_pool_hits;
+			uint32_t zero_pool_misses;
+			/// objects set aside for ALLOC_ATOMIC requests
+			uint32_t reserve_objects;
 		} memory_usage;
 
 		struct {
@@ -169,6 +201,18 @@ struct Message {
 			char name[64];
 		} fs;
 
+		/// FS_CACHE_STATS reply: the FAT32 buffer cache (hits and misses
+		/// count block reads)
+		struct {
+			uint32_t blocks;
+			uint32_t block_size;
+			uint32_t dirty;
+			uint32_t hits;
+			uint32_t misses;
+			uint32_t writebacks;
+			uint32_t evictions;
+		} buffer_cache;
+
 		/// SMOKE_REPORT payload: OK when the whole fork→exec→wait round-trip
 		/// succeeded with a zero child status, else the first error_t on
 		/// that path (fork failure or the child's exit status)
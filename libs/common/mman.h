@@ -0,0 +1,18 @@
+/**
+ * @file mman.h
+ * @brief Flags of the brk/mmap/munmap/mprotect system calls
+ *
+ * Plain C header shared by the kernel and the user runtime. The values
+ * match Linux, so code written against <sys/mman.h> passes the same bits.
+ * Only private anonymous mappings exist; there are no file mappings.
+ */
+
+#pragma once
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
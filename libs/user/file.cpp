@@ -27,12 +27,14 @@ ssize_t fs_read(fd_t fd, void* buf, size_t count)
 			sys_read(fd, reinterpret_cast<uint64_t>(buf), count));
 }
 
-void fs_close(fd_t fd)
+error_t fs_close(fd_t fd)
 {
 	Message m = make_request(MsgType::FS_CLOSE);
 	m.data.fs.fd = fd;
 
-	send_message(process_ids::FS_FAT32, &m);
+	Message res = call(process_ids::FS_FAT32, &m);
+
+	return res.result;
 }
 
 fd_t fs_create(const char* path)
@@ -96,3 +98,12 @@ fd_t fs_dup2(fd_t oldfd, fd_t newfd)
 
 	return IS_ERR(res.result) ? res.result : res.data.fs.fd;
 }
+
+error_t fs_sync()
+{
+	Message m = make_request(MsgType::FS_SYNC);
+
+	Message res = call(process_ids::FS_FAT32, &m);
+
+	return res.result;
+}
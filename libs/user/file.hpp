@@ -16,7 +16,9 @@ ssize_t fs_read(fd_t fd, void* buf, size_t count);
 /// @return Bytes written, or a negative error_t
 ssize_t fs_write(fd_t fd, const void* buf, size_t count);
 
-void fs_close(fd_t fd);
+/// Closing writes what the file system still caches to the disk
+/// @return OK, or the first device error of that write
+error_t fs_close(fd_t fd);
 
 /// @return The created file's fd, or a negative error_t
 fd_t fs_create(const char* path);
@@ -29,3 +31,7 @@ error_t fs_change_dir(char* buf, const char* path);
 
 /// @return newfd on success, or a negative error_t
 fd_t fs_dup2(fd_t oldfd, fd_t newfd);
+
+/// Write the file system's cached dirty blocks to the disk
+/// @return OK, or the first device error
+error_t fs_sync();
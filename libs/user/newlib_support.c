@@ -3,7 +3,6 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <libs/common/memory_layout.h>
 
 int close(int fd)
 {
@@ -36,14 +35,16 @@ ssize_t read(int fd, void* buf, size_t count)
 
 caddr_t sbrk(int incr)
 {
-	/* The heap region is mapped by the kernel loader at exec (see
-	 * kernel/elf.cpp); this hands it out linearly with bounds checks.
-	 * The old static 4 KiB array had none: overrunning it silently
-	 * corrupted whatever .bss happened to follow (issue #315). */
-	static uintptr_t brk = USER_HEAP_BASE;
+	/* The kernel owns the heap end (sys_brk) and faults pages in on first
+	 * touch; shrinking hands the pages back. The cached end is only a
+	 * shortcut for the common case: the kernel checks the bounds. */
+	static uintptr_t brk = 0;
+	if (brk == 0) {
+		brk = sys_brk(0);
+	}
 
 	uintptr_t next = brk + (intptr_t)incr;
-	if (next < USER_HEAP_BASE || next > USER_HEAP_BASE + USER_HEAP_SIZE) {
+	if (sys_brk(next) != next) {
 		errno = ENOMEM;
 		return (caddr_t)-1;
 	}
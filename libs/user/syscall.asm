@@ -16,6 +16,10 @@ define_syscall draw_text, 4
 define_syscall fill_rect, 5
 define_syscall time, 6
 define_syscall ipc, 7
+define_syscall mmap, 9
+define_syscall mprotect, 10
+define_syscall munmap, 11
+define_syscall brk, 12
 define_syscall fork, 57
 define_syscall exec, 59
 define_syscall exit, 60
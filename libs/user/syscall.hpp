@@ -15,6 +15,13 @@ uint64_t sys_draw_text(const char* text, int x, int y, uint32_t color);
 uint64_t sys_fill_rect(int x, int y, int width, int height, uint32_t color);
 uint64_t sys_time(int ms, int is_periodic);
 uint64_t sys_ipc(int dest, int src, const void* m, int flags);
+/* Memory calls (flags in libs/common/mman.h). sys_brk returns the heap end
+ * after the call, unchanged on failure; sys_mmap returns the address or a
+ * negative error code. */
+uint64_t sys_brk(uint64_t addr);
+uint64_t sys_mmap(uint64_t addr, uint64_t length, int prot, int flags);
+uint64_t sys_mprotect(uint64_t addr, uint64_t length, int prot);
+uint64_t sys_munmap(uint64_t addr, uint64_t length);
 uint64_t sys_fork();
 uint64_t sys_exec(const char* path, const char* args);
 uint64_t sys_wait(int* status);
@@ -15,7 +15,8 @@ qemu-img create -f raw $disk_img 200M
 mkfs.fat -n 'UCH OS' -s 2 -f 2 -R 32 -F 32 $disk_img
 sudo mount -o loop $disk_img $mount_point
 
-# Create a storage disk image
+# Create a storage disk image. The volume stops 32 MiB (32768 KiB) short of
+# the end of the disk: the kernel swaps to that tail (memory/swap.hpp).
 qemu-img create -f raw $storage_img 1G
-mkfs.fat -n 'UCH STORAGE' -s 8 -f 2 -R 32 -F 32 $storage_img
+mkfs.fat -n 'UCH STORAGE' -s 8 -f 2 -R 32 -F 32 $storage_img 1015808
 sudo mount -o loop $storage_img $storage_mount_point
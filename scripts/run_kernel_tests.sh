@@ -104,7 +104,8 @@ if [ -n "$SMOKE_BINS" ]; then
     storage_img="$WORK_DIR/storage.img"
     rm -f "$storage_img"
     truncate -s 1G "$storage_img"
-    mkfs.fat -n 'UCH STORAGE' -s 8 -f 2 -R 32 -F 32 "$storage_img" > /dev/null
+    # Leaves the 32 MiB swap area at the end unformatted
+    mkfs.fat -n 'UCH STORAGE' -s 8 -f 2 -R 32 -F 32 "$storage_img" 1015808 > /dev/null
     for bin in $SMOKE_BINS; do
         if [ ! -f "$bin" ]; then
             echo "error: smoke binary not found: $bin" >&2
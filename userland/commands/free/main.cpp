@@ -1,3 +1,4 @@
+#include <cstddef>
 #include <libs/common/message.hpp>
 #include <libs/common/process_id.hpp>
 #include <libs/common/types.hpp>
@@ -11,9 +12,33 @@ extern "C" int main(int argc, char** argv)
 
 	Message msg = call(process_ids::KERNEL, &m);
 
-	printu("Used memory: %u MiB\nTotal memory: %u MiB",
-		   msg.data.memory_usage.used / 1024 / 1024,
-		   msg.data.memory_usage.total / 1024 / 1024);
+	const auto& usage = msg.data.memory_usage;
+
+	printu("Used memory: %u MiB\nTotal memory: %u MiB\n",
+		   static_cast<unsigned int>(usage.used / 1024 / 1024),
+		   static_cast<unsigned int>(usage.total / 1024 / 1024));
+	printu("Free: %u KiB  Slab: %u KiB (page tables: %u KiB, OOL: %u KiB)\n",
+		   usage.free_pages * 4, usage.slab_pages * 4, usage.page_table_pages * 4,
+		   usage.ool_pages * 4);
+
+	printu("Free blocks by order:");
+	for (size_t order = 0; order < MEMORY_USAGE_ORDERS; ++order) {
+		printu(" %u", usage.free_blocks[order]);
+	}
+	printu("\nFragmentation: %u.%u%%",
+		   usage.fragmentation / 10, usage.fragmentation % 10);
+	printu("\nZeroed page pool: %u objects, %u hits, %u misses",
+		   usage.zero_pool_objects, usage.zero_pool_hits, usage.zero_pool_misses);
+	printu("\nEmergency reserve: %u objects", usage.reserve_objects);
+
+	Message cm = make_request(MsgType::FS_CACHE_STATS);
+	Message cache_msg = call(process_ids::FS_FAT32, &cm);
+	if (IS_OK(cache_msg.result)) {
+		const auto& cache = cache_msg.data.buffer_cache;
+		printu("\nBuffer cache: %u KiB (%u KiB dirty), %u hits, %u misses",
+			   cache.blocks * cache.block_size / 1024,
+			   cache.dirty * cache.block_size / 1024, cache.hits, cache.misses);
+	}
 
 	return 0;
 }
@@ -0,0 +1,35 @@
+#include <cstddef>
+#include <libs/common/message.hpp>
+#include <libs/common/process_id.hpp>
+#include <libs/common/types.hpp>
+#include <libs/user/console.hpp>
+#include <libs/user/ipc.hpp>
+#include <libs/user/syscall.hpp>
+
+extern "C" int main(int argc, char** argv)
+{
+	Message m = make_request(MsgType::KERNEL_STACK_USAGE);
+	Message msg = call(process_ids::KERNEL, &m);
+	if (IS_ERR(msg.result)) {
+		printu("kstack: failed to read kernel stack usage");
+		return 0;
+	}
+
+	if (msg.ool.size == 0) {
+		printu("kstack: no tasks");
+		return 0;
+	}
+
+	const auto* infos = reinterpret_cast<const KernelStackInfo*>(msg.ool.addr);
+	const size_t num_tasks = msg.ool.size / sizeof(KernelStackInfo);
+
+	printu("  ID NAME             BACKED    PEAK");
+	for (size_t i = 0; i < num_tasks; ++i) {
+		printu("\n%4d %-16s %3u KiB %5u B", infos[i].task_id, infos[i].name,
+			   infos[i].backed_pages * 4, infos[i].peak_bytes);
+	}
+
+	ool_release(infos);
+
+	return 0;
+}
@@ -15,7 +15,10 @@ int main(int argc, char** argv)
 		return 0;
 	}
 
-	fs_close(fd);
+	if (IS_ERR(fs_close(fd))) {
+		printu("Failed to write %s to the disk", path);
+		return 0;
+	}
 
 	printu("File created: %s", path);
 
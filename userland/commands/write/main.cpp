@@ -41,7 +41,10 @@ int main(int argc, char** argv)
 		printu("Failed to write newline to %s", filename);
 	}
 
-	fs_close(fd);
+	if (IS_ERR(fs_close(fd))) {
+		printu("Failed to write %s to the disk", filename);
+		return 0;
+	}
 
 	printu("Written %d bytes to %s", static_cast<int>(written) + 1, filename);
 